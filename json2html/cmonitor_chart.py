@@ -606,6 +606,13 @@ def choose_byte_divider(mem_total_bytes):
     #print("%d -> %s, %d" % (mem_total_bytes,unit, divider))
     return (divider, unit)
 
+def select_samples_with_section(jdata, section_name):
+    '''
+    Returns only the samples containing the given JSON section: when the collector runs with per-family
+    sampling intervals (e.g. --collect=cpu@200ms,disk@1s) each sample contains only the families that were due
+    '''
+    return [s for s in jdata if section_name in s]
+
 def print_data_loading_stats(desc, jdata, n_invalid_samples):
     if n_invalid_samples>0:
         print("While parsing %s statistics found %d/%d (%.1f%%) samples that did not contain the JSON section." % 
@@ -687,7 +694,8 @@ def generate_config_js(jheader):
 
 def generate_cgroup_topN_procs(web, header, jdata, numProcsToShow=20):
     # if process data was not collected, just return:
-    if 'cgroup_tasks' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'cgroup_tasks')
+    if len(jdata) == 0:
         return web
     
     # build a dictionary containing cumulative metrics for CPU/IO/MEM data for each process
@@ -829,7 +837,8 @@ def generate_cgroup_topN_procs(web, header, jdata, numProcsToShow=20):
 
 def generate_baremetal_disks_io(web, jdata):
     # if disk data was not collected, just return:
-    if 'disks' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'disks')
+    if len(jdata) == 0:
         return web
     
     all_disks = jdata[0]["disks"].keys()
@@ -894,7 +903,8 @@ def generate_baremetal_disks_io(web, jdata):
 
 def generate_baremetal_network_traffic(web, jdata):
     # if network traffic data was not collected, just return:
-    if 'network_interfaces' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'network_interfaces')
+    if len(jdata) == 0:
         return web
     
     all_netdevices = jdata[0]["network_interfaces"].keys()
@@ -972,7 +982,8 @@ def generate_baremetal_network_traffic(web, jdata):
 
 def generate_baremetal_cpus(web, jdata, logical_cpus_indexes):
     # if baremetal CPU data was not collected, just return:
-    if 'stat' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'stat')
+    if len(jdata) == 0:
         return web
 
     # prepare empty tables
@@ -1034,8 +1045,11 @@ def generate_baremetal_cpus(web, jdata, logical_cpus_indexes):
     return web
 
 def generate_cgroup_cpus(web, jdata, logical_cpus_indexes):
-    if 'cgroup_cpuacct_stats' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'cgroup_cpuacct_stats')
+    if len(jdata) == 0:
         return web  # cgroup mode not enabled at collection time!
+    if len(logical_cpus_indexes) == 0 and 'cpu_total' in jdata[0]['cgroup_cpuacct_stats']:
+        return generate_cgroup_cpu_total(web, jdata)  # cgroups v2 provide no per-CPU stats
         
     # prepare empty tables
     cpu_stats_table = {}
@@ -1099,9 +1113,38 @@ def generate_cgroup_cpus(web, jdata, logical_cpus_indexes):
             stack_state=False))
     return web
 
+def generate_cgroup_cpu_total(web, jdata):
+    # the CPU time of the cgroup summed over all its CPUs: 100% corresponds to 1 CPU fully used
+    cpu_total_table = GoogleChartsTimeSeries(['Timestamp', 'User', 'System'])
+    
+    n_invalid_samples = 0
+    for i, s in enumerate(jdata):
+        if i == 0:
+            continue  # skip first sample
+        
+        try:
+            ts = s['timestamp']['datetime']
+            cpu_stats = s['cgroup_cpuacct_stats']['cpu_total']
+            cpu_total_table.addRow([ts, cpu_stats['user'], cpu_stats['sys']])
+        except KeyError: # avoid crashing if a key is not present in the dictionary...
+            n_invalid_samples+=1
+            pass
+    
+    print_data_loading_stats("cgroup CPU", jdata, n_invalid_samples)
+    
+    web.appendGoogleChart(GoogleChartsGraph(
+            data=cpu_total_table,  # Data
+            graph_title="All logical CPUs assigned to cmonitor_collector CGroup (from CGroup stats, 100% is 1 CPU)",
+            button_label="All CPUs",
+            y_axis_title="Time (%)",
+            graph_source=GRAPH_SOURCE_DATA_CGROUP,
+            stack_state=True))
+    return web
+
 def generate_baremetal_memory(web, jdata):
     # if baremetal memory data was not collected, just return:
-    if 'proc_meminfo' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'proc_meminfo')
+    if len(jdata) == 0:
         return web
     
     #
@@ -1157,7 +1200,8 @@ def generate_baremetal_memory(web, jdata):
 
 def generate_cgroup_memory(web, jheader, jdata):
     # if cgroup data was not collected, just return:
-    if 'cgroup_memory_stats' not in jdata[0]:
+    jdata = select_samples_with_section(jdata, 'cgroup_memory_stats')
+    if len(jdata) == 0:
         return web
     
     #
@@ -1372,14 +1416,16 @@ def main_process_file(infile, outfile):
 
     # detect num of CPUs:
     baremetal_logical_cpus_indexes = []
-    if 'stat' in jdata[0]:
-        baremetal_logical_cpus_indexes = collect_logical_cpu_indexes_from_section(jdata_first_sample, 'stat')
+    jdata_with_stat = select_samples_with_section(jdata, 'stat')
+    if len(jdata_with_stat) > 0:
+        baremetal_logical_cpus_indexes = collect_logical_cpu_indexes_from_section(jdata_with_stat[0], 'stat')
         if verbose:
             print("Found %d CPUs in baremetal stats with logical indexes [%s]" % (len(baremetal_logical_cpus_indexes), ', '.join(str(x) for x in baremetal_logical_cpus_indexes)))
         
     cgroup_logical_cpus_indexes = []
-    if 'cgroup_cpuacct_stats' in jdata_first_sample:
-        cgroup_logical_cpus_indexes = collect_logical_cpu_indexes_from_section(jdata_first_sample, 'cgroup_cpuacct_stats')
+    jdata_with_cpuacct = select_samples_with_section(jdata, 'cgroup_cpuacct_stats')
+    if len(jdata_with_cpuacct) > 0:
+        cgroup_logical_cpus_indexes = collect_logical_cpu_indexes_from_section(jdata_with_cpuacct[0], 'cgroup_cpuacct_stats')
         if verbose:
             print("Found %d CPUs in cgroup stats with logical indexes [%s]" % (len(cgroup_logical_cpus_indexes), ', '.join(str(x) for x in cgroup_logical_cpus_indexes)))
     
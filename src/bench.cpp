@@ -0,0 +1,1256 @@
+/*
+ * bench.cpp -- micro-benchmarks of the collectors and of the output frontends,
+ *              run against synthetic procfs fixtures of several sizes, plus
+ *              self-checks of the data structures they rely on
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include "flight_recorder.h"
+#include "output_frontend.h"
+#include <algorithm>
+#include <ftw.h>
+#include <getopt.h>
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+#define BENCH_DEFAULT_SAMPLES (200)
+#define BENCH_WARMUP_SAMPLES (3)
+#define BENCH_MIN_SAMPLES (10)
+#define BENCH_MAX_NSEC_PER_BENCHMARK (5 * 1000000000ULL) // stop slow benchmarks earlier
+
+#define BENCH_TASKS_NUM_PIDS (10000)
+#define BENCH_TASKS_FIRST_PID (100000)
+#define BENCH_TASKS_TOP_PROCESSES (20) // as many as shown by cmonitor_chart
+#define BENCH_TASKS_SCAN_THREADS (4)
+#define BENCH_DISKSTATS_NUM_DEVICES (1000)
+#define BENCH_NET_DEV_NUM_INTERFACES (5000)
+#define BENCH_VMSTAT_NUM_LINES (150)
+
+#define SELF_CHECK_TABLE_CLUSTER_SIZE (8) // PIDs sharing the same home slot
+#define SELF_CHECK_TABLE_NUM_PIDS (5000) // enough to grow the table several times
+#define SELF_CHECK_TABLE_ROUNDS (50)
+#define SELF_CHECK_QUEUE_CAPACITY (4)
+#define SELF_CHECK_QUEUE_LAPS (10) // the sequence numbers of the slots go around several times
+#define SELF_CHECK_QUEUE_NUM_ITEMS (200000) // pushed by a concurrent producer
+#define SELF_CHECK_FLIGHT_RECORDER_SAMPLES (25) // more than the ring can hold
+
+//------------------------------------------------------------------------------
+// CMonitorBenchmark
+//
+// Each benchmark runs a single collector (or output encoder) in a loop and
+// reports timings and allocations per sample. Collectors are pointed to the
+// fixtures through g_cfg.m_strProcRoot, so the same code paths used by
+// cmonitor_collector are measured.
+//------------------------------------------------------------------------------
+
+class CMonitorBenchmark {
+public:
+    CMonitorBenchmark() {}
+
+    bool init_fixtures(const std::string& dir);
+    void remove_fixtures();
+
+    void run_all(const std::string& filter, unsigned int num_samples);
+    void print_results(FILE* out) const;
+
+private:
+    struct result_t {
+        std::string name;
+        uint64_t items_per_sample; // CPUs, disks, PIDs or measurements processed by each sample
+        uint64_t samples;
+        double ns_per_sample;
+        uint64_t p50_ns;
+        uint64_t p99_ns;
+        double allocs_per_sample;
+    };
+
+    typedef std::function<void()> step_t;
+
+    // runs body() in a loop; cleanup() runs after each body() and is not measured
+    void measure(const std::string& name, uint64_t items_per_sample, const step_t& body, const step_t& cleanup);
+
+    // fixture generation
+    std::string write_proc_stat_fixture(unsigned int num_cpus);
+    std::string write_diskstats_fixture(unsigned int num_devices);
+    std::string write_net_dev_fixture(unsigned int num_interfaces);
+    std::string write_vmstat_fixture(unsigned int num_lines);
+    std::string write_tasks_fixture(const char* subdir, unsigned int num_pids, unsigned int tick_offset);
+    uint64_t next_random();
+
+    // benchmarks
+    void bench_proc_stat(unsigned int num_cpus);
+    void bench_proc_diskstats();
+    void bench_proc_net_dev();
+    void bench_proc_vmstat();
+    void bench_cgroup_proc_tasks();
+    void bench_output_frontends();
+
+private:
+    std::string m_fixtures_dir;
+    bool m_remove_fixtures = false;
+    std::string m_filter;
+    unsigned int m_num_samples = BENCH_DEFAULT_SAMPLES;
+    uint64_t m_random_state = 0x2545F4914F6CDD1DULL;
+    std::vector<result_t> m_results;
+};
+
+//------------------------------------------------------------------------------
+// Fixtures
+//------------------------------------------------------------------------------
+
+static bool write_file(const std::string& path, const std::string& contents)
+{
+    FILE* fp = fopen(path.c_str(), "w");
+    if (!fp) {
+        fprintf(stderr, "Failed to create fixture file %s\n", path.c_str());
+        return false;
+    }
+    fwrite(contents.data(), 1, contents.size(), fp);
+    fclose(fp);
+    return true;
+}
+
+static int remove_fixture_entry(const char* path, const struct stat*, int, struct FTW*) { return remove(path); }
+
+uint64_t CMonitorBenchmark::next_random()
+{
+    // xorshift64: deterministic fixtures across runs
+    m_random_state ^= m_random_state << 13;
+    m_random_state ^= m_random_state >> 7;
+    m_random_state ^= m_random_state << 17;
+    return m_random_state;
+}
+
+bool CMonitorBenchmark::init_fixtures(const std::string& dir)
+{
+    if (dir.empty()) {
+        char tmpl[] = "/tmp/cmonitor_bench.XXXXXX";
+        if (mkdtemp(tmpl) == NULL) {
+            perror("mkdtemp");
+            return false;
+        }
+        m_fixtures_dir = tmpl;
+        m_remove_fixtures = true;
+    } else {
+        m_fixtures_dir = dir;
+        if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+            perror("mkdir");
+            return false;
+        }
+    }
+    return true;
+}
+
+void CMonitorBenchmark::remove_fixtures()
+{
+    if (m_remove_fixtures)
+        nftw(m_fixtures_dir.c_str(), remove_fixture_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+std::string CMonitorBenchmark::write_proc_stat_fixture(unsigned int num_cpus)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s/proc_stat_%ucpu", m_fixtures_dir.c_str(), num_cpus);
+    std::string root(buf);
+    mkdir(root.c_str(), 0755);
+
+    // same layout of a real /proc/stat, including the long "intr" line
+    std::string contents;
+    contents += "cpu  1039484 3217 302940 29139212 17250 0 32420 0 0 0\n";
+    for (unsigned int i = 0; i < num_cpus; i++) {
+        snprintf(buf, sizeof(buf), "cpu%u %lu %lu %lu %lu %lu 0 %lu %lu 0 0\n", i, next_random() % 10000000,
+            next_random() % 100000, next_random() % 1000000, next_random() % 100000000, next_random() % 100000,
+            next_random() % 100000, next_random() % 1000);
+        contents += buf;
+    }
+    contents += "intr 1234567890";
+    for (unsigned int i = 0; i < 512; i++) {
+        snprintf(buf, sizeof(buf), " %lu", (i % 4 == 0) ? next_random() % 1000000 : 0);
+        contents += buf;
+    }
+    contents += "\nctxt 9876543210\nbtime 1600000000\nprocesses 1234567\nprocs_running 3\nprocs_blocked 0\n";
+    contents += "softirq 123456789 0 12345678 1234 2345678 345678 0 45678 5678901 0 6789012\n";
+
+    write_file(root + "/stat", contents);
+    return root;
+}
+
+std::string CMonitorBenchmark::write_diskstats_fixture(unsigned int num_devices)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s/proc_diskstats_%udev", m_fixtures_dir.c_str(), num_devices);
+    std::string root(buf);
+    mkdir(root.c_str(), 0755);
+    mkdir((root + "/proc").c_str(), 0755);
+    mkdir((root + "/sys").c_str(), 0755);
+    mkdir((root + "/sys/block").c_str(), 0755);
+
+    // 20 columns, as produced by Linux >= 5.5; each device has one partition, listed in /proc/diskstats
+    // but not in /sys/block
+    std::string contents;
+    for (unsigned int i = 0; i < num_devices; i++) {
+        const char* formats[] = {
+            "%4u %7u nvme%un1 %lu %lu %lu %lu %lu %lu %lu %lu 0 %lu %lu 0 0 0 0 %lu %lu\n", // force newline
+            "%4u %7u nvme%un1p1 %lu %lu %lu %lu %lu %lu %lu %lu 0 %lu %lu 0 0 0 0 %lu %lu\n" // force newline
+        };
+        for (unsigned int j = 0; j < 2; j++) {
+            snprintf(buf, sizeof(buf), formats[j], 259, 2 * i + j, i, next_random() % 10000000,
+                next_random() % 10000, next_random() % 1000000000, next_random() % 10000000,
+                next_random() % 10000000, next_random() % 10000, next_random() % 1000000000,
+                next_random() % 10000000, next_random() % 10000000, next_random() % 10000000,
+                next_random() % 100000, next_random() % 100000);
+            contents += buf;
+        }
+
+        snprintf(buf, sizeof(buf), "%s/sys/block/nvme%un1", root.c_str(), i);
+        mkdir(buf, 0755);
+        snprintf(buf, sizeof(buf), "%s/sys/block/nvme%un1/dev", root.c_str(), i);
+        write_file(buf, std::to_string(259) + ":" + std::to_string(2 * i) + "\n");
+    }
+
+    write_file(root + "/proc/diskstats", contents);
+    return root;
+}
+
+std::string CMonitorBenchmark::write_net_dev_fixture(unsigned int num_interfaces)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s/proc_net_dev_%uif", m_fixtures_dir.c_str(), num_interfaces);
+    std::string root(buf);
+    mkdir(root.c_str(), 0755);
+    mkdir((root + "/proc").c_str(), 0755);
+    mkdir((root + "/proc/net").c_str(), 0755);
+    mkdir((root + "/sys").c_str(), 0755);
+    mkdir((root + "/sys/class").c_str(), 0755);
+    mkdir((root + "/sys/class/net").c_str(), 0755);
+
+    // a container host: one physical interface and one veth interface per container
+    std::string contents = "Inter-|   Receive                                                |  Transmit\n"
+                           " face |bytes    packets errs drop fifo frame compressed multicast|"
+                           "bytes    packets errs drop fifo colls carrier compressed\n";
+    for (unsigned int i = 0; i < num_interfaces; i++) {
+        char name[32];
+        if (i == 0)
+            snprintf(name, sizeof(name), "eth0");
+        else
+            snprintf(name, sizeof(name), "veth%08x", i);
+
+        snprintf(buf, sizeof(buf), "%6s: %lu %lu 0 0 0 0 0 0 %lu %lu 0 0 0 0 0 0\n", name,
+            next_random() % 10000000000, next_random() % 10000000, next_random() % 10000000000,
+            next_random() % 10000000);
+        contents += buf;
+
+        snprintf(buf, sizeof(buf), "%s/sys/class/net/%s", root.c_str(), name);
+        mkdir(buf, 0755);
+        write_file(std::string(buf) + "/ifindex", std::to_string(i + 2) + "\n");
+    }
+
+    write_file(root + "/proc/net/dev", contents);
+    return root;
+}
+
+std::string CMonitorBenchmark::write_vmstat_fixture(unsigned int num_lines)
+{
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "%s/proc_vmstat_%ulines", m_fixtures_dir.c_str(), num_lines);
+    std::string root(buf);
+    mkdir(root.c_str(), 0755);
+
+    // "label value" lines with values of varying width, like the real /proc/vmstat
+    std::string contents;
+    for (unsigned int i = 0; i < num_lines; i++) {
+        snprintf(buf, sizeof(buf), "nr_vmstat_counter_%u %lu\n", i, (uint64_t)(next_random() % (1ULL << (i % 40))));
+        contents += buf;
+    }
+
+    write_file(root + "/vmstat", contents);
+    return root;
+}
+
+std::string CMonitorBenchmark::write_tasks_fixture(const char* subdir, unsigned int num_pids, unsigned int tick_offset)
+{
+    char buf[2048];
+    std::string root = m_fixtures_dir + "/" + subdir;
+    mkdir(root.c_str(), 0755);
+
+    std::string tasks;
+    for (unsigned int i = 0; i < num_pids; i++) {
+        unsigned int pid = BENCH_TASKS_FIRST_PID + i;
+        snprintf(buf, sizeof(buf), "%s/%u", root.c_str(), pid);
+        std::string piddir(buf);
+        mkdir(piddir.c_str(), 0755);
+
+        // all 52 fields of a recent kernel
+        snprintf(buf, sizeof(buf),
+            "%u (worker %u) S 1 %u %u 0 -1 4194560 %u 0 12 0 %u %u 0 0 20 0 4 0 %u 1234567890 %u "
+            "18446744073709551615 94000000000000 94000000100000 140000000000000 0 0 0 0 4096 16384 0 0 0 17 %u 0 0 "
+            "3 0 0 94000000200000 94000000300000 94000000400000 140000000100000 140000000100100 140000000100100 "
+            "140000000200000 0\n",
+            pid, pid, pid, pid, 1000 + i + tick_offset, 100 + (i % 100) + tick_offset, 10 + tick_offset, 5000 + i,
+            20000 + i, i % 64);
+        write_file(piddir + "/stat", buf);
+
+        snprintf(buf, sizeof(buf), "%u %u 1200 300 0 9000 0\n", 300000 + i, 20000 + i);
+        write_file(piddir + "/statm", buf);
+
+        snprintf(buf, sizeof(buf),
+            "Name:\tworker %u\nUmask:\t0022\nState:\tS (sleeping)\nTgid:\t%u\nNgid:\t0\nPid:\t%u\nPPid:\t1\n"
+            "TracerPid:\t0\nUid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\nFDSize:\t64\nGroups:\t\nVmPeak:\t 1234567 kB\n"
+            "VmSize:\t 1200000 kB\nVmLck:\t       0 kB\nVmHWM:\t   80000 kB\nVmRSS:\t   80000 kB\n"
+            "Threads:\t4\nSigQ:\t0/63412\nCpus_allowed_list:\t0-63\nvoluntary_ctxt_switches:\t1234\n"
+            "nonvoluntary_ctxt_switches:\t56\n",
+            pid, pid, pid);
+        write_file(piddir + "/status", buf);
+
+        snprintf(buf, sizeof(buf),
+            "rchar: %u\nwchar: %u\nsyscr: 1234\nsyscw: 567\nread_bytes: %u\nwrite_bytes: %u\n"
+            "cancelled_write_bytes: 0\n",
+            1000000 + i + tick_offset * 4096, 500000 + i + tick_offset * 4096, 40960 + tick_offset * 4096,
+            8192 + tick_offset * 4096);
+        write_file(piddir + "/io", buf);
+
+        snprintf(buf, sizeof(buf), "%u\n", pid);
+        tasks += buf;
+    }
+
+    write_file(root + "/tasks", tasks);
+    return root;
+}
+
+//------------------------------------------------------------------------------
+// Measurement
+//------------------------------------------------------------------------------
+
+void CMonitorBenchmark::measure(
+    const std::string& name, uint64_t items_per_sample, const step_t& body, const step_t& cleanup)
+{
+    for (unsigned int i = 0; i < BENCH_WARMUP_SAMPLES; i++) {
+        body();
+        cleanup();
+    }
+
+    std::vector<uint64_t> durations;
+    durations.reserve(m_num_samples);
+    uint64_t total_nsec = 0, total_allocs = 0;
+    for (unsigned int i = 0; i < m_num_samples; i++) {
+        uint64_t allocs_start = CMonitorSelfStats::get_thread_allocations();
+        uint64_t start = CMonitorScheduler::get_monotonic_time_nsec();
+        body();
+        uint64_t elapsed = CMonitorScheduler::get_monotonic_time_nsec() - start;
+        total_allocs += CMonitorSelfStats::get_thread_allocations() - allocs_start;
+        cleanup();
+
+        durations.push_back(elapsed);
+        total_nsec += elapsed;
+        if (durations.size() >= BENCH_MIN_SAMPLES && total_nsec > BENCH_MAX_NSEC_PER_BENCHMARK)
+            break;
+    }
+
+    std::sort(durations.begin(), durations.end());
+    size_t n = durations.size();
+
+    result_t r;
+    r.name = name;
+    r.items_per_sample = items_per_sample;
+    r.samples = n;
+    r.ns_per_sample = (double)total_nsec / n;
+    r.p50_ns = durations[n / 2];
+    r.p99_ns = durations[std::min(n - 1, n * 99 / 100)];
+    r.allocs_per_sample = (double)total_allocs / n;
+    m_results.push_back(r);
+
+    fprintf(stderr, "%-32s %10.0f ns/sample  p50=%-10lu p99=%-10lu %8.1f allocs/sample (%zu samples)\n",
+        name.c_str(), r.ns_per_sample, r.p50_ns, r.p99_ns, r.allocs_per_sample, n);
+}
+
+void CMonitorBenchmark::print_results(FILE* out) const
+{
+    fprintf(out, "{\n  \"cmonitor_bench\": {\n    \"version\": \"%s\",\n    \"results\": {", VERSION_STRING);
+    for (size_t i = 0; i < m_results.size(); i++) {
+        const result_t& r = m_results[i];
+        double samples_per_sec = 1e9 / r.ns_per_sample;
+        fprintf(out,
+            "%s\n      \"%s\": { \"items_per_sample\": %lu, \"samples\": %lu, \"ns_per_sample\": %.1f, "
+            "\"p50_ns\": %lu, \"p99_ns\": %lu, \"samples_per_sec\": %.1f, \"items_per_sec\": %.1f, "
+            "\"allocs_per_sample\": %.2f }",
+            i ? "," : "", r.name.c_str(), r.items_per_sample, r.samples, r.ns_per_sample, r.p50_ns, r.p99_ns,
+            samples_per_sec, samples_per_sec * r.items_per_sample, r.allocs_per_sample);
+    }
+    fprintf(out, "\n    }\n  }\n}\n");
+}
+
+//------------------------------------------------------------------------------
+// Benchmarks
+//------------------------------------------------------------------------------
+
+static void discard_sample() { g_output.discard_current_sample(); }
+
+void CMonitorBenchmark::bench_proc_stat(unsigned int num_cpus)
+{
+    std::string name = "proc_stat_" + std::to_string(num_cpus) + "cpu";
+    if (name.find(m_filter) == std::string::npos)
+        return;
+
+    g_cfg.m_strProcRoot = write_proc_stat_fixture(num_cpus);
+
+    CMonitorCollectorApp app;
+    measure(name, num_cpus, [&app]() { app.proc_stat(1.0, false, PF_ALL); }, discard_sample);
+}
+
+void CMonitorBenchmark::bench_proc_diskstats()
+{
+    std::string name = "proc_diskstats_" + std::to_string(BENCH_DISKSTATS_NUM_DEVICES) + "dev";
+    if (name.find(m_filter) == std::string::npos)
+        return;
+
+    std::string root = write_diskstats_fixture(BENCH_DISKSTATS_NUM_DEVICES);
+    g_cfg.m_strProcRoot = root + "/proc";
+    g_cfg.m_strSysRoot = root + "/sys";
+
+    CMonitorCollectorApp app;
+    measure(name, BENCH_DISKSTATS_NUM_DEVICES, [&app]() { app.proc_diskstats(1.0, PF_ALL); }, discard_sample);
+}
+
+void CMonitorBenchmark::bench_proc_net_dev()
+{
+    std::string name = "proc_net_dev_" + std::to_string(BENCH_NET_DEV_NUM_INTERFACES) + "if";
+    if (name.find(m_filter) == std::string::npos)
+        return;
+
+    std::string root = write_net_dev_fixture(BENCH_NET_DEV_NUM_INTERFACES);
+    g_cfg.m_strProcRoot = root + "/proc";
+    g_cfg.m_strSysRoot = root + "/sys";
+
+    // report all the veth interfaces, the worst case
+    g_cfg.m_vecNetExcludeGlobs.clear();
+
+    CMonitorCollectorApp app;
+    measure(name, BENCH_NET_DEV_NUM_INTERFACES, [&app]() { app.proc_net_dev(1.0, PF_ALL); }, discard_sample);
+}
+
+void CMonitorBenchmark::bench_proc_vmstat()
+{
+    std::string name = "proc_vmstat_" + std::to_string(BENCH_VMSTAT_NUM_LINES) + "lines";
+    if (name.find(m_filter) == std::string::npos)
+        return;
+
+    g_cfg.m_strProcRoot = write_vmstat_fixture(BENCH_VMSTAT_NUM_LINES);
+
+    // all lines selected, as done by --deep-collect
+    CMonitorCollectorApp app;
+    std::set<std::string> all_stats;
+    measure(name, BENCH_VMSTAT_NUM_LINES,
+        [&app, &all_stats]() {
+            app.proc_read_numeric_stats_from(app.m_proc_vmstat_file, app.m_proc_vmstat_parser, "vmstat", all_stats);
+        },
+        discard_sample);
+}
+
+void CMonitorBenchmark::bench_cgroup_proc_tasks()
+{
+    std::string all_name = "cgroup_proc_tasks_" + std::to_string(BENCH_TASKS_NUM_PIDS / 1000) + "kpid";
+    std::string top_name = all_name + "_top" + std::to_string(BENCH_TASKS_TOP_PROCESSES);
+    std::string idle_name = all_name + "_idle";
+    std::string parallel_name = top_name + "_" + std::to_string(BENCH_TASKS_SCAN_THREADS) + "threads";
+    std::string io_uring_name = idle_name + "_io_uring"; // the descriptors must be kept across samples
+    if (all_name.find(m_filter) == std::string::npos && top_name.find(m_filter) == std::string::npos
+        && idle_name.find(m_filter) == std::string::npos && parallel_name.find(m_filter) == std::string::npos
+        && io_uring_name.find(m_filter) == std::string::npos)
+        return;
+
+    // two trees with the same PIDs but different CPU counters, used in turn, so that
+    // all processes always have a non-zero score and all of them are emitted, unless --top-processes is used;
+    // with a single tree instead all processes are idle and no one is emitted
+    fprintf(stderr, "Generating fixtures for %u PIDs...\n", BENCH_TASKS_NUM_PIDS);
+    std::string roots[2] = {
+        write_tasks_fixture("tasks_a", BENCH_TASKS_NUM_PIDS, 0),
+        write_tasks_fixture("tasks_b", BENCH_TASKS_NUM_PIDS, 10),
+    };
+
+    for (const std::string& name : { all_name, top_name, idle_name, parallel_name, io_uring_name }) {
+        if (name.find(m_filter) == std::string::npos)
+            continue;
+        g_cfg.m_nTopProcesses = (name == top_name || name == parallel_name) ? BENCH_TASKS_TOP_PROCESSES : 0;
+        unsigned int num_roots = (name == idle_name || name == io_uring_name) ? 1 : 2;
+
+        CMonitorCollectorApp app;
+        app.m_bCGroupsFound = true;
+        app.m_cgroup_cpuacct_kernel_path = roots[0];
+        app.m_processes.set_max_fds(raise_max_open_files() / 2); // as done by the collector
+        if (name == parallel_name)
+            app.cgroup_proc_scan_init(BENCH_TASKS_SCAN_THREADS);
+        if (name == io_uring_name && !app.m_io_uring.open())
+            continue;
+
+        unsigned int n = 0;
+        measure(
+            name, BENCH_TASKS_NUM_PIDS,
+            [&app, &roots, &n, num_roots]() {
+                g_cfg.m_strProcRoot = roots[n++ % num_roots];
+                if (num_roots > 1)
+                    CMonitorProcFile::invalidate_all(); // as done by --replay when moving the root
+                app.cgroup_proc_tasks(1.0, PF_ALL);
+            },
+            discard_sample);
+    }
+    g_cfg.m_nTopProcesses = 0;
+}
+
+void CMonitorBenchmark::bench_output_frontends()
+{
+    const char* json_name = "push_current_sections_to_json";
+    const char* influx_name = "generate_influxdb_line";
+    if (strstr(json_name, m_filter.c_str()) == NULL && strstr(influx_name, m_filter.c_str()) == NULL)
+        return;
+
+    // a sample with a size similar to the one produced on a 256-CPU host
+    g_cfg.m_strProcRoot = write_proc_stat_fixture(256);
+    CMonitorCollectorApp app;
+    app.proc_stat(0, false, PF_NONE);
+    g_output.psection_start("proc_loadavg");
+    g_output.pdouble("load_avg_1min", 0.52);
+    g_output.pdouble("load_avg_5min", 0.58);
+    g_output.pdouble("load_avg_15min", 0.59);
+    g_output.psection_end();
+    app.proc_stat(1.0, false, PF_ALL);
+    CMonitorOutputFrontend::CMonitorOutputSample sample = g_output.get_current_sample();
+    sample.m_timestamp_nsec = 1600000000000000000ULL;
+    g_output.discard_current_sample();
+
+    size_t num_measurements = CMonitorOutputFrontend::get_sample_measurements(sample);
+
+    CMonitorOutputFrontend out;
+    out.m_outputJson = fopen("/dev/null", "w");
+    if (out.m_outputJson == NULL) {
+        perror("/dev/null");
+        return;
+    }
+
+    if (strstr(json_name, m_filter.c_str()))
+        measure(
+            json_name, num_measurements, [&out, &sample]() { out.push_current_sections_to_json(sample, false); },
+            []() {});
+
+    if (strstr(influx_name, m_filter.c_str())) {
+        // same loop of push_current_sections_to_influxdb(), without the network transmission
+        std::string all_measurements;
+        measure(
+            influx_name, num_measurements,
+            [&out, &sample, &all_measurements]() {
+                for (auto& sec : sample.m_sections) {
+                    if (sec.m_measurements.empty()) {
+                        for (auto& subsec : sec.m_subsections) {
+                            all_measurements += out.generate_influxdb_line(
+                                subsec.m_measurements, sec.m_name + "_" + subsec.m_name, "1600000000000000000");
+                            all_measurements += "\n";
+                        }
+                    } else {
+                        all_measurements
+                            += out.generate_influxdb_line(sec.m_measurements, sec.m_name, "1600000000000000000");
+                        all_measurements += "\n";
+                    }
+                }
+            },
+            [&all_measurements]() { all_measurements.clear(); });
+    }
+}
+
+void CMonitorBenchmark::run_all(const std::string& filter, unsigned int num_samples)
+{
+    m_filter = filter;
+    m_num_samples = std::max(num_samples, (unsigned int)BENCH_MIN_SAMPLES);
+
+    bench_proc_stat(8);
+    bench_proc_stat(256);
+    bench_proc_stat(1024);
+    bench_proc_diskstats();
+    bench_proc_net_dev();
+    bench_proc_vmstat();
+    bench_cgroup_proc_tasks();
+    bench_output_frontends();
+}
+
+//------------------------------------------------------------------------------
+// Self-checks
+// Behavior checks of the data structures whose bugs would not show up in the
+// timings above; run by --self-check (or "make check") instead of benchmarks.
+//------------------------------------------------------------------------------
+
+#define SELF_CHECK(cond)                                                                                               \
+    do {                                                                                                               \
+        if (!(cond)) {                                                                                                 \
+            fprintf(stderr, "self-check failed at %s:%d: %s\n", __FILE__, __LINE__, #cond);                           \
+            return false;                                                                                              \
+        }                                                                                                              \
+    } while (0)
+
+// runs one update of the table in which only the given PIDs are alive: the rows of the others are freed
+static void self_check_table_update(CMonitorProcessTable& table, const std::set<pid_t>& alive)
+{
+    table.start_update(1.0);
+    for (pid_t pid : alive) {
+        size_t row = table.find_or_add(pid);
+        table.get_identity(row).pi_start_time = pid; // constant: each PID is always the same process
+        table.set_updated(row);
+    }
+    table.remove_stale();
+}
+
+// checks that the table maps exactly the given PIDs, each to a row of its own
+static bool self_check_table_lookups(
+    CMonitorProcessTable& table, const std::set<pid_t>& alive, const std::set<pid_t>& removed)
+{
+    SELF_CHECK(table.get_num_processes() == alive.size());
+    std::set<size_t> rows;
+    for (pid_t pid : alive) {
+        size_t row = table.find(pid);
+        SELF_CHECK(row != PROCESS_TABLE_NO_ROW);
+        SELF_CHECK(table.is_updated(row));
+        SELF_CHECK(table.get_identity(row).pi_start_time == (uint64_t)pid);
+        SELF_CHECK(rows.insert(row).second);
+    }
+    for (pid_t pid : removed)
+        SELF_CHECK(table.find(pid) == PROCESS_TABLE_NO_ROW);
+    return true;
+}
+
+static bool self_check_process_table()
+{
+    // in the smallest table the PIDs whose home is the last slot form a cluster that wraps around
+    // to the first slots, where it collides with the PIDs whose home is the first slot
+    const unsigned int slot_bits = PROCESS_TABLE_MIN_SLOT_BITS;
+    std::vector<pid_t> last_slot, first_slot;
+    for (pid_t pid = 1; last_slot.size() < SELF_CHECK_TABLE_CLUSTER_SIZE
+         || first_slot.size() < SELF_CHECK_TABLE_CLUSTER_SIZE;
+         pid++) {
+        size_t home = CMonitorProcessTable::home_slot(pid, slot_bits);
+        if (home == (1U << slot_bits) - 1 && last_slot.size() < SELF_CHECK_TABLE_CLUSTER_SIZE)
+            last_slot.push_back(pid);
+        else if (home == 0 && first_slot.size() < SELF_CHECK_TABLE_CLUSTER_SIZE)
+            first_slot.push_back(pid);
+    }
+
+    {
+        // interleave the insertions, so that the two clusters are mixed across the wrap-around
+        CMonitorProcessTable table;
+        std::set<pid_t> alive, removed;
+        for (size_t i = 0; i < SELF_CHECK_TABLE_CLUSTER_SIZE; i++) {
+            alive.insert(last_slot[i]);
+            self_check_table_update(table, alive);
+            alive.insert(first_slot[i]);
+            self_check_table_update(table, alive);
+        }
+        if (!self_check_table_lookups(table, alive, removed))
+            return false;
+
+        // delete from the head, the middle and the tail of the clusters, one at a time, then all together
+        const pid_t deletions[] = { last_slot[0], first_slot[0], last_slot[3], first_slot[4],
+            last_slot[SELF_CHECK_TABLE_CLUSTER_SIZE - 1], first_slot[SELF_CHECK_TABLE_CLUSTER_SIZE - 1] };
+        for (pid_t pid : deletions) {
+            alive.erase(pid);
+            removed.insert(pid);
+            self_check_table_update(table, alive);
+            if (!self_check_table_lookups(table, alive, removed))
+                return false;
+        }
+
+        // PIDs reused after their deletion go back into the clusters
+        for (pid_t pid : deletions) {
+            alive.insert(pid);
+            removed.erase(pid);
+        }
+        self_check_table_update(table, alive);
+        if (!self_check_table_lookups(table, alive, removed))
+            return false;
+
+        removed.insert(alive.begin(), alive.end());
+        alive.clear();
+        self_check_table_update(table, alive);
+        if (!self_check_table_lookups(table, alive, removed))
+            return false;
+    }
+
+    {
+        // random churn: the table grows while PIDs are added and removed at each update
+        CMonitorProcessTable table;
+        std::set<pid_t> alive, removed;
+        uint64_t random_state = 0x2545F4914F6CDD1DULL;
+        for (unsigned int round = 0; round < SELF_CHECK_TABLE_ROUNDS; round++) {
+            for (unsigned int i = 0; i < SELF_CHECK_TABLE_NUM_PIDS / 10; i++) {
+                random_state ^= random_state << 13;
+                random_state ^= random_state >> 7;
+                random_state ^= random_state << 17;
+                pid_t pid = 1 + random_state % SELF_CHECK_TABLE_NUM_PIDS;
+                if (alive.erase(pid))
+                    removed.insert(pid);
+                else {
+                    alive.insert(pid);
+                    removed.erase(pid);
+                }
+            }
+            self_check_table_update(table, alive);
+            if (!self_check_table_lookups(table, alive, removed))
+                return false;
+        }
+    }
+    return true;
+}
+
+// pops all the items left in the queue, which must be consecutive from the given one; returns the next one
+static bool self_check_queue_drain(CMonitorSpscQueue<uint64_t>& queue, uint64_t& next)
+{
+    uint64_t item;
+    while (true) {
+        queue.wakeup_consumer(); // so that pop() returns false instead of blocking once the queue is empty
+        if (!queue.pop(item))
+            break;
+        SELF_CHECK(item == next);
+        next++;
+    }
+    SELF_CHECK(queue.get_depth() == 0);
+    return true;
+}
+
+// a producer thread pushes increasing numbers while the consumer checks their order, hitting both the
+// full and the empty queue many times; returns the number of items dropped by the producer
+static bool self_check_queue_concurrent(QueueOverflowPolicy policy, uint64_t& dropsOUT)
+{
+    CMonitorSpscQueue<uint64_t> queue;
+    queue.init(SELF_CHECK_QUEUE_CAPACITY, policy);
+    std::thread producer([&queue]() {
+        for (uint64_t i = 1; i <= SELF_CHECK_QUEUE_NUM_ITEMS; i++) {
+            uint64_t item = i;
+            queue.push(item);
+        }
+        queue.wakeup_consumer(); // all items are visible to the consumer before this
+    });
+
+    uint64_t item, last = 0, num_popped = 0;
+    bool in_order = true;
+    while (queue.pop(item)) {
+        in_order &= item > last;
+        last = item;
+        num_popped++;
+    }
+    producer.join();
+    dropsOUT = queue.get_drops();
+
+    SELF_CHECK(in_order);
+    SELF_CHECK(num_popped + queue.get_drops() == SELF_CHECK_QUEUE_NUM_ITEMS);
+    SELF_CHECK(last == SELF_CHECK_QUEUE_NUM_ITEMS || policy == QOP_DROP_NEWEST);
+    return true;
+}
+
+static bool self_check_spsc_queue()
+{
+    const QueueOverflowPolicy policies[] = { QOP_DROP_NEWEST, QOP_DROP_OLDEST };
+    for (QueueOverflowPolicy policy : policies) {
+        CMonitorSpscQueue<uint64_t> queue;
+        queue.init(SELF_CHECK_QUEUE_CAPACITY, policy);
+        SELF_CHECK(queue.get_capacity() == SELF_CHECK_QUEUE_CAPACITY);
+
+        uint64_t pushed = 0, next = 0;
+        for (unsigned int lap = 0; lap < SELF_CHECK_QUEUE_LAPS; lap++) {
+            // fill the queue, then push 2 items more than it can hold
+            for (unsigned int i = 0; i < SELF_CHECK_QUEUE_CAPACITY; i++) {
+                uint64_t item = pushed++;
+                SELF_CHECK(queue.push(item));
+            }
+            SELF_CHECK(queue.get_depth() == SELF_CHECK_QUEUE_CAPACITY);
+            for (unsigned int i = 0; i < 2; i++) {
+                uint64_t item = pushed++;
+                SELF_CHECK(queue.push(item) == (policy == QOP_DROP_OLDEST));
+            }
+            SELF_CHECK(queue.get_drops() == 2 * (lap + 1));
+            SELF_CHECK(queue.get_depth() == SELF_CHECK_QUEUE_CAPACITY);
+
+            // the newest items are dropped by QOP_DROP_NEWEST, the oldest ones by QOP_DROP_OLDEST
+            if (policy == QOP_DROP_OLDEST)
+                next += 2;
+            if (!self_check_queue_drain(queue, next))
+                return false;
+            if (policy == QOP_DROP_NEWEST)
+                next += 2;
+
+            // half-fill the queue and empty it, so that the next lap starts from another slot
+            for (unsigned int i = 0; i < SELF_CHECK_QUEUE_CAPACITY / 2 + lap % 2; i++) {
+                uint64_t item = pushed++;
+                SELF_CHECK(queue.push(item));
+            }
+            if (!self_check_queue_drain(queue, next))
+                return false;
+        }
+        SELF_CHECK(next == pushed);
+    }
+
+    const QueueOverflowPolicy concurrent_policies[] = { QOP_BLOCK, QOP_DROP_NEWEST, QOP_DROP_OLDEST };
+    for (QueueOverflowPolicy policy : concurrent_policies) {
+        uint64_t drops;
+        if (!self_check_queue_concurrent(policy, drops))
+            return false;
+        SELF_CHECK(drops == 0 || policy != QOP_BLOCK);
+    }
+    return true;
+}
+
+// fills the current sample of the given frontend with all kinds of measurements; the reordered variant
+// swaps the sections, so that the names are not found at the same position as in the previous sample
+static void self_check_fill_sample(CMonitorOutputFrontend& src, unsigned int i, bool reordered)
+{
+    for (unsigned int j = 0; j < 2; j++) {
+        if ((j == 0) != reordered) {
+            src.psection_start("numbers");
+            src.plong("zero", 0);
+            src.plong("index", i);
+            src.plong("negative", -123456789 - (long long)i);
+            src.plong("min", LLONG_MIN);
+            src.plong("max", LLONG_MAX);
+            src.pdouble("milli", 12.345 + i);
+            src.pdouble("negative_milli", -0.001);
+            src.pdouble("huge", 1e30); // too large for the fixed-point encoding
+            src.pdouble("nan", NAN);
+            src.phex("hex", 0xdeadbeef);
+            src.phex("hex_max", -1);
+            src.psection_end();
+        } else {
+            src.psection_start("strings");
+            src.pstring("text", "a string with spaces");
+            src.pstring("empty", "");
+            src.psubsection_start("eth0");
+            src.plong("bytes", 1LL << 40);
+            src.psubsection_end();
+            src.psection_end();
+        }
+    }
+    src.set_current_sample_timestamp(1000000000ULL * (i + 1));
+}
+
+static bool self_check_same_measurements(const CMonitorOutputFrontend::CMonitorMeasurementVector& a,
+    const CMonitorOutputFrontend::CMonitorMeasurementVector& b)
+{
+    SELF_CHECK(a.size() == b.size());
+    for (size_t i = 0; i < a.size(); i++) {
+        SELF_CHECK(strcmp(a[i].m_name.data(), b[i].m_name.data()) == 0);
+        SELF_CHECK(strcmp(a[i].m_value.data(), b[i].m_value.data()) == 0);
+        SELF_CHECK(a[i].m_numeric == b[i].m_numeric);
+    }
+    return true;
+}
+
+static bool self_check_same_sample(
+    const CMonitorOutputFrontend::CMonitorOutputSample& a, const CMonitorOutputFrontend::CMonitorOutputSample& b)
+{
+    SELF_CHECK(a.m_timestamp_nsec == b.m_timestamp_nsec);
+    SELF_CHECK(a.m_sections.size() == b.m_sections.size());
+    for (size_t i = 0; i < a.m_sections.size(); i++) {
+        SELF_CHECK(a.m_sections[i].m_name == b.m_sections[i].m_name);
+        if (!self_check_same_measurements(a.m_sections[i].m_measurements, b.m_sections[i].m_measurements))
+            return false;
+        SELF_CHECK(a.m_sections[i].m_subsections.size() == b.m_sections[i].m_subsections.size());
+        for (size_t j = 0; j < a.m_sections[i].m_subsections.size(); j++) {
+            const auto& sa = a.m_sections[i].m_subsections[j];
+            const auto& sb = b.m_sections[i].m_subsections[j];
+            SELF_CHECK(sa.m_name == sb.m_name);
+            if (!self_check_same_measurements(sa.m_measurements, sb.m_measurements))
+                return false;
+        }
+    }
+    return true;
+}
+
+static bool self_check_flight_recorder()
+{
+    // varints: the boundaries between encoded sizes, and the extremes
+    const struct {
+        uint64_t value;
+        size_t bytes;
+    } varints[] = { { 0, 1 }, { 127, 1 }, { 128, 2 }, { 16383, 2 }, { 16384, 3 }, { UINT64_MAX, 10 } };
+    for (const auto& v : varints) {
+        std::vector<uint8_t> buf;
+        CMonitorFlightRecorder::put_varint(buf, v.value);
+        SELF_CHECK(buf.size() == v.bytes);
+        const uint8_t* p = buf.data();
+        SELF_CHECK(CMonitorFlightRecorder::get_varint(p) == v.value);
+        SELF_CHECK(p == buf.data() + buf.size());
+    }
+
+    // zigzag: small values take one byte whatever their sign
+    const struct {
+        int64_t value;
+        size_t bytes;
+    } zigzags[] = { { 0, 1 }, { -1, 1 }, { 63, 1 }, { -64, 1 }, { 64, 2 }, { -65, 2 }, { INT64_MAX, 10 },
+        { INT64_MIN, 10 } };
+    for (const auto& z : zigzags) {
+        std::vector<uint8_t> buf;
+        CMonitorFlightRecorder::put_zigzag(buf, z.value);
+        SELF_CHECK(buf.size() == z.bytes);
+        const uint8_t* p = buf.data();
+        SELF_CHECK(CMonitorFlightRecorder::get_zigzag(p) == z.value);
+        SELF_CHECK(p == buf.data() + buf.size());
+    }
+
+    // each recorded sample is decoded back identical, including when the order of the names changes
+    // and when the ring has evicted older samples
+    CMonitorFlightRecorder recorder;
+    recorder.init(10000, 1000);
+    for (unsigned int i = 0; i < SELF_CHECK_FLIGHT_RECORDER_SAMPLES; i++) {
+        CMonitorOutputFrontend src, decoded;
+        self_check_fill_sample(src, i, i % 3 == 2);
+        recorder.record(src.get_current_sample());
+        recorder.decode_newest_record(decoded);
+        if (!self_check_same_sample(src.get_current_sample(), decoded.get_current_sample()))
+            return false;
+    }
+
+    // integers out of the 64-bit range are kept as doubles
+    CMonitorOutputFrontend decoded;
+    CMonitorOutputFrontend::CMonitorOutputSample sample;
+    sample.m_sections.resize(1);
+    sample.m_sections[0].m_name = "overflow";
+    sample.m_sections[0].m_measurements.push_back(
+        CMonitorOutputFrontend::CMonitorOutputMeasurement("value", "99999999999999999999", true));
+    recorder.record(sample);
+    recorder.decode_newest_record(decoded);
+    const auto& out = decoded.get_current_sample();
+    SELF_CHECK(out.m_sections.size() == 1 && out.m_sections[0].m_measurements.size() == 1);
+    SELF_CHECK(strtod(out.m_sections[0].m_measurements[0].m_value.data(), NULL) == 1e20);
+    return true;
+}
+
+// checks the labels and values extracted by the last parse(), in order
+static bool self_check_key_values(
+    const CMonitorKeyValueParser& parser, const std::vector<std::pair<std::string, int64_t>>& expected)
+{
+    SELF_CHECK(parser.size() == expected.size());
+    for (size_t i = 0; i < expected.size(); i++) {
+        SELF_CHECK(expected[i].first == parser.get_label(i));
+        SELF_CHECK(expected[i].second == parser.get_value(i));
+    }
+    return true;
+}
+
+static bool self_check_key_value_parser()
+{
+    {
+        // selected labels: the layout is learnt once, then relearnt whenever the lines move or change
+        CMonitorKeyValueParser parser;
+        const std::set<std::string> allowed = { "MemTotal", "Active_anon" };
+        parser.parse("MemTotal:  100 kB\nMemFree:  50 kB\nActive(anon):  7 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 1);
+        if (!self_check_key_values(parser, { { "MemTotal", 100000 }, { "Active_anon", 7000 } }))
+            return false;
+
+        parser.parse("MemTotal:  100 kB\nMemFree:  40 kB\nActive(anon):  8 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 1);
+        if (!self_check_key_values(parser, { { "MemTotal", 100000 }, { "Active_anon", 8000 } }))
+            return false;
+
+        // swapped lines
+        parser.parse("Active(anon):  9 kB\nMemTotal:  100 kB\nMemFree:  40 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 2);
+        if (!self_check_key_values(parser, { { "Active_anon", 9000 }, { "MemTotal", 100000 } }))
+            return false;
+
+        // a label having the learnt one as prefix on the same line
+        parser.parse("Active(anon):  9 kB\nMemTotals:  100 kB\nMemFree:  40 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 3);
+        if (!self_check_key_values(parser, { { "Active_anon", 9000 } }))
+            return false;
+
+        // a line inserted before the selected ones, then the file getting shorter
+        parser.parse("Buffers:  3 kB\nActive(anon):  9 kB\nMemTotal:  100 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 4);
+        if (!self_check_key_values(parser, { { "Active_anon", 9000 }, { "MemTotal", 100000 } }))
+            return false;
+        parser.parse("Buffers:  3 kB\nActive(anon):  9 kB\n", allowed);
+        SELF_CHECK(parser.get_num_learns() == 5);
+        if (!self_check_key_values(parser, { { "Active_anon", 9000 } }))
+            return false;
+    }
+
+    {
+        // all labels with a prefix: lines appended at the end are noticed too
+        CMonitorKeyValueParser parser;
+        const std::set<std::string> all;
+        parser.parse("nr_free 10\npgfault 20\npgmajfault 30\n", all, "pg");
+        SELF_CHECK(parser.get_num_learns() == 1);
+        if (!self_check_key_values(parser, { { "pgfault", 20 }, { "pgmajfault", 30 } }))
+            return false;
+
+        parser.parse("nr_free 11\npgfault 21\npgmajfault -31\n", all, "pg");
+        SELF_CHECK(parser.get_num_learns() == 1);
+        if (!self_check_key_values(parser, { { "pgfault", 21 }, { "pgmajfault", -31 } }))
+            return false;
+
+        parser.parse("nr_free 11\npgfault 22\npgmajfault 32\npgsteal 40\n", all, "pg");
+        SELF_CHECK(parser.get_num_learns() == 2);
+        if (!self_check_key_values(parser, { { "pgfault", 22 }, { "pgmajfault", 32 }, { "pgsteal", 40 } }))
+            return false;
+
+        parser.parse("pgmajfault 33\nnr_free 11\npgfault 23\npgsteal 41\n", all, "pg");
+        SELF_CHECK(parser.get_num_learns() == 3);
+        if (!self_check_key_values(parser, { { "pgmajfault", 33 }, { "pgfault", 23 }, { "pgsteal", 41 } }))
+            return false;
+    }
+    return true;
+}
+
+static bool self_check_counter_table()
+{
+    // the static helper wraps at the given width and treats 64-bit counters going backward as reset
+    SELF_CHECK(CMonitorCounterTable::counter_delta(5, 0xFFFFFFFFULL, 32) == 6);
+    SELF_CHECK(CMonitorCounterTable::counter_delta(5, 3, 32) == 2);
+    SELF_CHECK(CMonitorCounterTable::counter_delta(5, 10) == 5);
+    SELF_CHECK(CMonitorCounterTable::counter_delta(UINT64_MAX, 0) == UINT64_MAX);
+
+    CMonitorCounterTable table;
+    unsigned int wrap32 = table.add_counter("wrap32", CT_MONOTONIC, 1.0, 32);
+    unsigned int reset64 = table.add_counter("reset64", CT_MONOTONIC);
+    unsigned int sectors = table.add_counter("sectors", CT_MONOTONIC, 0.5);
+    unsigned int gauge = table.add_counter("gauge", CT_GAUGE);
+
+    size_t row = table.alloc_row();
+    const uint64_t first[] = { 0xFFFFFF00ULL, 1000, 100, 5 };
+    table.start_update();
+    table.update(row, first);
+    table.compute_rates(1.0);
+    SELF_CHECK(!table.has_rates(row)); // no baseline yet
+
+    // the 32-bit counter wraps around, the others increase
+    const uint64_t second[] = { 0x100, 1500, 300, 7 };
+    table.start_update();
+    table.update(row, second);
+    table.compute_rates(2.0);
+    SELF_CHECK(table.has_rates(row));
+    SELF_CHECK(table.get_rate(row, wrap32) == 0x200 / 2.0);
+    SELF_CHECK(table.get_rate(row, reset64) == 500 / 2.0);
+    SELF_CHECK(table.get_rate(row, sectors) == 200 * 0.5 / 2.0);
+    SELF_CHECK(table.get_rate(row, gauge) == 7);
+    SELF_CHECK(table.get_value(row, wrap32) == 0x100);
+    SELF_CHECK(!table.went_backward(row)); // wrapping around is not going backward
+    table.set_checkpoint();
+
+    // the 64-bit counter goes backward: it restarted from 0
+    const uint64_t third[] = { 0x300, 200, 400, 3 };
+    table.start_update();
+    table.update(row, third);
+    table.compute_rates(1.0);
+    SELF_CHECK(table.has_rates(row) && table.went_backward(row));
+    SELF_CHECK(table.get_rate(row, wrap32) == 0x200);
+    SELF_CHECK(table.get_rate(row, reset64) == 200);
+    SELF_CHECK(table.get_rate(row, sectors) == 100 * 0.5);
+    SELF_CHECK(table.get_rate(row, gauge) == 3);
+
+    // rates since the checkpoint span both updates
+    const uint64_t fourth[] = { 0x500, 600, 500, 4 };
+    table.start_update();
+    table.update(row, fourth);
+    table.compute_rates(4.0, true);
+    SELF_CHECK(table.has_rates(row));
+    SELF_CHECK(table.get_rate(row, wrap32) == (0x500 - 0x100) / 4.0);
+    SELF_CHECK(table.get_rate(row, sectors) == 200 * 0.5 / 4.0);
+
+    // a row not updated has no rates; a freed row reused has no baseline
+    size_t other = table.alloc_row();
+    table.start_update();
+    table.update(other, first);
+    table.compute_rates(1.0);
+    SELF_CHECK(!table.has_rates(row) && !table.has_rates(other));
+    table.free_row(row);
+    SELF_CHECK(table.alloc_row() == row);
+    table.start_update();
+    table.update(row, second);
+    table.update(other, second);
+    table.compute_rates(1.0);
+    SELF_CHECK(!table.has_rates(row) && table.has_rates(other));
+    return true;
+}
+
+static bool self_check_scheduler()
+{
+    SELF_CHECK(CMonitorScheduler::gcd(5, 0) == 5 && CMonitorScheduler::gcd(0, 5) == 5);
+    SELF_CHECK(CMonitorScheduler::gcd(1200, 1800) == 600);
+
+    // the scheduler ticks at the GCD of the intervals; each family is due once every its own interval
+    const uint64_t msec = 1000000ULL, t0 = 1000 * msec;
+    CMonitorScheduler scheduler;
+    scheduler.set_family_interval(PK_CPU, 200);
+    scheduler.set_family_interval(PK_DISK, 1000);
+    SELF_CHECK(scheduler.get_families_gcd_msec() == 200);
+    scheduler.start(200, t0);
+    SELF_CHECK(scheduler.get_tick_interval_msec() == 200);
+
+    scheduler.advance_to(t0 + 200 * msec);
+    SELF_CHECK(scheduler.get_due_families() == (PK_CPU | PK_DISK)); // the first tick collects all of them
+    for (uint64_t tick = 2; tick <= 11; tick++) {
+        scheduler.advance_to(t0 + tick * 200 * msec + 3 * msec /* jitter */);
+        SELF_CHECK(scheduler.get_last_overruns() == 0 && scheduler.get_last_jitter_usec() == 3000);
+        SELF_CHECK(scheduler.is_due(PK_CPU));
+        SELF_CHECK(scheduler.is_due(PK_DISK) == (tick % 5 == 1));
+        SELF_CHECK(scheduler.get_elapsed_sec(PK_CPU) == (tick == 2 ? 0.203 : 0.2));
+    }
+    SELF_CHECK(scheduler.get_elapsed_sec(PK_DISK) == 1.0);
+
+    // waking up 2.5 intervals late skips 2 deadlines: the slow family is not postponed by them
+    scheduler.advance_to(t0 + 12 * 200 * msec + 500 * msec);
+    SELF_CHECK(scheduler.get_last_overruns() == 2 && scheduler.get_total_overruns() == 2);
+    SELF_CHECK(scheduler.get_due_families() == PK_CPU);
+    scheduler.advance_to(t0 + 15 * 200 * msec);
+    SELF_CHECK(scheduler.get_last_overruns() == 0);
+    SELF_CHECK(scheduler.get_due_families() == PK_CPU);
+    scheduler.advance_to(t0 + 16 * 200 * msec);
+    SELF_CHECK(scheduler.get_due_families() == (PK_CPU | PK_DISK));
+    SELF_CHECK(scheduler.get_elapsed_sec(PK_DISK) == 0.997); // since the jittered tick 11
+
+    // the families registered by the collector: intervals without a common divisor of at least
+    // MIN_SAMPLING_INTERVAL_MSEC are rejected by parse_args()
+    CMonitorCollectorAppConfig saved_cfg = g_cfg;
+    g_cfg.m_nCollectFlags = PK_CPU | PK_DISK | PK_NETWORK;
+    g_cfg.m_nSamplingIntervalMsec = 60000;
+    g_cfg.m_mapCollectIntervalMsec = { { PK_CPU, 200 }, { PK_DISK, 1000 } };
+    CMonitorScheduler valid;
+    CMonitorCollectorApp::set_scheduler_families(valid);
+    SELF_CHECK(valid.get_families_gcd_msec() == 200);
+    g_cfg.m_mapCollectIntervalMsec = { { PK_CPU, 1001 } };
+    CMonitorScheduler too_fast;
+    CMonitorCollectorApp::set_scheduler_families(too_fast);
+    SELF_CHECK(too_fast.get_families_gcd_msec() == 1);
+    SELF_CHECK(too_fast.get_families_gcd_msec() < MIN_SAMPLING_INTERVAL_MSEC);
+    g_cfg = saved_cfg;
+    return true;
+}
+
+static bool run_self_checks()
+{
+    struct {
+        const char* name;
+        bool (*check)();
+    } checks[] = {
+        { "process_table", self_check_process_table }, // force newline
+        { "spsc_queue", self_check_spsc_queue }, // force newline
+        { "flight_recorder", self_check_flight_recorder }, // force newline
+        { "key_value_parser", self_check_key_value_parser }, // force newline
+        { "counter_table", self_check_counter_table }, // force newline
+        { "scheduler", self_check_scheduler }, // force newline
+    };
+
+    bool all_passed = true;
+    for (const auto& c : checks) {
+        bool passed = c.check();
+        fprintf(stderr, "%-32s %s\n", c.name, passed ? "OK" : "FAILED");
+        all_passed &= passed;
+    }
+    return all_passed;
+}
+
+//------------------------------------------------------------------------------
+// Main
+//------------------------------------------------------------------------------
+
+static struct option g_long_opts[] = {
+    { "samples", required_argument, 0, 'n' }, // force newline
+    { "filter", required_argument, 0, 'b' }, // force newline
+    { "fixtures-dir", required_argument, 0, 'x' }, // force newline
+    { "output", required_argument, 0, 'o' }, // force newline
+    { "self-check", no_argument, 0, 'c' }, // force newline
+    { "help", no_argument, 0, 'h' }, // force newline
+    { 0, 0, 0, 0 } // force newline
+};
+
+static void print_help()
+{
+    printf("Usage: cmonitor_bench [options]\n");
+    printf("Runs micro-benchmarks of cmonitor_collector parsers and output encoders against synthetic procfs\n");
+    printf("fixtures and writes a JSON report of ns/sample, throughput, allocations/sample and p50/p99 timings.\n");
+    printf("  -n, --samples=N        Number of samples for each benchmark (default %u); benchmarks taking\n"
+           "                         more than %llus are stopped earlier.\n",
+        BENCH_DEFAULT_SAMPLES, BENCH_MAX_NSEC_PER_BENCHMARK / 1000000000ULL);
+    printf("  -b, --filter=STRING    Run only benchmarks whose name contains STRING.\n");
+    printf("  -x, --fixtures-dir=DIR Generate fixtures inside DIR and keep them (default: temporary directory).\n");
+    printf("  -o, --output=FILE      Write the JSON report into FILE (default: stdout).\n");
+    printf("  -c, --self-check       Run the behavior checks of the internal data structures instead of the\n"
+           "                         benchmarks; the exit code is 0 only if all of them pass.\n");
+    printf("  -h, --help             Show this help.\n");
+}
+
+int main(int argc, char** argv)
+{
+    unsigned int num_samples = BENCH_DEFAULT_SAMPLES;
+    std::string filter, fixtures_dir, output;
+
+    // the allocations of each benchmark are reported, see measure()
+    CMonitorSelfStats::enable_allocation_counting();
+
+    while (true) {
+        int c = getopt_long(argc, argv, "n:b:x:o:ch", g_long_opts, NULL);
+        if (c == -1)
+            break;
+
+        uint64_t value;
+        switch (c) {
+        case 'n':
+            if (!string2int(optarg, value) || value == 0) {
+                fprintf(stderr, "Invalid number of samples: %s\n", optarg);
+                exit(1);
+            }
+            num_samples = value;
+            break;
+        case 'b':
+            filter = optarg;
+            break;
+        case 'x':
+            fixtures_dir = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'c':
+            exit(run_self_checks() ? 0 : 4);
+        case 'h':
+            print_help();
+            exit(0);
+        default:
+            print_help();
+            exit(1);
+        }
+    }
+
+    FILE* out = stdout;
+    if (!output.empty() && (out = fopen(output.c_str(), "w")) == NULL) {
+        perror(output.c_str());
+        exit(2);
+    }
+
+    CMonitorBenchmark bench;
+    if (!bench.init_fixtures(fixtures_dir))
+        exit(3);
+    bench.run_all(filter, num_samples);
+    bench.remove_fixtures();
+
+    bench.print_results(out);
+    if (out != stdout)
+        fclose(out);
+    return 0;
+}
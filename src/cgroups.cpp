@@ -21,25 +21,37 @@
 
 #include "cmonitor.h"
 #include "output_frontend.h"
+#include "snapshot.h"
+#include <algorithm>
 #include <assert.h>
-#include <fstream>
-#include <pwd.h>
+#include <dirent.h>
+#include <fcntl.h>
 #include <sstream>
-#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/wait.h>
 
 // ----------------------------------------------------------------------------------
 // Constants
 // ----------------------------------------------------------------------------------
 
-#define MAX_LOGICAL_CPU (256)
-#define MIN_ELAPSED_SECS (0.1)
+#define MIN_ELAPSED_SECS (0.001)
 #define PAGESIZE_BYTES (1024 * 4)
 
-/* Put a threshold on the CPU percentage basically:
- */
-//#define PROCESS_SCORE_IGNORE_THRESHOLD (1000)
-#define PROCESS_SCORE_IGNORE_THRESHOLD (1)
+// with --proc-events, the cgroup "tasks" file is read anyway every N samples to find the processes moved
+// into the cgroup by other processes (e.g. "docker exec"), which are not notified by any fork event
+#define PROC_EVENTS_RESYNC_SAMPLES (60)
+
+// with the /proc backend, only /proc/<pid>/stat is read for all processes, to compute their scores; moreover
+// the threads, and the processes without any CPU time in PROC_IDLE_SAMPLES consecutive reads, are read only
+// once every PROC_IDLE_SCAN_PERIOD samples: in between their counters are assumed unchanged
+#define PROC_IDLE_SAMPLES (3)
+#define PROC_IDLE_SCAN_PERIOD (5)
+
+// with --process-scan-threads, smaller slices of PIDs are not worth the synchronization
+#define PROC_SCAN_MIN_PIDS_PER_THREAD (256)
+
+// the memory limit reported by cgroups v1 for an unlimited cgroup (with 4K pages); cgroups v2 report "max" instead
+#define CGROUP_UNLIMITED_MEMORY_BYTES (0x7FFFFFFFFFFFF000ULL)
 
 typedef std::map<std::string /* controller type */, std::string /* path */> cgroup_paths_map_t;
 
@@ -47,18 +59,63 @@ typedef std::map<std::string /* controller type */, std::string /* path */> cgro
 // C++ Helper functions
 // ----------------------------------------------------------------------------------
 
-uint64_t compute_proc_score(const procsinfo_t* current_stats, const procsinfo_t* prev_stats, double elapsed_secs)
+// the score functions selectable with --process-score, indexed by ProcessScoreMetric:
+typedef double (*proc_score_fn_t)(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs);
+
+static double proc_score_cpu(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs)
 {
     static double ticks_per_sec = (double)sysconf(_SC_CLK_TCK); // clock ticks per second
 
     uint64_t cputime_clock_ticks = // force newline
-        (current_stats->pi_utime - prev_stats->pi_utime) + // force newline
-        (current_stats->pi_stime - prev_stats->pi_stime);
+        CMonitorCounterTable::counter_delta(current_stats->pi_utime, prev_stats->pi_utime)
+        + CMonitorCounterTable::counter_delta(current_stats->pi_stime, prev_stats->pi_stime);
 
-    // give a score which is linear in both CPU time and virtual memory size:
-    // return (cputime_clock_ticks * ticks_per_sec) * current_stats->pi_vsize;
+    // in percentage of one CPU
+    return cputime_clock_ticks * 100.0 / ticks_per_sec / elapsed_secs;
+}
 
-    return cputime_clock_ticks * ticks_per_sec;
+static double proc_score_rss(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs)
+{
+    // in MB
+    return (double)gauges->pi_rss * PAGESIZE_BYTES / (1024 * 1024);
+}
+
+static double proc_score_io(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs)
+{
+    // in MB/s, including the I/O served by the page cache, just like the "io_rchar" and "io_wchar" fields
+    uint64_t bytes = // force newline
+        CMonitorCounterTable::counter_delta(current_stats->io_rchar, prev_stats->io_rchar)
+        + CMonitorCounterTable::counter_delta(current_stats->io_wchar, prev_stats->io_wchar);
+    return (double)bytes / (1024 * 1024) / elapsed_secs;
+}
+
+static double proc_score_majflt(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs)
+{
+    // in faults per second
+    return (double)CMonitorCounterTable::counter_delta(current_stats->pi_majflt, prev_stats->pi_majflt)
+        / elapsed_secs;
+}
+
+static const proc_score_fn_t g_proc_score_functions[PSM_MAX] = {
+    proc_score_cpu, // PSM_CPU
+    proc_score_rss, // PSM_RSS
+    proc_score_io, // PSM_IO
+    proc_score_majflt, // PSM_MAJFLT
+};
+
+double compute_proc_score(const proc_counters_t* current_stats, const proc_counters_t* prev_stats,
+    const proc_gauges_t* gauges, double elapsed_secs)
+{
+    // a weighted sum of the metrics selected by --process-score
+    double score = 0;
+    for (const process_score_term_t& term : g_cfg.m_vecProcessScore)
+        score += term.weight * g_proc_score_functions[term.metric](current_stats, prev_stats, gauges, elapsed_secs);
+    return score;
 }
 
 /* Lookup the right process state string */
@@ -94,190 +151,289 @@ const char* get_state(char n)
     }
 }
 
-bool cgroup_proc_procsinfo(pid_t pid, procsinfo_t* p, OutputFields output_opts)
+static bool is_same_process(const proc_identity_t& identity, pid_t pid, uint64_t start_time)
 {
-    FILE* fp;
-    char filename[64];
-    char buf[1024 * 4];
-    int size = 0;
-    int ret = 0;
-    int count = 0;
-    int i;
-    struct stat statbuf;
-    struct passwd* pw;
-
-    /* the statistic directory for the process */
-    snprintf(filename, 64, "/proc/%d", pid);
-    if (stat(filename, &statbuf) != 0) {
-        g_logger.LogError("ERROR: failed to stat file %s", filename);
+    // the start time is exact when read from /proc/<pid>/stat, but it is estimated from the elapsed time when
+    // read from taskstats: estimates may differ by one tick and that must not be mistaken for a new process
+    if (identity.pi_pid != pid)
+        return false;
+    uint64_t diff = start_time > identity.pi_start_time ? start_time - identity.pi_start_time
+                                                        : identity.pi_start_time - start_time;
+    return diff <= (identity.from_taskstats ? 1 : 0);
+}
+
+static void proc_set_read_time(proc_gauges_t* gauges, unsigned int parts, double now, double elapsed_secs)
+{
+    // the deltas of counters read at each sample span one sampling interval, those of the others
+    // span all the samples since their last read
+    if (parts & PROC_READ_STAT) {
+        gauges->stat_interval_secs = gauges->stat_read_time > 0 ? now - gauges->stat_read_time : elapsed_secs;
+        gauges->stat_read_time = now;
+    }
+    if (parts & PROC_READ_IO) {
+        gauges->io_interval_secs = gauges->io_read_time > 0 ? now - gauges->io_read_time : elapsed_secs;
+        gauges->io_read_time = now;
+    }
+}
+
+static inline double proc_interval(double interval_secs, double elapsed_secs)
+{
+    // zero for the rows filled from taskstats, which are always read at each sample
+    return interval_secs > 0 ? interval_secs : elapsed_secs;
+}
+
+// parses /proc/<pid>/stat or /proc/<pid>/task/<tid>/stat; if the identity describes another process
+// it is reset and new_process is set: its PID is left zero, for the caller to set once it is complete
+static bool proc_parse_stat(const char* buf, pid_t pid, proc_counters_t* counters, proc_gauges_t* gauges,
+    proc_identity_t* identity, bool& new_process)
+{
+    const char* q = buf;
+    uint64_t pid_value;
+    if (!proc_parse_uint(q, pid_value) || *++q != '(') {
+        g_logger.LogError("procsinfo parsing failed line=%s\n", buf);
         return false;
     }
 
-    // by looking at the owner of the directory we know which user is running it:
-    p->uid = statbuf.st_uid;
-    pw = getpwuid(statbuf.st_uid);
-    if (pw) {
-        strncpy(p->username, pw->pw_name, 63);
-        p->username[63] = 0;
+    /* the command name is between parentheses and it may contain spaces and parentheses itself
+       (e.g. dumb Infiniband driver includes "()"): look for the last ")" in the line */
+    const char* comm_start = q + 1;
+    const char* comm_end = strrchr(comm_start, ')');
+    if (comm_end == NULL || comm_end[1] != ' ') {
+        g_logger.LogError("procsinfo failed to find end of command buf=%s\n", buf);
+        return false;
     }
 
-    { /* the statistic file for the process */
-        snprintf(filename, 64, "/proc/%d/stat", pid);
-        if ((fp = fopen(filename, "r")) == NULL) {
-            g_logger.LogError("ERROR: failed to open file %s", filename);
-            return false;
-        }
+    // see http://man7.org/linux/man-pages/man5/proc.5.html, search for /proc/[pid]/stat
+    /* column 1 and 2 are handled above */
+    q = comm_end + 2;
+    gauges->pi_state = *q++; /*3 - these numbers are taken from "man proc" */
+
+    // all other columns are integers, some of them signed (e.g. tty_pgrp is -1 for processes without a tty)
+    int64_t v[39];
+    unsigned int ret = 0;
+    while (ret < 39 && proc_parse_int(q, v[ret]))
+        ret++;
+    if (ret != 39) {
+        g_logger.LogError("procsinfo2 parsing wanted 40 returned = %u pid=%d line=%s\n", ret + 1, pid, buf);
+        return false;
+    }
 
-        size = fread(buf, 1, 1024 - 1, fp);
-        fclose(fp);
-        if (size == -1) {
-            g_logger.LogError(
-                "ERROR: procsinfo read returned = %d assuming process stopped pid=%d errno=%d\n", ret, pid, errno);
-            return false;
+    // the PID and the start time tell whether the identity describes this process already;
+    // NOTE: its PID is set only once all of it has been read, so that a failure leaves it invalid
+    new_process = !is_same_process(*identity, pid, v[18] /*22*/);
+    if (new_process) {
+        memset(identity, 0, sizeof(*identity));
+        identity->pi_start_time = v[18]; /*22*/
+    }
+
+    // the fields of the identity that can change during the life of the process (e.g. the command
+    // name, at each exec()) come for free with this file
+    size_t comm_len = std::min((size_t)(comm_end - comm_start), sizeof(identity->pi_comm) - 1);
+    memcpy(identity->pi_comm, comm_start, comm_len);
+    identity->pi_comm[comm_len] = 0;
+    identity->pi_ppid = v[0]; /*4*/
+    identity->pi_pgrp = v[1]; /*5*/
+    identity->pi_session = v[2]; /*6*/
+    identity->pi_tty_nr = v[3]; /*7*/
+
+    counters->pi_minflt = v[6]; /*10*/
+    counters->pi_majflt = v[8]; /*12*/
+    counters->pi_utime = v[10]; /*14*/
+    counters->pi_stime = v[11]; /*15*/
+    gauges->pi_priority = v[14]; /*18*/
+    gauges->pi_nice = v[15]; /*19*/
+    gauges->pi_num_threads = v[16]; /*20*/
+    gauges->pi_vsize = v[19]; /*23*/
+    gauges->pi_rss = v[20]; /*24*/
+    gauges->pi_rsslimit = v[21]; /*25*/
+    gauges->pi_swap_pages = v[32]; /*36*/
+    gauges->pi_child_swap_pages = v[33]; /*37*/
+    gauges->pi_last_cpu = v[35]; /*39*/
+    gauges->pi_realtime_priority = v[36]; /*40*/
+    gauges->pi_sched_policy = v[37]; /*41*/
+    gauges->pi_delayacct_blkio_ticks = v[38]; /*42*/
+    return true;
+}
+
+bool cgroup_proc_procsinfo(CMonitorProcFile& file, pid_t pid, proc_counters_t* counters, proc_gauges_t* gauges,
+    proc_identity_t* identity, unsigned int parts, int* stat_fd, bool log_errors)
+{
+    char filename[1024];
+    const char* buf = NULL;
+    const char* q;
+    bool new_process = false;
+    const char* proc_root = g_cfg.m_strProcRoot.c_str();
+
+    if (parts & PROC_READ_STAT) { /* the statistic file for the process */
+        snprintf(filename, sizeof(filename), "%s/%d/stat", proc_root, pid);
+        if (stat_fd != NULL && *stat_fd != -1) {
+            // kept open since last sample: it cannot be read anymore once the process is gone
+            file.adopt(*stat_fd, filename);
+            *stat_fd = -1;
+            buf = file.read();
         }
-        ret = sscanf(buf, "%d (%s)", &p->pi_pid, &p->pi_comm[0]);
-        if (ret != 2) {
-            g_logger.LogError("procsinfo sscanf returned = %d line=%s\n", ret, buf);
+        if (buf == NULL && (!file.open(filename) || (buf = file.read()) == NULL)) {
+            if (log_errors)
+                g_logger.LogError("ERROR: failed to read file %s assuming process stopped", filename);
             return false;
         }
-        p->pi_comm[strlen(p->pi_comm) - 1] = 0;
 
-        /* now look for ") " as dumb Infiniband driver includes "()" */
-        for (count = 0; count < size; count++)
-            if (buf[count] == ')' && buf[count + 1] == ' ')
-                break;
-        if (count == size) {
-            g_logger.LogError("procsinfo failed to find end of command buf=%s\n", buf);
-            return false;
-        }
-        count++;
-        count++;
-
-        // see http://man7.org/linux/man-pages/man5/proc.5.html, search for /proc/[pid]/stat
-        /* column 1 and 2 are handled above */
-        long junk;
-        ret = sscanf(&buf[count],
-            "%c %d %d %d %d %d %lu %lu %lu %lu " /* from 3 to 13 */
-            "%lu %lu %lu %ld %ld %ld %ld %ld %ld %lu " /* from 14 to 23 */
-            "%lu %ld %lu %lu %lu %lu %lu %lu %lu %lu " /* from 24 to 33 */
-            "%lu %lu %lu %lu %lu %d %d %lu %lu %llu", /* from 34 to 42 */
-            &p->pi_state, /*3 - these numbers are taken from "man proc" */
-            &p->pi_ppid, /*4*/
-            &p->pi_pgrp, /*5*/
-            &p->pi_session, /*6*/
-            &p->pi_tty_nr, /*7*/
-            &p->pi_tty_pgrp, /*8*/
-            &p->pi_flags, /*9*/
-            &p->pi_minflt, /*10*/
-            &p->pi_child_min_flt, /*11*/
-            &p->pi_majflt, /*12*/
-            &p->pi_child_maj_flt, /*13*/
-            &p->pi_utime, /*14*/
-            &p->pi_stime, /*15*/
-            &p->pi_child_utime, /*16*/
-            &p->pi_child_stime, /*17*/
-            &p->pi_priority, /*18*/
-            &p->pi_nice, /*19*/
-            &p->pi_num_threads, /*20*/
-            &junk, /*21*/
-            &p->pi_start_time, /*22*/
-            &p->pi_vsize, /*23*/
-            &p->pi_rss, /*24*/
-            &p->pi_rsslimit, /*25*/
-            &p->pi_start_code, /*26*/
-            &p->pi_end_code, /*27*/
-            &p->pi_start_stack, /*28*/
-            &p->pi_esp, /*29*/
-            &p->pi_eip, /*30*/
-            &p->pi_signal_pending, /*31*/
-            &p->pi_signal_blocked, /*32*/
-            &p->pi_signal_ignore, /*33*/
-            &p->pi_signal_catch, /*34*/
-            &p->pi_wchan, /*35*/
-            &p->pi_swap_pages, /*36*/
-            &p->pi_child_swap_pages, /*37*/
-            &p->pi_signal_exit, /*38*/
-            &p->pi_last_cpu, /*39*/
-            &p->pi_realtime_priority, /*40*/
-            &p->pi_sched_policy, /*41*/
-            &p->pi_delayacct_blkio_ticks /*42*/
-        );
-        if (ret != 40) {
-            g_logger.LogError("procsinfo2 sscanf wanted 40 returned = %d pid=%d line=%s\n", ret, pid, buf);
+        if (!proc_parse_stat(buf, pid, counters, gauges, identity, new_process))
             return false;
-        }
+        if (stat_fd != NULL)
+            *stat_fd = file.release();
     }
 
-    if (output_opts == PF_ALL) { /* the statm file for the process */
+    if (parts & PROC_READ_STATM) { /* the statm file for the process */
 
-        snprintf(filename, 64, "/proc/%d/statm", pid);
-        if ((fp = fopen(filename, "r")) == NULL) {
-            g_logger.LogError("failed to open file %s", filename);
-            return false;
-        }
-        size = fread(buf, 1, 1024 * 4 - 1, fp);
-        fclose(fp); /* close it even if the read failed, the file could have been removed
-                    between open & read i.e. the device driver does not behave like a file */
-        if (size == -1) {
-            g_logger.LogError("failed to read file %s", filename);
+        snprintf(filename, sizeof(filename), "%s/%d/statm", proc_root, pid);
+        if (!file.open(filename) || (buf = file.read()) == NULL) {
+            if (log_errors)
+                g_logger.LogError("failed to read file %s", filename);
             return false;
         }
 
-        ret = sscanf(&buf[0], "%lu %lu %lu %lu %lu %lu %lu", // force newline
-            &p->statm_size, &p->statm_resident, &p->statm_share, &p->statm_trs, &p->statm_lrs, &p->statm_drs,
-            &p->statm_dt);
+        uint64_t v[7];
+        q = buf;
+        unsigned int ret = proc_parse_uint_array(q, v, 7);
         if (ret != 7) {
-            g_logger.LogError("sscanf wanted 7 returned = %d line=%s\n", ret, buf);
+            g_logger.LogError("parsing wanted 7 returned = %u line=%s\n", ret, buf);
             return false;
         }
+        gauges->statm_size = v[0];
+        gauges->statm_resident = v[1];
+        gauges->statm_share = v[2];
+        gauges->statm_trs = v[3];
+        gauges->statm_drs = v[5]; // v[4] is "lib", unused since Linux 2.6 just like v[6], "dt"
     }
 
-    { /* the status file for the process */
-
-        snprintf(filename, 64, "/proc/%d/status", pid);
-        if ((fp = fopen(filename, "r")) == NULL) {
-            g_logger.LogError("failed to open file %s", filename);
+    if (new_process) {
+        /* the status file for the process */
+        snprintf(filename, sizeof(filename), "%s/%d/status", proc_root, pid);
+        if (!file.open(filename) || (buf = file.read()) == NULL) {
+            if (log_errors)
+                g_logger.LogError("failed to read file %s", filename);
             return false;
         }
-        for (i = 0;; i++) {
-            if (fgets(buf, 1024, fp) == NULL) {
-                break;
-            }
-            if (strncmp("Tgid:", buf, 5) == 0) {
+        // NOTE: the user running the process is read from this file, rather than from the owner of the
+        //       /proc/<pid> directory, so that it is recorded and replayed like all other data, see --record
+        bool has_tgid = false, has_uid = false;
+        q = buf;
+        do {
+            if (proc_starts_with(q, "Tgid:", 5)) {
                 // this info is only available from the /status file apparently and not from /stat
-                sscanf(&buf[6], "%d", &p->pi_tgid);
+                const char* r = &q[5];
+                uint64_t tgid;
+                if (proc_parse_uint(r, tgid))
+                    identity->pi_tgid = tgid;
+                has_tgid = true;
+            } else if (proc_starts_with(q, "Uid:", 4)) {
+                // real, effective, saved and filesystem UIDs: the effective one is the owner of /proc/<pid>
+                const char* r = &q[4];
+                uint64_t uids[2];
+                if (proc_parse_uint_array(r, uids, 2) == 2)
+                    identity->uid = uids[1];
+                has_uid = true;
             }
-        }
-        fclose(fp);
+        } while (!(has_tgid && has_uid) && proc_next_line(q));
+
+        identity->pi_pid = pid;
     }
 
-    /*if (uid == (uid_t)0)*/
-    { /* the io file for the process */
-        p->io_read_bytes = 0;
-        p->io_write_bytes = 0;
-        sprintf(filename, "/proc/%d/io", pid);
-        if ((fp = fopen(filename, "r")) != NULL) {
-            for (i = 0; i < 6; i++) {
-                if (fgets(buf, 1024, fp) == NULL) {
-                    break;
-                }
-                if (strncmp("rchar:", buf, 6) == 0)
-                    sscanf(&buf[7], "%lld", &p->io_rchar);
-                if (strncmp("wchar:", buf, 6) == 0)
-                    sscanf(&buf[7], "%lld", &p->io_wchar);
-                if (strncmp("read_bytes:", buf, 11) == 0)
-                    sscanf(&buf[12], "%lld", &p->io_read_bytes);
-                if (strncmp("write_bytes:", buf, 12) == 0)
-                    sscanf(&buf[13], "%lld", &p->io_write_bytes);
-            }
+    if (parts & PROC_READ_IO) { /* the io file for the process */
+        counters->io_rchar = 0;
+        counters->io_wchar = 0;
+        counters->io_read_bytes = 0;
+        counters->io_write_bytes = 0;
+        snprintf(filename, sizeof(filename), "%s/%d/io", proc_root, pid);
+        if (file.open(filename) && (buf = file.read()) != NULL) {
+            q = buf;
+            uint64_t value;
+            do {
+                const char* r = q;
+                if (proc_starts_with(q, "rchar:", 6) && proc_parse_uint(r += 6, value))
+                    counters->io_rchar = value;
+                else if (proc_starts_with(q, "wchar:", 6) && proc_parse_uint(r += 6, value))
+                    counters->io_wchar = value;
+                else if (proc_starts_with(q, "read_bytes:", 11) && proc_parse_uint(r += 11, value))
+                    counters->io_read_bytes = value;
+                else if (proc_starts_with(q, "write_bytes:", 12) && proc_parse_uint(r += 12, value))
+                    counters->io_write_bytes = value;
+            } while (proc_next_line(q));
         }
-
-        if (fp != NULL)
-            fclose(fp);
     }
+
+    file.close();
     return true;
 }
 
+void cgroup_proc_taskstats(
+    const process_taskstats_t& ts, proc_counters_t* counters, proc_gauges_t* gauges, proc_identity_t* identity)
+{
+    static double ticks_per_usec = (double)sysconf(_SC_CLK_TCK) / 1E6;
+    static double ticks_per_nsec = (double)sysconf(_SC_CLK_TCK) / 1E9;
+
+    // the per-PID stats describe the main thread only, while CPU times and delays must include all threads:
+    // take them from the per-TGID stats, when available
+    const struct taskstats& pid_stats = ts.pid_stats;
+    const struct taskstats& all_threads = ts.has_tgid_stats ? ts.tgid_stats : ts.pid_stats;
+
+    // the elapsed time is measured from the same monotonic clock used by /proc/<pid>/stat for the start time:
+    struct timespec now;
+    clock_gettime(CLOCK_BOOTTIME, &now);
+    uint64_t now_usec = (uint64_t)now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+    uint64_t start_time = (now_usec - std::min(now_usec, (uint64_t)pid_stats.ac_etime)) * ticks_per_usec;
+
+    if (!is_same_process(*identity, ts.pid, start_time)) {
+        memset(identity, 0, sizeof(*identity));
+        identity->pi_pid = ts.pid;
+        identity->pi_tgid = ts.pid;
+        identity->pi_start_time = start_time;
+        identity->uid = pid_stats.ac_uid;
+
+        // the state, the threads and the other fields of /proc/<pid>/stat are not available:
+        identity->from_taskstats = true;
+    }
+    identity->pi_ppid = pid_stats.ac_ppid;
+    size_t comm_len = std::min(strnlen(pid_stats.ac_comm, sizeof(pid_stats.ac_comm)), sizeof(identity->pi_comm) - 1);
+    memcpy(identity->pi_comm, pid_stats.ac_comm, comm_len);
+    identity->pi_comm[comm_len] = 0;
+
+    memset(gauges, 0, sizeof(*gauges));
+    gauges->pi_nice = (int8_t)pid_stats.ac_nice;
+    gauges->pi_sched_policy = pid_stats.ac_sched;
+
+    counters->pi_utime = all_threads.ac_utime * ticks_per_usec;
+    counters->pi_stime = all_threads.ac_stime * ticks_per_usec;
+    counters->pi_minflt = pid_stats.ac_minflt;
+    counters->pi_majflt = pid_stats.ac_majflt;
+
+    // only the peak memory usage is available: the current one is read by cgroup_proc_taskstats_memory()
+    gauges->pi_vsize_peak = pid_stats.hiwater_vm * 1024;
+    gauges->pi_rss_peak = pid_stats.hiwater_rss * 1024;
+
+    counters->io_rchar = pid_stats.read_char;
+    counters->io_wchar = pid_stats.write_char;
+    counters->io_read_bytes = pid_stats.read_bytes;
+    counters->io_write_bytes = pid_stats.write_bytes;
+
+    // delays are accounted only if enabled with the kernel.task_delayacct sysctl:
+    gauges->pi_delayacct_blkio_ticks = all_threads.blkio_delay_total * ticks_per_nsec;
+    gauges->pi_delayacct_cpu_nsec = all_threads.cpu_delay_total;
+    gauges->pi_delayacct_swapin_nsec = all_threads.swapin_delay_total;
+    gauges->pi_delayacct_reclaim_nsec = all_threads.freepages_delay_total;
+}
+
+void cgroup_proc_taskstats_memory(CMonitorProcFile& file, pid_t pid, proc_counters_t* counters, proc_gauges_t* gauges,
+    proc_identity_t* identity)
+{
+    // the same values of /proc/<pid>/stat, in the same units; left to zero if the process has exited already
+    if (!cgroup_proc_procsinfo(file, pid, counters, gauges, identity, PROC_READ_STATM, NULL, false))
+        return;
+    gauges->pi_vsize = gauges->statm_size * PAGESIZE_BYTES;
+    gauges->pi_rss = gauges->statm_resident;
+}
+
 /* static */
 bool get_cgroup_paths_for_this_pid(cgroup_paths_map_t& cgroup_pathsOUT)
 {
@@ -305,10 +461,11 @@ bool get_cgroup_paths_for_this_pid(cgroup_paths_map_t& cgroup_pathsOUT)
                         1:name=systemd:/user.slice/user-0.slice/session-5.scope
                         0::/user.slice/user-0.slice/session-5.scope
      */
-    std::ifstream inputf("/proc/self/cgroup");
-    if (!inputf.is_open())
+    CMonitorProcFile file;
+    if (!file.read(g_cfg.m_strProcRoot, "/self/cgroup"))
         return false; // cannot read the cgroup information!
 
+    std::istringstream inputf(file.get_data());
     std::string line;
     while (std::getline(inputf, line)) {
         std::vector<std::string> tuple = split_string_in_array(line, ':');
@@ -351,10 +508,11 @@ bool get_cgroup_abs_path_prefix_for_this_pid(const std::string& cgroup_type, std
      * find all the current value of that cgroup; the fourth string fs_mntops contains the indication of the cgroup type
      * (e.g. cpuset)
      */
-    std::ifstream inputf("/proc/self/mounts");
-    if (!inputf.is_open())
+    CMonitorProcFile file;
+    if (!file.read(g_cfg.m_strProcRoot, "/self/mounts"))
         return false; // cannot read the cgroup information!
 
+    std::istringstream inputf(file.get_data());
     std::string line;
     while (std::getline(inputf, line)) {
         // cout << line << '\n';
@@ -374,7 +532,11 @@ bool get_cgroup_abs_path_prefix_for_this_pid(const std::string& cgroup_type, std
                 cgroup_pathOUT = "";
                 return false;
             } else {
-                cgroup_pathOUT = fs_file;
+                // mountpoints are reported as seen by the kernel: move them below the sysfs root in use
+                if (fs_file.compare(0, 5, "/sys/") == 0)
+                    cgroup_pathOUT = g_cfg.m_strSysRoot + fs_file.substr(4);
+                else
+                    cgroup_pathOUT = fs_file;
                 return true;
             }
         }
@@ -383,48 +545,127 @@ bool get_cgroup_abs_path_prefix_for_this_pid(const std::string& cgroup_type, std
     return false; // cgroup name not found
 }
 
+/* static */
+bool get_cgroup2_abs_path_prefix(std::string& cgroup_pathOUT)
+{
+    /*
+     * With cgroups v2 all controllers share a single hierarchy, mounted with the "cgroup2" filesystem type, e.g.:
+     *    cgroup2 /sys/fs/cgroup cgroup2 rw,nosuid,nodev,noexec,relatime,nsdelegate,memory_recursiveprot 0 0
+     * and /proc/self/cgroup contains a single line for it, with an empty controller list:
+     *    0::/user.slice/user-1000.slice/session-3.scope
+     * Systems in "hybrid" mode mount it as well, e.g. at /sys/fs/cgroup/unified, but without any controller:
+     * they are found by get_cgroup_abs_path_prefix_for_this_pid() instead.
+     */
+    CMonitorProcFile file;
+    if (!file.read(g_cfg.m_strProcRoot, "/self/mounts"))
+        return false; // cannot read the cgroup information!
+
+    std::istringstream inputf(file.get_data());
+    std::string line;
+    while (std::getline(inputf, line)) {
+        std::vector<std::string> tuple = split_string_in_array(line, ' ');
+        if (tuple.size() != 6)
+            return false; // invalid format
+
+        const std::string& fs_file = tuple[1];
+        const std::string& fs_vfstype = tuple[2];
+        if (fs_vfstype == "cgroup2" && !fs_file.empty()) {
+            // mountpoints are reported as seen by the kernel: move them below the sysfs root in use
+            if (fs_file.compare(0, 5, "/sys/") == 0)
+                cgroup_pathOUT = g_cfg.m_strSysRoot + fs_file.substr(4);
+            else
+                cgroup_pathOUT = fs_file;
+            return true;
+        }
+    }
+
+    return false; // cgroup2 filesystem not mounted
+}
+
 bool read_from_system_cpu_for_current_cgroup(std::string kernelPath, std::set<uint64_t>& cpus)
 {
     std::set<uint64_t> empty_set;
     return read_integers_with_range_validation(kernelPath + "/cpuset.cpus", 0, INT32_MAX, cpus);
 }
 
-bool read_cpuacct_line(const std::string& path, std::vector<uint64_t>& valuesINT /* OUT */)
+bool read_cpuacct_line(
+    CMonitorProcFile& file, const std::string& dir, const char* filename, std::vector<uint64_t>& valuesINT /* OUT */)
 {
     static unsigned int num_cpus = 0;
-    char line[8192];
 
-    FILE* fp1 = 0;
-    if ((fp1 = fopen(path.c_str(), "r")) == NULL)
+    const char* p = file.read(dir, filename);
+    if (p == NULL)
         return false;
 
-    if (fgets(line, 1000, fp1) == NULL) {
-        fclose(fp1);
-        return false;
-    }
-
-    fclose(fp1);
+    // the file contains a single line with one counter for each CPU
+    valuesINT.clear();
+    uint64_t value;
+    while (proc_parse_uint(p, value))
+        valuesINT.push_back(value);
+    if (*p != '\n' && *p != 0)
+        return false; // invalid format
 
-    std::vector<std::string> values = split_string_in_array(line, ' ');
     if (num_cpus == 0) {
         // first time we read the CPU stats
-        num_cpus = values.size();
+        num_cpus = valuesINT.size();
     } else {
-        if (values.size() != num_cpus) {
+        if (valuesINT.size() != num_cpus) {
             // error: we read a different number of CPUs compared to previous read
             num_cpus = 0;
             return false;
         }
     }
 
-    valuesINT.resize(num_cpus);
-    for (unsigned int i = 0; i < num_cpus; i++)
-        if (!string2int(values[i].c_str(), valuesINT[i]))
-            return false;
+    return true;
+}
+
+// reads the CPU times of a cgroup v2, in nanoseconds, as single-element vectors like those of read_cpuacct_line()
+bool read_cpu_stat(CMonitorProcFile& file, const std::string& dir, std::vector<uint64_t>& user_nsecOUT,
+    std::vector<uint64_t>& sys_nsecOUT)
+{
+    const char* line = file.read(dir, "/cpu.stat");
+    if (line == NULL)
+        return false;
+
+    // the file contains "label value" lines, e.g. "usage_usec 1234"; user_usec and system_usec come after
+    // usage_usec and are always present, even when the cpu controller is not enabled for the cgroup
+    bool has_user = false, has_sys = false;
+    uint64_t user_usec = 0, sys_usec = 0;
+    do {
+        if (proc_starts_with(line, "user_usec ", 10)) {
+            const char* p = &line[10];
+            has_user = proc_parse_uint(p, user_usec);
+        } else if (proc_starts_with(line, "system_usec ", 12)) {
+            const char* p = &line[12];
+            has_sys = proc_parse_uint(p, sys_usec);
+        }
+    } while (!(has_user && has_sys) && proc_next_line(line));
+    if (!has_user || !has_sys)
+        return false; // invalid format
 
+    user_nsecOUT.assign(1, user_usec * 1000);
+    sys_nsecOUT.assign(1, sys_usec * 1000);
     return true;
 }
 
+// the kernel name of a block device, e.g. "sda", as found in its uevent file; "major:minor" if not found
+void read_block_device_name(uint64_t major, uint64_t minor, char* nameOUT, size_t name_size)
+{
+    char filename[64];
+    snprintf(filename, sizeof(filename), "/dev/block/%lu:%lu/uevent", major, minor);
+    CMonitorProcFile file;
+    const char* line = file.read(g_cfg.m_strSysRoot, filename);
+    if (line != NULL) {
+        do {
+            if (proc_starts_with(line, "DEVNAME=", 8)) {
+                snprintf(nameOUT, name_size, "%.*s", (int)strcspn(&line[8], "\n"), &line[8]);
+                return;
+            }
+        } while (proc_next_line(line));
+    }
+    snprintf(nameOUT, name_size, "%lu:%lu", major, minor);
+}
+
 // ----------------------------------------------------------------------------------
 // CMonitorCollectorApp - Functions used by the cmonitor_collector engine
 // ----------------------------------------------------------------------------------
@@ -432,12 +673,19 @@ bool read_cpuacct_line(const std::string& path, std::vector<uint64_t>& valuesINT
 void CMonitorCollectorApp::cgroup_init()
 {
     m_bCGroupsFound = false;
+    m_bCGroupsV2 = false;
     m_cgroup_systemd_name = "N/A";
 
     // ABSOLUTE PATH PREFIXES
 
     if (!get_cgroup_abs_path_prefix_for_this_pid("memory", m_cgroup_memory_kernel_path)) {
-        g_logger.LogDebug("Could not find the 'memory' cgroup path prefix. CGroup mode disabled.\n");
+        // no cgroups v1 'memory' controller: all controllers may be in the unified hierarchy of cgroups v2
+        std::string unified_path;
+        if (!get_cgroup2_abs_path_prefix(unified_path)) {
+            g_logger.LogDebug("Could not find the 'memory' cgroup path prefix. CGroup mode disabled.\n");
+            return;
+        }
+        cgroup_init_v2(unified_path);
         return;
     }
 
@@ -535,6 +783,86 @@ void CMonitorCollectorApp::cgroup_init()
         m_cgroup_memory_kernel_path.c_str());
 }
 
+void CMonitorCollectorApp::cgroup_init_v2(const std::string& mount_path)
+{
+    // with cgroups v2 the stats of all controllers are read from the same directory:
+    // see https://www.kernel.org/doc/Documentation/cgroup-v2.txt
+    m_bCGroupsV2 = true;
+    m_cgroup_memory_kernel_path = mount_path;
+    g_logger.LogDebug("Found cgroup2 unified hierarchy mounted at %s\n", mount_path.c_str());
+
+    // ACTUAL CGROUP PATH
+
+    if (g_cfg.m_strCGroupName.empty() || g_cfg.m_strCGroupName == "self") {
+        g_logger.LogDebug("No cgroup name provided. Trying to autodetect my own cgroup.");
+
+        cgroup_paths_map_t cgroup_paths;
+        if (!get_cgroup_paths_for_this_pid(cgroup_paths)) {
+            g_logger.LogDebug("Could not get the cgroup paths. CGroup mode disabled.\n");
+            return;
+        }
+
+        // NOTE: inside a container with its own cgroup namespace, our cgroup is the root of the mountpoint and
+        //       its path is "/"; otherwise the path read from /proc/self/cgroup must be added to the mountpoint
+        std::string unified_path = cgroup_paths[""]; // the unified hierarchy has no controller list
+        if (cgroup_init_check_for_our_pid()) {
+            m_cgroup_systemd_name = unified_path;
+        } else {
+            m_cgroup_memory_kernel_path += "/" + unified_path;
+            g_logger.LogDebug("Adjusting unified cgroup path to %s\n", m_cgroup_memory_kernel_path.c_str());
+            if (cgroup_init_check_for_our_pid())
+                m_cgroup_systemd_name = unified_path;
+        }
+    } else {
+        m_cgroup_memory_kernel_path += "/" + g_cfg.m_strCGroupName;
+        if (!file_or_dir_exists(m_cgroup_memory_kernel_path.c_str())) {
+            g_logger.LogError("Cannot find the cgroup directory corresponding to the provided cgroup name: directory "
+                              "[%s] does not exist. CGroup mode disabled.\n",
+                m_cgroup_memory_kernel_path.c_str());
+            return;
+        }
+
+        m_cgroup_systemd_name = g_cfg.m_strCGroupName;
+    }
+    m_cgroup_cpuacct_kernel_path = m_cgroup_memory_kernel_path;
+    m_cgroup_cpuset_kernel_path = m_cgroup_memory_kernel_path;
+
+    // READ LIMITS IMPOSED BY CGROUPS
+
+    // memory.max does not exist in the root cgroup, nor when the memory controller is not enabled for the cgroup:
+    // in both cases no limit applies
+    CMonitorProcFile file;
+    const char* p = file.read(m_cgroup_memory_kernel_path, "/memory.max");
+    if (p == NULL || proc_starts_with(p, "max", 3) || !proc_parse_uint(p, m_cgroup_memory_limit_bytes))
+        m_cgroup_memory_limit_bytes = CGROUP_UNLIMITED_MEMORY_BYTES;
+
+    // cpuset.cpus.effective exists only when the cpuset controller is enabled for the cgroup: all the online CPUs
+    // are allowed otherwise
+    if (!read_integers_with_range_validation(
+            m_cgroup_cpuset_kernel_path + "/cpuset.cpus.effective", 0, INT32_MAX, m_cgroup_cpus)
+        && !read_integers_with_range_validation(
+            g_cfg.m_strSysRoot + "/devices/system/cpu/online", 0, INT32_MAX, m_cgroup_cpus)) {
+        g_logger.LogDebug("Could not read the CPUs from the unified cgroup. CGroup mode disabled.\n");
+        return;
+    }
+
+    m_bCGroupsFound = true;
+    g_logger.LogDebug("CGroup v2 monitoring successfully enabled. CGroup name is %s\n", m_cgroup_systemd_name.c_str());
+    g_logger.LogDebug("Found unified cgroup limiting to CPUs: %s and to Bytes: %lu, at %s\n",
+        stl_container2string(m_cgroup_cpus, ",").c_str(), m_cgroup_memory_limit_bytes,
+        m_cgroup_memory_kernel_path.c_str());
+}
+
+void CMonitorCollectorApp::cgroup_move_sys_root(const std::string& old_sys_root)
+{
+    std::string* paths[]
+        = { &m_cgroup_memory_kernel_path, &m_cgroup_cpuacct_kernel_path, &m_cgroup_cpuset_kernel_path };
+    for (std::string* path : paths) {
+        if (path->compare(0, old_sys_root.size(), old_sys_root) == 0)
+            path->replace(0, old_sys_root.size(), g_cfg.m_strSysRoot);
+    }
+}
+
 bool CMonitorCollectorApp::cgroup_init_check_for_our_pid()
 {
     // CGROUP CHECKS
@@ -543,9 +871,18 @@ bool CMonitorCollectorApp::cgroup_init_check_for_our_pid()
     //       but presence of cgroups (like those of e.g. systemd) we may have a masquerated PID
     //       (e.g. PID '8' inside a Docker container while the real PID is 2348 on baremetal)
 
-    pid_t ourPid = getpid();
+    // NOTE: when replaying a recording, look for the PID of the cmonitor_collector that recorded it
+    pid_t ourPid = g_snapshot_replayer.is_enabled() ? g_snapshot_replayer.get_tick().pid : getpid();
     bool found = true;
 
+    if (m_bCGroupsV2) {
+        // a single cgroup, which lists only processes, not threads
+        found = search_integer(m_cgroup_memory_kernel_path + "/cgroup.procs", uint64_t(ourPid));
+        g_logger.LogDebug("%s our PID %d in the unified cgroup.\n", found ? "Successfully found" : "Could not find",
+            ourPid);
+        return found;
+    }
+
     if (search_integer(m_cgroup_memory_kernel_path + "/tasks", uint64_t(ourPid)))
         g_logger.LogDebug("Successfully found our PID %d in the 'memory' cgroup.\n", ourPid);
     else {
@@ -577,6 +914,7 @@ void CMonitorCollectorApp::cgroup_config()
 
     g_output.psection_start("cgroup_config");
     g_output.pstring("name", m_cgroup_systemd_name.c_str());
+    g_output.plong("version", m_bCGroupsV2 ? 2 : 1);
     g_output.pstring("memory_path", &m_cgroup_memory_kernel_path[0]);
     g_output.pstring("cpuacct_path", &m_cgroup_cpuacct_kernel_path[0]);
     g_output.pstring("cpuset_path", &m_cgroup_cpuset_kernel_path[0]);
@@ -594,6 +932,32 @@ bool CMonitorCollectorApp::cgroup_still_exists()
         file_or_dir_exists(m_cgroup_cpuset_kernel_path.c_str());
 }
 
+bool CMonitorCollectorApp::cgroup_get_oom_kill_count(uint64_t& count)
+{
+    if (!m_bCGroupsFound)
+        return false;
+
+    // the number of processes killed by the OOM killer is reported as "oom_kill <N>"
+    // in memory.oom_control for cgroups v1 (since Linux 4.13) and in memory.events for cgroups v2;
+    // the file where it was found is kept open for all next reads
+    const char* files[] = { "/memory.oom_control", "/memory.events" };
+    for (const char* file : files) {
+        const char* line = m_cgroup_memory_oom_file.read(m_cgroup_memory_kernel_path, file);
+        if (line != NULL) {
+            do {
+                if (proc_starts_with(line, "oom_kill ", 9)) {
+                    const char* p = &line[9];
+                    if (proc_parse_uint(p, count))
+                        return true;
+                }
+            } while (proc_next_line(line));
+        }
+        m_cgroup_memory_oom_file.close();
+    }
+
+    return false;
+}
+
 bool CMonitorCollectorApp::cgroup_is_allowed_cpu(int cpu)
 {
     if (!m_bCGroupsFound)
@@ -610,50 +974,62 @@ void CMonitorCollectorApp::cgroup_proc_memory(const std::set<std::string>& allow
     //   https://lwn.net/Articles/529927/
     //   https://www.kernel.org/doc/Documentation/cgroup-v1/memory.txt
     //   https://www.kernel.org/doc/Documentation/cgroup-v2.txt
-    int i, len;
     uint64_t value;
 
-    /* Static data */
-    static FILE* fp = 0;
-    static char line[8192];
-    char label[512];
+    const char* line = m_cgroup_memory_stat_file.read(m_cgroup_memory_kernel_path, "/memory.stat");
+    if (line == NULL)
+        return;
 
-    if (fp == 0) {
-        std::string path = m_cgroup_memory_kernel_path + "/memory.stat";
-        if ((fp = fopen(path.c_str(), "r")) == NULL) {
-            fp = 0;
-            return;
+    if (!m_bCGroupsV2) {
+        // collect only cgroup-total values
+        m_cgroup_memory_stat_parser.parse(line, allowedStatsNames /* all stats must be put in output when empty */,
+            "total_" /* skip NON-totals */);
+    } else {
+        // all values of cgroups v2 include the descendant cgroups, so they have no "total_" prefix; the values
+        // charted by cmonitor_chart are selected by their cgroups v2 names, "anon" and "file"
+        if (m_cgroup_memory_stat_v2_labels.empty()) {
+            for (const std::string& label : allowedStatsNames)
+                m_cgroup_memory_stat_v2_labels.insert(
+                    label == "total_rss" ? "anon" : (label == "total_cache" ? "file" : label));
         }
-    } else
-        rewind(fp);
+        m_cgroup_memory_stat_parser.parse(line, m_cgroup_memory_stat_v2_labels);
+    }
 
     g_output.psection_start("cgroup_memory_stats");
-    while (fgets(line, 1000, fp) != NULL) {
-        len = strlen(line);
-        if (strncmp(line, "total_", 6) != 0)
-            continue; // skip NON-totals: collect only cgroup-total values
+    for (size_t i = 0; i < m_cgroup_memory_stat_parser.size(); i++) {
+        const char* label = m_cgroup_memory_stat_parser.get_label(i);
+        g_output.plong(label, m_cgroup_memory_stat_parser.get_value(i));
+
+        // with cgroups v2, the charted values are emitted also with their cgroups v1 names
+        if (m_bCGroupsV2 && strcmp(label, "anon") == 0)
+            g_output.plong("total_rss", m_cgroup_memory_stat_parser.get_value(i));
+        else if (m_bCGroupsV2 && strcmp(label, "file") == 0)
+            g_output.plong("total_cache", m_cgroup_memory_stat_parser.get_value(i));
+    }
 
-        for (i = 0; i < len; i++) {
-            if (line[i] == '(')
-                line[i] = '_';
-            if (line[i] == ')')
-                line[i] = ' ';
-            if (line[i] == ':')
-                line[i] = ' ';
-            if (line[i] == '\n')
-                line[i] = 0;
+    if (!m_bCGroupsV2) {
+        const char* p = m_cgroup_memory_failcnt_file.read(m_cgroup_memory_kernel_path, "/memory.failcnt");
+        if (p != NULL && proc_parse_uint(p, value))
+            g_output.plong("failcnt", value);
+    } else {
+        const char* p = m_cgroup_memory_current_file.read(m_cgroup_memory_kernel_path, "/memory.current");
+        if (p != NULL && proc_parse_uint(p, value))
+            g_output.plong("current", value);
+
+        // the closest thing to the failcnt of cgroups v1: the number of times the usage hit memory.max
+        p = m_cgroup_memory_failcnt_file.read(m_cgroup_memory_kernel_path, "/memory.events");
+        if (p != NULL) {
+            do {
+                if (proc_starts_with(p, "max ", 4)) {
+                    const char* q = &p[4];
+                    if (proc_parse_uint(q, value))
+                        g_output.plong("failcnt", value);
+                    break;
+                }
+            } while (proc_next_line(p));
         }
-        value = 0;
-        sscanf(line, "%s %lu", label, &value);
-
-        if (allowedStatsNames.empty() /* all stats must be put in output */
-            || allowedStatsNames.find(label) != allowedStatsNames.end())
-            g_output.plong(label, value);
     }
 
-    if (read_integer(m_cgroup_memory_kernel_path + "/memory.failcnt", value))
-        g_output.plong("failcnt", value);
-
     g_output.psection_end();
 }
 
@@ -668,7 +1044,8 @@ void CMonitorCollectorApp::cgroup_proc_cpuacct(double elapsed_sec, bool print)
      *     /sys/fs/cgroup/cpu,cpuacct/cpuacct.usage_percpu_user
      * but older ones (e.g. Centos7) have only:
      *     /sys/fs/cgroup/cpu,cpuacct/cpuacct.usage_percpu
-     * Here we try to handle both cases.
+     * Here we try to handle both cases. With cgroups v2 instead only the totals of the cgroup are available,
+     * in cpu.stat.
      *
      * See:
      *  https://www.kernel.org/doc/Documentation/cgroup-v1/cpuacct.txt
@@ -676,143 +1053,402 @@ void CMonitorCollectorApp::cgroup_proc_cpuacct(double elapsed_sec, bool print)
      *  https://access.redhat.com/documentation/en-us/red_hat_enterprise_linux/6/html/resource_management_guide/sec-cpuacct
      */
 
-    /* structure to recall previous values */
-    struct cpuacct_utilisation {
-        uint64_t counter_nsec_user_mode;
-        uint64_t counter_nsec_sys_mode;
-    };
-    static struct cpuacct_utilisation prev_values[MAX_LOGICAL_CPU] = { 0 };
-
-    // non-static data:
+    // previous values are kept in m_cgroup_cpuacct_counters, one row per CPU reported by the cgroup (a single
+    // row with cgroups v2); rates are computed as percentages of the elapsed time
     char label[512];
 
-    std::string path = m_cgroup_cpuacct_kernel_path + "/cpuacct.usage_percpu_sys";
-    if (file_or_dir_exists(path.c_str())) {
+    if (m_cgroup_cpuacct_counters.get_num_counters() == 0) {
+        m_cgroup_cpuacct_counters.add_counter("user", CT_MONOTONIC, 100 / 1E9);
+        m_cgroup_cpuacct_counters.add_counter("sys", CT_MONOTONIC, 100 / 1E9);
+    }
+
+    std::vector<uint64_t> counter_nsec_user_mode;
+    std::vector<uint64_t> counter_nsec_sys_mode;
+    bool has_sys_user_split = m_bCGroupsV2 || m_cgroup_cpuacct_sys_file.is_open()
+        || file_or_dir_exists((m_cgroup_cpuacct_kernel_path + "/cpuacct.usage_percpu_sys").c_str());
+    if (m_bCGroupsV2) {
 
-        // this system supports per-cpu system/user stats:
+        // cgroups v2 account the CPU time of the whole cgroup only, in microseconds:
 
-        std::vector<uint64_t> counter_nsec_sys_mode;
-        if (!read_cpuacct_line(path, counter_nsec_sys_mode))
+        if (!read_cpu_stat(m_cgroup_cpu_stat_file, m_cgroup_cpuacct_kernel_path, counter_nsec_user_mode,
+                counter_nsec_sys_mode))
             return;
 
-        std::vector<uint64_t> counter_nsec_user_mode;
-        if (!read_cpuacct_line(m_cgroup_cpuacct_kernel_path + "/cpuacct.usage_percpu_user", counter_nsec_user_mode))
+        g_logger.LogDebug("Reading data from cgroup cpu.stat");
+    } else if (has_sys_user_split) {
+
+        // this system supports per-cpu system/user stats:
+
+        if (!read_cpuacct_line(
+                m_cgroup_cpuacct_sys_file, m_cgroup_cpuacct_kernel_path, "/cpuacct.usage_percpu_sys", counter_nsec_sys_mode))
+            return;
+        if (!read_cpuacct_line(m_cgroup_cpuacct_user_file, m_cgroup_cpuacct_kernel_path, "/cpuacct.usage_percpu_user",
+                counter_nsec_user_mode))
             return;
 
         if (counter_nsec_sys_mode.size() != counter_nsec_user_mode.size())
             return;
-        if (counter_nsec_sys_mode.empty())
-            return;
 
         g_logger.LogDebug(
             "Found cpuacct.usage_percpu_sys/user cgroups; computing CPU usage for %.2fsec delta time and %zu CPUs "
             "(print=%d)\n",
             elapsed_sec, counter_nsec_user_mode.size(), print);
-
-        if (print)
-            g_output.psection_start("cgroup_cpuacct_stats");
-        for (size_t i = 0; i < counter_nsec_user_mode.size(); i++) {
-
-            /*
-             * We know how much time has elapsed; we thus divide the delta
-             * of the incremental counter of ns spent in user mode by the elapsed
-             * to understand how much time (for this CPU) was spent in user mode.
-             *
-             * HOW TO TEST THIS CODE:
-             * run
-             *     make ; src/cmonitor_collector -C -c100 -s1 >test.json
-             *     taskset --cpu-list 3 stress --cpu 1   # launch a "stress" process with CPU-affinity on cpu #3
-             * then just verify that
-             *     watch -n1 'grep cpu3 -A6 -B1 test.json | tail -20'
-             * produces cpu3 at 100%
-             */
-            g_logger.LogDebug("CPU %d, current user=%lu, current sys=%lu, prev user=%lu, prev sys=%lu", // force newline
-                i, counter_nsec_user_mode[i], counter_nsec_sys_mode[i], prev_values[i].counter_nsec_user_mode,
-                prev_values[i].counter_nsec_sys_mode);
-            if (cgroup_is_allowed_cpu(i) && print && elapsed_sec > MIN_ELAPSED_SECS) {
-                double cpuUserPercent = // force newline
-                    100 * ((double)(counter_nsec_user_mode[i] - prev_values[i].counter_nsec_user_mode))
-                    / (elapsed_sec * 1E9);
-                double cpuSysPercent = // force newline
-                    100 * ((double)(counter_nsec_sys_mode[i] - prev_values[i].counter_nsec_sys_mode))
-                    / (elapsed_sec * 1E9);
-
-                // output JSON counter
-                sprintf(label, "cpu%zu", i);
-                g_output.psubsection_start(label);
-                g_output.pdouble("user", cpuUserPercent);
-                g_output.pdouble("sys", cpuSysPercent);
-                g_output.psubsection_end();
-            }
-
-            // save for next cycle
-            prev_values[i].counter_nsec_user_mode = counter_nsec_user_mode[i];
-            prev_values[i].counter_nsec_sys_mode = counter_nsec_sys_mode[i];
-        }
-        if (print)
-            g_output.psection_end();
     } else {
 
         // just get the per-cpu total:
 
-        std::vector<uint64_t> counter_nsec_user_mode;
-        if (!read_cpuacct_line(m_cgroup_cpuacct_kernel_path + "/cpuacct.usage_percpu", counter_nsec_user_mode))
-            return;
-        if (counter_nsec_user_mode.empty())
+        if (!read_cpuacct_line(
+                m_cgroup_cpuacct_total_file, m_cgroup_cpuacct_kernel_path, "/cpuacct.usage_percpu", counter_nsec_user_mode))
             return;
+        counter_nsec_sys_mode.resize(counter_nsec_user_mode.size(), 0);
 
         g_logger.LogDebug("Reading data from cgroup cpuacct.usage_percpu");
+    }
+    if (counter_nsec_user_mode.empty())
+        return;
 
-        if (print)
-            g_output.psection_start("cgroup_cpuacct_stats");
-        for (size_t i = 0; i < counter_nsec_user_mode.size(); i++) {
-
-            /*
-             * Same comments for USER/SYS computations done above apply here!
-             */
-            if (cgroup_is_allowed_cpu(i) && print && elapsed_sec > MIN_ELAPSED_SECS) {
-                double cpuUserPercent = // force newline
-                    100 * ((double)(counter_nsec_user_mode[i] - prev_values[i].counter_nsec_user_mode))
-                    / (elapsed_sec * 1E9);
-
-                // output JSON counter
-                sprintf(label, "cpu%zu", i);
-                g_output.psubsection_start(label);
-                g_output.pdouble("user", cpuUserPercent);
-                g_output.psubsection_end();
+    m_cgroup_cpuacct_counters.start_update();
+    for (size_t i = 0; i < counter_nsec_user_mode.size(); i++) {
+        g_logger.LogDebug("CPU %zu, current user=%lu, current sys=%lu", // force newline
+            i, counter_nsec_user_mode[i], counter_nsec_sys_mode[i]);
+        uint64_t values[CGROUP_CPUACCT_MAX] = { counter_nsec_user_mode[i], counter_nsec_sys_mode[i] };
+        m_cgroup_cpuacct_counters.update(i, values);
+    }
+
+    if (!print)
+        return;
+
+    /*
+     * We know how much time has elapsed; we thus divide the delta
+     * of the incremental counter of ns spent in user mode by the elapsed
+     * to understand how much time (for this CPU) was spent in user mode.
+     *
+     * HOW TO TEST THIS CODE:
+     * run
+     *     make ; src/cmonitor_collector -C -c100 -s1 >test.json
+     *     taskset --cpu-list 3 stress --cpu 1   # launch a "stress" process with CPU-affinity on cpu #3
+     * then just verify that
+     *     watch -n1 'grep cpu3 -A6 -B1 test.json | tail -20'
+     * produces cpu3 at 100%
+     */
+    bool compute_rates = get_rates_elapsed_sec(elapsed_sec) > MIN_ELAPSED_SECS;
+    if (compute_rates)
+        compute_table_rates(m_cgroup_cpuacct_counters, elapsed_sec);
+
+    g_output.psection_start("cgroup_cpuacct_stats");
+    for (size_t i = 0; compute_rates && i < counter_nsec_user_mode.size(); i++) {
+        if ((!m_bCGroupsV2 && !cgroup_is_allowed_cpu(i)) || !m_cgroup_cpuacct_counters.has_rates(i))
+            continue;
+
+        // output JSON counter; the single row of cgroups v2 is in percentage of one CPU as well, so it may exceed 100
+        if (m_bCGroupsV2)
+            strcpy(label, "cpu_total");
+        else
+            sprintf(label, "cpu%zu", i);
+        g_output.psubsection_start(label);
+        g_output.pdouble("user", m_cgroup_cpuacct_counters.get_rate(i, CGROUP_CPUACCT_USER));
+        if (has_sys_user_split)
+            g_output.pdouble("sys", m_cgroup_cpuacct_counters.get_rate(i, CGROUP_CPUACCT_SYS));
+        g_output.psubsection_end();
+    }
+    g_output.psection_end();
+}
+
+void CMonitorCollectorApp::cgroup_proc_blkio(double elapsed_sec, OutputFields output_opts)
+{
+    // NOTE: the 'blkio' controller of cgroups v1 is not supported yet
+    if (!m_bCGroupsFound || !m_bCGroupsV2)
+        return;
+
+    /*
+     * io.stat has a line for each device the cgroup did any I/O to, with "key=value" counters, e.g.:
+     *     8:0 rbytes=90430464 wbytes=299008000 rios=8950 wios=12252 dbytes=50331648 dios=3021
+     * See https://www.kernel.org/doc/Documentation/cgroup-v2.txt
+     */
+    static const char* keys[CGROUP_IO_MAX] = { "rios", "wios", "rbytes", "wbytes", "dios", "dbytes" };
+
+    DEBUGLOG_FUNCTION_START();
+    const char* line = m_cgroup_io_stat_file.read(m_cgroup_memory_kernel_path, "/io.stat");
+    if (line == NULL)
+        return; // the io controller is not enabled for the cgroup
+
+    if (m_cgroup_io_counters.get_num_counters() == 0) {
+        m_cgroup_io_counters.add_counter("reads", CT_MONOTONIC);
+        m_cgroup_io_counters.add_counter("writes", CT_MONOTONIC);
+        m_cgroup_io_counters.add_counter("rkb", CT_MONOTONIC, 1 / 1024.0);
+        m_cgroup_io_counters.add_counter("wkb", CT_MONOTONIC, 1 / 1024.0);
+        m_cgroup_io_counters.add_counter("discards", CT_MONOTONIC);
+        m_cgroup_io_counters.add_counter("dkb", CT_MONOTONIC, 1 / 1024.0);
+    }
+
+    m_cgroup_io_counters.start_update();
+    m_cgroup_io_listed.clear();
+    do {
+        const char* p = line;
+        uint64_t major, minor;
+        if (!proc_parse_uint(p, major) || *p++ != ':' || !proc_parse_uint(p, minor))
+            continue; // e.g. the file is empty since the cgroup did no I/O yet
+
+        auto it = m_cgroup_io_devices.find(DISK_KEY(major, minor));
+        if (it == m_cgroup_io_devices.end()) {
+            diskinfo_t device;
+            read_block_device_name(major, minor, device.dk_name, sizeof(device.dk_name));
+            device.dk_row = m_cgroup_io_counters.alloc_row();
+            it = m_cgroup_io_devices.emplace(DISK_KEY(major, minor), device).first;
+        }
+
+        // keys not known (e.g. added by newer kernels) are skipped; those missing on older kernels are left to zero
+        uint64_t values[CGROUP_IO_MAX] = { 0 };
+        proc_skip_spaces(p);
+        while ((unsigned char)*p > ' ') {
+            const char* key = p;
+            while (*p != '=' && (unsigned char)*p > ' ')
+                p++;
+            size_t key_len = p - key;
+            if (*p == '=') {
+                p++;
+                for (unsigned int i = 0; i < CGROUP_IO_MAX; i++) {
+                    if (strlen(keys[i]) == key_len && proc_starts_with(key, keys[i], key_len)) {
+                        proc_parse_uint(p, values[i]);
+                        break;
+                    }
+                }
             }
+            proc_skip_token(p);
+        }
+
+        m_cgroup_io_counters.update(it->second.dk_row, values);
+        m_cgroup_io_listed.push_back(&it->second);
+    } while (proc_next_line(line));
+
+    if (output_opts == PF_NONE)
+        return;
 
-            // save for next cycle
-            prev_values[i].counter_nsec_user_mode = counter_nsec_user_mode[i];
+    compute_table_rates(m_cgroup_io_counters, elapsed_sec);
+
+    g_output.psection_start("cgroup_blkio_stats");
+    for (const diskinfo_t* device : m_cgroup_io_listed) {
+        // devices with their first I/O have no baseline yet
+        size_t row = device->dk_row;
+        if (!m_cgroup_io_counters.has_rates(row))
+            continue;
+
+        g_output.psubsection_start(device->dk_name);
+        switch (output_opts) {
+        case PF_NONE:
+            assert(0);
+            break;
+
+        case PF_ALL:
+            for (unsigned int i = 0; i < CGROUP_IO_MAX; i++)
+                g_output.pdouble(m_cgroup_io_counters.get_counter_name(i), m_cgroup_io_counters.get_rate(row, i));
+            break;
+
+        case PF_USED_BY_CHART_SCRIPT_ONLY:
+            g_output.pdouble("rkb", m_cgroup_io_counters.get_rate(row, CGROUP_IO_RKB));
+            g_output.pdouble("wkb", m_cgroup_io_counters.get_rate(row, CGROUP_IO_WKB));
+            break;
         }
-        if (print)
-            g_output.psection_end();
+        g_output.psubsection_end();
     }
+    g_output.psection_end();
 }
 
 bool CMonitorCollectorApp::cgroup_collect_pids(std::vector<pid_t>& pids)
 {
-    std::string path = m_cgroup_cpuacct_kernel_path + "/tasks";
-    g_logger.LogDebug("Trying to read tasks for my cgroup from %s.\n", path.c_str());
-    if (!file_or_dir_exists(path.c_str()))
-        return false;
-
-    std::ifstream inputf(path);
-    if (!inputf.is_open())
+    // NOTE: with cgroups v2, cgroup.procs lists only the processes: their threads are in cgroup.threads
+    const char* tasks_file = m_bCGroupsV2 ? "/cgroup.procs" : "/tasks";
+    g_logger.LogDebug(
+        "Trying to read tasks for my cgroup from %s%s.\n", m_cgroup_cpuacct_kernel_path.c_str(), tasks_file);
+    const char* line = m_cgroup_tasks_file.read(m_cgroup_cpuacct_kernel_path, tasks_file);
+    if (line == NULL)
         return false; // cannot read the cgroup information!
 
     DEBUGLOG_FUNCTION_START();
 
-    std::string line;
-    while (std::getline(inputf, line)) {
+    // one PID per line:
+    do {
         uint64_t pid;
-        if (string2int(line.c_str(), pid))
+        if (proc_parse_uint(line, pid))
             pids.push_back((pid_t)pid);
-    }
+    } while (proc_next_line(line));
 
     return true;
 }
 
+void CMonitorCollectorApp::cgroup_proc_threads(pid_t pid, double elapsed_sec)
+{
+    // the files of all threads are opened relative to the /proc/<pid>/task directory
+    char task_dir[1024];
+    snprintf(task_dir, sizeof(task_dir), "%s/%d/task", g_cfg.m_strProcRoot.c_str(), pid);
+    int dir_fd = open(task_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dir_fd == -1)
+        return; // the process has exited since it was read
+    DIR* dir = fdopendir(dir_fd);
+    if (dir == NULL) {
+        close(dir_fd);
+        return;
+    }
+
+    size_t first = m_thread_topper.size();
+    double now = m_threads.get_time();
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        const char* q = entry->d_name;
+        uint64_t tid;
+        if (!proc_parse_uint(q, tid) || *q != 0)
+            continue; // "." and ".."
+
+        // NOTE: threads that exit while being read are just skipped, no error is logged
+        char filename[64];
+        const char* buf;
+        snprintf(filename, sizeof(filename), "%lu/stat", (unsigned long)tid);
+        if (!m_pid_file.open_at(dir_fd, task_dir, filename) || (buf = m_pid_file.read()) == NULL)
+            continue;
+
+        size_t row = m_threads.find_or_add(tid);
+        proc_counters_t& current = m_threads.get_current(row);
+        proc_gauges_t& gauges = m_threads.get_gauges(row);
+        proc_identity_t& identity = m_threads.get_identity(row);
+        bool new_thread;
+        if (!proc_parse_stat(buf, tid, &current, &gauges, &identity, new_thread))
+            continue;
+
+        // context switches are available only in the status file
+        current.pi_nvcsw = current.pi_nivcsw = 0;
+        snprintf(filename, sizeof(filename), "%lu/status", (unsigned long)tid);
+        if (m_pid_file.open_at(dir_fd, task_dir, filename) && (buf = m_pid_file.read()) != NULL) {
+            q = buf;
+            uint64_t value;
+            do {
+                const char* r = q;
+                if (proc_starts_with(q, "voluntary_ctxt_switches:", 24) && proc_parse_uint(r += 24, value))
+                    current.pi_nvcsw = value;
+                else if (proc_starts_with(q, "nonvoluntary_ctxt_switches:", 27) && proc_parse_uint(r += 27, value))
+                    current.pi_nivcsw = value;
+            } while (proc_next_line(q));
+        }
+
+        identity.pi_pid = tid;
+        identity.pi_tgid = pid;
+        if (m_threads.set_updated(row)) {
+            // unlike new processes, new threads are not reported until they have a baseline: they are read only
+            // while their process is reported, so their rates would be computed since their start
+            gauges.stat_read_time = now;
+            gauges.stat_interval_secs = 0;
+            continue;
+        }
+        proc_set_read_time(&gauges, PROC_READ_STAT, now, elapsed_sec);
+
+        // the threads started since the checkpoint have no baseline either
+        double interval_sec = m_threads.get_stat_interval(row);
+        if (interval_sec <= 0)
+            continue;
+        double score = compute_proc_score(&current, &m_threads.get_baseline(row), &gauges, interval_sec);
+        if (score > 0)
+            m_thread_topper.push_back(std::make_pair(score, row));
+    }
+    closedir(dir); // closes dir_fd as well
+    m_pid_file.close();
+
+    // the same selection done for processes, applied to the threads of this process only
+    typedef std::greater<std::pair<double, size_t>> higher_score_first;
+    auto begin = m_thread_topper.begin() + first;
+    if (g_cfg.m_nTopProcesses > 0 && m_thread_topper.size() - first > g_cfg.m_nTopProcesses) {
+        std::nth_element(begin, begin + (g_cfg.m_nTopProcesses - 1), m_thread_topper.end(), higher_score_first());
+        m_thread_topper.resize(first + g_cfg.m_nTopProcesses);
+        begin = m_thread_topper.begin() + first;
+    }
+    std::sort(begin, m_thread_topper.end(), higher_score_first());
+}
+
+void CMonitorCollectorApp::cgroup_proc_scan_init(unsigned int num_threads)
+{
+    // the thread calling cgroup_proc_tasks() reads a slice as well: at most num_threads CPUs are used
+    m_scan_files.clear();
+    for (unsigned int i = 0; i < num_threads; i++)
+        m_scan_files.emplace_back(new CMonitorProcFile());
+    if (num_threads > 1)
+        m_scan_workers.start(num_threads - 1);
+}
+
+// the first phase of the /proc backend for the given PIDs, whose rows are allocated already; with io_uring the
+// /proc/<pid>/stat files kept open are read all at once beforehand and the others with plain syscalls as usual
+void CMonitorCollectorApp::cgroup_proc_read_slice(const pid_t* pids, const size_t* rows, size_t count,
+    unsigned int parts, double elapsed_sec, CMonitorProcFile& file, CMonitorIoUring* io_uring)
+{
+    uint64_t update = m_processes.get_num_updates();
+    double now = m_processes.get_time();
+
+    // idle processes and threads are read in turn, spread over PROC_IDLE_SCAN_PERIOD samples
+    auto is_skipped = [&](size_t i) {
+        size_t row = rows[i];
+        bool idle = m_processes.get_identity(row).pi_tgid != pids[i]
+            || m_processes.get_gauges(row).idle_samples >= PROC_IDLE_SAMPLES;
+        return idle && m_processes.was_updated(row) && (update + pids[i]) % PROC_IDLE_SCAN_PERIOD != 0;
+    };
+
+    size_t num_batched = 0;
+    if (io_uring != NULL) {
+        io_uring->clear();
+        for (size_t i = 0; i < count; i++)
+            if (m_processes.get_fd(rows[i]) != -1 && !is_skipped(i))
+                io_uring->add_read(m_processes.get_fd(rows[i]), i);
+        if (!io_uring->submit_all())
+            io_uring->clear(); // all files are read again below
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        pid_t pid = pids[i];
+        size_t row = rows[i];
+        proc_counters_t& current = m_processes.get_current(row);
+        const proc_counters_t& previous = m_processes.get_previous(row);
+        proc_gauges_t& gauges = m_processes.get_gauges(row);
+        proc_identity_t& identity = m_processes.get_identity(row);
+
+        if (is_skipped(i)) {
+            current = previous;
+            m_processes.set_updated(row);
+            continue;
+        }
+
+        // a batched read that failed, e.g. since the process is gone, is retried with the plain reads
+        const char* stat_data = NULL;
+        if (io_uring != NULL && num_batched < io_uring->size() && io_uring->get_tag(num_batched) == i)
+            stat_data = io_uring->get_data(num_batched++);
+        bool new_process = false;
+        bool read;
+        if (stat_data != NULL && proc_parse_stat(stat_data, pid, &current, &gauges, &identity, new_process)
+            && !new_process) {
+            read = !(parts & PROC_READ_IO)
+                || cgroup_proc_procsinfo(file, pid, &current, &gauges, &identity, PROC_READ_IO);
+        } else {
+            int stat_fd = m_processes.take_fd(row);
+            read = cgroup_proc_procsinfo(file, pid, &current, &gauges, &identity, parts, &stat_fd);
+            m_processes.keep_fd(row, stat_fd);
+        }
+        if (!read)
+            continue;
+        if (m_processes.set_updated(row)) {
+            gauges.stat_read_time = gauges.io_read_time = 0; // a new process
+            gauges.idle_samples = 0;
+        }
+        proc_set_read_time(&gauges, parts, now, elapsed_sec);
+
+        if (current.pi_utime == previous.pi_utime && current.pi_stime == previous.pi_stime)
+            gauges.idle_samples++;
+        else
+            gauges.idle_samples = 0;
+        if (!(parts & PROC_READ_IO)) {
+            // until the second phase reads them, if it does
+            current.io_rchar = previous.io_rchar;
+            current.io_wchar = previous.io_wchar;
+            current.io_read_bytes = previous.io_read_bytes;
+            current.io_write_bytes = previous.io_write_bytes;
+        }
+    }
+}
+
 void CMonitorCollectorApp::cgroup_proc_tasks(double elapsed_sec, OutputFields output_opts)
 {
     char str[256];
@@ -820,88 +1456,273 @@ void CMonitorCollectorApp::cgroup_proc_tasks(double elapsed_sec, OutputFields ou
     if (!m_bCGroupsFound)
         return;
 
-    // swap databases
-    m_pid_database_current_index = !m_pid_database_current_index;
-    std::map<pid_t, procsinfo_t>& currDB = m_pid_databases[m_pid_database_current_index];
-    std::map<pid_t, procsinfo_t>& prevDB = m_pid_databases[!m_pid_database_current_index];
-
-    // collect all PIDs for current cgroup
+    // collect all PIDs for current cgroup; with --proc-events the "tasks" file is read only when the
+    // tracked set must be rebuilt and periodically, to find processes moved into the cgroup from outside
     std::vector<pid_t> all_pids;
-    if (!cgroup_collect_pids(all_pids))
-        return;
+    bool bEvents = m_proc_events.is_running();
+    if (!bEvents || !m_proc_events.get_tracked(all_pids)
+        || ++m_proc_events_samples_since_resync >= PROC_EVENTS_RESYNC_SAMPLES) {
+        all_pids.clear();
+        if (!cgroup_collect_pids(all_pids))
+            return;
+        if (bEvents) {
+            m_proc_events.track(all_pids);
+            m_proc_events_samples_since_resync = 0;
+        }
+    }
 
-    // get new fresh processes data and update current database:
-    currDB.clear();
-    for (size_t i = 0; i < all_pids.size(); i++) {
-        procsinfo_t procData;
-        memset(&procData, 0, sizeof(procData));
-        cgroup_proc_procsinfo(all_pids[i], &procData, output_opts);
+    // the descriptors kept open by the rows refer to the previous procfs root, e.g. with --replay
+    if (m_processes_fds_generation != CMonitorProcFile::get_generation()) {
+        m_processes.close_fds();
+        m_processes_fds_generation = CMonitorProcFile::get_generation();
+    }
 
-        // FIXME: allow to process threads
-        if (procData.pi_pid == procData.pi_tgid)
-            currDB.insert(std::make_pair(all_pids[i], procData));
-        // else
-        // g_logger.LogDebug("Found thread %d %d", procData.pi_pid, procData.pi_tgid);
+    // get new fresh processes data: the rows of processes not found anymore are freed by remove_stale() below
+    m_processes.start_update(elapsed_sec);
+    double now = m_processes.get_time();
+    double rates_elapsed_sec = get_rates_elapsed_sec(elapsed_sec); // used when the time of a read is unknown
+    unsigned int parts = PROC_READ_PARTS(output_opts); // the files of /proc/<pid> read for all processes
+    bool bScoreNeedsIO = false, bScoreNeedsRSS = false;
+    for (const process_score_term_t& term : g_cfg.m_vecProcessScore) {
+        bScoreNeedsIO |= term.metric == PSM_IO;
+        bScoreNeedsRSS |= term.metric == PSM_RSS;
+    }
+    if (m_taskstats.is_open()) {
+        // a couple of binary netlink replies per process instead of several /proc files to open and parse;
+        // the current memory usage is read from /proc, for all processes only if the scores need it
+        parts = bScoreNeedsRSS ? PROC_READ_STATM : 0;
+        if (!m_taskstats.query(all_pids, m_taskstats_results))
+            g_logger.LogError("Failed to query the taskstats of %zu processes", all_pids.size());
+        for (const process_taskstats_t& ts : m_taskstats_results) {
+            size_t row = m_processes.find_or_add(ts.pid);
+            cgroup_proc_taskstats(ts, &m_processes.get_current(row), &m_processes.get_gauges(row),
+                &m_processes.get_identity(row));
+            if (parts & PROC_READ_STATM)
+                cgroup_proc_taskstats_memory(m_pid_file, ts.pid, &m_processes.get_current(row),
+                    &m_processes.get_gauges(row), &m_processes.get_identity(row));
+            m_processes.set_updated(row);
+        }
+    } else {
+        // first phase: only what the scores need, see the second phase below
+        parts = PROC_READ_STAT | (bScoreNeedsIO ? PROC_READ_IO : 0);
+
+        // the rows are allocated here, so that the threads of a parallel scan only have to fill them
+        // NOTE: threads are kept in the table too, so that their identity is not read again at each sample
+        m_pid_rows.resize(all_pids.size());
+        for (size_t i = 0; i < all_pids.size(); i++)
+            m_pid_rows[i] = m_processes.find_or_add(all_pids[i]);
+
+        // with --process-scan-threads, contiguous slices of the PIDs are read in parallel, each one with its
+        // own file buffer: the threads share nothing but the table, where each of them fills different rows
+        size_t num_pids = all_pids.size();
+        size_t num_slices = std::min(m_scan_files.size(), num_pids / PROC_SCAN_MIN_PIDS_PER_THREAD);
+        // NOTE: io_uring is not used by parallel scans, nor with --record, which must see all the files read
+        if (num_slices <= 1) {
+            CMonitorIoUring* io_uring = m_io_uring.is_open() && !CMonitorProcFile::has_observer() ? &m_io_uring : NULL;
+            cgroup_proc_read_slice(
+                all_pids.data(), m_pid_rows.data(), num_pids, parts, elapsed_sec, m_pid_file, io_uring);
+        } else {
+            std::vector<CMonitorWorkerPool::job_t> jobs;
+            size_t slice_size = (num_pids + num_slices - 1) / num_slices;
+            for (size_t i = 0; i * slice_size < num_pids; i++) {
+                size_t first = i * slice_size;
+                size_t count = std::min(slice_size, num_pids - first);
+                CMonitorProcFile* file = m_scan_files[i].get();
+                jobs.push_back([this, &all_pids, first, count, parts, elapsed_sec, file]() {
+                    cgroup_proc_read_slice(
+                        &all_pids[first], &m_pid_rows[first], count, parts, elapsed_sec, *file, NULL);
+                });
+            }
+            m_scan_workers.run_all(jobs);
+        }
     }
 
+    if (bEvents) {
+        // stop tracking threads and the processes found dead without an exit event
+        for (pid_t pid : all_pids) {
+            size_t row = m_processes.find(pid);
+            if (row == PROCESS_TABLE_NO_ROW || !m_processes.is_updated(row)
+                || m_processes.get_identity(row).pi_tgid != pid)
+                m_proc_events.untrack(pid);
+        }
+    }
+
+    // add the processes that exited since last sample, with their final stats; those exited before their
+    // /proc files could be read are reported with the stats of last sample, if any
+    size_t nExited = 0, nExitedUnknown = 0;
+    if (bEvents) {
+        m_proc_events.take_exited(m_proc_events_exited);
+        for (const exited_proc_t& exited : m_proc_events_exited) {
+            size_t row = m_processes.find(exited.pid);
+            if (exited.has_final_stats) {
+                if (row == PROCESS_TABLE_NO_ROW)
+                    row = m_processes.find_or_add(exited.pid); // lived less than one interval
+                else if (m_processes.is_updated(row)
+                    && !is_same_process(m_processes.get_identity(row), exited.pid,
+                        exited.final_identity.pi_start_time))
+                    continue; // a new process has reused the PID already: it takes precedence
+
+                // the identity of a process seen in previous samples is already complete
+                if (!m_processes.is_updated(row) && m_processes.get_identity(row).pi_pid != exited.pid)
+                    m_processes.get_identity(row) = exited.final_identity;
+                m_processes.get_current(row) = exited.final_counters;
+
+                // the final stats may cover more than one interval, if the process was idle
+                proc_gauges_t& gauges = m_processes.get_gauges(row);
+                double stat_read_time = gauges.stat_read_time, io_read_time = gauges.io_read_time;
+                gauges = exited.final_gauges;
+                gauges.stat_read_time = stat_read_time;
+                gauges.io_read_time = io_read_time;
+                proc_set_read_time(&gauges, PROC_READ_STAT | PROC_READ_IO, now, elapsed_sec);
+            } else {
+                if (row == PROCESS_TABLE_NO_ROW) {
+                    nExitedUnknown++;
+                    continue;
+                }
+                if (m_processes.is_updated(row))
+                    continue; // a new process has reused the PID already
+
+                // no CPU time or I/O since last sample can be accounted
+                m_processes.get_current(row) = m_processes.get_previous(row);
+            }
+
+            m_processes.get_gauges(row).pi_state = 'X';
+            m_processes.get_gauges(row).pi_exit_code = exited.exit_code;
+            m_processes.set_updated(row);
+            nExited++;
+        }
+        m_proc_events_exited.clear();
+
+        g_logger.LogDebug("%zu processes exited since last sample, %zu of them without any stats; %lu process "
+                          "events and %lu overruns so far",
+            nExited, nExitedUnknown, m_proc_events.get_num_events(), m_proc_events.get_num_overruns());
+    }
+
+    m_processes.remove_stale();
+
     if (output_opts == PF_NONE)
         return;
 
-    // Sort the processes by their "score" by inserting them into an ordered map
-    assert(m_topper.empty());
-    for (const auto& current_entry : currDB) {
-        const procsinfo_t* pcurrent = &current_entry.second;
+    // Select the processes with the highest "score": those with a zero score are never reported
+    m_topper.clear();
+    size_t nProcs = 0;
+    for (size_t row = 0; row < m_processes.size(); row++) {
+        if (!m_processes.is_updated(row))
+            continue;
+        const proc_identity_t& identity = m_processes.get_identity(row);
+        if (identity.pi_tgid != identity.pi_pid)
+            continue; // a thread
+
+        const proc_gauges_t& gauges = m_processes.get_gauges(row);
+        double score = compute_proc_score(&m_processes.get_current(row), &m_processes.get_baseline(row), &gauges,
+            proc_interval(m_processes.get_stat_interval(row), rates_elapsed_sec));
+        if (score > 0)
+            m_topper.push_back(std::make_pair(score, row));
+        nProcs++;
+    }
 
-        // find the previous stats for this PID:
-        const procsinfo_t* pprev = &prevDB[current_entry.first /* pid */];
+    // with --top-processes only the first N are needed: a partial selection in linear time, then only N are sorted;
+    // NOTE: ties are broken by the row, so that processes with the same score are never lost
+    typedef std::greater<std::pair<double, size_t>> higher_score_first;
+    if (g_cfg.m_nTopProcesses > 0 && m_topper.size() > g_cfg.m_nTopProcesses) {
+        std::nth_element(m_topper.begin(), m_topper.begin() + (g_cfg.m_nTopProcesses - 1), m_topper.end(),
+            higher_score_first());
+        m_topper.resize(g_cfg.m_nTopProcesses);
+    }
 
-        uint64_t score = compute_proc_score(pcurrent, pprev, elapsed_sec);
-        proc_topper_t newEntry = { .current = pcurrent, .prev = pprev };
-        m_topper.insert(std::make_pair(score, newEntry));
+    // second phase: the files not needed by the scores are read only for the reported processes,
+    // in the order of the table rather than by score, which is faster when most processes are reported
+    unsigned int deep_parts = PROC_READ_PARTS(output_opts) & ~parts;
+    for (size_t i = 0; deep_parts != 0 && i < m_topper.size(); i++) {
+        size_t row = m_topper[i].second;
+        proc_gauges_t& gauges = m_processes.get_gauges(row);
+        proc_identity_t& identity = m_processes.get_identity(row);
+        if (gauges.pi_state == 'X')
+            continue; // all stats are available already
+        if (identity.from_taskstats) {
+            if (!(parts & PROC_READ_STATM))
+                cgroup_proc_taskstats_memory(
+                    m_pid_file, identity.pi_pid, &m_processes.get_current(row), &gauges, &identity);
+            continue; // all other stats are available already
+        }
+
+        // NOTE: if the process exited after the first phase, the stats of its previous samples are reported
+        if (cgroup_proc_procsinfo(m_pid_file, identity.pi_pid, &m_processes.get_current(row), &gauges, &identity,
+                deep_parts, NULL, false))
+            proc_set_read_time(&gauges, deep_parts, now, elapsed_sec);
     }
 
+    std::sort(m_topper.begin(), m_topper.end(), higher_score_first());
+
+    // with --threads, the threads of the reported processes, in the same order
+    m_thread_topper.clear();
+    if (g_cfg.m_bThreads) {
+        m_threads.start_update(elapsed_sec);
+        for (const auto& entry : m_topper)
+            if (m_processes.get_gauges(entry.second).pi_state != 'X')
+                cgroup_proc_threads(m_processes.get_identity(entry.second).pi_pid, elapsed_sec);
+        m_threads.remove_stale();
+    }
+
+    g_logger.LogDebug("Tracking %zu/%zu processes/threads; reporting %zu of them and %zu threads", // force newline
+        nProcs, all_pids.size(), m_topper.size(), m_thread_topper.size());
     if (m_topper.empty())
         return;
 
-    g_logger.LogDebug("Tracking %zu/%zu processes/threads; min/max score found: %lu/%lu", // force newline
-        currDB.size(), all_pids.size(), m_topper.begin()->first, m_topper.rbegin()->first);
-
-    // Now output all data for each process, starting from the minimal score PROCESS_SCORE_IGNORE_THRESHOLD
+    // Now output all data for each selected process, starting from the highest score
+    if (!g_cfg.m_bNumericUids)
+        m_usernames.check_passwd_file();
     static double ticks = (double)sysconf(_SC_CLK_TCK); // clock ticks per second
-    size_t nProcsOverThreshold = 0;
     g_output.psection_start("cgroup_tasks");
-    for (auto entry = m_topper.lower_bound(PROCESS_SCORE_IGNORE_THRESHOLD); entry != m_topper.end(); entry++) {
-        uint64_t score = (*entry).first;
-        const procsinfo_t* p = (*entry).second.current;
-        const procsinfo_t* q = (*entry).second.prev;
+    for (const auto& entry : m_topper) {
+        double score = entry.first;
+        size_t row = entry.second;
+        const proc_counters_t* p = &m_processes.get_current(row);
+        const proc_counters_t* q = &m_processes.get_baseline(row);
+        const proc_gauges_t& gauges = m_processes.get_gauges(row);
+        const proc_identity_t& identity = m_processes.get_identity(row);
+        double stat_interval_sec = proc_interval(m_processes.get_stat_interval(row), rates_elapsed_sec);
+        double io_interval_sec = proc_interval(m_processes.get_io_interval(row), rates_elapsed_sec);
 
 #define CURRENT(member) (p->member)
 #define PREVIOUS(member) (q->member)
-#define TIMEDELTA(member) (CURRENT(member) - PREVIOUS(member))
-#define COUNTDELTA(member) ((PREVIOUS(member) > CURRENT(member)) ? 0 : (CURRENT(member) - PREVIOUS(member)))
+#define DELTA(member) ((double)CMonitorCounterTable::counter_delta(CURRENT(member), PREVIOUS(member)))
 
-        sprintf(str, "pid_%ld", (long)CURRENT(pi_pid));
+        sprintf(str, "pid_%ld", (long)identity.pi_pid);
         g_output.psubsection_start(str);
-        g_output.plong("cmon_score", score);
+        g_output.plong("cmon_score", (long)score);
 
         /*
          * Process fields
          */
-        g_output.pstring("cmd", CURRENT(pi_comm)); // Full command line can be found /proc/PID/cmdline with zeros in it!
-        g_output.plong("pid", CURRENT(pi_pid));
-        g_output.plong("ppid", CURRENT(pi_ppid));
-        g_output.plong("pgrp", CURRENT(pi_pgrp));
-        g_output.plong("priority", CURRENT(pi_priority));
-        g_output.plong("nice", CURRENT(pi_nice));
-        g_output.plong("session", CURRENT(pi_session));
-        g_output.plong("tty_nr", CURRENT(pi_tty_nr));
-        // g_output.phex("flags", CURRENT(pi_flags));
-        g_output.pstring("state", get_state(CURRENT(pi_state)));
-        g_output.plong("threads", CURRENT(pi_num_threads));
-        g_output.pdouble("start_time_secs", (double)(CURRENT(pi_start_time)) / ticks);
-        g_output.plong("uid", CURRENT(uid));
-        if (strlen(CURRENT(username)) > 0)
-            g_output.pstring("username", CURRENT(username));
+        g_output.pstring("cmd", identity.pi_comm); // Full command line can be found /proc/PID/cmdline with zeros in it!
+        g_output.plong("pid", identity.pi_pid);
+        g_output.plong("ppid", identity.pi_ppid);
+        if (!identity.from_taskstats) {
+            g_output.plong("pgrp", identity.pi_pgrp);
+            g_output.plong("priority", gauges.pi_priority);
+        }
+        g_output.plong("nice", gauges.pi_nice);
+        if (!identity.from_taskstats) {
+            g_output.plong("session", identity.pi_session);
+            g_output.plong("tty_nr", identity.pi_tty_nr);
+        }
+        if (gauges.pi_state != 0)
+            g_output.pstring("state", get_state(gauges.pi_state));
+        if (gauges.pi_state == 'X') {
+            // exit status encoded like shells do: 128+N for processes killed by signal N
+            int status = gauges.pi_exit_code;
+            g_output.plong("exit_code", WIFSIGNALED(status) ? 128 + WTERMSIG(status) : WEXITSTATUS(status));
+        }
+        if (!identity.from_taskstats)
+            g_output.plong("threads", gauges.pi_num_threads);
+        g_output.pdouble("start_time_secs", (double)identity.pi_start_time / ticks);
+        g_output.plong("uid", identity.uid);
+        if (!g_cfg.m_bNumericUids) {
+            const std::string& username = m_usernames.get(identity.uid);
+            if (!username.empty())
+                g_output.pstring("username", username.c_str());
+        }
 
         /*
          * CPU fields
@@ -911,65 +1732,61 @@ void CMonitorCollectorApp::cgroup_proc_tasks(double elapsed_sec, OutputFields ou
                  IOW there is no need to do any math to produce a percentage, just taking
                  the delta of the absolute, monotonic-increasing value and divide by the time
         */
-        g_output.pdouble("cpu_tot", (TIMEDELTA(pi_utime) + TIMEDELTA(pi_stime)) / elapsed_sec);
-        g_output.pdouble("cpu_usr", TIMEDELTA(pi_utime) / elapsed_sec);
-        g_output.pdouble("cpu_sys", TIMEDELTA(pi_stime) / elapsed_sec);
+        g_output.pdouble("cpu_tot", (DELTA(pi_utime) + DELTA(pi_stime)) / stat_interval_sec);
+        g_output.pdouble("cpu_usr", DELTA(pi_utime) / stat_interval_sec);
+        g_output.pdouble("cpu_sys", DELTA(pi_stime) / stat_interval_sec);
 
         // provide also the total, monotonically-increasing CPU time:
         // this is used by chart script to produce the "top of the topper" chart
         g_output.pdouble("cpu_usr_total_secs", CURRENT(pi_utime) / ticks);
         g_output.pdouble("cpu_sys_total_secs", CURRENT(pi_stime) / ticks);
-        g_output.plong("cpu_last", CURRENT(pi_last_cpu));
+        if (!identity.from_taskstats)
+            g_output.plong("cpu_last", gauges.pi_last_cpu);
 
         /*
          * Memory fields
          */
-        if (output_opts == PF_ALL) {
-            g_output.plong("mem_size_kb", CURRENT(statm_size) * PAGESIZE_BYTES / 1024);
-            g_output.plong("mem_resident_kb", CURRENT(statm_resident) * PAGESIZE_BYTES / 1024);
-            g_output.plong("mem_restext_kb", CURRENT(statm_trs) * PAGESIZE_BYTES / 1024);
-            g_output.plong("mem_resdata_kb", CURRENT(statm_drs) * PAGESIZE_BYTES / 1024);
-            g_output.plong("mem_share_kb", CURRENT(statm_share) * PAGESIZE_BYTES / 1024);
-        }
-        g_output.pdouble("mem_minor_fault", COUNTDELTA(pi_minflt) / elapsed_sec);
-        g_output.pdouble("mem_major_fault", COUNTDELTA(pi_majflt) / elapsed_sec);
-        g_output.plong("mem_virtual_bytes", CURRENT(pi_vsize));
-        g_output.plong("mem_rss_bytes", CURRENT(pi_rss) * PAGESIZE_BYTES);
-        g_output.plong("mem_rss_limit", CURRENT(pi_rsslimit));
+        if (output_opts == PF_ALL && !identity.from_taskstats) {
+            g_output.plong("mem_size_kb", gauges.statm_size * PAGESIZE_BYTES / 1024);
+            g_output.plong("mem_resident_kb", gauges.statm_resident * PAGESIZE_BYTES / 1024);
+            g_output.plong("mem_restext_kb", gauges.statm_trs * PAGESIZE_BYTES / 1024);
+            g_output.plong("mem_resdata_kb", gauges.statm_drs * PAGESIZE_BYTES / 1024);
+            g_output.plong("mem_share_kb", gauges.statm_share * PAGESIZE_BYTES / 1024);
+        }
+        g_output.pdouble("mem_minor_fault", DELTA(pi_minflt) / stat_interval_sec);
+        g_output.pdouble("mem_major_fault", DELTA(pi_majflt) / stat_interval_sec);
+        g_output.plong("mem_virtual_bytes", gauges.pi_vsize);
+        g_output.plong("mem_rss_bytes", gauges.pi_rss * PAGESIZE_BYTES);
+        if (identity.from_taskstats) {
+            g_output.plong("mem_virtual_peak_bytes", gauges.pi_vsize_peak);
+            g_output.plong("mem_rss_peak_bytes", gauges.pi_rss_peak);
+        }
+        if (!identity.from_taskstats)
+            g_output.plong("mem_rss_limit", gauges.pi_rsslimit);
 
-        /*
-         * Signal fields
-         */
-#if PROCESS_DEBUGGING_ADDRESSES_SIGNALS
-        /* NOT INCLUDED AS THEY ARE FOR DEBUGGING AND NOT PERFORMANCE TUNING */
-        g_output.phex("start_code", CURRENT(pi_start_code));
-        g_output.phex("end_code", CURRENT(pi_end_code));
-        g_output.phex("start_stack", CURRENT(pi_start_stack));
-        g_output.phex("esp_stack_pointer", CURRENT(pi_esp));
-        g_output.phex("eip_instruction_pointer", CURRENT(pi_eip));
-        g_output.phex("signal_pending", CURRENT(pi_signal_pending));
-        g_output.phex("signal_blocked", CURRENT(pi_signal_blocked));
-        g_output.phex("signal_ignore", CURRENT(pi_signal_ignore));
-        g_output.phex("signal_catch", CURRENT(pi_signal_catch));
-        g_output.phex("signal_exit", CURRENT(pi_signal_exit));
-        g_output.phex("wchan", CURRENT(pi_wchan));
-        /* NOT INCLUDED AS THEY ARE FOR DEBUGGING AND NOT PERFORMANCE TUNING */
-#endif
         if (output_opts == PF_ALL) {
-            g_output.plong("swap_pages", CURRENT(pi_swap_pages));
-            g_output.plong("child_swap_pages", CURRENT(pi_child_swap_pages));
-            g_output.plong("realtime_priority", CURRENT(pi_realtime_priority));
-            g_output.plong("sched_policy", CURRENT(pi_sched_policy));
+            if (!identity.from_taskstats) {
+                g_output.plong("swap_pages", gauges.pi_swap_pages);
+                g_output.plong("child_swap_pages", gauges.pi_child_swap_pages);
+                g_output.plong("realtime_priority", gauges.pi_realtime_priority);
+            }
+            g_output.plong("sched_policy", gauges.pi_sched_policy);
         }
 
         /*
          * I/O fields
          */
-        g_output.pdouble("io_delayacct_blkio_secs", (double)CURRENT(pi_delayacct_blkio_ticks) / ticks);
-        g_output.plong("io_rchar", TIMEDELTA(io_rchar) / elapsed_sec);
-        g_output.plong("io_wchar", TIMEDELTA(io_wchar) / elapsed_sec);
-        g_output.plong("io_read_bytes", TIMEDELTA(io_read_bytes) / elapsed_sec);
-        g_output.plong("io_write_bytes", TIMEDELTA(io_write_bytes) / elapsed_sec);
+        g_output.pdouble("io_delayacct_blkio_secs", (double)gauges.pi_delayacct_blkio_ticks / ticks);
+        if (identity.from_taskstats) {
+            // delays for other resources are provided only by taskstats
+            g_output.pdouble("delayacct_cpu_secs", (double)gauges.pi_delayacct_cpu_nsec / 1E9);
+            g_output.pdouble("delayacct_swapin_secs", (double)gauges.pi_delayacct_swapin_nsec / 1E9);
+            g_output.pdouble("delayacct_reclaim_secs", (double)gauges.pi_delayacct_reclaim_nsec / 1E9);
+        }
+        g_output.plong("io_rchar", DELTA(io_rchar) / io_interval_sec);
+        g_output.plong("io_wchar", DELTA(io_wchar) / io_interval_sec);
+        g_output.plong("io_read_bytes", DELTA(io_read_bytes) / io_interval_sec);
+        g_output.plong("io_write_bytes", DELTA(io_write_bytes) / io_interval_sec);
 
         // provide also the total, monotonically-increasing I/O time:
         // this is used by chart script to produce the "top of the topper" chart
@@ -977,10 +1794,39 @@ void CMonitorCollectorApp::cgroup_proc_tasks(double elapsed_sec, OutputFields ou
         g_output.plong("io_total_write", CURRENT(io_wchar));
 
         g_output.psubsection_end();
-        nProcsOverThreshold++;
     }
     g_output.psection_end();
 
-    g_logger.LogDebug("%zu processes found over score threshold", nProcsOverThreshold);
-    m_topper.clear();
+    if (m_thread_topper.empty())
+        return;
+
+    // the threads selected with --threads, grouped by process
+    g_output.psection_start("cgroup_threads");
+    for (const auto& entry : m_thread_topper) {
+        size_t row = entry.second;
+        const proc_counters_t* p = &m_threads.get_current(row);
+        const proc_counters_t* q = &m_threads.get_baseline(row);
+        const proc_gauges_t& gauges = m_threads.get_gauges(row);
+        const proc_identity_t& identity = m_threads.get_identity(row);
+        double interval_sec = m_threads.get_stat_interval(row);
+
+        sprintf(str, "pid_%ld_tid_%ld", (long)identity.pi_tgid, (long)identity.pi_pid);
+        g_output.psubsection_start(str);
+        g_output.plong("cmon_score", (long)entry.first);
+        g_output.pstring("cmd", identity.pi_comm); // the thread name, e.g. as set by pthread_setname_np()
+        g_output.plong("tid", identity.pi_pid);
+        g_output.plong("pid", identity.pi_tgid);
+        g_output.pstring("state", get_state(gauges.pi_state));
+
+        // same units of the process fields
+        g_output.pdouble("cpu_tot", (DELTA(pi_utime) + DELTA(pi_stime)) / interval_sec);
+        g_output.pdouble("cpu_usr", DELTA(pi_utime) / interval_sec);
+        g_output.pdouble("cpu_sys", DELTA(pi_stime) / interval_sec);
+        g_output.plong("cpu_last", gauges.pi_last_cpu);
+        g_output.pdouble("ctxt_switches_voluntary", DELTA(pi_nvcsw) / interval_sec);
+        g_output.pdouble("ctxt_switches_involuntary", DELTA(pi_nivcsw) / interval_sec);
+
+        g_output.psubsection_end();
+    }
+    g_output.psection_end();
 }
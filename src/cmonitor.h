@@ -23,11 +23,24 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include "counter_table.h"
+#include "proc_file.h"
+#include "process_table.h"
+#include "spsc_queue.h"
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <linux/taskstats.h>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string.h>
 #include <string>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 //------------------------------------------------------------------------------
@@ -44,6 +57,10 @@
 //------------------------------------------------------------------------------
 
 #define SPECIAL_NUMSAMPLES_UNTIL_CGROUP_ALIVE (UINT64_MAX)
+#define MIN_SAMPLING_INTERVAL_MSEC (10)
+#define MAX_COLLECTOR_THREADS (64)
+#define DEFAULT_OUTPUT_QUEUE_SIZE (0) // samples are written by the sampling loop itself
+#define MAX_OUTPUT_QUEUE_SIZE (4096)
 
 enum PerformanceKpiFamily {
     PK_INVALID = 0,
@@ -77,105 +94,169 @@ enum OutputFields {
     PF_USED_BY_CHART_SCRIPT_ONLY // force newline
 };
 
+enum ProcessBackend {
+    PB_PROCFS, // force newline
+    PB_TASKSTATS, // force newline
+    PB_IO_URING // force newline
+};
+
+// metrics that can be combined into the score used to select the processes to report, see --process-score
+enum ProcessScoreMetric {
+    PSM_CPU, // CPU usage, in percentage of one CPU
+    PSM_RSS, // resident memory, in MB
+    PSM_IO, // bytes read and written, in MB/s
+    PSM_MAJFLT, // major faults per second
+
+    PSM_MAX,
+    PSM_INVALID = PSM_MAX
+};
+
 //------------------------------------------------------------------------------
 // Types
 //------------------------------------------------------------------------------
 
 /*
- * Structure to store CPU usage specs as reported by Linux kernel
+ * Per-CPU time counters read from /proc/stat, in the same order of the /proc/stat columns;
+ * they are also the columns of CMonitorCollectorApp::m_proc_stat_cpus.
  * NOTE: all fields specify amount of time, measured in units of USER_HZ
          (1/100ths of a second on most architectures); this means that if the
          _delta_ CPU value reported is 60 in mode X, then that mode took 60% of the CPU!
          IOW there is no need to do any math to produce a percentage, just taking
          the delta of the absolute, monotonic-increasing value and divide by the time
-*/
-typedef struct cpu_specs_s {
-    long long user;
-    long long nice;
-    long long sys;
-    long long idle;
-    long long iowait;
-    long long hardirq;
-    long long softirq;
-    long long steal;
-    long long guest;
-    long long guestnice;
-} cpu_specs_t;
-
-typedef struct procsinfo_s {
-    /* Process owner */
-    uid_t uid;
-    char username[64];
-    /* Process details; see http://man7.org/linux/man-pages/man5/proc.5.html */
-    int pi_pid;
-    char pi_comm[64]; // The filename of the executable
-    char pi_state;
-    int pi_ppid; // The PID of the parent of this process.
-    int pi_tgid; // The Thread group ID of this process
-    int pi_pgrp; // The process group ID of the process
-    int pi_session; // The session ID of the process.
-    int pi_tty_nr; //  The controlling terminal of the process
-    int pi_tty_pgrp; // The ID of the foreground process group of the controlling terminal
-    unsigned long pi_flags; // The kernel flags word of the process
-    unsigned long pi_minflt; // The number of minor faults the process has made which have not required loading a memory
-                             // page from disk.
-    unsigned long pi_child_min_flt;
-    unsigned long pi_majflt; // The number of major faults the process has made which have required loading a memory
-                             // page from disk.
-    unsigned long pi_child_maj_flt;
-    unsigned long pi_utime; // Amount of time that this process has been scheduled in user mode, in clock ticks
-    unsigned long pi_stime; // Amount of time that this process has been scheduled in kernel mode, in clock ticks
-    long pi_child_utime; // Amount of time that this process's waited-for children have been scheduled in user mode
-    long pi_child_stime; // Amount of time that this process's waited-for children have been scheduled in kernel mode
-    long pi_priority;
-    long pi_nice; // The nice value
-    long pi_num_threads; // Number of threads in this process
-    unsigned long pi_start_time;
-    unsigned long pi_vsize; // Virtual memory size in bytes.
-    long pi_rss; /* - 3 */
-    unsigned long pi_rsslimit;
-    unsigned long pi_start_code;
-    unsigned long pi_end_code;
-    unsigned long pi_start_stack;
-    unsigned long pi_esp;
-    unsigned long pi_eip;
-    /* The signal information here is obsolete. See "man proc" */
-    unsigned long pi_signal_pending;
-    unsigned long pi_signal_blocked;
-    unsigned long pi_signal_ignore;
-    unsigned long pi_signal_catch;
-    unsigned long pi_wchan;
-    unsigned long pi_swap_pages;
-    unsigned long pi_child_swap_pages;
-    int pi_signal_exit;
-    int pi_last_cpu;
-    unsigned long pi_realtime_priority;
-    unsigned long pi_sched_policy;
-    unsigned long long pi_delayacct_blkio_ticks;
-    /* Process stats for memory */
-    unsigned long statm_size; /* total program size, measured in pages */
-    unsigned long statm_resident; /* resident set size, measured in pages */
-    unsigned long statm_share; /* shared pages */
-    unsigned long statm_trs; /* text (code) */
-    unsigned long statm_drs; /* data/stack */
-    unsigned long statm_lrs; /* library */
-    unsigned long statm_dt; /* dirty pages */
-    /* Process stats for disks */
-    unsigned long long io_rchar; // includes things such as terminal I/O and is
-                                 // unaffected by whether or not actual physical disk I/O
-                                 // was required (the read might have been satisfied from pagecache).
-    unsigned long long io_wchar; // The number of bytes which this task has caused, or
-                                 // shall cause to be written to disk
-    unsigned long long io_read_bytes; // Attempt to count the number of bytes which this process
-                                      // really did cause to be fetched from the storage layer.
-    unsigned long long io_write_bytes; // Attempt to count the number of bytes which this process
-                                       // caused to be sent to the storage layer.
-} procsinfo_t;
-
-typedef struct proc_topper_s {
-    const procsinfo_t* current;
-    const procsinfo_t* prev;
-} proc_topper_t;
+ */
+enum CpuTimeField {
+    CPU_TIME_USER, // force newline
+    CPU_TIME_NICE, // force newline
+    CPU_TIME_SYS, // force newline
+    CPU_TIME_IDLE, // force newline
+    CPU_TIME_IOWAIT, // force newline
+    CPU_TIME_HARDIRQ, // force newline
+    CPU_TIME_SOFTIRQ, // force newline
+    CPU_TIME_STEAL, // force newline
+    CPU_TIME_GUEST, // force newline
+    CPU_TIME_GUESTNICE, // force newline
+
+    CPU_TIME_MAX
+};
+
+/*
+ * System-wide counters read from /proc/stat: the columns of CMonitorCollectorApp::m_proc_stat_counters
+ */
+enum ProcStatCounter {
+    PROC_STAT_CTXT, // context switches
+    PROC_STAT_PROCESSES, // forks
+
+    PROC_STAT_MAX
+};
+
+/*
+ * Per-CPU counters read from the cpuacct cgroup: the columns of CMonitorCollectorApp::m_cgroup_cpuacct_counters;
+ * with cgroups v2 there is a single row, for all CPUs
+ */
+enum CGroupCpuacctField {
+    CGROUP_CPUACCT_USER, // nanoseconds in user mode; the total time when the system/user split is not available
+    CGROUP_CPUACCT_SYS, // nanoseconds in system mode
+
+    CGROUP_CPUACCT_MAX
+};
+
+/*
+ * Per-device counters read from the io.stat file of cgroups v2, in the order they are emitted by --deep-collect;
+ * they are also the columns of CMonitorCollectorApp::m_cgroup_io_counters
+ */
+enum CGroupIoField {
+    CGROUP_IO_READS, // "rios"
+    CGROUP_IO_WRITES, // "wios"
+    CGROUP_IO_RKB, // "rbytes" [converted by us to Kbytes]
+    CGROUP_IO_WKB, // "wbytes" [converted by us to Kbytes]
+    CGROUP_IO_DISCARDS, // "dios", since Linux 5.0
+    CGROUP_IO_DKB, // "dbytes", since Linux 5.0 [converted by us to Kbytes]
+
+    CGROUP_IO_MAX
+};
+
+/*
+ * Block device counters read from /proc/diskstats, in the order they are emitted by --deep-collect;
+ * they are also the columns of CMonitorCollectorApp::m_disk_counters.
+ * See https://www.kernel.org/doc/Documentation/iostats.txt
+ */
+enum DiskField {
+    // reads
+    DISK_READS, // Field 1: This is the total number of reads completed successfully.
+    DISK_RMERGE, // Field 2: Reads and writes which are adjacent to each other may be merged for efficiency.
+    DISK_RKB, // Field 3: This is the total number of sectors read successfully. [converted by us to Kbytes]
+    DISK_RMSEC, // Field 4: This is the total number of milliseconds spent by all reads
+
+    // writes
+    DISK_WRITES, // Same as Field 1 but for writes
+    DISK_WMERGE, // Same as Field 2 but for writes
+    DISK_WKB, // Same as Field 3 but for writes
+    DISK_WMSEC, // Same as Field 4 but for writes
+
+    // others
+    DISK_INFLIGHT, // Field 9: number of I/Os currently in progress (a gauge)
+    DISK_TIME, // Field 10: This field increases so long as field 9 is nonzero. (milliseconds) [converted in
+               // percentage]
+    DISK_BACKLOG, // Field 11: weighted # of milliseconds spent doing I/Os
+
+    // computed by ourselves:
+    DISK_XFERS, // sum of number of read/write operations
+
+    DISK_MAX
+};
+
+/*
+ * Structure to store a block device listed in /proc/diskstats
+ */
+typedef struct diskinfo_s {
+    char dk_name[128];
+    size_t dk_row; // inside CMonitorCollectorApp::m_disk_counters
+} diskinfo_t;
+
+#define DISK_KEY(major, minor) (((uint64_t)(major) << 32) | (uint64_t)(minor))
+
+/*
+ * Network interface counters read from /proc/net/dev, in the order they are emitted by --deep-collect;
+ * they are also the columns of CMonitorCollectorApp::m_netif_counters
+ */
+enum NetIfField {
+    NET_IF_IBYTES, // force newline
+    NET_IF_IPACKETS, // force newline
+    NET_IF_IERRS, // force newline
+    NET_IF_IDROP, // force newline
+    NET_IF_IFIFO, // force newline
+    NET_IF_IFRAME, // force newline
+    NET_IF_OBYTES, // force newline
+    NET_IF_OPACKETS, // force newline
+    NET_IF_OERRS, // force newline
+    NET_IF_ODROP, // force newline
+    NET_IF_OFIFO, // force newline
+    NET_IF_OCOLLS, // force newline
+    NET_IF_OCARRIER, // force newline
+
+    NET_IF_MAX
+};
+
+#define NETIF_REPORTED (-1) // the interface is reported in its own subsection
+#define NETIF_EXCLUDED (-2) // the interface is discarded by --net-include/--net-exclude
+
+// interfaces are keyed by their ifindex; when sysfs does not provide it, a hash of the name is used instead
+#define NETIF_KEY_FROM_NAME_HASH(hash) ((1ULL << 32) | ((uint64_t)(hash)&0xFFFFFFFF))
+
+/*
+ * Structure to store the state of a network interface listed in /proc/net/dev
+ */
+typedef struct netinfo_s {
+    char if_name[128];
+    size_t if_row; // inside CMonitorCollectorApp::m_netif_counters
+    int if_rollup; // NETIF_REPORTED, NETIF_EXCLUDED or the index inside g_cfg.m_vecNetRollups
+    uint64_t if_last_seen; // value of m_netifs_num_reads when the interface was last listed in /proc/net/dev
+} netinfo_t;
+
+struct process_score_term_t {
+    ProcessScoreMetric metric;
+    double weight;
+};
 
 //------------------------------------------------------------------------------
 // Command-Line Globals
@@ -194,6 +275,8 @@ public:
     // local data saving opts
     std::string m_strOutputDir; // --output-directory
     std::string m_strOutputFilenamePrefix; // --output-filename
+    uint64_t m_nOutputQueueSize = DEFAULT_OUTPUT_QUEUE_SIZE; // --output-queue-size
+    QueueOverflowPolicy m_nOutputQueuePolicy = QOP_DROP_OLDEST; // --output-queue-policy
 
     // remove streaming opts
     std::string m_strRemoteAddress; // --remote-ip
@@ -202,15 +285,502 @@ public:
 
     // data collecting options
     uint64_t m_nSamples = 0; // --num-samples
-    uint64_t m_nSamplingInterval = 60; // --sampling-interval
+    uint64_t m_nSamplingIntervalMsec = 60000; // --sampling-interval
     unsigned int m_nCollectFlags = PK_ALL; // --collect: a combination of PerformanceKpiFamily values
+    std::map<unsigned int /* PerformanceKpiFamily */, uint64_t> m_mapCollectIntervalMsec; // --collect=family@interval
     OutputFields m_nOutputFields = PF_USED_BY_CHART_SCRIPT_ONLY; // --deep-collect
     std::string m_strCGroupName; // --cgroup-name
+    unsigned int m_nCollectorThreads = 0; // --collector-threads
+    bool m_bSelfStats = false; // --self-stats
+    uint64_t m_nFlightRecorderDurationMsec = 0; // --flight-recorder
+    uint64_t m_nFlightRecorderIntervalMsec = 0; // --flight-recorder
+    bool m_bFlightRecorderOnOom = false; // --flight-recorder-trigger=oom
+    bool m_bProcEvents = false; // --proc-events
+    ProcessBackend m_nProcessBackend = PB_PROCFS; // --process-backend
+    uint64_t m_nTopProcesses = 0; // --top-processes; 0 means all processes with a non-zero score
+    bool m_bNumericUids = false; // --numeric-uids
+    bool m_bThreads = false; // --threads
+    unsigned int m_nProcessScanThreads = 0; // --process-scan-threads
+    std::vector<process_score_term_t> m_vecProcessScore = { { PSM_CPU, 1.0 } }; // --process-score
+
+    // network interfaces selection
+    struct NetRollup {
+        std::string m_strName; // name of the aggregate entry
+        std::vector<std::string> m_vecGlobs; // interfaces summed into the aggregate entry
+    };
+    std::vector<std::string> m_vecNetIncludeGlobs; // --net-include; empty means all interfaces
+    std::vector<std::string> m_vecNetExcludeGlobs = { "veth*" }; // --net-exclude
+    std::vector<NetRollup> m_vecNetRollups; // --net-rollup
+
+    // where procfs and sysfs files are read from; moved at each tick by --replay
+    std::string m_strProcRoot = "/proc"; // --proc-root
+    std::string m_strSysRoot = "/sys"; // --sys-root
+    std::string m_strRecordDir; // --record
+    std::string m_strReplayDir; // --replay
 };
 
 // app-wide config settings:
 extern CMonitorCollectorAppConfig g_cfg;
 
+// set by signal handlers to request a graceful exit:
+extern bool g_bExiting;
+
+// set by the SIGUSR2 handler, and taken by the sampling loop, to request a dump of the flight recorder;
+// NOTE: atomic booleans are lock-free, hence safe to use from a signal handler
+extern std::atomic<bool> g_bFlightRecorderDumpRequested;
+
+//------------------------------------------------------------------------------
+// Sampling scheduler
+// Paces the main loop using absolute CLOCK_MONOTONIC deadlines, so that the time
+// spent collecting a sample does not accumulate as drift on the next ones.
+// Each performance stats family may have its own sampling interval: the scheduler
+// ticks at the GCD of all intervals and tells which families are due at each tick.
+//------------------------------------------------------------------------------
+
+// pseudo-family used by the scheduler to pace the regular output when the flight recorder is active
+#define SCHED_REGULAR_OUTPUT (0x80000000)
+
+class CMonitorScheduler {
+public:
+    CMonitorScheduler() {}
+
+    // families must be registered before calling start():
+    void set_family_interval(unsigned int family, uint64_t interval_msec);
+    void start(uint64_t first_delay_msec, uint64_t now_nsec = 0 /* 0 means current monotonic time */);
+
+    // blocks until the next deadline is reached; returns false if interrupted by a termination signal
+    bool wait_next_deadline();
+
+    // what wait_next_deadline() does once awake: moves the clock to the given monotonic time, counting the
+    // deadlines missed as overruns, and decides which families are due; also used by the self-checks
+    void advance_to(uint64_t now_nsec);
+
+    // replaces wait_next_deadline() when replaying a recording: moves the clock to the recorded wakeup time
+    // of a tick, without sleeping, and marks as due the families that were collected in that tick
+    void replay_tick(uint64_t now_nsec, unsigned int due_families, uint64_t jitter_usec, uint64_t overruns);
+
+    // interval between two ticks: the GCD of all family intervals
+    uint64_t get_tick_interval_msec() const { return m_interval_nsec / 1000000ULL; }
+    uint64_t get_families_gcd_msec() const; // same, but available before start(); 0 if no family
+
+    // combination of PerformanceKpiFamily values that must be collected in current tick
+    unsigned int get_due_families() const { return m_due_families; }
+    bool is_due(unsigned int family) const { return (m_due_families & family) != 0; }
+
+    // time elapsed since the previous collection of the given family (or of any family when 0 is given)
+    double get_elapsed_sec(unsigned int family = 0) const;
+
+    // how late the last wakeup was compared to its deadline
+    uint64_t get_last_jitter_usec() const { return m_last_jitter_usec; }
+
+    // number of deadlines skipped because the previous sample took longer than the sampling interval
+    uint64_t get_last_overruns() const { return m_last_overruns; }
+    uint64_t get_total_overruns() const { return m_total_overruns; }
+
+    // monotonic time of the last wakeup
+    uint64_t get_last_wakeup_nsec() const { return m_last_wakeup_nsec; }
+
+    static uint64_t get_monotonic_time_nsec();
+    static uint64_t gcd(uint64_t a, uint64_t b); // gcd(a, 0) is a
+
+private:
+    struct family_schedule_t {
+        uint64_t interval_msec = 0;
+        uint64_t period_ticks = 1;
+        uint64_t last_tick = 0;
+        uint64_t last_collect_nsec = 0;
+        double elapsed_sec = 0;
+    };
+
+    std::map<unsigned int /* PerformanceKpiFamily */, family_schedule_t> m_families;
+    unsigned int m_due_families = 0;
+    uint64_t m_tick_count = 0;
+
+    uint64_t m_interval_nsec = 0;
+    uint64_t m_next_deadline_nsec = 0;
+    uint64_t m_last_wakeup_nsec = 0;
+    double m_elapsed_sec = 0;
+    uint64_t m_last_jitter_usec = 0;
+    uint64_t m_last_overruns = 0;
+    uint64_t m_total_overruns = 0;
+};
+
+//------------------------------------------------------------------------------
+// Self-instrumentation
+// Measures how much time and how many allocations each collector and each output
+// sink costs; results go into the "cmonitor_self" section of each sample and
+// latency histograms accumulated over the whole run go into the JSON footer.
+//------------------------------------------------------------------------------
+
+enum SelfStatsProbe {
+    SSP_PROC_STAT, // force newline
+    SSP_PROC_MEMINFO, // force newline
+    SSP_PROC_NET_DEV, // force newline
+    SSP_PROC_DISKSTATS, // force newline
+    SSP_CGROUP_CPUACCT, // force newline
+    SSP_CGROUP_MEMORY, // force newline
+    SSP_CGROUP_BLKIO, // force newline
+    SSP_CGROUP_TASKS, // force newline
+    SSP_SINK_JSON, // force newline
+    SSP_SINK_INFLUXDB, // force newline
+    SSP_SINK_FLIGHT_RECORDER, // both sinks, when writing a dump of the flight recorder
+
+    SSP_MAX
+};
+
+#define SELF_STATS_HISTOGRAM_BUCKETS (25) // log2 buckets in usecs: the last one collects everything above 8sec
+
+class CMonitorSelfStats {
+public:
+    // measures the execution of a scope on behalf of the given probe
+    class Timer {
+    public:
+        Timer(SelfStatsProbe probe);
+        ~Timer();
+
+    private:
+        SelfStatsProbe m_probe;
+        uint64_t m_start_wall_nsec = 0;
+        uint64_t m_start_cpu_nsec = 0;
+        uint64_t m_start_allocs = 0;
+    };
+
+    CMonitorSelfStats() {}
+
+    // must be called before any thread is started, since it enables the counting of allocations too
+    void enable();
+    bool is_enabled() const { return m_enabled; }
+
+    // allocations are counted only once enabled, to keep operator new as cheap as possible otherwise
+    static void enable_allocation_counting();
+
+    // accounting API, callable from any thread:
+    void add_bytes(SelfStatsProbe probe, uint64_t nbytes) { m_probes[probe].bytes += nbytes; }
+    static void count_allocation();
+    static uint64_t get_thread_allocations();
+
+    // output API:
+    void psample_start(); // marks the start of the collection of a sample
+    void psection_self(); // generates the "cmonitor_self" section with the stats since last call
+    void pfooter(); // generates the footer sections with the latency histograms
+
+private:
+    void record(SelfStatsProbe probe, uint64_t wall_nsec, uint64_t cpu_nsec, uint64_t allocs);
+
+    struct probe_stats_t {
+        // stats since last sample, reset by psection_self():
+        std::atomic<uint64_t> calls { 0 };
+        std::atomic<uint64_t> wall_nsec { 0 };
+        std::atomic<uint64_t> cpu_nsec { 0 };
+        std::atomic<uint64_t> allocs { 0 };
+        std::atomic<uint64_t> bytes { 0 };
+
+        // stats for the whole run:
+        std::atomic<uint64_t> total_calls { 0 };
+        std::atomic<uint64_t> total_wall_nsec { 0 };
+        std::atomic<uint64_t> max_wall_nsec { 0 };
+        std::atomic<uint64_t> histogram[SELF_STATS_HISTOGRAM_BUCKETS];
+    };
+
+    bool m_enabled = false;
+    probe_stats_t m_probes[SSP_MAX];
+
+    // process-wide stats, updated only by the sampling thread:
+    uint64_t m_sample_start_wall_nsec = 0;
+    uint64_t m_last_rusage_cpu_usec = 0;
+    uint64_t m_last_total_allocs = 0;
+};
+
+// app-wide self-instrumentation:
+extern CMonitorSelfStats g_self_stats;
+
+//------------------------------------------------------------------------------
+// Worker pool
+// A fixed set of threads used to run the collectors of independent stats families
+// concurrently. Threads are created once at startup and reused for every sample.
+//------------------------------------------------------------------------------
+
+class CMonitorWorkerPool {
+public:
+    typedef std::function<void()> job_t;
+
+    CMonitorWorkerPool() {}
+    ~CMonitorWorkerPool() { stop(); }
+
+    void start(unsigned int num_threads);
+    void stop();
+
+    bool is_running() const { return !m_threads.empty(); }
+
+    // runs all given jobs, in no particular order, and returns only when all of them have completed;
+    // the calling thread takes part to the execution of the jobs
+    void run_all(std::vector<job_t>& jobs);
+
+private:
+    bool run_next_job(std::unique_lock<std::mutex>& lock);
+    void worker_main();
+
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_cond_new_jobs;
+    std::condition_variable m_cond_jobs_done;
+
+    // jobs of the current batch; protected by m_mutex
+    std::vector<job_t>* m_jobs = nullptr;
+    size_t m_next_job = 0;
+    size_t m_pending_jobs = 0;
+    bool m_stop = false;
+};
+
+//------------------------------------------------------------------------------
+// Taskstats
+// Per-process accounting delivered by the kernel through the TASKSTATS generic
+// netlink family, as one binary message per process instead of several /proc
+// files to open and parse:
+//  - per-PID stats provide identity, peak memory, I/O and faults of a task;
+//  - per-TGID stats provide CPU times and delays summed over all threads;
+//  - in exit-notification mode the kernel sends the stats of each exiting task.
+// Requires CAP_NET_ADMIN and a kernel providing taskstats version 12 or later,
+// which reports the thread group of each task.
+//------------------------------------------------------------------------------
+
+struct process_taskstats_t {
+    pid_t pid = 0;
+    bool has_pid_stats = false;
+    bool has_tgid_stats = false; // the kernel sends no per-TGID exit record for single-threaded processes
+    struct taskstats pid_stats;
+    struct taskstats tgid_stats;
+};
+
+class CMonitorTaskstats {
+public:
+    CMonitorTaskstats() {}
+    ~CMonitorTaskstats() { close(); }
+
+    bool open();
+    void close();
+    bool is_open() const { return m_socket != -1; }
+    int get_socket() const { return m_socket; }
+
+    // queries the per-PID and per-TGID stats of the given PIDs, in batches of requests sent with a single
+    // syscall; results contain only the processes still alive, not the threads
+    bool query(const std::vector<pid_t>& pids, std::vector<process_taskstats_t>& results);
+
+    // exit-notification mode: receives the stats of all tasks exiting on the given CPUs, e.g. "0-7"
+    bool register_exits(const std::string& cpumask);
+
+    // appends to the given vector the exit records received so far, without blocking; each record
+    // has either the per-PID or the per-TGID stats; returns false when records have been lost
+    bool receive_exits(std::vector<process_taskstats_t>& records);
+
+private:
+    bool resolve_family_id();
+    void append_request(uint16_t type, uint8_t cmd, uint16_t attr, const void* value, size_t len, uint32_t seq,
+        bool ack); // appends a request to the datagram sent by send_requests()
+    bool send_requests();
+    void parse_stats(const struct nlmsghdr* hdr, process_taskstats_t* pid_rec, process_taskstats_t* tgid_rec);
+
+private:
+    int m_socket = -1;
+    uint16_t m_family_id = 0;
+    uint32_t m_next_seq = 1;
+    std::string m_exit_cpumask; // registered for exit notifications
+    std::vector<char> m_send_buf;
+    size_t m_send_len = 0;
+    std::vector<char> m_recv_buf; // room for a batch of datagrams received by recvmmsg()
+};
+
+//------------------------------------------------------------------------------
+// io_uring
+// Reads many small files at once, e.g. the /proc/<pid>/stat files kept open
+// by CMonitorProcessTable: all the reads are queued in the submission ring of
+// an io_uring instance and a single syscall per ring-full of reads submits
+// them and waits for their completion, instead of one pread() per file.
+// Each read fills a fixed-size slot of a buffer reused across batches: the
+// files which do not fit their slot must be read again with a plain read.
+// The rings are set up through the raw syscalls: open() probes the kernel
+// support, which may be missing (before Linux 5.6), disabled by the
+// kernel.io_uring_disabled sysctl or forbidden by a seccomp filter.
+// NOTE: procfs files cannot be read without blocking: the kernel completes
+// those reads in its io-wq worker threads, spread over all CPUs.
+//------------------------------------------------------------------------------
+
+class CMonitorIoUring {
+public:
+    CMonitorIoUring() {}
+    ~CMonitorIoUring() { close(); }
+
+    // non-copyable: the rings are mapped in memory
+    CMonitorIoUring(const CMonitorIoUring&) = delete;
+    CMonitorIoUring& operator=(const CMonitorIoUring&) = delete;
+
+    bool open();
+    void close();
+    bool is_open() const { return m_ring_fd != -1; }
+
+    // queues the read of the given file from offset 0; the tag is any value identifying it for the caller
+    void add_read(int fd, size_t tag);
+
+    // submits all the queued reads and waits for their completion; on failure the ring is closed
+    bool submit_all();
+
+    // the results of the reads queued since last clear(), in the order they were added
+    size_t size() const { return m_reads.size(); }
+    size_t get_tag(size_t i) const { return m_reads[i].tag; }
+    const char* get_data(size_t i) const; // NUL-terminated, or nullptr if the read failed or did not fit
+    void clear() { m_reads.clear(); }
+
+private:
+    struct read_t {
+        int fd;
+        int result; // bytes read or -errno
+        size_t tag;
+    };
+
+    int m_ring_fd = -1;
+
+    // the rings shared with the kernel: both live in a single mapping, the entries of the submission ring in another
+    void* m_rings = nullptr;
+    size_t m_rings_size = 0;
+    void* m_sqes = nullptr;
+    size_t m_sqes_size = 0;
+    unsigned int m_sq_entries = 0;
+    unsigned int m_cq_entries = 0;
+    unsigned int* m_sq_head = nullptr; // advanced by the kernel
+    unsigned int* m_sq_tail = nullptr;
+    unsigned int* m_sq_array = nullptr;
+    unsigned int* m_cq_head = nullptr;
+    unsigned int* m_cq_tail = nullptr; // advanced by the kernel
+    void* m_cqes = nullptr;
+
+    std::vector<read_t> m_reads;
+    std::vector<char> m_buffer; // one slot per read
+};
+
+//------------------------------------------------------------------------------
+// Process events
+// Subscribes to the proc connector (NETLINK_CONNECTOR, CN_IDX_PROC) and keeps
+// the set of tracked processes updated from a dedicated listener thread:
+//  - a process forked by a tracked process is tracked as well, since children
+//    inherit the cgroup of their parent;
+//  - when a tracked process exits, its /proc files are read immediately, while
+//    it still exists as a zombie, and its final stats are queued for the next
+//    sample: this allows to report processes living less than one interval.
+// Threads are ignored, just like in the /proc/<pid> scan of cgroup_proc_tasks().
+// When the listener cannot keep up with the kernel, events are lost and the
+// tracked set must be rebuilt from the cgroup "tasks" file.
+// Subscribing requires CAP_NET_ADMIN.
+//------------------------------------------------------------------------------
+
+struct exited_proc_t {
+    pid_t pid = 0;
+    int exit_code = 0; // as returned by wait(): use WIFEXITED() & co to decode it
+    bool has_final_stats = false; // false when the process was reaped before its /proc files could be read
+
+    // valid only if has_final_stats:
+    proc_counters_t final_counters;
+    proc_gauges_t final_gauges;
+    proc_identity_t final_identity;
+};
+
+class CMonitorProcEvents {
+public:
+    CMonitorProcEvents() {}
+    ~CMonitorProcEvents() { stop(); }
+
+    // subscribes to the proc connector and starts the listener thread; if a CPU mask is given, the final
+    // stats of exited processes are taken from the taskstats exit records of those CPUs instead of /proc
+    bool start(OutputFields output_opts, const std::string& taskstats_cpumask = "");
+    void stop();
+
+    // false also after the listener thread has failed: then the caller must fall back to reading the cgroup
+    // "tasks" file at each sample
+    bool is_running() const { return m_listener_alive; }
+
+    // provides the tracked processes; returns false when the tracked set needs to be
+    // rebuilt, i.e. at startup or when events have been lost
+    bool get_tracked(std::vector<pid_t>& pids);
+
+    // adds the given processes to the tracked set, e.g. after reading the cgroup "tasks" file
+    void track(const std::vector<pid_t>& pids);
+
+    // stops tracking a process that has been found dead without an exit event
+    void untrack(pid_t pid);
+
+    // moves into the given vector the processes that exited since last call
+    void take_exited(std::vector<exited_proc_t>& exited);
+
+    // counters since start(), for debugging:
+    uint64_t get_num_events() const { return m_num_events; }
+    uint64_t get_num_overruns() const { return m_num_overruns; }
+
+private:
+    bool send_mcast_op(int op);
+    void listener_main();
+    void handle_events(const char* buf, size_t len);
+    void handle_taskstats_exits();
+
+private:
+    int m_socket = -1;
+    int m_stop_pipe[2] = { -1, -1 };
+    std::thread m_thread;
+    std::atomic<bool> m_listener_alive { false }; // cleared by the listener thread when it exits
+    OutputFields m_output_opts = PF_NONE;
+
+    // owned by the listener thread:
+    CMonitorProcFile m_pid_file; // reused for all /proc/<pid>/ files of exited processes
+    CMonitorTaskstats m_taskstats;
+    std::vector<process_taskstats_t> m_taskstats_records; // reused for each batch of exit records
+    std::unordered_map<pid_t, process_taskstats_t> m_taskstats_exits; // of tracked processes, until their exit event
+
+    // shared between the listener thread and the collector; protected by m_mutex:
+    std::mutex m_mutex;
+    std::unordered_set<pid_t> m_tracked;
+    std::vector<exited_proc_t> m_exited;
+    bool m_resync_needed = true;
+
+    std::atomic<uint64_t> m_num_events { 0 };
+    std::atomic<uint64_t> m_num_overruns { 0 };
+};
+
+//------------------------------------------------------------------------------
+// Username cache
+// Resolves the UIDs of the monitored processes to user names. Each lookup goes
+// through NSS and may be a network round-trip (e.g. to LDAP through sssd), so
+// names are cached for the whole run: all of them are dropped when /etc/passwd
+// changes and each of them is looked up again after USERNAME_CACHE_TTL_SEC, to
+// notice changes of remote user databases too. UIDs without a name are cached
+// as well. Not thread-safe: used only by cgroup_proc_tasks().
+//------------------------------------------------------------------------------
+
+#define USERNAME_CACHE_TTL_SEC (600)
+
+class CMonitorUsernameCache {
+public:
+    CMonitorUsernameCache() {}
+
+    // drops all names if /etc/passwd has changed since last call: to be called once per sample
+    void check_passwd_file();
+
+    // returns the name of the given user, or an empty string if it has none
+    const std::string& get(uid_t uid);
+
+    // counter since start, for debugging:
+    uint64_t get_num_lookups() const { return m_num_lookups; }
+
+private:
+    struct entry_t {
+        std::string name;
+        uint64_t lookup_time_sec; // CLOCK_MONOTONIC
+    };
+
+    std::unordered_map<uid_t, entry_t> m_entries;
+    std::vector<char> m_pwbuf; // for getpwuid_r()
+    struct timespec m_passwd_mtime = { 0, 0 };
+    ino_t m_passwd_ino = 0;
+    uint64_t m_num_lookups = 0;
+};
+
 //------------------------------------------------------------------------------
 // Logging functions for this app
 //------------------------------------------------------------------------------
@@ -225,6 +795,9 @@ public:
 private:
     std::string m_strErrorFileName;
 
+    // collectors may log from the worker threads:
+    std::mutex m_mutex;
+
     // output:
     FILE* m_outputErr = nullptr;
 };
@@ -237,6 +810,8 @@ extern CMonitorLoggerUtils g_logger;
 //------------------------------------------------------------------------------
 
 class CMonitorCollectorApp {
+    friend class CMonitorBenchmark; // to drive single collectors against fixtures
+
 public:
     CMonitorCollectorApp() {}
 
@@ -244,56 +819,79 @@ public:
     void parse_args(int argc, char** argv);
     int run(int argc, char** argv);
 
+    // registers into the given scheduler the interval of each family enabled by the configuration
+    static void set_scheduler_families(CMonitorScheduler& scheduler);
+
 private:
     void print_help();
     void check_pid_file();
     std::string get_hostname();
     void get_timestamps(std::string& localTime, std::string& utcTime);
-    void file_read_one_stat(const char* file, const char* name);
-    void proc_read_numeric_stats_from(const char* statname, const std::set<std::string>& allowedStatsNames);
+    void file_read_one_stat(const std::string& file, const char* name);
+    void proc_read_numeric_stats_from(CMonitorProcFile& file, CMonitorKeyValueParser& parser, const char* statname,
+        const std::set<std::string>& allowedStatsNames);
     void psample_date_time(long loop);
-    double get_timestamp_sec();
+    bool collect_sample(unsigned int loop, const std::set<std::string>& charted_stats_from_meminfo,
+        const std::set<std::string>& charted_stats_from_cgroup_memory);
+    bool wait_next_tick(); // either sleeps until next deadline or moves to next recorded tick
+
+    // in flight recorder mode the regular samples report the rates since the previous regular sample, i.e. since
+    // the checkpoint of all counters taken with it, rather than since the previous flight recorder sample
+    void set_rates_checkpoint();
+    double get_rates_elapsed_sec(double elapsed_sec) const;
+    void compute_table_rates(CMonitorCounterTable& table, double elapsed_sec);
 
     //------------------------------------------------------------------------------
     // JSON header functions
     //------------------------------------------------------------------------------
 
     void header_identity();
-    void header_cmonitor_info(
-        int argc, char** argv, long sampling_interval_sec, long num_samples, unsigned int collect_flags);
+    void header_cmonitor_info(int argc, char** argv, uint64_t sampling_interval_msec, long num_samples,
+        unsigned int collect_flags, const std::map<unsigned int, uint64_t>& collect_intervals_msec);
     void header_etc_os_release();
     void header_cpuinfo();
     void header_version();
     void header_lscpu();
     void header_lshw();
     void header_meminfo();
+    void header_process_usernames();
 
     //------------------------------------------------------------------------------
     // CGroup functions
     //------------------------------------------------------------------------------
 
     void cgroup_init();
+    void cgroup_init_v2(const std::string& mount_path); // utility of cgroup_init()
+    void cgroup_move_sys_root(const std::string& old_sys_root); // used by --replay at each tick
     bool cgroup_init_check_for_our_pid();
     void cgroup_config();
     bool cgroup_is_allowed_cpu(int cpu);
     bool cgroup_still_exists();
+    bool cgroup_get_oom_kill_count(uint64_t& count);
     void cgroup_proc_memory(const std::set<std::string>& allowedStatsNames);
     void cgroup_proc_cpuacct(double elapsed_sec, bool print);
+    void cgroup_proc_blkio(double elapsed_sec, OutputFields output_opts);
     void cgroup_proc_tasks(double elapsed_sec, OutputFields output_opts);
     bool cgroup_collect_pids(std::vector<pid_t>& pids); // utility of cgroup_proc_tasks()
+    void cgroup_proc_threads(pid_t pid, double elapsed_sec); // utility of cgroup_proc_tasks()
+    void cgroup_proc_scan_init(unsigned int num_threads); // --process-scan-threads
+    void cgroup_proc_read_slice(const pid_t* pids, const size_t* rows, size_t count, unsigned int parts,
+        double elapsed_sec, CMonitorProcFile& file, CMonitorIoUring* io_uring); // utility of cgroup_proc_tasks()
 
     //------------------------------------------------------------------------------
     // Functions to collect /proc stats
     //------------------------------------------------------------------------------
 
     void proc_stat(double elapsed, bool onlyCgroupAllowedCpus, OutputFields output_opts);
-    void proc_stat_cpu_total(const char* cpu_data, double elapsed_sec, OutputFields output_opts, cpu_specs_t& total_cpu,
-        int max_cpu_count); // utility of proc_stat()
-    int proc_stat_cpu_index(const char* cpu_data, double elapsed_sec, OutputFields output_opts,
-        cpu_specs_t* logical_cpu, bool onlyCgroupAllowedCpus);
+    int proc_stat_cpu_index(const char* cpu_data, bool onlyCgroupAllowedCpus); // utility of proc_stat()
+    void proc_stat_cpu_output(double elapsed_sec, OutputFields output_opts); // utility of proc_stat()
+    size_t get_possible_cpu_count();
 
     void proc_diskstats(double elapsed, OutputFields output_opts);
+    void proc_diskstats_scan_devices(); // utility of proc_diskstats()
     void proc_net_dev(double elapsed, OutputFields output_opts);
+    uint64_t proc_net_dev_read_key(const std::string& name); // utility of proc_net_dev()
+    uint64_t proc_net_dev_add_interface(const std::string& name); // utility of proc_net_dev()
     void proc_loadavg();
     void proc_filesystems();
     void proc_uptime();
@@ -304,11 +902,75 @@ private:
     //------------------------------------------------------------------------------
     std::string m_strHostname; // full hostname for this machine
     std::string m_strShortHostname; // short hostname for this machine
+    CMonitorScheduler m_scheduler;
+    CMonitorWorkerPool m_workers;
+    uint64_t m_last_oom_kill_count = 0;
+    bool m_bRatesSinceCheckpoint = false; // set while collecting a regular sample in flight recorder mode
+
+    //------------------------------------------------------------------------------
+    // Files read at each sample
+    // NOTE: each file is accessed only by the stats family that owns it, so that
+    //       families can still be collected in parallel
+    //------------------------------------------------------------------------------
+    CMonitorProcFile m_proc_stat_file;
+    CMonitorProcFile m_proc_meminfo_file;
+    CMonitorProcFile m_proc_vmstat_file;
+    CMonitorProcFile m_proc_diskstats_file;
+    CMonitorProcFile m_proc_net_dev_file;
+    CMonitorProcFile m_proc_uptime_file;
+    CMonitorProcFile m_proc_loadavg_file;
+    CMonitorProcFile m_cgroup_memory_stat_file;
+    CMonitorProcFile m_cgroup_memory_failcnt_file;
+    CMonitorProcFile m_cgroup_memory_oom_file;
+    CMonitorProcFile m_cgroup_cpuacct_sys_file;
+    CMonitorProcFile m_cgroup_cpuacct_user_file;
+    CMonitorProcFile m_cgroup_cpuacct_total_file;
+    CMonitorProcFile m_cgroup_tasks_file;
+    CMonitorProcFile m_cgroup_memory_current_file; // cgroups v2 only, as the files below
+    CMonitorProcFile m_cgroup_cpu_stat_file;
+    CMonitorProcFile m_cgroup_io_stat_file;
+    CMonitorProcFile m_pid_file; // reused for all /proc/<pid>/ files of the monitored processes
+
+    // parsers of the "label value" files above:
+    CMonitorKeyValueParser m_proc_meminfo_parser;
+    CMonitorKeyValueParser m_proc_vmstat_parser;
+    CMonitorKeyValueParser m_cgroup_memory_stat_parser;
+    std::set<std::string> m_cgroup_memory_stat_v2_labels; // the allowed labels, as named by cgroups v2
+
+    //------------------------------------------------------------------------------
+    // Disks
+    //------------------------------------------------------------------------------
+    std::unordered_map<uint64_t /* DISK_KEY(major, minor) */, diskinfo_t> m_disks;
+    std::vector<uint64_t> m_disks_diskstats_keys; // DISK_KEY() of each /proc/diskstats line at the last scan
+    CMonitorCounterTable m_disk_counters; // DiskField columns
+    std::vector<const diskinfo_t*> m_disks_listed; // in /proc/diskstats order, reused at each sample
+
+    //------------------------------------------------------------------------------
+    // Network interfaces
+    //------------------------------------------------------------------------------
+    std::unordered_map<uint64_t /* ifindex */, netinfo_t> m_netifs;
+    std::unordered_map<std::string, uint64_t /* ifindex */> m_netifs_by_name; // /proc/net/dev lists names only
+    uint64_t m_netifs_num_reads = 0; // number of reads of /proc/net/dev so far
+    std::string m_netif_name; // reused for each /proc/net/dev line, to avoid allocations
+    std::vector<double> m_netif_rollup_rates; // g_cfg.m_vecNetRollups.size() x NET_IF_MAX
+    CMonitorCounterTable m_netif_counters; // NetIfField columns
+    std::vector<const netinfo_t*> m_netifs_listed; // in /proc/net/dev order, reused at each sample
+
+    //------------------------------------------------------------------------------
+    // Per-CPU state
+    //------------------------------------------------------------------------------
+    CMonitorCounterTable m_proc_stat_cpus; // CpuTimeField columns, one row per CPU number
+    CMonitorCounterTable m_proc_stat_counters; // ProcStatCounter columns, a single row
+    CMonitorCounterTable m_cgroup_cpuacct_counters; // CGroupCpuacctField columns, one row per CPU number
+    CMonitorCounterTable m_cgroup_io_counters; // CGroupIoField columns, one row per device
+    std::unordered_map<uint64_t /* DISK_KEY(major, minor) */, diskinfo_t> m_cgroup_io_devices; // found in io.stat
+    std::vector<const diskinfo_t*> m_cgroup_io_listed; // in io.stat order, reused at each sample
 
     //------------------------------------------------------------------------------
     // CGroups variables
     //------------------------------------------------------------------------------
     bool m_bCGroupsFound = false;
+    bool m_bCGroupsV2 = false; // unified hierarchy: the paths below are all the same directory
 
     // paths of cgroups for the cgroup to monitor (either our own cgroup or another one):
     std::string m_cgroup_systemd_name;
@@ -323,11 +985,43 @@ private:
     //------------------------------------------------------------------------------
     // Process tracking
     //------------------------------------------------------------------------------
-    std::map<pid_t, procsinfo_t> m_pid_databases[2];
-    unsigned int m_pid_database_current_index = 0; // will be alternatively 0 and 1
-    std::map<uint64_t /* process score */, proc_topper_t> m_topper;
+    CMonitorProcessTable m_processes;
+    unsigned int m_processes_fds_generation = 0; // CMonitorProcFile generation of the descriptors kept by the rows
+    std::vector<size_t> m_pid_rows; // rows of the PIDs read at each sample; reused
+    CMonitorWorkerPool m_scan_workers; // --process-scan-threads
+    std::vector<std::unique_ptr<CMonitorProcFile>> m_scan_files; // one for each slice of a parallel scan
+    std::vector<std::pair<double /* process score */, size_t /* row of m_processes */>> m_topper; // reused
+    CMonitorUsernameCache m_usernames;
+    CMonitorProcessTable m_threads; // --threads: the threads of the reported processes, indexed by TID
+    std::vector<std::pair<double /* thread score */, size_t /* row of m_threads */>> m_thread_topper; // reused
+    CMonitorProcEvents m_proc_events; // --proc-events
+    unsigned int m_proc_events_samples_since_resync = 0;
+    std::vector<exited_proc_t> m_proc_events_exited; // reused at each sample
+    CMonitorTaskstats m_taskstats; // --process-backend=taskstats
+    std::vector<process_taskstats_t> m_taskstats_results; // reused at each sample
+    CMonitorIoUring m_io_uring; // --process-backend=io_uring
 };
 
+//------------------------------------------------------------------------------
+// Process utilities
+//------------------------------------------------------------------------------
+
+// the files of /proc/<pid> read by cgroup_proc_procsinfo(), as a bitmask:
+#define PROC_READ_STAT (1) // stat, and the identity if it does not describe the same process already
+#define PROC_READ_STATM (2) // statm
+#define PROC_READ_IO (4) // io; if unreadable, the I/O counters are zeroed
+#define PROC_READ_PARTS(output_opts) (PROC_READ_STAT | PROC_READ_IO | ((output_opts) == PF_ALL ? PROC_READ_STATM : 0))
+
+// the identity is read only if it does not describe the same process already, see CMonitorProcessTable;
+// if stat_fd is given, it is the descriptor of /proc/<pid>/stat kept open since the previous call, or -1,
+// and it is set to the descriptor to keep open until the next call, or -1
+bool cgroup_proc_procsinfo(CMonitorProcFile& file, pid_t pid, proc_counters_t* counters, proc_gauges_t* gauges,
+    proc_identity_t* identity, unsigned int parts, int* stat_fd = NULL, bool log_errors = true);
+void cgroup_proc_taskstats(
+    const process_taskstats_t& ts, proc_counters_t* counters, proc_gauges_t* gauges, proc_identity_t* identity);
+void cgroup_proc_taskstats_memory(CMonitorProcFile& file, pid_t pid, proc_counters_t* counters, proc_gauges_t* gauges,
+    proc_identity_t* identity); // the current memory usage, which taskstats do not provide
+
 //------------------------------------------------------------------------------
 // String/File utilities
 //------------------------------------------------------------------------------
@@ -337,12 +1031,14 @@ std::string to_lower(const std::string& orig_str);
 std::string trim_string(const std::string& s);
 void strip_spaces(char* s);
 bool string2int(const char* s, uint64_t& result);
+bool string2msec(const char* s, uint64_t& result_msec);
 bool file_or_dir_exists(const char* filename);
 template <typename T> std::string stl_container2string(const T& par, const std::string& delim);
 std::vector<std::string> split_string_in_array(const std::string& str, char splitter);
-bool parse_string_with_multiple_ranges(const std::string& data, std::vector<int>& result);
-bool parse_string_with_multiple_ranges(const std::string& data, std::set<int>& result);
+bool parse_string_with_multiple_ranges(const std::string& data, std::vector<uint64_t>& result);
+bool parse_string_with_multiple_ranges(const std::string& data, std::set<uint64_t>& result);
 bool search_integer(std::string filePath, uint64_t valueToSearch);
 bool read_integer(std::string filePath, uint64_t& value);
 bool read_integers_with_range_validation(
     const std::string& filename, uint64_t lower_limit, uint64_t upper_limit, std::set<uint64_t>& cpus);
+uint64_t raise_max_open_files(); // returns the new limit of open files, 0 on failure
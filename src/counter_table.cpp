@@ -0,0 +1,146 @@
+/*
+ * counter_table.cpp -- storage of performance counters of similar entities
+ *                      (CPUs, disks, network interfaces...) and computation of their rates
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "counter_table.h"
+#include <algorithm>
+#include <assert.h>
+
+//------------------------------------------------------------------------------
+// CMonitorCounterTable
+//------------------------------------------------------------------------------
+
+unsigned int CMonitorCounterTable::add_counter(const char* name, CounterType type, double scale, unsigned int bits)
+{
+    assert(size() == 0);
+    assert(bits > 0 && bits <= 64);
+
+    column_t column;
+    column.name = name;
+    column.type = type;
+    column.scale = scale;
+    column.bits = bits;
+    m_columns.push_back(column);
+    return m_columns.size() - 1;
+}
+
+size_t CMonitorCounterTable::alloc_row()
+{
+    if (m_free_rows.empty()) {
+        resize(size() + 1);
+        return size() - 1;
+    }
+
+    size_t row = m_free_rows.back();
+    m_free_rows.pop_back();
+    return row;
+}
+
+void CMonitorCounterTable::free_row(size_t row)
+{
+    // the row will have no baseline when reused
+    m_present[row] = 0;
+    m_was_present[row] = 0;
+    m_checkpoint_present[row] = 0;
+    m_free_rows.push_back(row);
+}
+
+void CMonitorCounterTable::resize(size_t num_rows)
+{
+    for (column_t& column : m_columns) {
+        column.current.resize(num_rows, 0);
+        column.previous.resize(num_rows, 0);
+        column.checkpoint.resize(num_rows, 0);
+        column.rates.resize(num_rows, 0);
+    }
+    m_present.resize(num_rows, 0);
+    m_was_present.resize(num_rows, 0);
+    m_checkpoint_present.resize(num_rows, 0);
+}
+
+void CMonitorCounterTable::start_update()
+{
+    // NOTE: swapping does not allocate; the values of rows not updated are left stale
+    for (column_t& column : m_columns)
+        column.current.swap(column.previous);
+    m_present.swap(m_was_present);
+    std::fill(m_present.begin(), m_present.end(), 0);
+}
+
+void CMonitorCounterTable::update(size_t row, const uint64_t* values)
+{
+    if (row >= size())
+        resize(row + 1); // e.g. a CPU beyond the "possible" ones: hotplug or a kernel that lied to us
+    for (unsigned int c = 0; c < m_columns.size(); c++)
+        m_columns[c].current[row] = values[c];
+    m_present[row] = 1;
+}
+
+void CMonitorCounterTable::update(size_t row, unsigned int counter, uint64_t value)
+{
+    if (row >= size())
+        resize(row + 1);
+    m_columns[counter].current[row] = value;
+    m_present[row] = 1;
+}
+
+bool CMonitorCounterTable::went_backward(size_t row) const
+{
+    if (!m_present[row] || !m_was_present[row])
+        return false;
+    for (const column_t& column : m_columns)
+        if (column.type == CT_MONOTONIC && column.bits == 64 && column.current[row] < column.previous[row])
+            return true;
+    return false;
+}
+
+void CMonitorCounterTable::set_checkpoint()
+{
+    // NOTE: the sizes are the same, so that copying does not allocate
+    for (column_t& column : m_columns)
+        column.checkpoint = column.current;
+    m_checkpoint_present = m_present;
+}
+
+void CMonitorCounterTable::compute_rates(double elapsed_sec, bool since_checkpoint)
+{
+    m_rates_since_checkpoint = since_checkpoint;
+
+    // branch-free loops over contiguous arrays; rates of rows not updated are garbage but never used
+    size_t n = size();
+    for (column_t& column : m_columns) {
+        const uint64_t* current = column.current.data();
+        const uint64_t* previous = since_checkpoint ? column.checkpoint.data() : column.previous.data();
+        double* rates = column.rates.data();
+
+        if (column.type == CT_GAUGE) {
+            for (size_t i = 0; i < n; i++)
+                rates[i] = (double)current[i] * column.scale;
+        } else if (column.bits < 64) {
+            double factor = column.scale / elapsed_sec;
+            uint64_t mask = (1ULL << column.bits) - 1;
+            for (size_t i = 0; i < n; i++)
+                rates[i] = (double)((current[i] - previous[i]) & mask) * factor;
+        } else {
+            double factor = column.scale / elapsed_sec;
+            for (size_t i = 0; i < n; i++)
+                rates[i] = (double)(current[i] >= previous[i] ? current[i] - previous[i] : current[i]) * factor;
+        }
+    }
+}
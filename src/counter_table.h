@@ -0,0 +1,128 @@
+/*
+ * counter_table.h -- storage of performance counters of similar entities
+ *                    (CPUs, disks, network interfaces...) and computation of their rates
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Types
+//------------------------------------------------------------------------------
+
+enum CounterType {
+    CT_GAUGE, // an instantaneous value, e.g. the I/Os in flight: its last value is reported
+    CT_MONOTONIC, // a counter that only increases, e.g. the bytes received: its rate is reported
+};
+
+//------------------------------------------------------------------------------
+// CMonitorCounterTable
+//
+// Each counter is a column registered once by add_counter(); each entity is a
+// row, either indexed directly (e.g. by CPU number, see resize()) or allocated
+// when the entity is discovered (see alloc_row()). Current and previous values
+// of each column live in contiguous arrays, so that compute_rates() is a plain
+// loop per column that the compiler can vectorize.
+// Rates are computed in double precision. Monotonic counters narrower than 64
+// bits wrap around at their width; 64-bit counters that go backward have been
+// reset (e.g. a network interface deleted and created again with the same name)
+// and their delta is their current value, i.e. they are assumed to restart from 0.
+// A checkpoint keeps the values of all rows until the next one, so that rates
+// can span many updates, e.g. in flight recorder mode, where the regular
+// samples are much less frequent than the updates.
+//------------------------------------------------------------------------------
+
+class CMonitorCounterTable {
+public:
+    CMonitorCounterTable() {}
+
+    // Registers a new column and returns its index, starting from 0; the reported rates (or values,
+    // for gauges) of the column are multiplied by the given scale (e.g. 0.5 to convert 512B sectors to kB).
+    // All columns must be registered before any row is added.
+    unsigned int add_counter(const char* name, CounterType type, double scale = 1.0, unsigned int bits = 64);
+    unsigned int get_num_counters() const { return m_columns.size(); }
+    const char* get_counter_name(unsigned int counter) const { return m_columns[counter].name.c_str(); }
+    CounterType get_counter_type(unsigned int counter) const { return m_columns[counter].type; }
+
+    // rows allocated one by one: a new row has no baseline; freed rows are reused
+    size_t alloc_row();
+    void free_row(size_t row);
+
+    // rows indexed directly: keeps the values of existing rows
+    void resize(size_t num_rows);
+    size_t size() const { return m_present.size(); }
+
+    // the current values become the previous ones and all rows are marked as not updated
+    void start_update();
+    void update(size_t row, const uint64_t* values /* get_num_counters() values */);
+    void update(size_t row, unsigned int counter, uint64_t value);
+
+    // true if any 64-bit monotonic counter of the row went backward since the update before,
+    // e.g. because the entity has been deleted and created again
+    bool went_backward(size_t row) const;
+
+    // the current values of all rows become the checkpoint
+    void set_checkpoint();
+
+    // computes the rates of all columns for all rows updated in both the last two updates or, if since_checkpoint
+    // is set, in both the last update and the last one before set_checkpoint(): elapsed_sec is the time between them
+    void compute_rates(double elapsed_sec, bool since_checkpoint = false);
+    bool has_rates(size_t row) const
+    {
+        return m_present[row] && (m_rates_since_checkpoint ? m_checkpoint_present[row] : m_was_present[row]);
+    }
+
+    // the change per second of a monotonic counter or the last value of a gauge, times its scale
+    double get_rate(size_t row, unsigned int counter) const { return m_columns[counter].rates[row]; }
+    uint64_t get_value(size_t row, unsigned int counter) const { return m_columns[counter].current[row]; }
+
+    // the delta used by compute_rates(), for counters that are not stored in a table
+    static uint64_t counter_delta(uint64_t current, uint64_t previous, unsigned int bits = 64)
+    {
+        if (bits < 64)
+            return (current - previous) & ((1ULL << bits) - 1);
+        return current >= previous ? current - previous : current;
+    }
+
+private:
+    struct column_t {
+        std::string name;
+        CounterType type;
+        double scale;
+        unsigned int bits;
+        std::vector<uint64_t> current;
+        std::vector<uint64_t> previous;
+        std::vector<uint64_t> checkpoint;
+        std::vector<double> rates;
+    };
+
+    std::vector<column_t> m_columns;
+    std::vector<uint8_t> m_present; // row updated in the last update
+    std::vector<uint8_t> m_was_present; // row updated in the update before
+    std::vector<uint8_t> m_checkpoint_present; // row updated in the last update before the checkpoint
+    bool m_rates_since_checkpoint = false; // how the last rates have been computed
+    std::vector<size_t> m_free_rows;
+};
@@ -0,0 +1,518 @@
+/*
+ * flight_recorder.cpp -- in-memory ring of high-rate samples that is dumped
+ *                        through the output frontends only when a trigger fires
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "flight_recorder.h"
+#include "cmonitor.h"
+#include <errno.h>
+#include <math.h>
+#include <signal.h>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+// values of FRT_MILLI, once multiplied by 1000, must fit into an int64_t:
+#define FLIGHT_RECORDER_MAX_MILLI_VALUE (9.0e15)
+
+// tags of the binary encoding; each sample is a sequence of:
+//   <8 bytes timestamp> { <tag> <varint name ID> <payload> }
+enum FlightRecorderTag {
+    FRT_SECTION = 1, // no payload
+    FRT_SUBSECTION, // no payload
+    FRT_LONG, // payload: zigzag varint
+    FRT_MILLI, // payload: zigzag varint of value*1000 (all pdouble() values have 3 decimals)
+    FRT_HEX, // payload: varint
+    FRT_DOUBLE, // payload: 8 bytes; used only for values that are not finite or too large for FRT_MILLI
+    FRT_STRING // payload: varint length + chars
+};
+
+//------------------------------------------------------------------------------
+// Globals
+//------------------------------------------------------------------------------
+
+CMonitorFlightRecorder g_flight_recorder;
+
+//------------------------------------------------------------------------------
+// Varint helpers
+//------------------------------------------------------------------------------
+
+/* static */
+void CMonitorFlightRecorder::put_varint(std::vector<uint8_t>& out, uint64_t v)
+{
+    while (v >= 0x80) {
+        out.push_back((uint8_t)(v | 0x80));
+        v >>= 7;
+    }
+    out.push_back((uint8_t)v);
+}
+
+/* static */
+void CMonitorFlightRecorder::put_zigzag(std::vector<uint8_t>& out, int64_t v)
+{
+    put_varint(out, ((uint64_t)v << 1) ^ (uint64_t)(v >> 63));
+}
+
+/* static */
+uint64_t CMonitorFlightRecorder::get_varint(const uint8_t*& p)
+{
+    uint64_t v = 0;
+    unsigned int shift = 0;
+    while (*p & 0x80) {
+        v |= (uint64_t)(*p++ & 0x7F) << shift;
+        shift += 7;
+    }
+    v |= (uint64_t)(*p++) << shift;
+    return v;
+}
+
+/* static */
+int64_t CMonitorFlightRecorder::get_zigzag(const uint8_t*& p)
+{
+    uint64_t v = get_varint(p);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+//------------------------------------------------------------------------------
+// Trigger
+//------------------------------------------------------------------------------
+
+bool CMonitorFlightRecorder::Trigger::parse(const std::string& expr)
+{
+    // supported syntax is:
+    //    section.measurement>value
+    //    section.subsection.measurement<value
+    size_t op = expr.find_first_of("<>");
+    if (op == std::string::npos || op == 0)
+        return false;
+
+    m_expr = expr;
+    m_greater_than = expr[op] == '>';
+
+    char* end;
+    std::string value = expr.substr(op + 1);
+    m_threshold = strtod(value.c_str(), &end);
+    if (value.empty() || *end != '\0')
+        return false;
+
+    std::vector<std::string> path = split_string_in_array(expr.substr(0, op), '.');
+    if (path.size() == 2) {
+        m_section = path[0];
+        m_measurement = path[1];
+    } else if (path.size() == 3) {
+        m_section = path[0];
+        m_subsection = path[1];
+        m_measurement = path[2];
+    } else
+        return false;
+
+    return !m_section.empty() && !m_measurement.empty();
+}
+
+bool CMonitorFlightRecorder::Trigger::evaluate(const CMonitorOutputFrontend::CMonitorOutputSample& sample)
+{
+    for (const auto& sec : sample.m_sections) {
+        if (sec.m_name != m_section)
+            continue;
+
+        std::string value;
+        if (m_subsection.empty())
+            value = sec.get_value_for_measurement(m_measurement);
+        else {
+            for (const auto& subsec : sec.m_subsections)
+                if (subsec.m_name == m_subsection)
+                    value = subsec.get_value_for_measurement(m_measurement);
+        }
+        if (value.empty())
+            return false;
+
+        double v = strtod(value.c_str(), NULL);
+        bool condition = m_greater_than ? (v > m_threshold) : (v < m_threshold);
+        if (!condition) {
+            m_armed = true;
+            return false;
+        }
+        if (!m_armed)
+            return false; // still above/below threshold since last time it fired
+
+        m_armed = false;
+        return true;
+    }
+
+    return false; // section not present in this sample
+}
+
+//------------------------------------------------------------------------------
+// Recording
+//------------------------------------------------------------------------------
+
+void CMonitorFlightRecorder::init(uint64_t duration_msec, uint64_t interval_msec)
+{
+    m_interval_msec = interval_msec;
+    m_max_records = duration_msec / interval_msec;
+    if (m_max_records == 0)
+        m_max_records = 1;
+    m_records.resize(m_max_records);
+
+    // the byte ring is allocated later, when the size of a sample is known
+    m_encoded.reserve(FLIGHT_RECORDER_MIN_BYTES_PER_SAMPLE);
+}
+
+uint32_t CMonitorFlightRecorder::intern_name(const char* name)
+{
+    // the names of a sample come almost always in the same order of the previous sample: the ID found at the
+    // same position is checked first, so that no temporary string is built for the lookup into m_name_ids
+    size_t pos = m_name_pos++;
+    if (pos < m_name_cache.size() && strcmp(m_names[m_name_cache[pos]].c_str(), name) == 0)
+        return m_name_cache[pos];
+
+    uint32_t id;
+    auto it = m_name_ids.find(name);
+    if (it != m_name_ids.end())
+        id = it->second;
+    else {
+        id = m_names.size();
+        m_names.push_back(name);
+        m_name_ids[name] = id;
+    }
+
+    if (pos >= m_name_cache.size())
+        m_name_cache.resize(pos + 1);
+    m_name_cache[pos] = id;
+    return id;
+}
+
+void CMonitorFlightRecorder::encode_measurement(
+    const CMonitorOutputFrontend::CMonitorOutputMeasurement& m, std::vector<uint8_t>& out)
+{
+    uint32_t id = intern_name(m.m_name.data());
+    const char* value = m.m_value.data();
+
+    if (m.m_numeric) {
+        // NOTE: integers out of range are not clamped but encoded as doubles, like huge doubles are
+        char* end;
+        errno = 0;
+        if (value[0] == '0' && value[1] == 'x') {
+            uint64_t v = strtoull(value + 2, &end, 16);
+            if (*end == '\0' && errno == 0) {
+                out.push_back(FRT_HEX);
+                put_varint(out, id);
+                put_varint(out, v);
+                return;
+            }
+        } else if (strchr(value, '.') == NULL) {
+            int64_t v = strtoll(value, &end, 10);
+            if (*end == '\0' && errno == 0) {
+                out.push_back(FRT_LONG);
+                put_varint(out, id);
+                put_zigzag(out, v);
+                return;
+            }
+        } else {
+            double v = strtod(value, &end);
+            if (*end == '\0' && fabs(v) < FLIGHT_RECORDER_MAX_MILLI_VALUE) { // false for NaN too
+                out.push_back(FRT_MILLI);
+                put_varint(out, id);
+                put_zigzag(out, llround(v * 1000.0));
+                return;
+            }
+        }
+
+        // fallback for "nan", "inf", huge values and the like:
+        double v = strtod(value, NULL);
+        out.push_back(FRT_DOUBLE);
+        put_varint(out, id);
+        const uint8_t* p = (const uint8_t*)&v;
+        out.insert(out.end(), p, p + sizeof(v));
+        return;
+    }
+
+    size_t len = strlen(value);
+    out.push_back(FRT_STRING);
+    put_varint(out, id);
+    put_varint(out, len);
+    out.insert(out.end(), value, value + len);
+}
+
+void CMonitorFlightRecorder::encode_sample(
+    const CMonitorOutputFrontend::CMonitorOutputSample& sample, std::vector<uint8_t>& out)
+{
+    out.clear();
+    m_name_pos = 0;
+
+    const uint8_t* ts = (const uint8_t*)&sample.m_timestamp_nsec;
+    out.insert(out.end(), ts, ts + sizeof(sample.m_timestamp_nsec));
+
+    for (const auto& sec : sample.m_sections) {
+        out.push_back(FRT_SECTION);
+        put_varint(out, intern_name(sec.m_name.c_str()));
+        for (const auto& m : sec.m_measurements)
+            encode_measurement(m, out);
+
+        for (const auto& subsec : sec.m_subsections) {
+            out.push_back(FRT_SUBSECTION);
+            put_varint(out, intern_name(subsec.m_name.c_str()));
+            for (const auto& m : subsec.m_measurements)
+                encode_measurement(m, out);
+        }
+    }
+}
+
+void CMonitorFlightRecorder::evict_oldest()
+{
+    m_first_record = (m_first_record + 1) % m_max_records;
+    m_num_records--;
+    m_num_evicted++;
+}
+
+void CMonitorFlightRecorder::store_record(const std::vector<uint8_t>& rec)
+{
+    if (m_buffer.empty()) {
+        // first sample: size the ring so that it can contain all samples even if they grow a bit
+        size_t bytes_per_sample = std::max(rec.size() * 2, (size_t)FLIGHT_RECORDER_MIN_BYTES_PER_SAMPLE);
+        m_buffer.resize(bytes_per_sample * m_max_records);
+        g_logger.LogDebug("Flight recorder: allocated %zu bytes for %zu samples", m_buffer.size(), m_max_records);
+    }
+    if (rec.size() > m_buffer.size()) {
+        g_logger.LogError("Flight recorder: sample of %zu bytes is too large for the ring", rec.size());
+        return;
+    }
+
+    // records are stored contiguously, one after the other; when the end of the buffer is reached
+    // the next record restarts from offset 0:
+    size_t offset = 0;
+    if (m_num_records > 0) {
+        const record_t& newest = m_records[(m_first_record + m_num_records - 1) % m_max_records];
+        offset = newest.offset + newest.len;
+    }
+    if (offset + rec.size() > m_buffer.size()) {
+        // the records placed after the newest one are the oldest ones: they must go
+        while (m_num_records > 0 && m_records[m_first_record].offset >= offset)
+            evict_oldest();
+        offset = 0;
+    }
+
+    // now evict all old records overlapping with the space needed by the new one:
+    while (m_num_records > 0) {
+        const record_t& oldest = m_records[m_first_record];
+        bool overlapping = oldest.offset < offset + rec.size() && offset < oldest.offset + oldest.len;
+        if (!overlapping && m_num_records < m_max_records)
+            break;
+        evict_oldest();
+    }
+
+    memcpy(&m_buffer[offset], rec.data(), rec.size());
+    m_records[(m_first_record + m_num_records) % m_max_records] = { offset, rec.size() };
+    m_num_records++;
+}
+
+void CMonitorFlightRecorder::record(const CMonitorOutputFrontend::CMonitorOutputSample& sample)
+{
+    encode_sample(sample, m_encoded);
+    store_record(m_encoded);
+}
+
+bool CMonitorFlightRecorder::check_triggers(
+    const CMonitorOutputFrontend::CMonitorOutputSample& sample, std::string& reason)
+{
+    bool fired = false;
+    for (auto& t : m_triggers) {
+        // NOTE: evaluate all triggers to keep their armed/disarmed state up to date
+        if (t.evaluate(sample) && !fired) {
+            reason = t.m_expr;
+            fired = true;
+        }
+    }
+    return fired;
+}
+
+//------------------------------------------------------------------------------
+// Dumping
+//------------------------------------------------------------------------------
+
+/* static */
+void CMonitorFlightRecorder::decode_record(
+    const uint8_t* p, size_t len, const std::vector<std::string>& names, CMonitorOutputFrontend& out)
+{
+    const uint8_t* end = p + len;
+
+    uint64_t ts;
+    memcpy(&ts, p, sizeof(ts));
+    p += sizeof(ts);
+
+    while (p < end) {
+        uint8_t tag = *p++;
+        const char* name = names[get_varint(p)].c_str();
+
+        switch (tag) {
+        case FRT_SECTION:
+            out.psection_start(name);
+            break;
+        case FRT_SUBSECTION:
+            out.psubsection_start(name);
+            break;
+        case FRT_LONG:
+            out.plong(name, get_zigzag(p));
+            break;
+        case FRT_MILLI:
+            out.pdouble(name, (double)get_zigzag(p) / 1000.0);
+            break;
+        case FRT_HEX:
+            out.phex(name, get_varint(p));
+            break;
+        case FRT_DOUBLE: {
+            double v;
+            memcpy(&v, p, sizeof(v));
+            p += sizeof(v);
+            out.pdouble(name, v);
+        } break;
+        case FRT_STRING: {
+            size_t slen = get_varint(p);
+            std::string value((const char*)p, slen);
+            p += slen;
+            out.pstring(name, value.c_str());
+        } break;
+        }
+    }
+
+    out.set_current_sample_timestamp(ts);
+}
+
+void CMonitorFlightRecorder::dump(const std::string& reason, const CMonitorOutputFrontend& main_output)
+{
+    if (m_dump_in_progress) {
+        g_logger.LogError("Flight recorder: dump triggered by '%s' ignored: previous dump still in progress",
+            reason.c_str());
+        return;
+    }
+    if (m_num_records == 0)
+        return;
+
+    wait_dump_completion(); // join the thread of the previous, completed dump
+
+    // take a snapshot of the ring, so that recording can continue while the dump is written;
+    // this is the only time the flight recorder allocates memory after startup
+    dump_job_t* job = new dump_job_t;
+    job->reason = reason;
+    job->index = m_num_dumps++;
+    job->names = m_names;
+    job->header = main_output.get_header_sample();
+    for (size_t i = 0; i < m_num_records; i++) {
+        const record_t& r = m_records[(m_first_record + i) % m_max_records];
+        job->data.insert(job->data.end(), m_buffer.begin() + r.offset, m_buffer.begin() + r.offset + r.len);
+        job->record_lengths.push_back(r.len);
+    }
+
+    g_logger.LogDebug("Flight recorder: dumping %zu samples because of '%s'", m_num_records, reason.c_str());
+
+    m_dump_in_progress = true;
+    m_dump_thread = std::thread(&CMonitorFlightRecorder::dump_thread_main, this, job);
+}
+
+void CMonitorFlightRecorder::decode_newest_record(CMonitorOutputFrontend& out) const
+{
+    if (m_num_records == 0)
+        return;
+    const record_t& newest = m_records[(m_first_record + m_num_records - 1) % m_max_records];
+    decode_record(&m_buffer[newest.offset], newest.len, m_names, out);
+}
+
+void CMonitorFlightRecorder::wait_dump_completion()
+{
+    if (m_dump_thread.joinable())
+        m_dump_thread.join();
+}
+
+void CMonitorFlightRecorder::dump_thread_main(dump_job_t* job)
+{
+    // signals must be handled by the sampling thread:
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, NULL);
+
+    if (write_dump(job))
+        g_logger.LogDebug("Flight recorder: dump #%u completed", job->index);
+    delete job;
+    m_dump_in_progress = false;
+}
+
+bool CMonitorFlightRecorder::write_dump(dump_job_t* job)
+{
+    CMonitorOutputFrontend out;
+    out.set_flight_recorder_dump();
+
+    // same sinks of the main output, but JSON goes into a separate file for each dump: samples are never
+    // interleaved with the regular ones on stdout
+    const std::string& prefix = g_cfg.m_strOutputFilenamePrefix;
+    bool has_json = prefix != "stdout" && prefix != "none";
+    bool has_influxdb = !g_cfg.m_strRemoteAddress.empty() && g_cfg.m_nRemotePort != 0;
+    if (!has_json && !has_influxdb) {
+        g_logger.LogError("Flight recorder: dump #%u dropped: it is written only to a JSON file or to InfluxDB, "
+                          "and neither is configured",
+            job->index);
+        return false;
+    }
+    std::string filename = prefix + "_flightrec" + std::to_string(job->index);
+    if (has_json && !out.open_json_output_file(filename)) {
+        g_logger.LogError("Flight recorder: dump #%u dropped: cannot open the output JSON file %s: %s", job->index,
+            filename.c_str(), strerror(errno));
+        return false;
+    }
+    if (has_influxdb && !out.open_influxdb_connection(g_cfg.m_strRemoteAddress, g_cfg.m_nRemotePort)) {
+        g_logger.LogError("Flight recorder: dump #%u dropped: cannot resolve the InfluxDB server %s", job->index,
+            g_cfg.m_strRemoteAddress.c_str());
+        return false;
+    }
+    if (g_output.is_json_pretty_print())
+        out.enable_json_pretty_print();
+
+    // the header is the one of the main output, with the sampling interval of the flight recorder:
+    for (auto& sec : job->header.m_sections) {
+        if (sec.m_name != "cmonitor")
+            continue;
+        for (auto& m : sec.m_measurements) {
+            char value[64];
+            if (strcmp(m.m_name.data(), "sample_interval_seconds") == 0) {
+                snprintf(value, sizeof(value), "%.3f", (double)m_interval_msec / 1000.0);
+                m = CMonitorOutputFrontend::CMonitorOutputMeasurement("sample_interval_seconds", value, true);
+            } else if (strcmp(m.m_name.data(), "sample_interval_msec") == 0) {
+                snprintf(value, sizeof(value), "%lu", m_interval_msec);
+                m = CMonitorOutputFrontend::CMonitorOutputMeasurement("sample_interval_msec", value, true);
+            }
+        }
+    }
+    out.pheader_start();
+    out.merge_sample(job->header);
+    out.psection_start("flight_recorder");
+    out.pstring("trigger", job->reason.c_str());
+    out.plong("dump_index", job->index);
+    out.plong("num_samples", job->record_lengths.size());
+    out.psection_end();
+    out.push_header();
+
+    out.psample_array_start();
+    size_t offset = 0;
+    for (size_t len : job->record_lengths) {
+        decode_record(&job->data[offset], len, job->names, out);
+        out.push_current_sample();
+        offset += len;
+    }
+    out.psample_array_end();
+    return true;
+}
@@ -0,0 +1,158 @@
+/*
+ * flight_recorder.h -- in-memory ring of high-rate samples that is dumped
+ *                      through the output frontends only when a trigger fires
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include "output_frontend.h"
+#include <atomic>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+#define FLIGHT_RECORDER_MIN_BYTES_PER_SAMPLE (4096)
+
+//------------------------------------------------------------------------------
+// CMonitorFlightRecorder
+//
+// Keeps the last N samples in a fixed-size byte ring, allocated once, using a
+// compact binary encoding: names of sections and measurements are interned
+// into small integer IDs and numeric values are stored as varints.
+// Each time a trigger fires (SIGUSR2, a threshold on a measurement, a cgroup
+// OOM kill) the content of the ring is written, on a background thread, into
+// a new JSON file (and to InfluxDB, if configured) using a private instance of
+// CMonitorOutputFrontend.
+//------------------------------------------------------------------------------
+
+class CMonitorFlightRecorder {
+public:
+    // a condition on a measurement, e.g. "proc_loadavg.load_avg_1min>4"
+    class Trigger {
+    public:
+        bool parse(const std::string& expr);
+        bool evaluate(const CMonitorOutputFrontend::CMonitorOutputSample& sample); // true if just fired
+
+        std::string m_expr;
+        std::string m_section;
+        std::string m_subsection; // optional
+        std::string m_measurement;
+        bool m_greater_than = true;
+        double m_threshold = 0;
+        bool m_armed = true; // triggers are edge-sensitive: re-armed when the condition becomes false again
+    };
+
+public:
+    CMonitorFlightRecorder() {}
+    ~CMonitorFlightRecorder() { wait_dump_completion(); }
+
+    void init(uint64_t duration_msec, uint64_t interval_msec);
+    bool is_enabled() const { return m_max_records > 0; }
+    uint64_t get_interval_msec() const { return m_interval_msec; }
+
+    void add_trigger(const Trigger& t) { m_triggers.push_back(t); }
+
+    // stores a copy of the given sample, evicting the oldest ones if needed
+    void record(const CMonitorOutputFrontend::CMonitorOutputSample& sample);
+
+    // returns true if any threshold trigger fires on the given sample, and a description of it
+    bool check_triggers(const CMonitorOutputFrontend::CMonitorOutputSample& sample, std::string& reason);
+
+    // starts writing all samples currently in the ring; the header is copied from given frontend
+    void dump(const std::string& reason, const CMonitorOutputFrontend& main_output);
+    void wait_dump_completion();
+
+    // decodes the newest sample of the ring into the current sample of the given frontend, the same way
+    // a dump does; used by the self-checks of cmonitor_bench
+    void decode_newest_record(CMonitorOutputFrontend& out) const;
+
+    // varints are LEB128-encoded; signed values are zigzag-encoded first, so that small negative
+    // values take few bytes too
+    static void put_varint(std::vector<uint8_t>& out, uint64_t v);
+    static void put_zigzag(std::vector<uint8_t>& out, int64_t v);
+    static uint64_t get_varint(const uint8_t*& p);
+    static int64_t get_zigzag(const uint8_t*& p);
+
+private:
+    struct record_t {
+        size_t offset;
+        size_t len;
+    };
+
+    // the data needed by the background dump
+    struct dump_job_t {
+        std::string reason;
+        unsigned int index = 0;
+        std::vector<uint8_t> data; // all records, in order from oldest to newest
+        std::vector<size_t> record_lengths;
+        std::vector<std::string> names;
+        CMonitorOutputFrontend::CMonitorOutputSample header;
+    };
+
+    // encoding
+    uint32_t intern_name(const char* name);
+    void encode_sample(const CMonitorOutputFrontend::CMonitorOutputSample& sample, std::vector<uint8_t>& out);
+    void encode_measurement(const CMonitorOutputFrontend::CMonitorOutputMeasurement& m, std::vector<uint8_t>& out);
+    void store_record(const std::vector<uint8_t>& rec);
+    void evict_oldest();
+
+    // decoding
+    static void decode_record(const uint8_t* p, size_t len, const std::vector<std::string>& names,
+        CMonitorOutputFrontend& out);
+    void dump_thread_main(dump_job_t* job);
+    bool write_dump(dump_job_t* job); // returns false if the dump has been dropped
+
+private:
+    uint64_t m_interval_msec = 0;
+
+    // the ring; m_records is a circular array of (offset, len) into m_buffer
+    std::vector<uint8_t> m_buffer;
+    std::vector<record_t> m_records;
+    size_t m_max_records = 0;
+    size_t m_first_record = 0;
+    size_t m_num_records = 0;
+    uint64_t m_num_evicted = 0;
+
+    // scratch buffer for the encoding of the current sample
+    std::vector<uint8_t> m_encoded;
+
+    // name interning
+    std::map<std::string, uint32_t> m_name_ids;
+    std::vector<std::string> m_names;
+    std::vector<uint32_t> m_name_cache; // IDs in the order they were needed by the last encoded sample
+    size_t m_name_pos = 0; // position in m_name_cache of the next name to encode
+
+    std::vector<Trigger> m_triggers;
+
+    // background dump
+    std::thread m_dump_thread;
+    std::atomic<bool> m_dump_in_progress { false };
+    unsigned int m_num_dumps = 0;
+};
+
+// app-wide flight recorder:
+extern CMonitorFlightRecorder g_flight_recorder;
@@ -20,6 +20,7 @@
 
 #include "cmonitor.h"
 #include "output_frontend.h"
+#include <algorithm>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
 #include <netdb.h>
@@ -27,18 +28,14 @@
 #include <stdarg.h> /* va_list, va_start, va_arg, va_end */
 #include <sys/types.h>
 
-void CMonitorCollectorApp::file_read_one_stat(const char* file, const char* name)
+void CMonitorCollectorApp::file_read_one_stat(const std::string& file, const char* name)
 {
-    FILE* fp;
-    char buf[1024 + 1];
-
-    if ((fp = fopen(file, "r")) != NULL) {
-        if (fgets(buf, 1024, fp) != NULL) {
-            if (buf[strlen(buf) - 1] == '\n') /* remove last char = newline */
-                buf[strlen(buf) - 1] = 0;
-            g_output.pstring(name, buf);
-        }
-        fclose(fp);
+    CMonitorProcFile f;
+    const char* p = f.open(file) ? f.read() : NULL;
+    if (p != NULL && *p != 0) {
+        /* keep only the first line */
+        std::string line(p, std::min(strcspn(p, "\n"), (size_t)1024));
+        g_output.pstring(name, line.c_str());
     }
 }
 
@@ -123,25 +120,27 @@ void CMonitorCollectorApp::header_identity()
     }
 
     /* POWER and AMD and may be others */
-    if (access("/proc/device-tree", R_OK) == 0) {
-        file_read_one_stat("/proc/device-tree/compatible", "compatible");
-        file_read_one_stat("/proc/device-tree/model", "model");
-        file_read_one_stat("/proc/device-tree/part-number", "part-number");
-        file_read_one_stat("/proc/device-tree/serial-number", "serial-number");
-        file_read_one_stat("/proc/device-tree/system-id", "system-id");
-        file_read_one_stat("/proc/device-tree/vendor", "vendor");
+    std::string device_tree = g_cfg.m_strProcRoot + "/device-tree";
+    if (access(device_tree.c_str(), R_OK) == 0) {
+        file_read_one_stat(device_tree + "/compatible", "compatible");
+        file_read_one_stat(device_tree + "/model", "model");
+        file_read_one_stat(device_tree + "/part-number", "part-number");
+        file_read_one_stat(device_tree + "/serial-number", "serial-number");
+        file_read_one_stat(device_tree + "/system-id", "system-id");
+        file_read_one_stat(device_tree + "/vendor", "vendor");
     }
     /*x86_64 and AMD64 */
-    if (access("/sys/devices/virtual/dmi/id/", R_OK) == 0) {
-        file_read_one_stat("/sys/devices/virtual/dmi/id/product_serial", "serial-number");
-        file_read_one_stat("/sys/devices/virtual/dmi/id/product_name", "model");
-        file_read_one_stat("/sys/devices/virtual/dmi/id/sys_vendor", "vendor");
+    std::string dmi_id = g_cfg.m_strSysRoot + "/devices/virtual/dmi/id";
+    if (access(dmi_id.c_str(), R_OK) == 0) {
+        file_read_one_stat(dmi_id + "/product_serial", "serial-number");
+        file_read_one_stat(dmi_id + "/product_name", "model");
+        file_read_one_stat(dmi_id + "/sys_vendor", "vendor");
     }
     g_output.psection_end();
 }
 
-void CMonitorCollectorApp::header_cmonitor_info(
-    int argc, char** argv, long sampling_interval_sec, long num_samples, unsigned int collect_flags)
+void CMonitorCollectorApp::header_cmonitor_info(int argc, char** argv, uint64_t sampling_interval_msec,
+    long num_samples, unsigned int collect_flags, const std::map<unsigned int, uint64_t>& collect_intervals_msec)
 {
     /* user name and id */
     struct passwd* pw;
@@ -157,7 +156,8 @@ void CMonitorCollectorApp::header_cmonitor_info(
     }
 
     g_output.pstring("command", command);
-    g_output.plong("sample_interval_seconds", sampling_interval_sec);
+    g_output.pdouble("sample_interval_seconds", (double)sampling_interval_msec / 1000.0);
+    g_output.plong("sample_interval_msec", sampling_interval_msec);
     g_output.plong("sample_num", num_samples);
     g_output.pstring("version", VERSION_STRING);
 
@@ -174,6 +174,18 @@ void CMonitorCollectorApp::header_cmonitor_info(
         str.pop_back();
     g_output.pstring("collecting", str.c_str());
 
+    // families having their own sampling interval:
+    str.clear();
+    for (const auto& it : collect_intervals_msec) {
+        if (collect_flags & it.first)
+            str += performanceKpiFamily2string((PerformanceKpiFamily)it.first) + "@" + std::to_string(it.second)
+                + "ms,";
+    }
+    if (!str.empty()) {
+        str.pop_back();
+        g_output.pstring("collecting_intervals", str.c_str());
+    }
+
     uid = geteuid();
     if ((pw = getpwuid(uid)) != NULL) {
         g_output.pstring("username", pw->pw_name);
@@ -224,7 +236,8 @@ void CMonitorCollectorApp::header_etc_os_release()
 
 void CMonitorCollectorApp::header_cpuinfo()
 {
-    static FILE* fp = 0;
+    CMonitorProcFile file;
+    FILE* fp = 0;
     char buf[1024 + 1];
     char string[1024 + 1];
     double value;
@@ -235,12 +248,10 @@ void CMonitorCollectorApp::header_cpuinfo()
     int ispower = 0;
 
     DEBUGLOG_FUNCTION_START();
-    if (fp == 0) {
-        if ((fp = fopen("/proc/cpuinfo", "r")) == NULL) {
-            return;
-        }
-    } else
-        rewind(fp);
+    // the file is read in one go (so that --record can see it) and then parsed line by line:
+    if (file.read(g_cfg.m_strProcRoot, "/cpuinfo") == NULL || file.get_size() == 0
+        || (fp = fmemopen((void*)file.get_data(), file.get_size(), "r")) == NULL)
+        return;
 
     g_output.psection_start("cpuinfo");
     processor = -1;
@@ -329,6 +340,7 @@ void CMonitorCollectorApp::header_cpuinfo()
         }
         g_output.psection_end();
     }
+    fclose(fp);
 }
 
 void CMonitorCollectorApp::header_meminfo()
@@ -337,23 +349,38 @@ void CMonitorCollectorApp::header_meminfo()
     static_memory_stats.insert("MemTotal");
     static_memory_stats.insert("HugePages_Total");
     static_memory_stats.insert("Hugepagesize");
-    proc_read_numeric_stats_from("meminfo", static_memory_stats);
+    CMonitorKeyValueParser parser; // the selection differs from the one of the samples
+    proc_read_numeric_stats_from(m_proc_meminfo_file, parser, "meminfo", static_memory_stats);
+}
+
+void CMonitorCollectorApp::header_process_usernames()
+{
+    // with --numeric-uids, the processes report only their UID: provide the names of the users
+    // owning the processes found at startup once, here, instead of in each sample
+    std::set<uid_t> uids;
+    for (size_t row = 0; row < m_processes.size(); row++)
+        if (m_processes.is_updated(row))
+            uids.insert(m_processes.get_identity(row).uid);
+
+    DEBUGLOG_FUNCTION_START();
+    g_output.psection_start("process_usernames");
+    for (uid_t uid : uids) {
+        const std::string& username = m_usernames.get(uid);
+        if (!username.empty())
+            g_output.pstring(std::to_string(uid).c_str(), username.c_str());
+    }
+    g_output.psection_end();
 }
 
 void CMonitorCollectorApp::header_version()
 {
-    static FILE* fp = 0;
+    CMonitorProcFile file;
     char buf[1024 + 1];
 
     DEBUGLOG_FUNCTION_START();
-    if (fp == 0) {
-        if ((fp = fopen("/proc/version", "r")) == NULL) {
-            return;
-        }
-    } else
-        rewind(fp);
-    if (fgets(buf, 1024, fp) != NULL) {
-        buf[strlen(buf) - 1] = 0; /* remove newline */
+    const char* p = file.read(g_cfg.m_strProcRoot, "/version");
+    if (p != NULL && *p != 0) {
+        snprintf(buf, sizeof(buf), "%.*s", (int)strcspn(p, "\n"), p); /* remove newline */
         for (size_t i = 0; i < strlen(buf); i++) {
             if (buf[i] == '"')
                 buf[i] = '|';
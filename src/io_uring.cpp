@@ -0,0 +1,186 @@
+/*
+ * io_uring.cpp -- batched reads of many small files through io_uring
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+// ----------------------------------------------------------------------------------
+// Constants
+// ----------------------------------------------------------------------------------
+
+// reads submitted with each syscall: the completion ring is twice as large, so it never overflows
+#define IO_URING_ENTRIES (256)
+
+// a /proc/<pid>/stat line is usually about 300 bytes long; longer files are read again by the caller
+#define IO_URING_SLOT_SIZE (512)
+
+// ----------------------------------------------------------------------------------
+// Syscalls, not wrapped by glibc
+// ----------------------------------------------------------------------------------
+
+static int io_uring_setup(unsigned int entries, struct io_uring_params* params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int io_uring_enter(int ring_fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int io_uring_register(int ring_fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, ring_fd, opcode, arg, nr_args);
+}
+
+// ----------------------------------------------------------------------------------
+// CMonitorIoUring
+// ----------------------------------------------------------------------------------
+
+bool CMonitorIoUring::open()
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    m_ring_fd = io_uring_setup(IO_URING_ENTRIES, &params);
+    if (m_ring_fd == -1) {
+        g_logger.LogError("Cannot set up an io_uring instance: %s", strerror(errno));
+        return false;
+    }
+
+    // IORING_OP_READ comes with Linux 5.6, together with the probe itself; the single mapping of both
+    // rings with Linux 5.4
+    std::vector<char> probe_buf(sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op));
+    struct io_uring_probe* probe = (struct io_uring_probe*)probe_buf.data();
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)
+        || io_uring_register(m_ring_fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) != 0
+        || probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED)) {
+        g_logger.LogError("The io_uring instance does not support the read operation: Linux 5.6 or later is needed");
+        close();
+        return false;
+    }
+
+    m_sq_entries = params.sq_entries;
+    m_cq_entries = params.cq_entries;
+    m_rings_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned int),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    m_sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    int prot = PROT_READ | PROT_WRITE, flags = MAP_SHARED | MAP_POPULATE;
+    m_rings = mmap(NULL, m_rings_size, prot, flags, m_ring_fd, IORING_OFF_SQ_RING);
+    m_sqes = mmap(NULL, m_sqes_size, prot, flags, m_ring_fd, IORING_OFF_SQES);
+    if (m_rings == MAP_FAILED || m_sqes == MAP_FAILED) {
+        g_logger.LogError("Cannot map the io_uring rings: %s", strerror(errno));
+        close();
+        return false;
+    }
+
+    char* rings = (char*)m_rings;
+    m_sq_head = (unsigned int*)(rings + params.sq_off.head);
+    m_sq_tail = (unsigned int*)(rings + params.sq_off.tail);
+    m_sq_array = (unsigned int*)(rings + params.sq_off.array);
+    m_cq_head = (unsigned int*)(rings + params.cq_off.head);
+    m_cq_tail = (unsigned int*)(rings + params.cq_off.tail);
+    m_cqes = rings + params.cq_off.cqes;
+
+    // the submission ring is always filled in order: its array maps each slot to the entry with the same index
+    for (unsigned int i = 0; i < m_sq_entries; i++)
+        m_sq_array[i] = i;
+
+    g_logger.LogDebug("Set up an io_uring instance with %u entries, features 0x%x", m_sq_entries, params.features);
+    return true;
+}
+
+void CMonitorIoUring::close()
+{
+    // NOTE: closing the ring cancels the reads still in flight, which happens only after a failure: since no
+    //       read is queued anymore, their slots in m_buffer are never reused
+    if (m_rings != nullptr && m_rings != MAP_FAILED)
+        munmap(m_rings, m_rings_size);
+    if (m_sqes != nullptr && m_sqes != MAP_FAILED)
+        munmap(m_sqes, m_sqes_size);
+    m_rings = m_sqes = nullptr;
+    if (m_ring_fd != -1) {
+        ::close(m_ring_fd);
+        m_ring_fd = -1;
+    }
+}
+
+void CMonitorIoUring::add_read(int fd, size_t tag)
+{
+    read_t r = { fd, -EAGAIN, tag };
+    m_reads.push_back(r);
+}
+
+bool CMonitorIoUring::submit_all()
+{
+    if (!is_open())
+        return false;
+    if (m_buffer.size() < m_reads.size() * IO_URING_SLOT_SIZE)
+        m_buffer.resize(m_reads.size() * IO_URING_SLOT_SIZE);
+
+    struct io_uring_sqe* sqes = (struct io_uring_sqe*)m_sqes;
+    struct io_uring_cqe* cqes = (struct io_uring_cqe*)m_cqes;
+    unsigned int sq_mask = m_sq_entries - 1, cq_mask = m_cq_entries - 1;
+    size_t num_queued = 0, num_completed = 0;
+    while (num_completed < m_reads.size()) {
+        // fill the submission ring with the next reads; the kernel consumes all of them at each syscall below
+        unsigned int tail = *m_sq_tail;
+        for (; num_queued < m_reads.size() && num_queued - num_completed < m_sq_entries; num_queued++, tail++) {
+            struct io_uring_sqe* sqe = &sqes[tail & sq_mask];
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->opcode = IORING_OP_READ;
+            sqe->fd = m_reads[num_queued].fd;
+            sqe->addr = (uint64_t)(uintptr_t)&m_buffer[num_queued * IO_URING_SLOT_SIZE];
+            sqe->len = IO_URING_SLOT_SIZE - 1; // room for the NUL terminator
+            sqe->off = 0;
+            sqe->user_data = num_queued;
+        }
+        __atomic_store_n(m_sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned int to_submit = tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+        unsigned int in_flight = num_queued - num_completed;
+        if (io_uring_enter(m_ring_fd, to_submit, in_flight, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+            g_logger.LogError("Cannot submit %u reads to the io_uring instance: %s", to_submit, strerror(errno));
+            close();
+            return false;
+        }
+
+        unsigned int head = *m_cq_head;
+        unsigned int cq_tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != cq_tail; head++, num_completed++) {
+            const struct io_uring_cqe* cqe = &cqes[head & cq_mask];
+            m_reads[cqe->user_data].result = cqe->res;
+            if (cqe->res >= 0 && cqe->res < IO_URING_SLOT_SIZE)
+                m_buffer[cqe->user_data * IO_URING_SLOT_SIZE + cqe->res] = 0;
+        }
+        __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+    }
+    return true;
+}
+
+const char* CMonitorIoUring::get_data(size_t i) const
+{
+    // a slot filled up to its end may hold only the beginning of the file
+    int result = m_reads[i].result;
+    if (result <= 0 || result >= IO_URING_SLOT_SIZE - 1)
+        return nullptr;
+    return &m_buffer[i * IO_URING_SLOT_SIZE];
+}
@@ -18,11 +18,16 @@
  */
 
 #include "cmonitor.h"
+#include "flight_recorder.h"
 #include "output_frontend.h"
+#include "snapshot.h"
+#include <algorithm>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <iostream>
+#include <limits.h>
 #include <signal.h>
 #include <sstream>
 #include <stdarg.h> /* va_list, va_start, va_arg, va_end */
@@ -47,6 +52,7 @@ CMonitorLoggerUtils g_logger;
 CMonitorCollectorAppConfig g_cfg;
 CMonitorCollectorApp g_app;
 bool g_bExiting = false;
+std::atomic<bool> g_bFlightRecorderDumpRequested { false };
 
 //------------------------------------------------------------------------------
 // Command Line Globals
@@ -61,17 +67,39 @@ struct option g_long_opts[] = {
     { "collect", required_argument, 0, 'C' }, // force newline
     { "deep-collect", no_argument, 0, 'e' }, // force newline
     { "cgroup-name", required_argument, 0, 'g' }, // force newline
+    { "collector-threads", required_argument, 0, 'T' }, // force newline
+    { "self-stats", no_argument, 0, 'S' }, // force newline
+    { "flight-recorder", required_argument, 0, 'R' }, // force newline
+    { "flight-recorder-trigger", required_argument, 0, 't' }, // force newline
+    { "net-include", required_argument, 0, 'I' }, // force newline
+    { "net-exclude", required_argument, 0, 'E' }, // force newline
+    { "net-rollup", required_argument, 0, 'U' }, // force newline
+    { "proc-events", no_argument, 0, 'N' }, // force newline
+    { "process-backend", required_argument, 0, 'B' }, // force newline
+    { "top-processes", required_argument, 0, 'n' }, // force newline
+    { "process-score", required_argument, 0, 'o' }, // force newline
+    { "numeric-uids", no_argument, 0, 'u' }, // force newline
+    { "threads", no_argument, 0, 'H' }, // force newline
+    { "process-scan-threads", required_argument, 0, 'j' }, // force newline
 
     // Options to save data locally
     { "output-directory", required_argument, 0, 'm' }, // force newline
     { "output-filename", required_argument, 0, 'f' }, // force newline
     { "output-pretty", no_argument, 0, 'P' }, // force newline
+    { "output-queue-size", required_argument, 0, 'Q' }, // force newline
+    { "output-queue-policy", required_argument, 0, 'O' }, // force newline
 
     // Options to stream data remotely
     { "remote-ip", required_argument, 0, 'i' }, // force newline
     { "remote-port", required_argument, 0, 'p' }, // force newline
     { "remote-secret", required_argument, 0, 'X' }, // force newline
 
+    // Options to record and replay data
+    { "proc-root", required_argument, 0, 'z' }, // force newline
+    { "sys-root", required_argument, 0, 'Z' }, // force newline
+    { "record", required_argument, 0, 'r' }, // force newline
+    { "replay", required_argument, 0, 'y' }, // force newline
+
     // Other options
     { "version", no_argument, 0, 'v' }, // force newline
     { "debug", no_argument, 0, 'd' }, // force newline
@@ -85,7 +113,9 @@ struct option_extended {
     const char* additional_help;
 } const g_opts_extended[] = {
     // Data sampling options
-    { "Data sampling options", &g_long_opts[0], "Seconds between samples of data (default 60 seconds)." },
+    { "Data sampling options", &g_long_opts[0],
+        "Time between samples of data (default 60 seconds). A plain number is interpreted as seconds;\n"
+        "use the 'ms' suffix to specify milliseconds (e.g. 100ms). Minimum value is 10ms." },
     { "Data sampling options", &g_long_opts[1],
         "Number of samples to collect; special values are:\n" // force newline
         "   '0': means forever (default value)\n" // force newline
@@ -101,12 +131,16 @@ struct option_extended {
         "  'network': collect network stats from /proc/net/dev\n" // force newline
         "  'cgroup_cpu': collect CPU stats from the 'cpuacct' cgroup\n" // force newline
         "  'cgroup_memory': collect memory stats from 'memory' cgroup\n" // force newline
-        /*"  'cgroup_blkio': collect IO stats from 'blkio' cgroup\n" NOT YET AVAILABLE */
+        "  'cgroup_blkio': collect IO stats from the 'io' controller (with cgroups v2 only)\n" // force newline
         "  'cgroup_processes': collect stats for each process inside the 'cpuacct' cgroup\n" // force newline
         "  'all_baremetal': the combination of 'cpu', 'memory', 'disk', 'network'\n"
-        "  'all_cgroup': the combination of 'cgroup_cpu', 'cgroup_memory', 'cgroup_processes'\n"
+        "  'all_cgroup': the combination of 'cgroup_cpu', 'cgroup_memory', 'cgroup_blkio', 'cgroup_processes'\n"
         "  'all': the combination of all previous stats (this is the default)\n"
-        "Note that a comma-separated list of above stats can be provided." },
+        "Note that a comma-separated list of above stats can be provided.\n"
+        "Each stats family may be followed by '@' and its own sampling interval, e.g. 'cpu@200ms,disk@1s';\n"
+        "families without an explicit interval are sampled every --sampling-interval. Each sample will then\n"
+        "contain only the families that are due at that time. All the intervals must be multiples of a common\n"
+        "interval of at least 10ms." },
     { "Data sampling options", &g_long_opts[5],
         "Collect all available details about the stats families enabled by --collect.\n"
         "By default, for each family, only the stats that are used by the 'cmonitor_chart' companion utility\n"
@@ -117,32 +151,137 @@ struct option_extended {
         "cmonitor_collector runs will be collected. Note that this option is mostly useful when running \n"
         "cmonitor_collector directly on the baremetal since a process running inside a container cannot monitor\n"
         "the performances of other containers.\n" },
+    { "Data sampling options", &g_long_opts[7],
+        "Number of worker threads used to collect the enabled stats families in parallel (default 0).\n"
+        "With 0 all stats are collected sequentially by the main thread. Values larger than the number of\n"
+        "enabled stats families bring no benefit." },
+    { "Data sampling options", &g_long_opts[8],
+        "Add to each sample a 'cmonitor_self' section reporting the wall-clock time, CPU time and memory\n"
+        "allocations spent by cmonitor_collector itself in each stats collector and output sink, plus the\n"
+        "bytes emitted. Latency histograms for the whole run are written in the JSON footer." },
+    { "Data sampling options", &g_long_opts[9],
+        "Enable the flight recorder, using the syntax <duration>@<interval>, e.g. '30s@100ms'.\n"
+        "All enabled stats are then collected every <interval> and the samples of the last <duration> are kept\n"
+        "in memory, while the regular output keeps receiving one sample every --sampling-interval.\n"
+        "The samples in memory are written to a new <output-filename>_flightrecN.json file (and to InfluxDB)\n"
+        "when the SIGUSR2 signal is received or any --flight-recorder-trigger fires.\n"
+        "Note that per-family intervals provided via --collect are ignored in this mode and that the rates in the\n"
+        "samples kept in memory at the same time of a regular sample are computed over --sampling-interval, as\n"
+        "those of the regular sample." },
+    { "Data sampling options", &g_long_opts[10],
+        "Comma-separated list of conditions that trigger the dump of the flight recorder. Supported are:\n"
+        "  'section.measurement>value' or 'section.subsection.measurement<value': a threshold on a stat,\n"
+        "     e.g. 'proc_loadavg.load_avg_1min>4'\n"
+        "  'oom': an OOM kill happened inside the monitored memory cgroup" },
+    { "Data sampling options", &g_long_opts[11],
+        "Comma-separated list of glob patterns (e.g. 'eth*,ens*') selecting the network interfaces to monitor.\n"
+        "By default all interfaces listed in /proc/net/dev are monitored, except those matching --net-exclude." },
+    { "Data sampling options", &g_long_opts[12],
+        "Comma-separated list of glob patterns selecting the network interfaces NOT to monitor; takes precedence\n"
+        "over --net-include. Default is 'veth*'; pass an empty value to monitor also veth interfaces." },
+    { "Data sampling options", &g_long_opts[13],
+        "Comma-separated list of NAME:GLOB entries, e.g. 'containers:veth*,containers:cali*'.\n"
+        "The network interfaces matching GLOB are reported as a single entry NAME having as stats the sum\n"
+        "of their stats, whatever the --net-include and --net-exclude settings. Useful on hosts running\n"
+        "thousands of containers, each one adding a veth interface." },
+    { "Data sampling options", &g_long_opts[14],
+        "If cgroup process sampling is active (--collect=cgroup_processes), keep track of the processes of the\n"
+        "cgroup using the fork/exit events of the kernel proc connector, instead of reading the cgroup 'tasks'\n"
+        "file at each sample. Processes that exited since the previous sample are reported as well, with their\n"
+        "final stats, state 'Dead' and their exit code: this allows to account for short-lived processes.\n"
+        "Requires the CAP_NET_ADMIN capability; without it the 'tasks' file is read at each sample." },
+    { "Data sampling options", &g_long_opts[15],
+        "Where the stats of the processes of the cgroup are read from (--collect=cgroup_processes):\n"
+        "  'procfs': the /proc/<pid>/ files of each process (default)\n"
+        "  'taskstats': the taskstats generic netlink interface, delivering CPU, memory, I/O and delay accounting\n"
+        "     data of each process as a single binary message; much cheaper with thousands of processes, but\n"
+        "     I/O and faults of multi-threaded processes include only their main thread and state, threads and a few\n"
+        "     other fields are not available. The current memory usage is still read from /proc/<pid>/statm, for\n"
+        "     all processes only if --process-score includes 'rss', and the peak one is reported as well.\n"
+        "     With --proc-events, taskstats exit records provide also the final stats of exited processes.\n"
+        "     Requires the CAP_NET_ADMIN capability and Linux 5.19 or later; delay accounting data is available\n"
+        "     only if enabled with the kernel.task_delayacct sysctl.\n"
+        "  'io_uring': same as 'procfs', but the /proc/<pid>/stat files of all processes are read with a few\n"
+        "     batches of requests submitted through io_uring, instead of one syscall per process; the kernel\n"
+        "     completes the reads in its own worker threads, spread over all CPUs. Requires Linux 5.6 or later\n"
+        "     and io_uring not disabled with the kernel.io_uring_disabled sysctl; falls back to 'procfs'." },
+    { "Data sampling options", &g_long_opts[16],
+        "If cgroup process sampling is active (--collect=cgroup_processes), report at each sample only the N\n"
+        "processes with the highest score (see --process-score). By default all processes with a non-zero score\n"
+        "are reported; the 'cmonitor_chart' companion utility shows only the top 20 processes anyway." },
+    { "Data sampling options", &g_long_opts[17],
+        "The score used to select the processes to report, as a comma-separated list of METRIC[:WEIGHT];\n"
+        "the score is the weighted sum of the metrics (the default weight is 1). Available metrics:\n"
+        "  'cpu': CPU usage, in percentage of one CPU (default)\n"
+        "  'rss': resident memory, in MB\n"
+        "  'io': bytes read and written, including the page cache hits, in MB/s\n"
+        "  'majflt': major page faults per second\n"
+        "Processes with a zero score are never reported. Example: --process-score=cpu,io:10" },
+    { "Data sampling options", &g_long_opts[18],
+        "If cgroup process sampling is active (--collect=cgroup_processes), report only the numeric UID of each\n"
+        "process, instead of resolving it to a user name at each sample; the names of the users owning the\n"
+        "processes found at startup are reported once in the header. User names are cached anyway: this option\n"
+        "avoids even the occasional lookups on hosts where they are slow, e.g. when users come from LDAP." },
+    { "Data sampling options", &g_long_opts[19],
+        "If cgroup process sampling is active (--collect=cgroup_processes), report also the threads of each\n"
+        "reported process in the 'cgroup_threads' section, grouped by process, with their CPU usage, context\n"
+        "switches and the CPU they last ran on. Threads are selected with the same --process-score and\n"
+        "--top-processes, applied to the threads of each process. Threads are read only while their process\n"
+        "is reported: they appear once their process has been reported in two consecutive samples." },
+    { "Data sampling options", &g_long_opts[20],
+        "If cgroup process sampling is active (--collect=cgroup_processes) with the 'procfs' backend, the number\n"
+        "of threads reading the /proc/<pid>/ files of the processes of the cgroup in parallel (default 1): this\n"
+        "is also the maximum number of CPUs used by the scan. Useful for cgroups with tens of thousands of tasks,\n"
+        "whose scan would otherwise take longer than the sampling interval." },
 
     // Options to save data locally
-    { "Options to save data locally", &g_long_opts[7],
+    { "Options to save data locally", &g_long_opts[21],
         "Program will write output files to provided directory (default cwd)." },
-    { "Options to save data locally", &g_long_opts[8],
+    { "Options to save data locally", &g_long_opts[22],
         "Name the output files using provided prefix instead of defaulting to the filenames:\n"
         "\thostname_<year><month><day>_<hour><minutes>.json  (for JSON data)\n"
         "\thostname_<year><month><day>_<hour><minutes>.err   (for error log)\n"
         "Use special prefix 'stdout' to indicate that you want the utility to write on stdout.\n"
         "Use special prefix 'none' to indicate that you want to disable JSON genreation." },
-    { "Options to save data locally", &g_long_opts[9],
+    { "Options to save data locally", &g_long_opts[23],
         "Generate a pretty-printed JSON file instead of a machine-friendly JSON (the default).\n" },
+    { "Options to save data locally", &g_long_opts[24],
+        "Number of collected samples that can be waiting to be written on the JSON file or sent to InfluxDB.\n"
+        "With a non-zero size, samples are written by a dedicated thread, so that a slow output does not delay\n"
+        "the sampling, and the 'timestamp' section of each sample reports the 'output_queue_depth' and the\n"
+        "'output_queue_drops' so far. The default is 0: each sample is written directly from the sampling loop." },
+    { "Options to save data locally", &g_long_opts[25],
+        "What to do when the output queue is full:\n" // force newline
+        "  'drop-oldest': discard the oldest sample waiting in the queue (default)\n" // force newline
+        "  'drop-newest': discard the sample just collected\n" // force newline
+        "  'block': wait for the output to catch up; this may delay the next samples" },
 
     // Options to stream data remotely
-    { "Options to stream data remotely", &g_long_opts[10],
+    { "Options to stream data remotely", &g_long_opts[26],
         "IP address or hostname of the InfluxDB instance to send measurements to;\n"
         "cmonitor_collector will use a database named 'cmonitor' to store them." },
-    { "Options to stream data remotely", &g_long_opts[11], "Port used by InfluxDB." },
-    { "Options to stream data remotely", &g_long_opts[12],
+    { "Options to stream data remotely", &g_long_opts[27], "Port used by InfluxDB." },
+    { "Options to stream data remotely", &g_long_opts[28],
         "Set the InfluxDB collector secret (by default use environment variable CMONITOR_SECRET).\n" },
 
+    // Options to record and replay data
+    { "Options to record and replay data", &g_long_opts[29],
+        "Read all procfs files from the provided directory instead of /proc." },
+    { "Options to record and replay data", &g_long_opts[30],
+        "Read all sysfs files, including cgroup ones, from the provided directory instead of /sys." },
+    { "Options to record and replay data", &g_long_opts[31],
+        "Copy all procfs and sysfs files read at each tick into a new tick_NNNNNN subdirectory of the provided\n"
+        "directory (created if missing); tick_000000 contains the files read before the first sample." },
+    { "Options to record and replay data", &g_long_opts[32],
+        "Produce the samples from a directory previously created by --record instead of from the live system.\n"
+        "The recorded ticks are processed at full speed, using the recorded timings: this allows to profile\n"
+        "cmonitor_collector on synthetic or remote machines. Use the same --collect option of the recording." },
+
     // help
-    { "Other options", &g_long_opts[13], "Show version and exit" }, // force newline
-    { "Other options", &g_long_opts[14],
+    { "Other options", &g_long_opts[33], "Show version and exit" }, // force newline
+    { "Other options", &g_long_opts[34],
         "Enable debug mode; automatically activates --foreground mode" }, // force newline
-    { "Other options", &g_long_opts[15], "Show this help" },
+    { "Other options", &g_long_opts[35], "Show this help" },
 
     { NULL, NULL, NULL }
 };
@@ -154,14 +293,18 @@ struct option_extended {
 void interrupt(int signum)
 {
     switch (signum) {
+    case SIGUSR2:
+        if (g_flight_recorder.is_enabled()) {
+            g_bFlightRecorderDumpRequested = true;
+            break;
+        }
+        // fall through
     case SIGTERM:
     case SIGINT:
-        g_bExiting = true;
-        break;
     case SIGUSR1:
-    case SIGUSR2:
-        fflush(NULL);
-        exit(0);
+        // the sampling loop exits at its next wakeup: the output thread, if any, is then woken up and joined,
+        // so that the samples still queued are written, and the JSON is closed
+        g_bExiting = true;
         break;
     }
 }
@@ -200,6 +343,20 @@ PerformanceKpiFamily string2PerformanceKpiFamily(const std::string& str)
     return PK_INVALID;
 }
 
+ProcessScoreMetric string2ProcessScoreMetric(const std::string& str)
+{
+    if (to_lower(str) == "cpu")
+        return PSM_CPU;
+    if (to_lower(str) == "rss")
+        return PSM_RSS;
+    if (to_lower(str) == "io")
+        return PSM_IO;
+    if (to_lower(str) == "majflt")
+        return PSM_MAJFLT;
+
+    return PSM_INVALID;
+}
+
 std::string performanceKpiFamily2string(PerformanceKpiFamily k)
 {
     switch (k) {
@@ -272,6 +429,8 @@ void CMonitorLoggerUtils::LogDebug(const char* line, ...)
     vsnprintf(currLogLine, 255, line, args);
     va_end(args);
 
+    std::lock_guard<std::mutex> lock(m_mutex);
+
     // in debug mode stdout is still open, so we can printf:
     printf("%s", currLogLine);
     size_t lastCh = strlen(currLogLine) - 1;
@@ -288,6 +447,7 @@ void CMonitorLoggerUtils::LogError(const char* line, ...)
     vsnprintf(currLogLine, 255, line, args);
     va_end(args);
 
+    std::lock_guard<std::mutex> lock(m_mutex);
     if (!m_outputErr && !m_strErrorFileName.empty()) {
         // apparently this is the first error happening: time to open the logfile for errors:
         if ((m_outputErr = fopen(m_strErrorFileName.c_str(), "w")) == 0) {
@@ -413,6 +573,7 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
             short_opts += "::";
     }
 
+    bool bFlightRecorderTriggers = false;
     while (true) {
         int c = getopt_long(argc, argv, short_opts.c_str(), g_long_opts, 0);
         if (c < 0)
@@ -421,12 +582,16 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
             switch (c) {
             // Data sampling options
             case 's':
-                if (!string2int(optarg, g_cfg.m_nSamplingInterval)) {
+                if (!string2msec(optarg, g_cfg.m_nSamplingIntervalMsec)) {
                     printf("Unrecognized sampling interval: %s\n", optarg);
                     exit(51);
                 }
-                if (g_cfg.m_nSamplingInterval == 0) // safety check
-                    g_cfg.m_nSamplingInterval = 1;
+                if (g_cfg.m_nSamplingIntervalMsec == 0) // safety check
+                    g_cfg.m_nSamplingIntervalMsec = 1000;
+                if (g_cfg.m_nSamplingIntervalMsec < MIN_SAMPLING_INTERVAL_MSEC) {
+                    printf("Sampling interval %s is too small: minimum is %dms\n", optarg, MIN_SAMPLING_INTERVAL_MSEC);
+                    exit(51);
+                }
                 break;
             case 'c':
                 if (strcmp(optarg, "until-cgroup-alive") == 0)
@@ -445,12 +610,35 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
                 std::vector<std::string> tokens = split_string_in_array(optarg, ',');
                 g_cfg.m_nCollectFlags = 0;
                 for (auto token : tokens) {
-                    PerformanceKpiFamily k = string2PerformanceKpiFamily(token);
+                    // each token may carry its own sampling interval, e.g. "cpu@200ms"
+                    std::vector<std::string> family_and_rate = split_string_in_array(token, '@');
+                    if (family_and_rate.size() > 2) {
+                        printf("Unrecognized performance statistics family provided: %s\n", token.c_str());
+                        exit(51);
+                    }
+
+                    PerformanceKpiFamily k = string2PerformanceKpiFamily(family_and_rate[0]);
                     if (k == PK_INVALID) {
                         printf("Unrecognized performance statistics family provided: %s\n", token.c_str());
                         exit(51);
                     }
                     g_cfg.m_nCollectFlags |= k;
+
+                    if (family_and_rate.size() == 2) {
+                        uint64_t interval_msec;
+                        if (!string2msec(family_and_rate[1].c_str(), interval_msec)
+                            || interval_msec < MIN_SAMPLING_INTERVAL_MSEC) {
+                            printf("Unrecognized or too small sampling interval for performance statistics family: "
+                                   "%s\n",
+                                token.c_str());
+                            exit(51);
+                        }
+
+                        // aggregated families like "all_cgroup@10s" apply the interval to all their members:
+                        for (unsigned int j = 1; j < PK_MAX; j *= 2)
+                            if (k & j)
+                                g_cfg.m_mapCollectIntervalMsec[j] = interval_msec;
+                    }
                 }
             } break;
             case 'e':
@@ -462,6 +650,131 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
             case 'g':
                 g_cfg.m_strCGroupName = optarg;
                 break;
+            case 'T': {
+                uint64_t nthreads;
+                if (!string2int(optarg, nthreads) || nthreads > MAX_COLLECTOR_THREADS) {
+                    printf("Unrecognized or too large number of collector threads: %s\n", optarg);
+                    exit(51);
+                }
+                g_cfg.m_nCollectorThreads = nthreads;
+            } break;
+            case 'S':
+                g_cfg.m_bSelfStats = true;
+                g_self_stats.enable();
+                break;
+            case 'R': {
+                std::vector<std::string> duration_and_rate = split_string_in_array(optarg, '@');
+                if (duration_and_rate.size() != 2
+                    || !string2msec(duration_and_rate[0].c_str(), g_cfg.m_nFlightRecorderDurationMsec)
+                    || !string2msec(duration_and_rate[1].c_str(), g_cfg.m_nFlightRecorderIntervalMsec)
+                    || g_cfg.m_nFlightRecorderIntervalMsec < MIN_SAMPLING_INTERVAL_MSEC
+                    || g_cfg.m_nFlightRecorderDurationMsec < g_cfg.m_nFlightRecorderIntervalMsec) {
+                    printf("Unrecognized flight recorder configuration: %s\n", optarg);
+                    exit(51);
+                }
+                g_flight_recorder.init(g_cfg.m_nFlightRecorderDurationMsec, g_cfg.m_nFlightRecorderIntervalMsec);
+            } break;
+            case 't': {
+                bFlightRecorderTriggers = true;
+                std::vector<std::string> tokens = split_string_in_array(optarg, ',');
+                for (auto token : tokens) {
+                    CMonitorFlightRecorder::Trigger t;
+                    if (token == "oom")
+                        g_cfg.m_bFlightRecorderOnOom = true;
+                    else if (t.parse(token))
+                        g_flight_recorder.add_trigger(t);
+                    else {
+                        printf("Unrecognized flight recorder trigger: %s\n", token.c_str());
+                        exit(51);
+                    }
+                }
+            } break;
+            case 'I':
+                g_cfg.m_vecNetIncludeGlobs = split_string_in_array(optarg, ',');
+                break;
+            case 'E':
+                g_cfg.m_vecNetExcludeGlobs = split_string_in_array(optarg, ',');
+                break;
+            case 'N':
+                g_cfg.m_bProcEvents = true;
+                break;
+            case 'B':
+                if (strcmp(optarg, "procfs") == 0)
+                    g_cfg.m_nProcessBackend = PB_PROCFS;
+                else if (strcmp(optarg, "taskstats") == 0)
+                    g_cfg.m_nProcessBackend = PB_TASKSTATS;
+                else if (strcmp(optarg, "io_uring") == 0)
+                    g_cfg.m_nProcessBackend = PB_IO_URING;
+                else {
+                    printf("Unrecognized process backend: %s\n", optarg);
+                    exit(51);
+                }
+                break;
+            case 'n':
+                if (!string2int(optarg, g_cfg.m_nTopProcesses)) {
+                    printf("Unrecognized number of top processes: %s\n", optarg);
+                    exit(51);
+                }
+                break;
+            case 'u':
+                g_cfg.m_bNumericUids = true;
+                break;
+            case 'H':
+                g_cfg.m_bThreads = true;
+                break;
+            case 'j': {
+                uint64_t nthreads;
+                if (!string2int(optarg, nthreads) || nthreads > MAX_COLLECTOR_THREADS) {
+                    printf("Unrecognized or too large number of process scan threads: %s\n", optarg);
+                    exit(51);
+                }
+                g_cfg.m_nProcessScanThreads = nthreads;
+            } break;
+            case 'o': {
+                g_cfg.m_vecProcessScore.clear();
+                std::vector<std::string> tokens = split_string_in_array(optarg, ',');
+                for (auto token : tokens) {
+                    process_score_term_t term;
+                    term.weight = 1.0;
+
+                    size_t colon = token.find(':');
+                    if (colon != std::string::npos) {
+                        char* endptr = NULL;
+                        term.weight = strtod(token.c_str() + colon + 1, &endptr);
+                        if (colon == token.size() - 1 || *endptr != '\0' || !(term.weight > 0)) {
+                            printf("Invalid weight in process score term: %s\n", token.c_str());
+                            exit(51);
+                        }
+                    }
+                    term.metric = string2ProcessScoreMetric(token.substr(0, colon));
+                    if (term.metric == PSM_INVALID) {
+                        printf("Unrecognized process score metric: %s\n", token.c_str());
+                        exit(51);
+                    }
+                    g_cfg.m_vecProcessScore.push_back(term);
+                }
+            } break;
+            case 'U': {
+                std::vector<std::string> tokens = split_string_in_array(optarg, ',');
+                for (auto token : tokens) {
+                    size_t colon = token.find(':');
+                    if (colon == 0 || colon == std::string::npos || colon == token.size() - 1) {
+                        printf("Invalid network interface roll-up: %s; expected NAME:GLOB\n", token.c_str());
+                        exit(51);
+                    }
+
+                    // entries with the same NAME are summed together
+                    std::string name = token.substr(0, colon);
+                    auto it = std::find_if(g_cfg.m_vecNetRollups.begin(), g_cfg.m_vecNetRollups.end(),
+                        [&name](const CMonitorCollectorAppConfig::NetRollup& r) { return r.m_strName == name; });
+                    if (it == g_cfg.m_vecNetRollups.end()) {
+                        g_cfg.m_vecNetRollups.push_back(CMonitorCollectorAppConfig::NetRollup());
+                        it = g_cfg.m_vecNetRollups.end() - 1;
+                        it->m_strName = name;
+                    }
+                    it->m_vecGlobs.push_back(token.substr(colon + 1));
+                }
+            } break;
 
                 // Local data saving options
             case 'm':
@@ -478,6 +791,24 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
             case 'P':
                 g_output.enable_json_pretty_print();
                 break;
+            case 'Q':
+                if (!string2int(optarg, g_cfg.m_nOutputQueueSize) || g_cfg.m_nOutputQueueSize > MAX_OUTPUT_QUEUE_SIZE) {
+                    printf("Unrecognized or too large output queue size: %s\n", optarg);
+                    exit(51);
+                }
+                break;
+            case 'O':
+                if (strcmp(optarg, "drop-oldest") == 0)
+                    g_cfg.m_nOutputQueuePolicy = QOP_DROP_OLDEST;
+                else if (strcmp(optarg, "drop-newest") == 0)
+                    g_cfg.m_nOutputQueuePolicy = QOP_DROP_NEWEST;
+                else if (strcmp(optarg, "block") == 0)
+                    g_cfg.m_nOutputQueuePolicy = QOP_BLOCK;
+                else {
+                    printf("Unrecognized output queue policy: %s\n", optarg);
+                    exit(51);
+                }
+                break;
 
                 // Remote data collector options
             case 'i':
@@ -493,6 +824,36 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
                 g_cfg.m_strRemoteSecret = optarg;
                 break;
 
+                // Record/replay options
+            case 'z':
+            case 'Z':
+            case 'y': {
+                // NOTE: store absolute paths since the output directory becomes our working directory
+                char abs_path[PATH_MAX];
+                if (realpath(optarg, abs_path) == NULL) {
+                    printf("Cannot find the directory: %s\n", optarg);
+                    exit(51);
+                }
+                if (c == 'z')
+                    g_cfg.m_strProcRoot = abs_path;
+                else if (c == 'Z')
+                    g_cfg.m_strSysRoot = abs_path;
+                else
+                    g_cfg.m_strReplayDir = abs_path;
+            } break;
+            case 'r': {
+                char abs_path[PATH_MAX];
+                if (mkdir(optarg, 0755) != 0 && errno != EEXIST) {
+                    printf("Cannot create the recording directory: %s\n", optarg);
+                    exit(51);
+                }
+                if (realpath(optarg, abs_path) == NULL) {
+                    printf("Cannot find the directory: %s\n", optarg);
+                    exit(51);
+                }
+                g_cfg.m_strRecordDir = abs_path;
+            } break;
+
             // help
             case 'v':
                 printf("cmonitor_collector version: %s\n", VERSION_STRING);
@@ -536,6 +897,52 @@ void CMonitorCollectorApp::parse_args(int argc, char** argv)
         printf("Option --remote-port=%lu provided but the --remote-ip option was not provided\n", g_cfg.m_nRemotePort);
         exit(53);
     }
+    if (bFlightRecorderTriggers && !g_flight_recorder.is_enabled()) {
+        printf("Option --flight-recorder-trigger provided but the --flight-recorder option was not provided\n");
+        exit(54);
+    }
+    if (g_flight_recorder.is_enabled()
+        && (g_cfg.m_strOutputFilenamePrefix == "stdout" || g_cfg.m_strOutputFilenamePrefix == "none")
+        && (g_cfg.m_strRemoteAddress.empty() || g_cfg.m_nRemotePort == 0)) {
+        // stderr, since stdout may carry the JSON output:
+        fprintf(stderr,
+            "Warning: flight recorder dumps are written only to JSON files or to InfluxDB: with --output-filename=%s "
+            "and no --remote-ip they will be dropped\n",
+            g_cfg.m_strOutputFilenamePrefix.c_str());
+    }
+    {
+        // the scheduler ticks at the GCD of all the intervals it is given in run(): e.g.
+        // 'cpu@1001ms' with the default interval would wake it up every millisecond
+        CMonitorScheduler scheduler;
+        set_scheduler_families(scheduler);
+        uint64_t tick_msec = scheduler.get_families_gcd_msec();
+        if (tick_msec != 0 && tick_msec < MIN_SAMPLING_INTERVAL_MSEC) {
+            printf("The sampling intervals provided are not multiples of a common interval of at least %dms: "
+                   "they would require sampling every %lums\n",
+                MIN_SAMPLING_INTERVAL_MSEC, tick_msec);
+            exit(51);
+        }
+    }
+    if (!g_cfg.m_strRecordDir.empty() && !g_cfg.m_strReplayDir.empty()) {
+        printf("Options --record and --replay cannot be used together\n");
+        exit(55);
+    }
+    if (g_cfg.m_bProcEvents && !g_cfg.m_strReplayDir.empty()) {
+        printf("Options --proc-events and --replay cannot be used together\n");
+        exit(56);
+    }
+    if (g_cfg.m_nProcessBackend == PB_TASKSTATS && !g_cfg.m_strReplayDir.empty()) {
+        printf("Options --process-backend=taskstats and --replay cannot be used together\n");
+        exit(57);
+    }
+    if (!g_cfg.m_strRecordDir.empty() && !g_snapshot_recorder.init(g_cfg.m_strRecordDir)) {
+        printf("Cannot create the recording directory: %s\n", g_cfg.m_strRecordDir.c_str());
+        exit(51);
+    }
+    if (!g_cfg.m_strReplayDir.empty() && !g_snapshot_replayer.init(g_cfg.m_strReplayDir)) {
+        printf("Cannot find any recorded tick inside the directory: %s\n", g_cfg.m_strReplayDir.c_str());
+        exit(51);
+    }
 
     optind = 0; /* reset getopt lib */
 }
@@ -570,7 +977,10 @@ void CMonitorCollectorApp::get_timestamps(std::string& localTime, std::string& u
     time_t timer; /* used to work out the time details*/
     struct tm* tim = nullptr; /* used to work out the local hour/min/second */
 
-    timer = time(0);
+    if (g_snapshot_replayer.is_enabled())
+        timer = (time_t)(g_snapshot_replayer.get_tick().realtime_nsec / 1000000000ULL);
+    else
+        timer = time(0);
     tim = localtime(&timer);
     tim->tm_year += 1900; /* read localtime() manual page!! */
     tim->tm_mon += 1; /* because it is 0 to 11 */
@@ -591,13 +1001,6 @@ void CMonitorCollectorApp::get_timestamps(std::string& localTime, std::string& u
     utcTime = buffer;
 }
 
-double CMonitorCollectorApp::get_timestamp_sec()
-{
-    struct timeval tv;
-    gettimeofday(&tv, 0);
-    return (double)tv.tv_sec + (double)tv.tv_usec * 1.0e-6;
-}
-
 void CMonitorCollectorApp::psample_date_time(long loop)
 {
     DEBUGLOG_FUNCTION_START();
@@ -609,6 +1012,12 @@ void CMonitorCollectorApp::psample_date_time(long loop)
     g_output.pstring("datetime", localTime.c_str());
     g_output.pstring("UTC", utcTime.c_str());
     g_output.plong("sample_index", loop);
+    g_output.plong("sched_jitter_usec", m_scheduler.get_last_jitter_usec());
+    g_output.plong("sched_overruns", m_scheduler.get_last_overruns());
+    if (g_cfg.m_nOutputQueueSize > 0) {
+        g_output.plong("output_queue_depth", g_output.get_output_queue_depth());
+        g_output.plong("output_queue_drops", g_output.get_output_queue_drops());
+    }
     g_output.psection_end();
 }
 
@@ -629,6 +1038,241 @@ void CMonitorCollectorApp::check_pid_file()
     // else: this is the first instance of this software... continue
 }
 
+/* static */
+void CMonitorCollectorApp::set_scheduler_families(CMonitorScheduler& scheduler)
+{
+    if (g_flight_recorder.is_enabled()) {
+        // all enabled families are sampled at the flight recorder rate:
+        for (unsigned int j = 1; j < PK_MAX; j *= 2)
+            if (g_cfg.m_nCollectFlags & j)
+                scheduler.set_family_interval(j, g_cfg.m_nFlightRecorderIntervalMsec);
+        scheduler.set_family_interval(SCHED_REGULAR_OUTPUT, g_cfg.m_nSamplingIntervalMsec);
+    } else {
+        // each enabled family is sampled with its own interval, if any, or with the main one:
+        for (unsigned int j = 1; j < PK_MAX; j *= 2) {
+            if (g_cfg.m_nCollectFlags & j) {
+                auto it = g_cfg.m_mapCollectIntervalMsec.find(j);
+                scheduler.set_family_interval(
+                    j, it != g_cfg.m_mapCollectIntervalMsec.end() ? it->second : g_cfg.m_nSamplingIntervalMsec);
+            }
+        }
+    }
+}
+
+void CMonitorCollectorApp::set_rates_checkpoint()
+{
+    m_proc_stat_cpus.set_checkpoint();
+    m_proc_stat_counters.set_checkpoint();
+    m_disk_counters.set_checkpoint();
+    m_netif_counters.set_checkpoint();
+    m_cgroup_cpuacct_counters.set_checkpoint();
+    m_cgroup_io_counters.set_checkpoint();
+    m_processes.set_checkpoint();
+    m_threads.set_checkpoint();
+}
+
+double CMonitorCollectorApp::get_rates_elapsed_sec(double elapsed_sec) const
+{
+    return m_bRatesSinceCheckpoint ? m_scheduler.get_elapsed_sec(SCHED_REGULAR_OUTPUT) : elapsed_sec;
+}
+
+void CMonitorCollectorApp::compute_table_rates(CMonitorCounterTable& table, double elapsed_sec)
+{
+    table.compute_rates(get_rates_elapsed_sec(elapsed_sec), m_bRatesSinceCheckpoint);
+}
+
+bool CMonitorCollectorApp::collect_sample(unsigned int loop, const std::set<std::string>& charted_stats_from_meminfo,
+    const std::set<std::string>& charted_stats_from_cgroup_memory)
+{
+    // NOTE: elapsed time includes sleep and data collection time; it's measured on the monotonic clock
+    //       and each family uses the time elapsed since its own previous collection as baseline,
+    //       except for the regular samples of the flight recorder mode, see set_rates_checkpoint()
+    m_bRatesSinceCheckpoint = g_flight_recorder.is_enabled() && m_scheduler.is_due(SCHED_REGULAR_OUTPUT);
+    m_processes.set_rates_since_checkpoint(m_bRatesSinceCheckpoint);
+    m_threads.set_rates_since_checkpoint(m_bRatesSinceCheckpoint);
+
+    g_output.psample_start();
+    g_self_stats.psample_start();
+    if (g_snapshot_replayer.is_enabled())
+        g_output.set_current_sample_timestamp(g_snapshot_replayer.get_tick().realtime_nsec);
+
+    // some stats are always collected, regardless of g_cfg.m_nCollectFlags
+    psample_date_time(loop);
+    // proc_uptime(); // not really useful!!
+    proc_loadavg();
+
+    // each stats family touches only its own /proc or /sys files and its own state, so that
+    // all families due in this tick can be collected independently:
+    std::vector<CMonitorWorkerPool::job_t> jobs;
+
+    // baremetal stats:
+
+    if (m_scheduler.is_due(PK_CPU)) {
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_PROC_STAT);
+            proc_stat(m_scheduler.get_elapsed_sec(PK_CPU), false /* collect from ALL cpus */,
+                g_cfg.m_nOutputFields /* emit JSON */);
+        });
+    }
+
+    if (m_scheduler.is_due(PK_MEMORY)) {
+        jobs.push_back([this, &charted_stats_from_meminfo]() {
+            CMonitorSelfStats::Timer timer(SSP_PROC_MEMINFO);
+            proc_read_numeric_stats_from(
+                m_proc_meminfo_file, m_proc_meminfo_parser, "meminfo", charted_stats_from_meminfo);
+            if (g_cfg.m_nOutputFields == PF_ALL)
+                proc_read_numeric_stats_from(
+                    m_proc_vmstat_file, m_proc_vmstat_parser, "vmstat", std::set<std::string>());
+        });
+    }
+
+    if (m_scheduler.is_due(PK_NETWORK)) {
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_PROC_NET_DEV);
+            proc_net_dev(m_scheduler.get_elapsed_sec(PK_NETWORK), g_cfg.m_nOutputFields /* emit JSON */);
+        });
+    }
+
+    if (m_scheduler.is_due(PK_DISK)) {
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_PROC_DISKSTATS);
+            proc_diskstats(m_scheduler.get_elapsed_sec(PK_DISK), g_cfg.m_nOutputFields /* emit JSON */);
+            // proc_filesystems(); // I don't find this really useful...specially for ephemeral containers!
+        });
+    }
+
+    // cgroup stats:
+
+    if (m_scheduler.is_due(PK_CGROUP_CPU_ACCT)) {
+        // do not list all CPU informations when cgroup mode is ON: don't put information
+        // for CPUs outside current cgroup!
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_CGROUP_CPUACCT);
+            cgroup_proc_cpuacct(m_scheduler.get_elapsed_sec(PK_CGROUP_CPU_ACCT), true /* emit JSON */);
+        });
+    }
+
+    if (m_scheduler.is_due(PK_CGROUP_MEMORY)) {
+        jobs.push_back([this, &charted_stats_from_cgroup_memory]() {
+            CMonitorSelfStats::Timer timer(SSP_CGROUP_MEMORY);
+            cgroup_proc_memory(charted_stats_from_cgroup_memory);
+        });
+    }
+    if (m_scheduler.is_due(PK_CGROUP_BLKIO)) {
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_CGROUP_BLKIO);
+            cgroup_proc_blkio(m_scheduler.get_elapsed_sec(PK_CGROUP_BLKIO), g_cfg.m_nOutputFields /* emit JSON */);
+        });
+    }
+    if (m_scheduler.is_due(PK_CGROUP_PROCESSES)) {
+        jobs.push_back([this]() {
+            CMonitorSelfStats::Timer timer(SSP_CGROUP_TASKS);
+            cgroup_proc_tasks(m_scheduler.get_elapsed_sec(PK_CGROUP_PROCESSES), g_cfg.m_nOutputFields /* emit JSON */);
+        });
+    }
+
+    if (!m_workers.is_running()) {
+        for (auto& job : jobs)
+            job();
+    } else {
+        // each job writes its sections into its own private buffer; buffers are then merged in the same
+        // order used by the sequential collection, so that the output does not depend on thread timings.
+        // NOTE: the buffers are static to reuse their memory across samples
+        static std::vector<CMonitorOutputFrontend::CMonitorOutputSample> private_samples;
+        if (private_samples.size() < jobs.size())
+            private_samples.resize(jobs.size());
+
+        std::vector<CMonitorWorkerPool::job_t> parallel_jobs;
+        for (size_t i = 0; i < jobs.size(); i++) {
+            CMonitorWorkerPool::job_t& job = jobs[i];
+            CMonitorOutputFrontend::CMonitorOutputSample* p = &private_samples[i];
+            parallel_jobs.push_back([&job, p]() {
+                g_output.set_thread_private_sample(p);
+                job();
+                g_output.set_thread_private_sample(nullptr);
+            });
+        }
+        m_workers.run_all(parallel_jobs);
+
+        for (size_t i = 0; i < jobs.size(); i++)
+            g_output.merge_sample(private_samples[i]);
+    }
+
+    if (!g_flight_recorder.is_enabled()) {
+        g_self_stats.psection_self();
+        g_output.push_current_sample();
+        return true;
+    }
+
+    // flight recorder mode: every sample goes into the flight recorder and only some of them reach the outputs;
+    // the stats of cmonitor itself are reported only by the latter, so that they span the whole sampling interval
+    if (m_bRatesSinceCheckpoint) {
+        g_self_stats.psection_self();
+        set_rates_checkpoint();
+    }
+    g_output.stamp_current_sample();
+    g_flight_recorder.record(g_output.get_current_sample());
+
+    std::string reason; // set below when a dump must start
+    g_flight_recorder.check_triggers(g_output.get_current_sample(), reason);
+    if (g_cfg.m_bFlightRecorderOnOom) {
+        uint64_t oom_kill_count;
+        if (cgroup_get_oom_kill_count(oom_kill_count)) {
+            if (oom_kill_count > m_last_oom_kill_count)
+                reason = "oom";
+            m_last_oom_kill_count = oom_kill_count;
+        }
+    }
+    if (g_bFlightRecorderDumpRequested.exchange(false))
+        reason = "SIGUSR2";
+    if (!reason.empty())
+        g_flight_recorder.dump(reason, g_output);
+
+    if (m_scheduler.is_due(SCHED_REGULAR_OUTPUT)) {
+        g_output.push_current_sample();
+        return true;
+    }
+    g_output.discard_current_sample();
+    return false;
+}
+
+static void fill_snapshot_tick(snapshot_tick_t& tick, uint64_t monotonic_nsec)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    tick.monotonic_nsec = monotonic_nsec;
+    tick.realtime_nsec = (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+    tick.pid = getpid();
+}
+
+bool CMonitorCollectorApp::wait_next_tick()
+{
+    if (g_snapshot_replayer.is_enabled()) {
+        // no sleep: just move to the files of next recorded tick
+        std::string old_sys_root = g_cfg.m_strSysRoot;
+        if (!g_snapshot_replayer.next_tick())
+            return false; // end of the recording
+        cgroup_move_sys_root(old_sys_root);
+
+        const snapshot_tick_t& tick = g_snapshot_replayer.get_tick();
+        m_scheduler.replay_tick(tick.monotonic_nsec, tick.due_families, tick.jitter_usec, tick.overruns);
+        return true;
+    }
+
+    if (!m_scheduler.wait_next_deadline())
+        return false; // interrupted by SIGTERM/SIGINT while waiting
+
+    if (g_snapshot_recorder.is_enabled()) {
+        snapshot_tick_t tick;
+        fill_snapshot_tick(tick, m_scheduler.get_last_wakeup_nsec());
+        tick.due_families = m_scheduler.get_due_families();
+        tick.jitter_usec = m_scheduler.get_last_jitter_usec();
+        tick.overruns = m_scheduler.get_last_overruns();
+        g_snapshot_recorder.begin_tick(tick);
+    }
+    return true;
+}
+
 int CMonitorCollectorApp::run(int argc, char** argv)
 {
     // if only one instance allowed, do the check:
@@ -675,6 +1319,23 @@ int CMonitorCollectorApp::run(int argc, char** argv)
         signal(SIGHUP, SIG_IGN); /* ignore hangups */
     }
 
+    // the files read up to the first sample (baselines and header) belong to the first recorded tick:
+    uint64_t baseline_nsec;
+    if (g_snapshot_replayer.is_enabled()) {
+        if (!g_snapshot_replayer.next_tick()) {
+            g_logger.LogError("Cannot replay the recording in [%s]", g_cfg.m_strReplayDir.c_str());
+            exit(12);
+        }
+        baseline_nsec = g_snapshot_replayer.get_tick().monotonic_nsec;
+    } else {
+        baseline_nsec = CMonitorScheduler::get_monotonic_time_nsec();
+        if (g_snapshot_recorder.is_enabled()) {
+            snapshot_tick_t tick;
+            fill_snapshot_tick(tick, baseline_nsec);
+            g_snapshot_recorder.begin_tick(tick);
+        }
+    }
+
     // init incremental stats (don't write yet anything!)
     bool bCollectCGroupInfo = // force newline
         (g_cfg.m_nCollectFlags & PK_CGROUP_CPU_ACCT) || // force newline
@@ -689,17 +1350,55 @@ int CMonitorCollectorApp::run(int argc, char** argv)
 
         if (g_cfg.m_nCollectFlags & PK_CGROUP_CPU_ACCT)
             cgroup_proc_cpuacct(0, false /* do not emit JSON */);
+        if (g_cfg.m_nCollectFlags & PK_CGROUP_BLKIO)
+            cgroup_proc_blkio(0, PF_NONE /* do not emit JSON */);
 
-        if (g_cfg.m_nCollectFlags & PK_CGROUP_PROCESSES)
+        if (g_cfg.m_nCollectFlags & PK_CGROUP_PROCESSES) {
+            std::string taskstats_cpumask;
+            if (g_cfg.m_nProcessBackend == PB_TASKSTATS && m_bCGroupsFound) {
+                if (m_taskstats.open())
+                    taskstats_cpumask = "0-" + std::to_string(get_possible_cpu_count() - 1);
+                else
+                    g_logger.LogError("Cannot use the taskstats process backend: falling back to reading /proc");
+            }
+
+            // half of the available file descriptors can be kept open by the /proc backend, see CMonitorProcessTable
+            if (!m_taskstats.is_open()) {
+                m_processes.set_max_fds(raise_max_open_files() / 2);
+                cgroup_proc_scan_init(g_cfg.m_nProcessScanThreads);
+            }
+            if (g_cfg.m_nProcessBackend == PB_IO_URING && m_bCGroupsFound && !m_io_uring.open())
+                g_logger.LogError("Cannot use the io_uring process backend: falling back to reading /proc");
+
+            // NOTE: subscribe before reading the "tasks" file, so that no fork can be missed
+            if (g_cfg.m_bProcEvents && m_bCGroupsFound
+                && !m_proc_events.start(g_cfg.m_nOutputFields, taskstats_cpumask))
+                g_logger.LogError("Cannot receive process events: falling back to reading the cgroup tasks file");
             cgroup_proc_tasks(0, PF_NONE /* do not emit JSON */);
+        }
     }
-
-    double current_time = get_timestamp_sec();
+    if (g_cfg.m_bFlightRecorderOnOom && !cgroup_get_oom_kill_count(m_last_oom_kill_count))
+        g_logger.LogError("Cannot read the OOM kill counter of the memory cgroup: the 'oom' flight recorder trigger "
+                          "will never fire");
+
+    /* first time just wait one interval so the first snapshot has some real-ish data */
+    /* if a long time between snapshot do a quick one after 60secs so we have one in the bank */
+    uint64_t first_delay_msec = g_cfg.m_nSamplingIntervalMsec;
+    set_scheduler_families(m_scheduler);
+    if (g_flight_recorder.is_enabled()) {
+        first_delay_msec = g_cfg.m_nFlightRecorderIntervalMsec;
+        set_rates_checkpoint(); // the baselines read above are the start of the first regular sample
+    } else {
+        for (auto it : g_cfg.m_mapCollectIntervalMsec)
+            first_delay_msec = std::min(first_delay_msec, it.second);
+    }
+    m_scheduler.start(std::min(first_delay_msec, (uint64_t)60000), baseline_nsec);
 
     // write stuff that is present only in the very first sample (never changes):
     g_output.pheader_start();
     header_identity();
-    header_cmonitor_info(argc, argv, g_cfg.m_nSamplingInterval, g_cfg.m_nSamples, g_cfg.m_nCollectFlags);
+    header_cmonitor_info(argc, argv, g_cfg.m_nSamplingIntervalMsec, g_cfg.m_nSamples, g_cfg.m_nCollectFlags,
+        g_cfg.m_mapCollectIntervalMsec);
     header_etc_os_release();
     header_version();
     if (bCollectCGroupInfo)
@@ -707,15 +1406,11 @@ int CMonitorCollectorApp::run(int argc, char** argv)
     header_lscpu();
     header_cpuinfo(); // ?!? this file contains basically the same info contained in lscpu output ?!?
     header_meminfo();
+    if ((g_cfg.m_nCollectFlags & PK_CGROUP_PROCESSES) && g_cfg.m_bNumericUids)
+        header_process_usernames();
     header_lshw();
     g_output.push_header();
 
-    /* first time just sleep(1) so the first snapshot has some real-ish data */
-    if (g_cfg.m_nSamplingInterval <= 60)
-        sleep(g_cfg.m_nSamplingInterval);
-    else
-        sleep(60); /* if a long time between snapshot do a quick one now so we have one in the bank */
-
     std::set<std::string> charted_stats_from_meminfo;
     if (g_cfg.m_nOutputFields == PF_USED_BY_CHART_SCRIPT_ONLY) {
         charted_stats_from_meminfo.insert("MemTotal");
@@ -732,63 +1427,25 @@ int CMonitorCollectorApp::run(int argc, char** argv)
     }
     // else: leave empty
 
+    // threads must be created after the fork() done for daemonization:
+    if (g_cfg.m_nCollectorThreads > 0)
+        m_workers.start(g_cfg.m_nCollectorThreads);
+
     // start actual data samples:
     g_logger.LogDebug("Starting sampling of performance data; collect flags=%lu", g_cfg.m_nCollectFlags);
     g_output.psample_array_start();
-    for (unsigned int loop = 0; g_cfg.m_nSamples == 0 || loop < g_cfg.m_nSamples; loop++) {
-        if (loop != 0)
-            sleep(g_cfg.m_nSamplingInterval);
-
-        /* calculate elapsed time to include sleep and data collection time */
-        double previous_time = current_time;
-        current_time = get_timestamp_sec();
-        double elapsed = current_time - previous_time;
-
-        g_output.psample_start();
-
-        // some stats are always collected, regardless of g_cfg.m_nCollectFlags
-        psample_date_time(loop);
-        // proc_uptime(); // not really useful!!
-        proc_loadavg();
-
-        // baremetal stats:
-
-        if (g_cfg.m_nCollectFlags & PK_CPU) {
-            proc_stat(elapsed, false /* collect from ALL cpus */, g_cfg.m_nOutputFields /* emit JSON */);
-        }
-
-        if (g_cfg.m_nCollectFlags & PK_MEMORY) {
-            proc_read_numeric_stats_from("meminfo", charted_stats_from_meminfo);
-            if (g_cfg.m_nOutputFields == PF_ALL)
-                proc_read_numeric_stats_from("vmstat", std::set<std::string>());
-        }
-
-        if (g_cfg.m_nCollectFlags & PK_NETWORK) {
-            proc_net_dev(elapsed, g_cfg.m_nOutputFields /* emit JSON */);
-        }
-
-        if (g_cfg.m_nCollectFlags & PK_DISK) {
-            proc_diskstats(elapsed, g_cfg.m_nOutputFields /* emit JSON */);
-            // proc_filesystems(); // I don't find this really useful...specially for ephemeral containers!
-        }
-
-        // cgroup stats:
-
-        if (g_cfg.m_nCollectFlags & PK_CGROUP_CPU_ACCT) {
-            // do not list all CPU informations when cgroup mode is ON: don't put information
-            // for CPUs outside current cgroup!
-            cgroup_proc_cpuacct(elapsed, true /* emit JSON */);
-        }
-
-        if (g_cfg.m_nCollectFlags & PK_CGROUP_MEMORY) {
-            cgroup_proc_memory(charted_stats_from_cgroup_memory);
-        }
-        if (g_cfg.m_nCollectFlags & PK_CGROUP_PROCESSES) {
-            cgroup_proc_tasks(elapsed, g_cfg.m_nOutputFields /* emit JSON */);
+    if (g_cfg.m_nOutputQueueSize > 0)
+        g_output.start_output_thread(g_cfg.m_nOutputQueueSize, g_cfg.m_nOutputQueuePolicy);
+    for (unsigned int loop = 0; g_cfg.m_nSamples == 0 || loop < g_cfg.m_nSamples;) {
+        if (!wait_next_tick())
+            break; // interrupted by SIGTERM/SIGINT while waiting or end of the recording to replay
+
+        // with per-family sampling intervals, some ticks may have nothing to collect:
+        if (m_scheduler.get_due_families() != 0) {
+            if (collect_sample(loop, charted_stats_from_meminfo, charted_stats_from_cgroup_memory))
+                loop++;
         }
 
-        g_output.push_current_sample();
-
         if (g_bExiting)
             break; // graceful exit allows to produce a valid JSON on SIGTERM signals!
         if (g_cfg.m_nSamples == SPECIAL_NUMSAMPLES_UNTIL_CGROUP_ALIVE && !cgroup_still_exists())
@@ -796,6 +1453,15 @@ int CMonitorCollectorApp::run(int argc, char** argv)
     }
 
     /* finish-of */
+    m_workers.stop();
+    m_proc_events.stop();
+    m_taskstats.close();
+    g_flight_recorder.wait_dump_completion();
+    g_output.stop_output_thread();
+    if (g_cfg.m_bSelfStats) {
+        g_output.pfooter_start();
+        g_self_stats.pfooter();
+    }
     g_output.psample_array_end();
     fflush(NULL);
 
@@ -805,8 +1471,10 @@ int CMonitorCollectorApp::run(int argc, char** argv)
 
 //------------------------------------------------------------------------------
 // Main
+// NOTE: cmonitor_bench links all the code of this file except for main()
 //------------------------------------------------------------------------------
 
+#ifndef CMONITOR_NO_MAIN
 int main(int argc, char** argv)
 {
     // init defaults (can be overridden by cmd line options):
@@ -826,3 +1494,4 @@ int main(int argc, char** argv)
 
     return g_app.run(argc, argv);
 }
+#endif
@@ -25,6 +25,7 @@
 #include <algorithm>
 #include <assert.h>
 #include <netdb.h>
+#include <signal.h>
 #include <sys/time.h>
 #include <unistd.h>
 
@@ -34,6 +35,8 @@
 
 CMonitorOutputFrontend g_output;
 
+thread_local CMonitorOutputFrontend::CMonitorOutputSample* CMonitorOutputFrontend::ms_thread_private_sample = nullptr;
+
 //------------------------------------------------------------------------------
 // Init functions
 //------------------------------------------------------------------------------
@@ -52,22 +55,28 @@ void CMonitorOutputFrontend::init_json_output_file(const std::string& filenamePr
         printf("Disabling JSON file generation (collected data will be available only via InfluxDB, if IP/port is "
                "provided)\n");
     } else {
-
-        std::string outFile(filenamePrefix);
-        if (filenamePrefix.size() > 5 && filenamePrefix.substr(filenamePrefix.size() - 5) != ".json")
-            outFile += ".json";
-
-        // open output files
-        if ((m_outputJson = fopen(outFile.c_str(), "w")) == 0) {
+        if (!open_json_output_file(filenamePrefix)) {
             perror("opening file for stdout");
-            fprintf(stderr, "ERROR nmon filename=%s\n", outFile.c_str());
+            fprintf(stderr, "ERROR nmon filename=%s\n", filenamePrefix.c_str());
             exit(13);
         }
-
-        printf("Opened output JSON file '%s'\n", outFile.c_str());
     }
 }
 
+bool CMonitorOutputFrontend::open_json_output_file(const std::string& filenamePrefix)
+{
+    std::string outFile(filenamePrefix);
+    if (filenamePrefix.size() > 5 && filenamePrefix.substr(filenamePrefix.size() - 5) != ".json")
+        outFile += ".json";
+
+    // open output files
+    if ((m_outputJson = fopen(outFile.c_str(), "w")) == 0)
+        return false; // errno is set by fopen()
+
+    printf("Opened output JSON file '%s'\n", outFile.c_str());
+    return true;
+}
+
 std::string hostname_to_ip(const std::string& hostname)
 {
     struct hostent* he;
@@ -90,13 +99,19 @@ std::string hostname_to_ip(const std::string& hostname)
 
 void CMonitorOutputFrontend::init_influxdb_connection(const std::string& hostname, unsigned int port)
 {
-    std::string ipaddress = hostname_to_ip(hostname);
-    if (ipaddress.empty()) {
+    if (!open_influxdb_connection(hostname, port)) {
         char buf[1024];
         herror(buf);
         fprintf(stderr, "hostname=%s to IP address convertion failed, bailing out: %s\n", hostname.c_str(), buf);
         exit(98);
     }
+}
+
+bool CMonitorOutputFrontend::open_influxdb_connection(const std::string& hostname, unsigned int port)
+{
+    std::string ipaddress = hostname_to_ip(hostname);
+    if (ipaddress.empty())
+        return false;
 
     m_influxdb_client_conn = new influx_client_t();
     m_influxdb_client_conn->host = strdup(ipaddress.c_str()); // force newline
@@ -107,6 +122,24 @@ void CMonitorOutputFrontend::init_influxdb_connection(const std::string& hostnam
 
     g_logger.LogDebug("init_influxdb_connection() initialized InfluxDB connection to %s:%d",
         m_influxdb_client_conn->host, m_influxdb_client_conn->port);
+    return true;
+}
+
+CMonitorOutputFrontend::~CMonitorOutputFrontend()
+{
+    if (m_output_thread.joinable())
+        m_output_thread.detach(); // only in case of abrupt exit: stop_output_thread() should be used instead
+
+    if (m_outputJson && fileno(m_outputJson) != STDOUT_FILENO)
+        fclose(m_outputJson);
+
+    if (m_influxdb_client_conn) {
+        free(m_influxdb_client_conn->host);
+        free(m_influxdb_client_conn->db);
+        free(m_influxdb_client_conn->usr);
+        free(m_influxdb_client_conn->pwd);
+        delete m_influxdb_client_conn;
+    }
 }
 
 void CMonitorOutputFrontend::enable_json_pretty_print()
@@ -169,7 +202,7 @@ void CMonitorOutputFrontend::get_quoted_tag_value(std::string& out, const char*
 }
 
 std::string CMonitorOutputFrontend::generate_influxdb_line(
-    CMonitorMeasurementVector& measurements, const std::string& meas_name, const std::string& ts_nsec)
+    const CMonitorMeasurementVector& measurements, const std::string& meas_name, const std::string& ts_nsec)
 {
     // format data according to the InfluxDB "line protocol":
     // see https://docs.influxdata.com/influxdb/v1.7/write_protocols/line_protocol_tutorial/
@@ -228,14 +261,14 @@ std::string CMonitorOutputFrontend::generate_influxdb_line(
     return ret;
 }
 
-void CMonitorOutputFrontend::push_current_sections_to_influxdb(bool is_header)
+void CMonitorOutputFrontend::push_current_sections_to_influxdb(const CMonitorOutputSample& sample, bool is_header)
 {
     if (is_header) {
         // instead of actually pushing something towards the InfluxDB server, generate the tagsets:
 
         // collect tags
         std::vector<std::pair<std::string /* tag name */, std::string /* tag value */>> tags;
-        for (auto& sec : m_current_sections) {
+        for (auto& sec : sample.m_sections) {
             if (sec.m_name == "identity") {
                 tags.push_back(std::make_pair("hostname", sec.get_value_for_measurement("hostname")));
 
@@ -270,17 +303,15 @@ void CMonitorOutputFrontend::push_current_sections_to_influxdb(bool is_header)
             "push_current_sections_to_influxdb() generated tagset for InfluxDB:\n %s\n", m_influxdb_tagset.c_str());
 
     } else {
-        struct timeval tv;
-        gettimeofday(&tv, 0);
-        uint64_t ts_nsec = ((uint64_t)tv.tv_sec * 1E9) + ((uint64_t)tv.tv_usec * 1E3);
-
+        // NOTE: use the time the sample was collected, not the time it's being sent, which may be later
+        //       if the output thread is lagging behind
         char ts_nsec_str[64];
-        snprintf(ts_nsec_str, sizeof(ts_nsec_str), "%lu", ts_nsec);
+        snprintf(ts_nsec_str, sizeof(ts_nsec_str), "%lu", sample.m_timestamp_nsec);
 
         std::string all_measurements;
         all_measurements.reserve(4096);
-        for (size_t sec_idx = 0; sec_idx < m_current_sections.size(); sec_idx++) {
-            auto& sec = m_current_sections[sec_idx];
+        for (size_t sec_idx = 0; sec_idx < sample.m_sections.size(); sec_idx++) {
+            auto& sec = sample.m_sections[sec_idx];
             if (sec.m_measurements.empty()) {
 
                 for (size_t subsec_idx = 0; subsec_idx < sec.m_subsections.size(); subsec_idx++) {
@@ -296,16 +327,18 @@ void CMonitorOutputFrontend::push_current_sections_to_influxdb(bool is_header)
                 all_measurements += generate_influxdb_line(sec.m_measurements, sec.m_name, ts_nsec_str);
             }
 
-            if (sec_idx < m_current_sections.size() - 1)
+            if (sec_idx < sample.m_sections.size() - 1)
                 all_measurements += "\n";
         }
 
-        size_t num_measurements = get_current_sample_measurements();
+        size_t num_measurements = get_sample_measurements(sample);
         g_logger.LogDebug(
             "push_current_sections_to_influxdb() pushing to InfluxDB %zu measurements for timestamp: %s\n",
             num_measurements, ts_nsec_str);
 
         post_http_send_line(m_influxdb_client_conn, all_measurements.data(), all_measurements.size());
+        g_self_stats.add_bytes(
+            m_flight_recorder_dump ? SSP_SINK_FLIGHT_RECORDER : SSP_SINK_INFLUXDB, all_measurements.size());
     }
 }
 
@@ -319,95 +352,80 @@ void CMonitorOutputFrontend::push_json_indent(unsigned int indent)
         return;
 
     for (size_t i = 0; i < indent; i++)
-        fputs(m_onelevel_indent_string.c_str(), m_outputJson);
+        json_puts(m_onelevel_indent_string.c_str());
 }
 
-void CMonitorOutputFrontend::push_json_measurements(CMonitorMeasurementVector& measurements, unsigned int indent)
+void CMonitorOutputFrontend::push_json_measurements(const CMonitorMeasurementVector& measurements, unsigned int indent)
 {
     for (size_t n = 0; n < measurements.size(); n++) {
         auto& m = measurements[n];
 
         push_json_indent(indent);
 
-        fputs("\"", m_outputJson);
-        fputs(m.m_name.data(), m_outputJson);
+        json_puts("\"");
+        json_puts(m.m_name.data());
         if (m.m_numeric) {
-            fputs("\": ", m_outputJson);
-            fputs(m.m_value.data(), m_outputJson);
+            json_puts("\": ");
+            json_puts(m.m_value.data());
         } else {
-            fputs("\": \"", m_outputJson);
-            fputs(m.m_value.data(), m_outputJson);
-            fputs("\"", m_outputJson);
+            json_puts("\": \"");
+            json_puts(m.m_value.data());
+            json_puts("\"");
         }
 
         bool last = (n == measurements.size() - 1);
         if (!last)
-            fputs(",", m_outputJson);
+            json_puts(",");
 
         if (m_json_pretty_print)
-            fputs("\n", m_outputJson);
+            json_puts("\n");
     }
 }
 
 void CMonitorOutputFrontend::push_json_object_start(const std::string& str, unsigned int indent)
 {
     push_json_indent(indent);
-    fputs("\"", m_outputJson);
-    fwrite(str.c_str(), 1, str.size(), m_outputJson);
-    fputs("\": {", m_outputJson);
+    json_puts("\"");
+    json_write(str.c_str(), str.size());
+    json_puts("\": {");
 
     if (m_json_pretty_print)
-        fputs("\n", m_outputJson);
+        json_puts("\n");
 }
 
 void CMonitorOutputFrontend::push_json_object_end(bool last, unsigned int indent)
 {
     push_json_indent(indent);
     if (last)
-        fputs("}", m_outputJson);
+        json_puts("}");
     else
-        fputs("},", m_outputJson);
+        json_puts("},");
 
     if (m_json_pretty_print)
-        fputs("\n", m_outputJson);
+        json_puts("\n");
 }
 
 void CMonitorOutputFrontend::push_json_array_start(const std::string& str, unsigned int indent)
 {
     push_json_indent(indent);
-    fputs("\"", m_outputJson);
-    fwrite(str.c_str(), 1, str.size(), m_outputJson);
-    fputs("\": [\n", m_outputJson);
+    json_puts("\"");
+    json_write(str.c_str(), str.size());
+    json_puts("\": [\n");
 }
 
 void CMonitorOutputFrontend::push_json_array_end(unsigned int indent)
 {
     push_json_indent(indent);
-
-    fputs("]\n", m_outputJson);
-    fputs("}\n", m_outputJson);
+    json_puts("]");
 }
 
-void CMonitorOutputFrontend::push_current_sections_to_json(bool is_header)
+void CMonitorOutputFrontend::push_json_sections(const CMonitorOutputSample& sample)
 {
-    // convert the current sample into JSON format:
-
     // we do all the JSON with max 4 indentation levels:
     enum { FIRST_LEVEL = 1, SECOND_LEVEL = 2, THIRD_LEVEL = 3, FOURTH_LEVEL = 4 };
 
-    if (is_header) {
-        fputs("{\n", m_outputJson); // document begin
-        push_json_object_start("header", FIRST_LEVEL);
-    } else {
-        if (m_samples > 0)
-            fputs(",\n", m_outputJson); // add separator from previous sample
-        push_json_indent(FIRST_LEVEL);
-        fputs("{", m_outputJson); // start of new sample inside sample array
-        if (m_json_pretty_print)
-            fputs("\n", m_outputJson);
-    }
-    for (size_t sec_idx = 0; sec_idx < m_current_sections.size(); sec_idx++) {
-        auto& sec = m_current_sections[sec_idx];
+    for (size_t sec_idx = 0; sec_idx < sample.m_sections.size(); sec_idx++) {
+        auto& sec = sample.m_sections[sec_idx];
 
         push_json_object_start(sec.m_name, SECOND_LEVEL);
         if (sec.m_measurements.empty()) {
@@ -421,18 +439,39 @@ void CMonitorOutputFrontend::push_current_sections_to_json(bool is_header)
         } else {
             push_json_measurements(sec.m_measurements, THIRD_LEVEL);
         }
-        push_json_object_end(sec_idx == m_current_sections.size() - 1, SECOND_LEVEL);
+        push_json_object_end(sec_idx == sample.m_sections.size() - 1, SECOND_LEVEL);
+    }
+}
+
+void CMonitorOutputFrontend::push_current_sections_to_json(const CMonitorOutputSample& sample, bool is_header)
+{
+    // convert the current sample into JSON format:
+
+    // we do all the JSON with max 4 indentation levels:
+    enum { FIRST_LEVEL = 1, SECOND_LEVEL = 2, THIRD_LEVEL = 3, FOURTH_LEVEL = 4 };
+
+    if (is_header) {
+        json_puts("{\n"); // document begin
+        push_json_object_start("header", FIRST_LEVEL);
+    } else {
+        if (m_samples > 0)
+            json_puts(",\n"); // add separator from previous sample
+        push_json_indent(FIRST_LEVEL);
+        json_puts("{"); // start of new sample inside sample array
+        if (m_json_pretty_print)
+            json_puts("\n");
     }
+    push_json_sections(sample);
     if (is_header) {
         push_json_indent(FIRST_LEVEL);
-        fputs("},\n", m_outputJson); // for sure at least 1 sample will follow
+        json_puts("},\n"); // for sure at least 1 sample will follow
     } else {
         push_json_indent(FIRST_LEVEL);
-        fputs("}", m_outputJson); // not sure if more samples will follow
+        json_puts("}"); // not sure if more samples will follow
         m_samples++;
     }
 
-    size_t num_measurements = get_current_sample_measurements();
+    size_t num_measurements = get_sample_measurements(sample);
     g_logger.LogDebug(
         "push_current_sections_to_json() writing on the JSON output %lu measurements\n", num_measurements);
 }
@@ -441,27 +480,106 @@ void CMonitorOutputFrontend::push_current_sections_to_json(bool is_header)
 // Generic routines
 //------------------------------------------------------------------------------
 
-void CMonitorOutputFrontend::push_current_sections(bool is_header)
+void CMonitorOutputFrontend::push_sample(const CMonitorOutputSample& sample, bool is_header)
 {
     DEBUGLOG_FUNCTION_START();
 
-    if (m_outputJson)
-        push_current_sections_to_json(is_header);
+    if (m_outputJson) {
+        SelfStatsProbe probe = m_flight_recorder_dump ? SSP_SINK_FLIGHT_RECORDER : SSP_SINK_JSON;
+        CMonitorSelfStats::Timer timer(probe);
+        uint64_t prev_bytes = m_json_bytes;
+        push_current_sections_to_json(sample, is_header);
+        g_self_stats.add_bytes(probe, m_json_bytes - prev_bytes);
+    }
 
-    if (m_influxdb_client_conn)
-        push_current_sections_to_influxdb(is_header);
+    if (m_influxdb_client_conn) {
+        CMonitorSelfStats::Timer timer(m_flight_recorder_dump ? SSP_SINK_FLIGHT_RECORDER : SSP_SINK_INFLUXDB);
+        push_current_sections_to_influxdb(sample, is_header);
+    }
 
     fflush(NULL); /* force I/O output now */
+}
+
+void CMonitorOutputFrontend::push_header()
+{
+    push_sample(m_current_sample, true);
+    m_header_sample = m_current_sample;
+    m_current_sample.clear();
+}
+
+void CMonitorOutputFrontend::stamp_current_sample()
+{
+    if (m_current_sample.m_timestamp_nsec != 0)
+        return;
+
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    m_current_sample.m_timestamp_nsec = ((uint64_t)tv.tv_sec * 1E9) + ((uint64_t)tv.tv_usec * 1E3);
+}
+
+void CMonitorOutputFrontend::push_current_sample()
+{
+    stamp_current_sample();
+
+    if (m_output_thread.joinable()) {
+        // the sample is swapped with a recycled one taken out of the queue: no copies involved
+        if (!m_output_queue.push(m_current_sample))
+            g_logger.LogDebug("Output queue is full: sample dropped");
+    } else {
+        push_sample(m_current_sample, false);
+    }
 
-    // IMPORTANT: clear() but do not shrink_to_fit() to avoid a bunch of reallocations for next sample:
-    m_current_sections.clear();
+    m_current_sample.clear();
 }
 
-size_t CMonitorOutputFrontend::get_current_sample_measurements() const
+void CMonitorOutputFrontend::start_output_thread(size_t queue_size, QueueOverflowPolicy policy)
+{
+    m_output_queue.init(queue_size, policy);
+    m_output_thread = std::thread(&CMonitorOutputFrontend::output_thread_main, this);
+
+    g_logger.LogDebug("Started output thread with a queue of %zu samples", m_output_queue.get_capacity());
+}
+
+void CMonitorOutputFrontend::stop_output_thread()
+{
+    if (!m_output_thread.joinable())
+        return;
+
+    m_output_queue.wakeup_consumer();
+    m_output_thread.join();
+
+    g_logger.LogDebug("Output thread stopped; %lu samples were dropped because the output queue was full",
+        m_output_queue.get_drops());
+}
+
+void CMonitorOutputFrontend::output_thread_main()
+{
+    // signals must be handled by the sampling thread:
+    sigset_t all_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, NULL);
+
+    CMonitorOutputSample sample;
+    while (m_output_queue.pop(sample)) {
+        // a slow sink (e.g. an unreachable InfluxDB server) stalls only this thread:
+        push_sample(sample, false);
+        sample.clear();
+    }
+}
+
+void CMonitorOutputFrontend::merge_sample(CMonitorOutputSample& p)
+{
+    for (auto& sec : p.m_sections)
+        m_current_sample.m_sections.push_back(std::move(sec));
+    p.clear();
+}
+
+/* static */
+size_t CMonitorOutputFrontend::get_sample_measurements(const CMonitorOutputSample& sample)
 {
     size_t ntotal_meas = 0;
-    for (size_t i = 0; i < m_current_sections.size(); i++) {
-        auto& sec = m_current_sections[i];
+    for (size_t i = 0; i < sample.m_sections.size(); i++) {
+        auto& sec = sample.m_sections[i];
         if (sec.m_measurements.empty()) {
             for (size_t i = 0; i < sec.m_subsections.size(); i++) {
                 auto& subsec = sec.m_subsections[i];
@@ -507,7 +625,26 @@ void CMonitorOutputFrontend::psample_array_end()
 {
     if (m_outputJson) {
         push_json_array_end(1);
+
+        if (!m_current_sample.m_sections.empty()) {
+            // some footer sections have been created:
+            json_puts(",\n");
+            push_json_object_start("footer", 1);
+            push_json_sections(m_current_sample);
+            push_json_indent(1);
+            json_puts("}");
+        }
+
+        json_puts("\n}\n"); // document end
     }
+
+    // NOTE: the footer is not sent to InfluxDB: it contains only stats accumulated over the whole run
+    m_current_sample.clear();
+}
+
+void CMonitorOutputFrontend::pfooter_start()
+{
+    // empty for now
 }
 
 void CMonitorOutputFrontend::psample_start()
@@ -519,36 +656,38 @@ void CMonitorOutputFrontend::psection_start(const char* section)
 {
     m_sections++;
 
+    CMonitorOutputSample& target = get_target_sample();
     CMonitorOutputSection sec;
     sec.m_name = section;
-    m_current_sections.push_back(sec);
+    target.m_sections.push_back(sec);
 
     // when adding new measurements, add them as children of this new section:
-    m_current_meas_list = &m_current_sections.back().m_measurements;
+    target.m_current_meas_list = &target.m_sections.back().m_measurements;
 }
 
 void CMonitorOutputFrontend::psection_end()
 {
     // stop adding measurements to last section:
-    m_current_meas_list = nullptr;
+    get_target_sample().m_current_meas_list = nullptr;
 }
 
 void CMonitorOutputFrontend::psubsection_start(const char* resource)
 {
     m_subsections++;
 
+    CMonitorOutputSample& target = get_target_sample();
     CMonitorOutputSubsection sec;
     sec.m_name = resource;
-    m_current_sections.back().m_subsections.push_back(sec);
+    target.m_sections.back().m_subsections.push_back(sec);
 
     // when adding new measurements, add them as children of this new subsection:
-    m_current_meas_list = &m_current_sections.back().m_subsections.back().m_measurements;
+    target.m_current_meas_list = &target.m_sections.back().m_subsections.back().m_measurements;
 }
 
 void CMonitorOutputFrontend::psubsection_end()
 {
     // stop adding measurements to last subsection:
-    m_current_meas_list = nullptr;
+    get_target_sample().m_current_meas_list = nullptr;
 }
 
 //------------------------------------------------------------------------------
@@ -558,37 +697,41 @@ void CMonitorOutputFrontend::psubsection_end()
 void CMonitorOutputFrontend::phex(const char* name, long long value)
 {
     m_hex++;
-    assert(m_current_meas_list);
+    CMonitorMeasurementVector* meas_list = get_target_sample().m_current_meas_list;
+    assert(meas_list);
 
     char buff[128];
     snprintf(buff, sizeof(buff), "0x%08llx", value);
-    m_current_meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
+    meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
 }
 
 void CMonitorOutputFrontend::plong(const char* name, long long value)
 {
     m_long++;
-    assert(m_current_meas_list);
+    CMonitorMeasurementVector* meas_list = get_target_sample().m_current_meas_list;
+    assert(meas_list);
 
     char buff[128];
     snprintf(buff, sizeof(buff), "%lld", value);
-    m_current_meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
+    meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
 }
 
 void CMonitorOutputFrontend::pdouble(const char* name, double value)
 {
     m_double++;
-    assert(m_current_meas_list);
+    CMonitorMeasurementVector* meas_list = get_target_sample().m_current_meas_list;
+    assert(meas_list);
 
     char buff[128];
     snprintf(buff, sizeof(buff), "%.3f", value);
-    m_current_meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
+    meas_list->push_back(CMonitorOutputMeasurement(name, buff, true));
 }
 
 void CMonitorOutputFrontend::pstring(const char* name, const char* value)
 {
     m_string++;
-    assert(m_current_meas_list);
+    CMonitorMeasurementVector* meas_list = get_target_sample().m_current_meas_list;
+    assert(meas_list);
 
-    m_current_meas_list->push_back(CMonitorOutputMeasurement(name, value));
+    meas_list->push_back(CMonitorOutputMeasurement(name, value));
 }
@@ -23,10 +23,13 @@
 // Includes
 //------------------------------------------------------------------------------
 
+#include "spsc_queue.h"
 #include <array>
+#include <atomic>
 #include <set>
 #include <string.h>
 #include <string>
+#include <thread>
 #include <vector>
 
 //------------------------------------------------------------------------------
@@ -58,13 +61,80 @@ typedef struct _influx_client_t influx_client_t;
 //------------------------------------------------------------------------------
 
 class CMonitorOutputFrontend {
+    friend class CMonitorBenchmark; // to measure the low-level JSON/InfluxDB encoders
+
+public:
+    class CMonitorOutputMeasurement {
+    public:
+        CMonitorOutputMeasurement(const char* name = "", const char* value = "", bool numeric = false)
+        {
+            strncpy(m_name.data(), name, CMONITOR_MEASUREMENT_NAME_MAXLEN);
+            strncpy(m_value.data(), value, CMONITOR_MEASUREMENT_VALUE_MAXLEN);
+            m_numeric = numeric;
+        }
+
+        std::array<char, CMONITOR_MEASUREMENT_NAME_MAXLEN> m_name; // use std::array to void dynamic allocations
+        std::array<char, CMONITOR_MEASUREMENT_VALUE_MAXLEN> m_value; // use std::array to void dynamic allocations
+        bool m_numeric;
+    };
+
+    typedef std::vector<CMonitorOutputMeasurement> CMonitorMeasurementVector;
+
+    class CMonitorOutputSubsection {
+    public:
+        std::string m_name;
+        CMonitorMeasurementVector m_measurements;
+
+        std::string get_value_for_measurement(const std::string& name) const
+        {
+            for (const auto& m : m_measurements)
+                if (strncmp(m.m_name.data(), name.c_str(), m.m_name.size()) == 0)
+                    return std::string(m.m_value.data());
+            return "";
+        }
+    };
+
+    class CMonitorOutputSection {
+    public:
+        std::string m_name;
+        std::vector<CMonitorOutputSubsection> m_subsections;
+        CMonitorMeasurementVector m_measurements;
+
+        std::string get_value_for_measurement(const std::string& name) const
+        {
+            for (const auto& m : m_measurements)
+                if (strncmp(m.m_name.data(), name.c_str(), m.m_name.size()) == 0)
+                    return std::string(m.m_value.data());
+            return "";
+        }
+    };
+
+    // All the sections generated so far for a sample.
+    // Collectors running on worker threads fill a private instance which is later merged
+    // into the main one, see set_thread_private_sample() and merge_sample().
+    class CMonitorOutputSample {
+    public:
+        std::vector<CMonitorOutputSection> m_sections;
+        CMonitorMeasurementVector* m_current_meas_list = nullptr;
+        uint64_t m_timestamp_nsec = 0; // wall-clock time at which the sample was completed
+
+        void clear()
+        {
+            // IMPORTANT: clear() but do not shrink_to_fit() to avoid a bunch of reallocations for next sample:
+            m_sections.clear();
+            m_current_meas_list = nullptr;
+            m_timestamp_nsec = 0;
+        }
+    };
+
 public:
     CMonitorOutputFrontend()
     {
-        m_current_sections.reserve(16);
+        m_current_sample.m_sections.reserve(16);
         m_onelevel_indent_string = ""; // using zero space for indentation is just to save disk space
         m_json_pretty_print = false;
     }
+    ~CMonitorOutputFrontend();
 
     //------------------------------------------------------------------------------
     // setup API
@@ -72,7 +142,27 @@ public:
 
     void init_json_output_file(const std::string& filenamePrefix);
     void init_influxdb_connection(const std::string& hostname, unsigned int port);
+
+    // same as above, for a regular file and a remote server, but return false on failure instead of exiting:
+    // to be used from threads other than the main one
+    bool open_json_output_file(const std::string& filenamePrefix);
+    bool open_influxdb_connection(const std::string& hostname, unsigned int port);
     void enable_json_pretty_print();
+    bool is_json_pretty_print() const { return m_json_pretty_print; }
+
+    // the sinks of a flight recorder dump are accounted apart from the regular ones, see --self-stats
+    void set_flight_recorder_dump() { m_flight_recorder_dump = true; }
+
+    // moves the writing of samples to a dedicated thread, fed through a queue of the given size;
+    // must be called after the header has been pushed
+    void start_output_thread(size_t queue_size, QueueOverflowPolicy policy);
+
+    // writes all samples still in the queue and terminates the output thread
+    void stop_output_thread();
+
+    // stats about the output queue:
+    size_t get_output_queue_depth() const { return m_output_thread.joinable() ? m_output_queue.get_depth() : 0; }
+    uint64_t get_output_queue_drops() const { return m_output_thread.joinable() ? m_output_queue.get_drops() : 0; }
 
     //------------------------------------------------------------------------------
     // Sample/Section/Subsection
@@ -82,7 +172,9 @@ public:
     void psample_start();
 
     void psample_array_start();
-    void psample_array_end();
+    void psample_array_end(); // also writes the footer, if any section was created after pfooter_start()
+
+    void pfooter_start();
 
     void psection_start(const char* section);
     void psection_end();
@@ -102,70 +194,53 @@ public:
     void pstats();
 
     //------------------------------------------------------------------------------
-    // Current sample manipulation:
+    // Parallel collection support:
     //------------------------------------------------------------------------------
 
-    size_t get_current_sample_measurements() const;
-    void push_header() { push_current_sections(true); } // writes on file, stdout or socket
-    void push_current_sample() { push_current_sections(false); } // writes on file, stdout or socket
-
-private:
-    class CMonitorOutputMeasurement {
-    public:
-        CMonitorOutputMeasurement(const char* name = "", const char* value = "", bool numeric = false)
-        {
-            strncpy(m_name.data(), name, CMONITOR_MEASUREMENT_NAME_MAXLEN);
-            strncpy(m_value.data(), value, CMONITOR_MEASUREMENT_VALUE_MAXLEN);
-            m_numeric = numeric;
-        }
-
-        std::array<char, CMONITOR_MEASUREMENT_NAME_MAXLEN> m_name; // use std::array to void dynamic allocations
-        std::array<char, CMONITOR_MEASUREMENT_VALUE_MAXLEN> m_value; // use std::array to void dynamic allocations
-        bool m_numeric;
-    };
-
-    typedef std::vector<CMonitorOutputMeasurement> CMonitorMeasurementVector;
+    // redirect all sections/measurements created by the calling thread into the given private sample;
+    // pass nullptr to go back writing into the current sample
+    void set_thread_private_sample(CMonitorOutputSample* p) { ms_thread_private_sample = p; }
 
-    class CMonitorOutputSubsection {
-    public:
-        std::string m_name;
-        CMonitorMeasurementVector m_measurements;
+    // move all sections of the given private sample at the end of the current sample
+    void merge_sample(CMonitorOutputSample& p);
 
-        std::string get_value_for_measurement(const std::string& name) const
-        {
-            for (const auto& m : m_measurements)
-                if (strncmp(m.m_name.data(), name.c_str(), m.m_name.size()) == 0)
-                    return std::string(m.m_value.data());
-            return "";
-        }
-    };
+    //------------------------------------------------------------------------------
+    // Current sample manipulation:
+    //------------------------------------------------------------------------------
 
-    class CMonitorOutputSection {
-    public:
-        std::string m_name;
-        std::vector<CMonitorOutputSubsection> m_subsections;
-        CMonitorMeasurementVector m_measurements;
+    size_t get_current_sample_measurements() const { return get_sample_measurements(m_current_sample); }
+    const CMonitorOutputSample& get_current_sample() const { return m_current_sample; }
+    const CMonitorOutputSample& get_header_sample() const { return m_header_sample; }
+    void set_current_sample_timestamp(uint64_t timestamp_nsec) { m_current_sample.m_timestamp_nsec = timestamp_nsec; }
+    void stamp_current_sample(); // sets the timestamp of the current sample to now, unless already set
+    void discard_current_sample() { m_current_sample.clear(); }
+    void push_header(); // writes on file, stdout or socket
+    void push_current_sample(); // writes on file, stdout or socket, or enqueues for the output thread
 
-        std::string get_value_for_measurement(const std::string& name) const
-        {
-            for (const auto& m : m_measurements)
-                if (strncmp(m.m_name.data(), name.c_str(), m.m_name.size()) == 0)
-                    return std::string(m.m_value.data());
-            return "";
-        }
-    };
+private:
+    CMonitorOutputSample& get_target_sample()
+    {
+        return ms_thread_private_sample ? *ms_thread_private_sample : m_current_sample;
+    }
 
     //------------------------------------------------------------------------------
     // JSON low-level functions
     //------------------------------------------------------------------------------
 
     void push_json_indent(unsigned int indent);
-    void push_json_measurements(CMonitorMeasurementVector& measurements, unsigned int indent);
+    void push_json_measurements(const CMonitorMeasurementVector& measurements, unsigned int indent);
     void push_json_object_start(const std::string& str, unsigned int indent);
     void push_json_object_end(bool last, unsigned int indent);
     void push_json_array_start(const std::string& str, unsigned int indent);
     void push_json_array_end(unsigned int indent);
-    void push_current_sections_to_json(bool is_header);
+    void push_json_sections(const CMonitorOutputSample& sample);
+    void json_puts(const char* str) { json_write(str, strlen(str)); }
+    void json_write(const char* str, size_t len)
+    {
+        fwrite(str, 1, len, m_outputJson);
+        m_json_bytes += len;
+    }
+    void push_current_sections_to_json(const CMonitorOutputSample& sample, bool is_header);
 
     //------------------------------------------------------------------------------
     // InfluxDB low-level functions
@@ -176,17 +251,24 @@ private:
     static void get_quoted_tag_value(std::string& out, const char* value);
 
     std::string generate_influxdb_line(
-        CMonitorMeasurementVector& measurements, const std::string& meas_name, const std::string& ts_nsec);
+        const CMonitorMeasurementVector& measurements, const std::string& meas_name, const std::string& ts_nsec);
 
-    void push_current_sections_to_influxdb(bool is_header);
+    void push_current_sections_to_influxdb(const CMonitorOutputSample& sample, bool is_header);
 
     // main output routine:
-    void push_current_sections(bool is_header);
+    static size_t get_sample_measurements(const CMonitorOutputSample& sample);
+    void push_sample(const CMonitorOutputSample& sample, bool is_header);
+    void output_thread_main();
 
 private:
     // Structured measurements generated so far for last sample:
-    std::vector<CMonitorOutputSection> m_current_sections;
-    CMonitorMeasurementVector* m_current_meas_list = nullptr;
+    CMonitorOutputSample m_current_sample;
+    CMonitorOutputSample m_header_sample; // a copy of the header, pushed once at startup
+    static thread_local CMonitorOutputSample* ms_thread_private_sample;
+
+    // Output thread internals
+    std::thread m_output_thread;
+    CMonitorSpscQueue<CMonitorOutputSample> m_output_queue;
 
     // InfluxDB internals
     influx_client_t* m_influxdb_client_conn = nullptr;
@@ -196,15 +278,19 @@ private:
     FILE* m_outputJson = nullptr;
     std::string m_onelevel_indent_string;
     bool m_json_pretty_print = false;
+    uint64_t m_json_bytes = 0; // updated only by the thread writing the output
+    bool m_flight_recorder_dump = false;
 
     // Stats on the generated output
-    unsigned int m_samples = 0;
-    unsigned int m_sections = 0;
-    unsigned int m_subsections = 0;
-    unsigned int m_string = 0;
-    unsigned int m_long = 0;
-    unsigned int m_double = 0;
-    unsigned int m_hex = 0;
+    unsigned int m_samples = 0; // read and updated only by the thread writing the output
+    // NOTE: the counters below are instead updated by psection_start() & co, which may be called
+    //       concurrently by the collectors running on worker threads
+    std::atomic<unsigned int> m_sections { 0 };
+    std::atomic<unsigned int> m_subsections { 0 };
+    std::atomic<unsigned int> m_string { 0 };
+    std::atomic<unsigned int> m_long { 0 };
+    std::atomic<unsigned int> m_double { 0 };
+    std::atomic<unsigned int> m_hex { 0 };
 };
 
 extern CMonitorOutputFrontend g_output;
@@ -0,0 +1,331 @@
+/*
+ * proc_events.cpp -- incremental tracking of the processes of a cgroup using the
+ *                    fork/exec/exit events of the kernel process connector
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/netlink.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+
+// ----------------------------------------------------------------------------------
+// Constants
+// ----------------------------------------------------------------------------------
+
+// the kernel drops events when the socket buffer is full, e.g. during a burst of process creations:
+// 4MB hold about 50k events
+#define PROC_EVENTS_SOCKET_BUFFER_SIZE (4 * 1024 * 1024)
+#define PROC_EVENTS_RECV_BUFFER_SIZE (64 * 1024)
+
+// ----------------------------------------------------------------------------------
+// CMonitorProcEvents
+// ----------------------------------------------------------------------------------
+
+bool CMonitorProcEvents::start(OutputFields output_opts, const std::string& taskstats_cpumask)
+{
+    m_socket = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_CONNECTOR);
+    if (m_socket == -1) {
+        g_logger.LogError("Cannot open the netlink connector socket: %s", strerror(errno));
+        return false;
+    }
+
+    // SO_RCVBUFFORCE allows to go beyond the rmem_max limit but requires CAP_NET_ADMIN, which we need anyway
+    int bufsize = PROC_EVENTS_SOCKET_BUFFER_SIZE;
+    if (setsockopt(m_socket, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) != 0)
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    struct sockaddr_nl addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    addr.nl_pid = 0; // let the kernel assign the port ID
+    if (bind(m_socket, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        g_logger.LogError("Cannot bind to the proc connector: %s", strerror(errno));
+        stop();
+        return false;
+    }
+
+    if (!send_mcast_op(PROC_CN_MCAST_LISTEN)) {
+        g_logger.LogError("Cannot subscribe to the proc connector: %s", strerror(errno));
+        stop();
+        return false;
+    }
+
+    if (pipe2(m_stop_pipe, O_CLOEXEC) != 0) {
+        g_logger.LogError("Cannot create the pipe to stop the proc connector listener: %s", strerror(errno));
+        stop();
+        return false;
+    }
+
+    // the kernel sends the taskstats exit record of a process before its exit event: when both are pending, the
+    // listener handles the taskstats first, so that the final stats are ready when the exit event is handled
+    if (!taskstats_cpumask.empty()) {
+        if (!m_taskstats.open() || !m_taskstats.register_exits(taskstats_cpumask)) {
+            g_logger.LogError("Cannot receive the taskstats exit records: reading /proc for exited processes");
+            m_taskstats.close();
+        }
+    }
+
+    m_output_opts = output_opts;
+    m_resync_needed = true;
+
+    // signals like SIGTERM/SIGINT must be delivered to the main thread, see CMonitorWorkerPool::start()
+    sigset_t all_signals, orig_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &orig_signals);
+    m_listener_alive = true;
+    m_thread = std::thread(&CMonitorProcEvents::listener_main, this);
+    pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+
+    g_logger.LogDebug("Subscribed to the process events of the proc connector");
+    return true;
+}
+
+void CMonitorProcEvents::stop()
+{
+    if (m_thread.joinable()) {
+        char c = 0;
+        if (write(m_stop_pipe[1], &c, 1) != 1)
+            g_logger.LogError("Cannot wake up the proc connector listener: %s", strerror(errno));
+        m_thread.join();
+    }
+
+    m_taskstats.close();
+    m_taskstats_exits.clear();
+
+    if (m_socket != -1) {
+        send_mcast_op(PROC_CN_MCAST_IGNORE);
+        close(m_socket);
+        m_socket = -1;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (m_stop_pipe[i] != -1) {
+            close(m_stop_pipe[i]);
+            m_stop_pipe[i] = -1;
+        }
+    }
+}
+
+bool CMonitorProcEvents::get_tracked(std::vector<pid_t>& pids)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_resync_needed) {
+        // the caller is going to rebuild the tracked set through track()
+        m_resync_needed = false;
+        return false;
+    }
+
+    pids.assign(m_tracked.begin(), m_tracked.end());
+    return true;
+}
+
+void CMonitorProcEvents::track(const std::vector<pid_t>& pids)
+{
+    // NOTE: the processes forked while the caller was reading the cgroup "tasks" file must not be lost:
+    //       the given processes are added to the tracked set, not replacing it
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracked.insert(pids.begin(), pids.end());
+}
+
+void CMonitorProcEvents::untrack(pid_t pid)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_tracked.erase(pid);
+}
+
+void CMonitorProcEvents::take_exited(std::vector<exited_proc_t>& exited)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    exited.swap(m_exited);
+    m_exited.clear();
+}
+
+bool CMonitorProcEvents::send_mcast_op(int op)
+{
+    alignas(struct nlmsghdr) char buf[NLMSG_SPACE(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op))];
+    memset(buf, 0, sizeof(buf));
+
+    struct nlmsghdr* hdr = (struct nlmsghdr*)buf;
+    hdr->nlmsg_len = NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    hdr->nlmsg_type = NLMSG_DONE;
+
+    struct cn_msg* msg = (struct cn_msg*)NLMSG_DATA(hdr);
+    msg->id.idx = CN_IDX_PROC;
+    msg->id.val = CN_VAL_PROC;
+    msg->len = sizeof(enum proc_cn_mcast_op);
+
+    enum proc_cn_mcast_op mcast_op = (enum proc_cn_mcast_op)op;
+    memcpy(msg->data, &mcast_op, sizeof(mcast_op));
+
+    return send(m_socket, hdr, hdr->nlmsg_len, 0) == (ssize_t)hdr->nlmsg_len;
+}
+
+void CMonitorProcEvents::listener_main()
+{
+    alignas(struct nlmsghdr) char buf[PROC_EVENTS_RECV_BUFFER_SIZE];
+
+    struct pollfd fds[3];
+    fds[0].fd = m_socket;
+    fds[0].events = POLLIN;
+    fds[1].fd = m_stop_pipe[0];
+    fds[1].events = POLLIN;
+    fds[2].fd = m_taskstats.get_socket(); // negative and thus ignored by poll() if not open
+    fds[2].events = POLLIN;
+
+    while (true) {
+        if (poll(fds, 3, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            g_logger.LogError("Failed waiting for process events, falling back to reading the cgroup tasks file: %s",
+                strerror(errno));
+            break;
+        }
+        if (fds[1].revents != 0)
+            break; // stop() has been called
+        if (fds[2].revents != 0)
+            handle_taskstats_exits();
+        if (fds[0].revents == 0)
+            continue;
+
+        ssize_t len = recv(m_socket, buf, sizeof(buf), MSG_DONTWAIT);
+        if (len < 0) {
+            if (errno == ENOBUFS) {
+                // the kernel dropped some events: the tracked set is not reliable anymore and the
+                // taskstats exit records of the processes whose exit event was lost would never be used
+                m_taskstats_exits.clear();
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_resync_needed = true;
+                m_num_overruns++;
+                continue;
+            }
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            g_logger.LogError("Failed reading process events, falling back to reading the cgroup tasks file: %s",
+                strerror(errno));
+            break;
+        }
+
+        handle_events(buf, len);
+    }
+
+    // the exit events of the processes not yet reported are lost: the collector resyncs with the tasks file
+    m_listener_alive = false;
+}
+
+void CMonitorProcEvents::handle_events(const char* buf, size_t len)
+{
+    int remaining = (int)len;
+    for (const struct nlmsghdr* hdr = (const struct nlmsghdr*)buf; NLMSG_OK(hdr, remaining);
+         hdr = NLMSG_NEXT(hdr, remaining)) {
+        if (hdr->nlmsg_type != NLMSG_DONE)
+            continue; // the proc connector sends each event as a single-part message
+
+        const struct cn_msg* msg = (const struct cn_msg*)NLMSG_DATA(hdr);
+        if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC)
+            continue;
+
+        const struct proc_event* ev = (const struct proc_event*)msg->data;
+        m_num_events++;
+
+        switch (ev->what) {
+        case proc_event::PROC_EVENT_FORK: {
+            // new threads are notified as forks as well: ignore them
+            if (ev->event_data.fork.child_pid != ev->event_data.fork.child_tgid)
+                break;
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_tracked.count(ev->event_data.fork.parent_tgid))
+                m_tracked.insert(ev->event_data.fork.child_pid);
+        } break;
+
+        case proc_event::PROC_EVENT_EXEC:
+            // the command name changes, but it is read anyway from /proc at each sample and at exit
+            break;
+
+        case proc_event::PROC_EVENT_EXIT: {
+            pid_t pid = ev->event_data.exit.process_pid;
+            if (pid != ev->event_data.exit.process_tgid)
+                break; // a thread
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (m_tracked.erase(pid) == 0)
+                    break;
+            }
+
+            exited_proc_t exited;
+            exited.pid = pid;
+            exited.exit_code = ev->event_data.exit.exit_code;
+            memset(&exited.final_counters, 0, sizeof(exited.final_counters));
+            memset(&exited.final_gauges, 0, sizeof(exited.final_gauges));
+            memset(&exited.final_identity, 0, sizeof(exited.final_identity));
+
+            auto it = m_taskstats_exits.find(pid);
+            if (it != m_taskstats_exits.end() && it->second.has_pid_stats) {
+                cgroup_proc_taskstats(
+                    it->second, &exited.final_counters, &exited.final_gauges, &exited.final_identity);
+                exited.has_final_stats = true;
+            } else {
+                // the event is sent while the process is exiting: its /proc files are still readable until
+                // its parent reaps it, so read them right away without holding the lock
+                exited.has_final_stats = cgroup_proc_procsinfo(m_pid_file, pid, &exited.final_counters,
+                    &exited.final_gauges, &exited.final_identity, PROC_READ_PARTS(m_output_opts), NULL,
+                    false /* the race with reaping is expected */);
+            }
+            if (it != m_taskstats_exits.end())
+                m_taskstats_exits.erase(it);
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_exited.push_back(exited);
+        } break;
+
+        default:
+            break;
+        }
+    }
+}
+
+void CMonitorProcEvents::handle_taskstats_exits()
+{
+    m_taskstats_records.clear();
+    if (!m_taskstats.receive_exits(m_taskstats_records))
+        m_num_overruns++; // the final stats of the affected processes are read from /proc
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    for (const process_taskstats_t& rec : m_taskstats_records) {
+        // records are sent for all tasks of the system: keep only those of tracked processes, i.e. the main
+        // thread record and, for multi-threaded processes, the per-TGID record of the whole process
+        if (m_tracked.count(rec.pid) == 0)
+            continue;
+
+        process_taskstats_t& stats = m_taskstats_exits[rec.pid];
+        stats.pid = rec.pid;
+        if (rec.has_pid_stats) {
+            stats.pid_stats = rec.pid_stats;
+            stats.has_pid_stats = true;
+        } else {
+            stats.tgid_stats = rec.tgid_stats;
+            stats.has_tgid_stats = true;
+        }
+    }
+}
@@ -0,0 +1,245 @@
+/*
+ * proc_file.cpp -- persistent-fd reader for /proc and /sys files
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "proc_file.h"
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// CMonitorProcFile
+//------------------------------------------------------------------------------
+
+unsigned int CMonitorProcFile::s_generation = 0;
+CMonitorProcFileObserver* CMonitorProcFile::s_observer = nullptr;
+
+CMonitorProcFile::~CMonitorProcFile()
+{
+    close();
+    free(m_buffer);
+}
+
+bool CMonitorProcFile::open(const char* path)
+{
+    close();
+    m_path = path; // no allocation once m_path has grown enough
+    m_generation = s_generation;
+    m_fd = ::open(path, O_RDONLY | O_CLOEXEC);
+    return m_fd != -1;
+}
+
+bool CMonitorProcFile::open_at(int dir_fd, const char* dir_path, const char* relative_path)
+{
+    close();
+    m_path = dir_path; // no allocation once m_path has grown enough
+    m_path += '/';
+    m_path += relative_path;
+    m_generation = s_generation;
+    m_fd = ::openat(dir_fd, relative_path, O_RDONLY | O_CLOEXEC);
+    return m_fd != -1;
+}
+
+void CMonitorProcFile::adopt(int fd, const char* path)
+{
+    close();
+    m_path = path;
+    m_generation = s_generation;
+    m_fd = fd;
+}
+
+int CMonitorProcFile::release()
+{
+    int fd = m_fd;
+    m_fd = -1;
+    return fd;
+}
+
+void CMonitorProcFile::close()
+{
+    if (m_fd != -1) {
+        ::close(m_fd);
+        m_fd = -1;
+    }
+    m_size = 0;
+}
+
+bool CMonitorProcFile::grow_buffer()
+{
+    size_t new_capacity = m_capacity ? m_capacity * 2 : PROC_FILE_INITIAL_BUFFER_SIZE;
+
+    // +1 for the NUL terminator
+    void* p = nullptr;
+    if (posix_memalign(&p, PROC_FILE_BUFFER_ALIGNMENT, new_capacity + 1) != 0)
+        return false;
+    if (m_size)
+        memcpy(p, m_buffer, m_size);
+    free(m_buffer);
+
+    m_buffer = (char*)p;
+    m_capacity = new_capacity;
+    return true;
+}
+
+const char* CMonitorProcFile::read(const std::string& dir, const char* filename)
+{
+    if (m_generation != s_generation)
+        close();
+
+    // the same instance may be used in turn for different files: compare the path of the open
+    // file in place, without building <dir><filename>, since the match is the common case
+    size_t dir_len = dir.size(), filename_len = strlen(filename);
+    if (m_fd != -1
+        && (m_path.size() != dir_len + filename_len || m_path.compare(0, dir_len, dir) != 0
+            || m_path.compare(dir_len, filename_len, filename) != 0))
+        close();
+    if (m_fd == -1 && !open(dir + filename))
+        return nullptr;
+
+    const char* ret = read();
+    if (!ret)
+        close(); // e.g. the cgroup or the network interface went away: retry to open it next time
+    return ret;
+}
+
+const char* CMonitorProcFile::read()
+{
+    if (m_generation != s_generation)
+        close();
+    if (m_fd == -1)
+        return nullptr;
+
+    // NOTE: files generated through seq_file may return less bytes than requested
+    //       even if there's more data available: keep reading until EOF
+    m_size = 0;
+    while (true) {
+        if (m_size == m_capacity && !grow_buffer())
+            return nullptr;
+
+        ssize_t n = pread(m_fd, m_buffer + m_size, m_capacity - m_size, m_size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            m_size = 0;
+            return nullptr;
+        }
+        if (n == 0)
+            break;
+        m_size += n;
+    }
+
+    m_buffer[m_size] = 0;
+    if (s_observer)
+        s_observer->on_file_read(m_path, m_buffer, m_size);
+    return m_buffer;
+}
+
+//------------------------------------------------------------------------------
+// CMonitorKeyValueParser
+//------------------------------------------------------------------------------
+
+static inline bool is_label_char(char c)
+{
+    return (unsigned char)c > ' ' && c != ':' && c != ')';
+}
+
+// parses the value after the label and its separator, e.g. "   1234 kB"
+static inline int64_t parse_value(const char*& p)
+{
+    while (*p == ':' || *p == ')' || *p == ' ' || *p == '\t')
+        p++;
+
+    int64_t value = 0;
+    proc_parse_int(p, value);
+    proc_skip_spaces(p);
+    if (proc_starts_with(p, "kB", 2))
+        value *= 1000;
+    return value;
+}
+
+void CMonitorKeyValueParser::parse(
+    const char* data, const std::set<std::string>& allowed_labels, const char* label_prefix)
+{
+    if (m_num_learns == 0 || !parse_learnt(data))
+        learn(data, allowed_labels, label_prefix);
+}
+
+bool CMonitorKeyValueParser::parse_learnt(const char* data)
+{
+    const char* p = data;
+    size_t line = 0;
+    for (entry_t& entry : m_entries) {
+        for (; line < entry.line; line++)
+            if (!proc_next_line(p))
+                return false; // file got shorter
+
+        const char* q = p;
+        proc_skip_spaces(q);
+        size_t len = entry.raw_label.size();
+        if (memcmp(q, entry.raw_label.data(), len) != 0 || is_label_char(q[len]))
+            return false; // a different label on this line
+
+        q += len;
+        entry.value = parse_value(q);
+    }
+
+    if (m_select_all) {
+        // new lines would be missed otherwise
+        while (proc_next_line(p))
+            line++;
+        if (line + 1 != m_num_lines)
+            return false;
+    }
+    return true;
+}
+
+void CMonitorKeyValueParser::learn(
+    const char* data, const std::set<std::string>& allowed_labels, const char* label_prefix)
+{
+    m_entries.clear();
+    m_select_all = allowed_labels.empty();
+    m_num_lines = 0;
+    m_num_learns++;
+
+    size_t prefix_len = strlen(label_prefix);
+    const char* p = data;
+    do {
+        size_t line = m_num_lines++;
+
+        proc_skip_spaces(p);
+        const char* raw_label = p;
+        while (is_label_char(*p))
+            p++;
+        if (p == raw_label || !proc_starts_with(raw_label, label_prefix, prefix_len))
+            continue;
+
+        entry_t entry;
+        entry.raw_label.assign(raw_label, p - raw_label);
+        entry.label = entry.raw_label;
+        std::replace(entry.label.begin(), entry.label.end(), '(', '_');
+        if (!m_select_all && allowed_labels.find(entry.label) == allowed_labels.end())
+            continue;
+
+        entry.line = line;
+        entry.value = parse_value(p);
+        m_entries.push_back(entry);
+    } while (proc_next_line(p));
+}
@@ -0,0 +1,297 @@
+/*
+ * proc_file.h -- persistent-fd reader for /proc and /sys files plus the
+ *                small tokenizer used by all collectors to parse them
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <set>
+#include <stddef.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+#define PROC_FILE_BUFFER_ALIGNMENT (64)
+#define PROC_FILE_INITIAL_BUFFER_SIZE (4096)
+
+//------------------------------------------------------------------------------
+// CMonitorProcFileObserver
+//
+// Receives the contents of every file successfully read by any CMonitorProcFile
+// instance; used by --record to snapshot all the files read at each tick.
+// NOTE: on_file_read() may be called concurrently by the collector threads.
+//------------------------------------------------------------------------------
+
+class CMonitorProcFileObserver {
+public:
+    virtual ~CMonitorProcFileObserver() {}
+    virtual void on_file_read(const std::string& path, const char* data, size_t size) = 0;
+};
+
+//------------------------------------------------------------------------------
+// CMonitorProcFile
+//
+// Opens a /proc or /sys file once and keeps its file descriptor; each read()
+// re-reads the whole file with pread() from offset 0 (which makes the kernel
+// regenerate its contents) into a cache-line aligned buffer that is reused
+// across reads and grown only when the file does not fit anymore.
+// The buffer is always NUL-terminated so that it can be parsed in-place with
+// the tokenizer functions below.
+// The same instance can also be open()ed in turn on different files (e.g.
+// /proc/<pid>/stat for many PIDs) to reuse a single buffer for all of them.
+// When the procfs/sysfs roots are moved (e.g. by --replay at each tick) all
+// instances can be invalidated at once: each of them closes its file at next
+// read() and read(dir, filename) then reopens it below the new root.
+//------------------------------------------------------------------------------
+
+class CMonitorProcFile {
+public:
+    CMonitorProcFile() {}
+    ~CMonitorProcFile();
+
+    // non-copyable: each instance owns a file descriptor and a buffer
+    CMonitorProcFile(const CMonitorProcFile&) = delete;
+    CMonitorProcFile& operator=(const CMonitorProcFile&) = delete;
+
+    // opens the given file, closing any previously-opened one; the buffer is kept
+    bool open(const char* path);
+    bool open(const std::string& path) { return open(path.c_str()); }
+
+    // same as open() but relative to the given directory, which saves the kernel the lookup of all
+    // the path components of the directory, when many files are opened below it; dir_path is its path
+    bool open_at(int dir_fd, const char* dir_path, const char* relative_path);
+
+    // adopt() takes the ownership of a descriptor opened on the given path, e.g. one kept open across samples
+    // by the caller, and release() gives it back: the descriptor is not closed and the buffer is kept
+    void adopt(int fd, const char* path);
+    int release();
+    void close();
+    bool is_open() const { return m_fd != -1; }
+    const std::string& get_path() const { return m_path; }
+
+    // opens the file <dir><filename> at first call, then re-reads it; returns nullptr on failure
+    // (and in that case the file is closed so that next call retries to open it);
+    // if a different file is open, e.g. because dir or filename changed, it is closed and <dir><filename> opened
+    const char* read(const std::string& dir, const char* filename);
+
+    // re-reads the currently-open file; returns nullptr on failure
+    const char* read();
+
+    // returns the contents obtained by the last successful read()
+    const char* get_data() const { return m_buffer; }
+    size_t get_size() const { return m_size; }
+
+    // makes all instances close their file at next read(); not thread-safe: call it between two samples
+    static void invalidate_all() { s_generation++; }
+    static unsigned int get_generation() { return s_generation; } // changes at each invalidate_all()
+
+    // installs the observer notified of all successful reads (nullptr to remove it)
+    static void set_observer(CMonitorProcFileObserver* observer) { s_observer = observer; }
+    static bool has_observer() { return s_observer != nullptr; }
+
+private:
+    bool grow_buffer();
+
+private:
+    static unsigned int s_generation;
+    static CMonitorProcFileObserver* s_observer;
+
+    unsigned int m_generation = 0; // value of s_generation when the file was opened
+    int m_fd = -1;
+    std::string m_path;
+    char* m_buffer = nullptr;
+    size_t m_capacity = 0; // not counting the NUL terminator
+    size_t m_size = 0;
+};
+
+//------------------------------------------------------------------------------
+// Tokenizer
+//
+// All functions take a reference to a pointer inside a NUL-terminated buffer
+// and advance it past what they consumed; none of them ever crosses the NUL.
+//------------------------------------------------------------------------------
+
+static inline void proc_skip_spaces(const char*& p)
+{
+    while (*p == ' ' || *p == '\t')
+        p++;
+}
+
+// skips a whitespace-delimited token (and the whitespace after it)
+static inline void proc_skip_token(const char*& p)
+{
+    while ((unsigned char)*p > ' ')
+        p++;
+    proc_skip_spaces(p);
+}
+
+// moves to the beginning of next line; returns false at the end of the buffer
+static inline bool proc_next_line(const char*& p)
+{
+    while (*p != '\n' && *p != 0)
+        p++;
+    if (*p == 0)
+        return false;
+    p++;
+    return *p != 0;
+}
+
+// returns true if the current token starts with the given prefix
+static inline bool proc_starts_with(const char* p, const char* prefix, size_t prefix_len)
+{
+    for (size_t i = 0; i < prefix_len; i++)
+        if (p[i] != prefix[i])
+            return false;
+    return true;
+}
+
+// Parses an unsigned decimal integer, skipping leading blanks. The only branch
+// in the loop is the digit check: (c - '0') wraps around for non-digits and is
+// thus caught by a single unsigned comparison.
+// Returns false (without consuming anything but blanks) if no digit is found.
+static inline bool proc_parse_uint(const char*& p, uint64_t& value)
+{
+    proc_skip_spaces(p);
+    uint64_t v = 0;
+    const char* start = p;
+    unsigned int d = (unsigned char)*p - '0';
+    while (d < 10) {
+        v = v * 10 + d;
+        d = (unsigned char)*++p - '0';
+    }
+    value = v;
+    return p != start;
+}
+
+// same as proc_parse_uint() but accepts an optional leading minus sign
+static inline bool proc_parse_int(const char*& p, int64_t& value)
+{
+    proc_skip_spaces(p);
+    bool negative = (*p == '-');
+    p += negative;
+    uint64_t v;
+    if (!proc_parse_uint(p, v))
+        return false;
+    value = negative ? -(int64_t)v : (int64_t)v;
+    return true;
+}
+
+// parses a non-negative decimal number with an optional fractional part, e.g. "0.52"
+static inline bool proc_parse_udouble(const char*& p, double& value)
+{
+    uint64_t int_part;
+    if (!proc_parse_uint(p, int_part))
+        return false;
+
+    value = (double)int_part;
+    if (*p == '.') {
+        p++;
+        double scale = 0.1;
+        unsigned int d = (unsigned char)*p - '0';
+        while (d < 10) {
+            value += d * scale;
+            scale /= 10;
+            d = (unsigned char)*++p - '0';
+        }
+    }
+    return true;
+}
+
+// Copies the label at the beginning of a "label: value" or "label value" line into the given
+// buffer, escaping characters that we don't like in JSON output: e.g. "Active(anon):" becomes
+// "Active_anon". Then skips the separator, so that the value can be parsed right away.
+// Returns the length of the label.
+static inline size_t proc_parse_label(const char*& p, char* label, size_t label_size)
+{
+    size_t len = 0;
+    proc_skip_spaces(p);
+    while ((unsigned char)*p > ' ' && *p != ':' && *p != ')') {
+        if (len < label_size - 1)
+            label[len++] = (*p == '(') ? '_' : *p;
+        p++;
+    }
+    label[len] = 0;
+    while (*p == ':' || *p == ')' || *p == ' ' || *p == '\t')
+        p++;
+    return len;
+}
+
+// parses up to max_values unsigned integers from current line; returns how many were found
+static inline unsigned int proc_parse_uint_array(const char*& p, uint64_t* values, unsigned int max_values)
+{
+    unsigned int n = 0;
+    while (n < max_values && proc_parse_uint(p, values[n]))
+        n++;
+    return n;
+}
+
+//------------------------------------------------------------------------------
+// CMonitorKeyValueParser
+//
+// Parser for the "label value" / "label: value [kB]" files, like /proc/meminfo,
+// /proc/vmstat and memory.stat, whose list of labels does not change until
+// next reboot. The first parse() checks every label against the selection and
+// learns which lines must be extracted; next parse()s only skip to those
+// lines, verify the raw label with a memcmp() and parse the value, without
+// copying or looking up any string. Whenever the verification fails (e.g. a
+// different kernel during --replay) the file is learnt again from scratch.
+//------------------------------------------------------------------------------
+
+class CMonitorKeyValueParser {
+public:
+    CMonitorKeyValueParser() {}
+
+    // Parses the given NUL-terminated buffer. At first call (and whenever the layout changes)
+    // the lines whose label starts with label_prefix and is contained in allowed_labels (or any
+    // label if allowed_labels is empty) are selected; label_prefix and allowed_labels must be the
+    // same at every call. Values followed by "kB" are multiplied by 1000.
+    void parse(const char* data, const std::set<std::string>& allowed_labels, const char* label_prefix = "");
+
+    // the values extracted by last parse(), in file order
+    size_t size() const { return m_entries.size(); }
+    const char* get_label(size_t i) const { return m_entries[i].label.c_str(); }
+    int64_t get_value(size_t i) const { return m_entries[i].value; }
+
+    // number of times the file layout has been learnt so far
+    unsigned int get_num_learns() const { return m_num_learns; }
+
+private:
+    bool parse_learnt(const char* data);
+    void learn(const char* data, const std::set<std::string>& allowed_labels, const char* label_prefix);
+
+private:
+    struct entry_t {
+        size_t line; // 0-based line number
+        std::string raw_label; // as found in the file, e.g. "Active(anon"
+        std::string label; // as emitted, e.g. "Active_anon"
+        int64_t value;
+    };
+
+    std::vector<entry_t> m_entries;
+    bool m_select_all = false; // all lines (having label_prefix) are selected
+    size_t m_num_lines = 0; // total lines of the file, checked only when m_select_all is true
+    unsigned int m_num_learns = 0;
+};
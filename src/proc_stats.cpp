@@ -20,14 +20,13 @@
 
 #include "cmonitor.h"
 #include "output_frontend.h"
+#include <algorithm>
 #include <assert.h>
+#include <dirent.h>
+#include <fnmatch.h>
 #include <mntent.h>
 #include <sys/vfs.h>
 
-#define MAX_LOGICAL_CPU (256)
-#define DELTA_TOTAL(stat) ((float)(stat - total_cpu.stat) / (float)elapsed_sec / ((float)(max_cpu_count + 1.0)))
-#define DELTA_LOGICAL(stat) ((float)(stat - logical_cpu[cpuno].stat) / (float)elapsed_sec)
-
 /*
 Reads files in one of the 3 formats supported below:
 
@@ -36,150 +35,76 @@ name: number
 name: number kB
 
 */
-void CMonitorCollectorApp::proc_read_numeric_stats_from(
+void CMonitorCollectorApp::proc_read_numeric_stats_from(CMonitorProcFile& file, CMonitorKeyValueParser& parser,
     const char* statname, const std::set<std::string>& allowedStatsNames)
 {
-    FILE* fp = 0;
-    char line[1024];
     char filename[1024];
     char label[512];
-    char number[512];
-    int i;
-    int len;
 
     DEBUGLOG_FUNCTION_START();
-    sprintf(filename, "/proc/%s", statname);
-    if ((fp = fopen(filename, "r")) == NULL) {
-        g_logger.LogError("Failed to open performance file %s", filename);
+    sprintf(filename, "/%s", statname);
+    const char* p = file.read(g_cfg.m_strProcRoot, filename);
+    if (p == NULL) {
+        g_logger.LogError("Failed to read performance file %s%s", g_cfg.m_strProcRoot.c_str(), filename);
         return;
     }
+    parser.parse(p, allowedStatsNames /* all stats must be put in output when empty */);
+
     sprintf(label, "proc_%s", statname);
     g_output.psection_start(label);
-    while (fgets(line, 1000, fp) != NULL) {
-        len = strlen(line);
-        bool is_kb = false;
-        for (i = 0; i < len; i++) {
-
-            // escape characters that we don't like in JSON output:
-            if (line[i] == '(')
-                line[i] = '_';
-            if (line[i] == ')')
-                line[i] = ' ';
-            if (line[i] == ':')
-                line[i] = ' ';
-            if (line[i] == '\n') {
-                line[i] = 0;
-                if (i > 3 && line[i - 2] == 'k' && line[i - 1] == 'B')
-                    is_kb = true;
-            }
-        }
-        sscanf(line, "%s %s", label, number);
-        // g_logger.LogDebug("read_data_numer(%s) |%s| |%s|=%lld\n", statname, label, numstr, atoll(numstr));
-
-        if (allowedStatsNames.empty() /* all stats must be put in output */
-            || allowedStatsNames.find(label) != allowedStatsNames.end()) {
-            long long num = atoll(number);
-            if (is_kb)
-                num *= 1000;
-
-            g_output.plong(label, num);
-        }
-    }
+    for (size_t i = 0; i < parser.size(); i++)
+        g_output.plong(parser.get_label(i), parser.get_value(i));
     g_output.psection_end();
-    (void)fclose(fp);
 }
 
-void CMonitorCollectorApp::proc_stat_cpu_total(
-    const char* cpu_data, double elapsed_sec, OutputFields output_opts, cpu_specs_t& total_cpu, int max_cpu_count)
-{
-    long long user;
-    long long nice;
-    long long sys;
-    long long idle;
-    long long iowait;
-    long long hardirq;
-    long long softirq;
-    long long steal;
-    long long guest;
-    long long guestnice;
+// ----------------------------------------------------------------------------------
+// CMonitorCollectorApp - /proc/stat
+// ----------------------------------------------------------------------------------
 
-    // see http://man7.org/linux/man-pages/man5/proc.5.html
-    // Look for "/proc/stat"
-
-    int count = sscanf(cpu_data, /* cpu USER */
-        "%lld %lld %lld %lld %lld %lld %lld %lld %lld %lld", // force newline
-        &user, &nice, &sys, &idle, &iowait, &hardirq, &softirq, &steal, &guest, &guestnice);
-    if (count != 10)
-        return;
-
-    if (output_opts != PF_NONE) {
-        g_output.psubsection_start("cpu_total");
-        switch (output_opts) {
-        case PF_NONE:
-            assert(0);
-            break;
-        case PF_ALL:
-        case PF_USED_BY_CHART_SCRIPT_ONLY:
-            g_output.pdouble("user", DELTA_TOTAL(user)); /* incrementing counter */
-            g_output.pdouble("nice", DELTA_TOTAL(nice)); /* incrementing counter */
-            g_output.pdouble("sys", DELTA_TOTAL(sys)); /* incrementing counter */
-            g_output.pdouble("idle", DELTA_TOTAL(idle)); /* incrementing counter */
-            /*			g_output.pdouble("DEBUG IDLE idle: %lld %lld %lld\n", total_cpu.idle,
-             * idle, idle-total_cpu.idle); */
-            g_output.pdouble("iowait", DELTA_TOTAL(iowait)); /* incrementing counter */
-            g_output.pdouble("hardirq", DELTA_TOTAL(hardirq)); /* incrementing counter */
-            g_output.pdouble("softirq", DELTA_TOTAL(softirq)); /* incrementing counter */
-            g_output.pdouble("steal", DELTA_TOTAL(steal)); /* incrementing counter */
-            g_output.pdouble("guest", DELTA_TOTAL(guest)); /* incrementing counter */
-            g_output.pdouble("guestnice", DELTA_TOTAL(guestnice)); /* incrementing counter */
-            break;
-        }
-        g_output.psubsection_end();
+size_t CMonitorCollectorApp::get_possible_cpu_count()
+{
+    // the file contains ranges like "0-511" or "0,2-7"
+    CMonitorProcFile file;
+    std::set<uint64_t> cpus;
+    if (file.read(g_cfg.m_strSysRoot, "/devices/system/cpu/possible") != NULL) {
+        std::string ranges = trim_string(file.get_data());
+        if (parse_string_with_multiple_ranges(ranges, cpus) && !cpus.empty())
+            return *cpus.rbegin() + 1;
     }
-    total_cpu.user = user;
-    total_cpu.nice = nice;
-    total_cpu.sys = sys;
-    total_cpu.idle = idle;
-    total_cpu.iowait = iowait;
-    total_cpu.hardirq = hardirq;
-    total_cpu.softirq = softirq;
-    total_cpu.steal = steal;
-    total_cpu.guest = guest;
-    total_cpu.guestnice = guestnice;
+
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+    return n > 0 ? n : 1;
 }
 
-int CMonitorCollectorApp::proc_stat_cpu_index(const char* cpu_data, double elapsed_sec, OutputFields output_opts,
-    cpu_specs_t* logical_cpu, bool onlyCgroupAllowedCpus)
+int CMonitorCollectorApp::proc_stat_cpu_index(const char* cpu_data, bool onlyCgroupAllowedCpus)
 {
-    long long user;
-    long long nice;
-    long long sys;
-    long long idle;
-    long long iowait;
-    long long hardirq;
-    long long softirq;
-    long long steal;
-    long long guest;
-    long long guestnice;
-    int cpuno;
-
     // see http://man7.org/linux/man-pages/man5/proc.5.html
     // Look for "/proc/stat"
 
-    int count = sscanf(cpu_data, /* cpuNNN USER*/
-        "%d %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld", // force newline
-        &cpuno, &user, &nice, &sys, &idle, &iowait, &hardirq, &softirq, &steal, &guest, &guestnice);
-    if (count != 11)
+    uint64_t values[1 + CPU_TIME_MAX];
+    if (proc_parse_uint_array(cpu_data, values, 1 + CPU_TIME_MAX) != 1 + CPU_TIME_MAX) /* cpuNNN USER*/
         return -1;
-
-    if (cpuno >= MAX_LOGICAL_CPU)
+    if (values[0] > INT32_MAX)
         return -1;
+    int cpuno = values[0];
+
     if (onlyCgroupAllowedCpus && !cgroup_is_allowed_cpu(cpuno))
         return -1;
 
-    if (output_opts != PF_NONE) {
-        char label[512];
-        sprintf(label, "cpu%d", cpuno);
+    m_proc_stat_cpus.update(cpuno, &values[1]);
+    return cpuno;
+}
+
+void CMonitorCollectorApp::proc_stat_cpu_output(double elapsed_sec, OutputFields output_opts)
+{
+    compute_table_rates(m_proc_stat_cpus, elapsed_sec);
+
+    char label[64];
+    for (unsigned int cpu = 0; cpu < m_proc_stat_cpus.size(); cpu++) {
+        if (!m_proc_stat_cpus.has_rates(cpu))
+            continue; // offline or just plugged in: no baseline to compute rates
+
+        sprintf(label, "cpu%u", cpu);
         g_output.psubsection_start(label);
 
         switch (output_opts) {
@@ -188,32 +113,12 @@ int CMonitorCollectorApp::proc_stat_cpu_index(const char* cpu_data, double elaps
             break;
         case PF_ALL:
         case PF_USED_BY_CHART_SCRIPT_ONLY:
-            g_output.pdouble("user", DELTA_LOGICAL(user)); /* counter */
-            g_output.pdouble("nice", DELTA_LOGICAL(nice)); /* counter */
-            g_output.pdouble("sys", DELTA_LOGICAL(sys)); /* counter */
-            g_output.pdouble("idle", DELTA_LOGICAL(idle)); /* counter */
-            g_output.pdouble("iowait", DELTA_LOGICAL(iowait)); /* counter */
-            g_output.pdouble("hardirq", DELTA_LOGICAL(hardirq)); /* counter */
-            g_output.pdouble("softirq", DELTA_LOGICAL(softirq)); /* counter */
-            g_output.pdouble("steal", DELTA_LOGICAL(steal)); /* counter */
-            g_output.pdouble("guest", DELTA_LOGICAL(guest)); /* counter */
-            g_output.pdouble("guestnice", DELTA_LOGICAL(guestnice)); /* counter */
+            for (unsigned int f = 0; f < CPU_TIME_MAX; f++)
+                g_output.pdouble(m_proc_stat_cpus.get_counter_name(f), m_proc_stat_cpus.get_rate(cpu, f)); /* counter */
             break;
         }
         g_output.psubsection_end();
     }
-    logical_cpu[cpuno].user = user;
-    logical_cpu[cpuno].nice = nice;
-    logical_cpu[cpuno].sys = sys;
-    logical_cpu[cpuno].idle = idle;
-    logical_cpu[cpuno].iowait = iowait;
-    logical_cpu[cpuno].hardirq = hardirq;
-    logical_cpu[cpuno].softirq = softirq;
-    logical_cpu[cpuno].steal = steal;
-    logical_cpu[cpuno].guest = guest;
-    logical_cpu[cpuno].guestnice = guestnice;
-
-    return cpuno;
 }
 
 /*
@@ -221,511 +126,549 @@ read /proc/stat and unpick
 */
 void CMonitorCollectorApp::proc_stat(double elapsed_sec, bool onlyCgroupAllowedCpus, OutputFields output_opts)
 {
-    int count;
-    long long value;
+    static const char* cpu_field_names[CPU_TIME_MAX] = {
+        "user", "nice", "sys", "idle", "iowait", "hardirq", "softirq", "steal", "guest", "guestnice"
+    };
 
-    /* Static data */
-    static FILE* fp = 0;
-    static char line[8192];
-    static int max_cpu_count;
+    DEBUGLOG_FUNCTION_START();
+    const char* line = m_proc_stat_file.read(g_cfg.m_strProcRoot, "/stat");
+    if (line == NULL) {
+        g_logger.LogError("failed to read file %s/stat", g_cfg.m_strProcRoot.c_str());
+        return;
+    }
 
-    static long long old_ctxt;
-    static long long old_processes;
-    //static cpu_specs_t total_cpu;
-    static cpu_specs_t logical_cpu[MAX_LOGICAL_CPU];
+    if (m_proc_stat_cpus.get_num_counters() == 0) {
+        for (unsigned int f = 0; f < CPU_TIME_MAX; f++)
+            m_proc_stat_cpus.add_counter(cpu_field_names[f], CT_MONOTONIC);
+        m_proc_stat_cpus.resize(get_possible_cpu_count());
 
-    DEBUGLOG_FUNCTION_START();
-    g_logger.LogDebug("proc_stat(%.4f) max_cpu_count=%d\n", elapsed_sec, max_cpu_count);
-    if (fp == 0) {
-        if ((fp = fopen("/proc/stat", "r")) == NULL) {
-            g_logger.LogError("failed to open file /proc/stat");
-            fp = 0;
-            return;
-        }
-    } else
-        rewind(fp);
+        m_proc_stat_counters.add_counter("ctxt", CT_MONOTONIC);
+        m_proc_stat_counters.add_counter("processes_forks", CT_MONOTONIC);
+        m_proc_stat_counters.resize(1);
+    }
+    m_proc_stat_cpus.start_update();
+    m_proc_stat_counters.start_update();
 
     if (output_opts != PF_NONE)
         g_output.psection_start("stat");
 
-    while (fgets(line, 1000, fp) != NULL) {
-        if (!strncmp(line, "cpu", 3)) {
-            if (line[3] == ' ') {
-                // found the summary line for ALL cpus together... skip it
-                continue;
-            } else {
+    // all per-CPU lines come first: their output is produced as soon as the first non-CPU line is found
+    bool cpus_done = false;
+    bool ctxt_found = false;
+    uint64_t btime = 0, procs_running = 0, procs_blocked = 0;
+    do {
+        const char* q;
+        uint64_t value;
+        if (proc_starts_with(line, "cpu", 3)) {
+            if (line[3] != ' ') {
                 // found a line like:
                 //    cpu1 90470 3217 30294 291392 17250 0 3242 0 0 0
-
-                int cpuno = proc_stat_cpu_index(&line[3], elapsed_sec, output_opts, logical_cpu, onlyCgroupAllowedCpus);
-                if (cpuno > max_cpu_count)
-                    max_cpu_count = cpuno;
-            }
-        } else if (!strncmp(line, "ctxt", 4)) {
-            value = 0;
-            count = sscanf(&line[5], "%lld", &value); /* counter */
-            if (count == 1) {
-                if (output_opts != PF_NONE) {
-                    g_output.psubsection_start("counters");
-                    g_output.pdouble("ctxt", ((double)(value - old_ctxt) / elapsed_sec));
-                }
-                old_ctxt = value;
+                proc_stat_cpu_index(&line[3], onlyCgroupAllowedCpus);
             }
-        } else if (!strncmp(line, "btime", 5)) {
-            value = 0;
-            count = sscanf(&line[6], "%lld", &value); /* seconds since boot */
-            if (output_opts != PF_NONE)
-                g_output.plong("btime", value);
-        } else if (!strncmp(line, "processes", 9)) {
-            value = 0;
-            count = sscanf(&line[10], "%lld", &value); /* counter  actually forks */
-            if (output_opts != PF_NONE)
-                g_output.pdouble("processes_forks", ((double)(value - old_processes) / elapsed_sec));
-            old_processes = value;
-        } else if (!strncmp(line, "procs_running", 13)) {
-            value = 0;
-            count = sscanf(&line[14], "%lld", &value);
+            // else found the summary line for ALL cpus together... skip it
+            continue;
+        }
+
+        if (!cpus_done) {
             if (output_opts != PF_NONE)
-                g_output.plong("procs_running", value);
-        } else if (!strncmp(line, "procs_blocked", 13)) {
-            value = 0;
-            count = sscanf(&line[14], "%lld", &value);
-            if (output_opts != PF_NONE) {
-                g_output.plong("procs_blocked", value);
-                g_output.psubsection_end();
+                proc_stat_cpu_output(elapsed_sec, output_opts);
+            cpus_done = true;
+        }
+
+        if (proc_starts_with(line, "ctxt", 4)) {
+            q = &line[5];
+            if (proc_parse_uint(q, value)) { /* counter */
+                m_proc_stat_counters.update(0, PROC_STAT_CTXT, value);
+                ctxt_found = true;
             }
+        } else if (proc_starts_with(line, "btime", 5)) {
+            q = &line[6];
+            proc_parse_uint(q, btime); /* seconds since boot */
+        } else if (proc_starts_with(line, "processes", 9)) {
+            q = &line[10];
+            if (proc_parse_uint(q, value)) /* counter  actually forks */
+                m_proc_stat_counters.update(0, PROC_STAT_PROCESSES, value);
+        } else if (proc_starts_with(line, "procs_running", 13)) {
+            q = &line[14];
+            proc_parse_uint(q, procs_running);
+        } else if (proc_starts_with(line, "procs_blocked", 13)) {
+            q = &line[14];
+            proc_parse_uint(q, procs_blocked);
         }
+    } while (proc_next_line(line));
+    if (!cpus_done && output_opts != PF_NONE)
+        proc_stat_cpu_output(elapsed_sec, output_opts);
+
+    if (ctxt_found && output_opts != PF_NONE) {
+        compute_table_rates(m_proc_stat_counters, elapsed_sec);
+        bool has_rates = m_proc_stat_counters.has_rates(0);
+
+        g_output.psubsection_start("counters");
+        if (has_rates)
+            g_output.pdouble("ctxt", m_proc_stat_counters.get_rate(0, PROC_STAT_CTXT));
+        g_output.plong("btime", btime);
+        if (has_rates)
+            g_output.pdouble("processes_forks", m_proc_stat_counters.get_rate(0, PROC_STAT_PROCESSES));
+        g_output.plong("procs_running", procs_running);
+        g_output.plong("procs_blocked", procs_blocked);
+        g_output.psubsection_end();
     }
     if (output_opts != PF_NONE)
         g_output.psection_end();
 }
 
-void CMonitorCollectorApp::proc_diskstats(double elapsed_sec, OutputFields output_opts)
+void CMonitorCollectorApp::proc_diskstats_scan_devices()
 {
-    // please refer https://www.kernel.org/doc/Documentation/iostats.txt
-
-    struct diskinfo {
-        long dk_major;
-        long dk_minor;
-        char dk_name[128];
-
-        // reads
-        long long dk_reads; // Field 1: This is the total number of reads completed successfully.
-        long long dk_rmerge; // Field 2: Reads and writes which are adjacent to each other may be merged for efficiency.
-        long long
-            dk_rkb; // Field 3: This is the total number of Kbytes read successfully. [converted by us from sectors]
-        long long dk_rmsec; // Field 4: This is the total number of milliseconds spent by all reads
-
-        // writes
-        long long dk_writes; // Same as Field 1 but for writes
-        long long dk_wmerge; // Same as Field 2 but for writes
-        long long dk_wkb; // Same as Field 3 but for writes
-        long long dk_wmsec; // Same as Field 4 but for writes
-
-        // others
-        long long dk_inflight; // Field 9: number of I/Os currently in progress
-        long long dk_time; // Field 10: This field increases so long as field 9 is nonzero. (milliseconds) [converted in
-                           // percentage]
-        long long dk_backlog; // Field 11: weighted # of milliseconds spent doing I/Os
-
-        // computed by ourselves:
-        long long dk_xfers; // sum of number of read/write operations
-        long long dk_bsize;
-    };
-
-    static struct diskinfo current;
-    static struct diskinfo* previous;
-    static long disks_found = 0, disks_sampled = 0;
-    static FILE* fp = 0;
-    char buf[1024];
-    int dk_stats;
-
-    /* popen variables */
-    FILE* pop;
-    char tmpstr[1024 + 1];
-    long i;
-    long j;
-    long len;
-    int filtered_out = 0;
+    // /sys/block lists only whole devices (no partitions): each entry contains a "dev" file
+    // with the "major:minor" numbers that identify the device inside /proc/diskstats
+    std::string sys_block = g_cfg.m_strSysRoot + "/block";
+    DIR* d = opendir(sys_block.c_str());
+    if (d == NULL) {
+        g_logger.LogError("failed to list block devices in %s", sys_block.c_str());
+        return;
+    }
 
-    DEBUGLOG_FUNCTION_START();
-    if (fp == (FILE*)0) {
-        /* Just count the number of disks */
-        pop = popen("lsblk --nodeps --output NAME,TYPE --raw 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            tmpstr[0] = 0;
-            disks_found = 0;
-            if (fgets(tmpstr, 127, pop)) {
-                for (;; disks_found++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 127, pop) == NULL)
-                        break;
-                    // g_logger.LogDebug("DEBUG %ld disks - %s\n", disks, tmpstr);
-                }
-            }
-            pclose(pop);
-        } else
-            disks_found = 0;
-        // g_logger.LogDebug("DEBUG %ld disks\n", disks);
-        previous = (diskinfo*)calloc(sizeof(struct diskinfo), disks_found);
-
-        pop = popen("lsblk --nodeps --output NAME,TYPE --raw 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            if (fgets(tmpstr, 70, pop)) {
-                for (i = 0; i < disks_found; i++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 70, pop) == NULL)
-                        break;
-                    tmpstr[strlen(tmpstr)] = 0; /* remove NL char */
-                    len = strlen(tmpstr);
-                    for (j = 0; j < len; j++)
-                        if (tmpstr[j] == ' ')
-                            tmpstr[j] = 0;
-
-                    if (strncmp(tmpstr, "loop", 4) != 0) {
-                        // g_logger.LogDebug("DEBUG saved %ld %s disk name\n", i, previous[i].dk_name);
-                        strcpy(previous[disks_sampled].dk_name, tmpstr);
-                        disks_sampled++;
-                    } else {
-                        g_logger.LogDebug("Discarding disk %s\n", tmpstr);
-                        /* loop**** disks are not real */
-                    }
-                }
-            }
-            pclose(pop);
-        } else
-            disks_sampled = 0;
+    std::unordered_map<uint64_t, diskinfo_t> disks;
+    CMonitorProcFile dev_file;
+    struct dirent* entry;
+    while ((entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] == '.')
+            continue;
+        if (strncmp(entry->d_name, "loop", 4) == 0 || strncmp(entry->d_name, "ram", 3) == 0) {
+            g_logger.LogDebug("Discarding disk %s\n", entry->d_name);
+            continue; /* loop**** and ram**** disks are not real */
+        }
 
-        if ((fp = fopen("/proc/diskstats", "r")) == NULL) {
-            g_logger.LogError("failed to open - /proc/diskstats");
-            return;
+        std::string dev_path = sys_block + "/" + entry->d_name + "/dev";
+        uint64_t major, minor;
+        const char* p = dev_file.open(dev_path) ? dev_file.read() : NULL;
+        if (p == NULL || !proc_parse_uint(p, major) || *p++ != ':' || !proc_parse_uint(p, minor))
+            continue; // device removed in the meanwhile?
+
+        // keep the state of devices already known
+        uint64_t key = DISK_KEY(major, minor);
+        auto it = m_disks.find(key);
+        if (it != m_disks.end() && strcmp(it->second.dk_name, entry->d_name) == 0) {
+            disks[key] = it->second;
+            m_disks.erase(it);
+        } else {
+            diskinfo_t& disk = disks[key];
+            snprintf(disk.dk_name, sizeof(disk.dk_name), "%.127s", entry->d_name);
+            disk.dk_row = m_disk_counters.alloc_row();
+            g_logger.LogDebug("Found disk %s (%lu:%lu)\n", disk.dk_name, major, minor);
         }
-    } else
-        rewind(fp);
+    }
+    closedir(d);
 
-    if (output_opts != PF_NONE)
-        g_output.psection_start("disks");
-    while (fgets(buf, 1024, fp) != NULL) {
-        buf[strlen(buf) - 1] = 0; /* remove newline */
+    // what is left are the devices removed
+    for (const auto& removed : m_disks)
+        m_disk_counters.free_row(removed.second.dk_row);
+    m_disks.swap(disks);
+}
+
+void CMonitorCollectorApp::proc_diskstats(double elapsed_sec, OutputFields output_opts)
+{
+    // please refer https://www.kernel.org/doc/Documentation/iostats.txt
 
-        // g_logger.LogDebug("DISKSTATS: \"%s\"", buf);
+    DEBUGLOG_FUNCTION_START();
+    const char* line = m_proc_diskstats_file.read(g_cfg.m_strProcRoot, "/diskstats");
+    if (line == NULL) {
+        g_logger.LogError("failed to read - %s/diskstats", g_cfg.m_strProcRoot.c_str());
+        return;
+    }
 
-        /* zero the data ready for reading */
-        bzero(&current, sizeof(struct diskinfo));
+    if (m_disk_counters.get_num_counters() == 0) {
+        // NOTE: the kernel prints the times in milliseconds as 32-bit unsigned integers, which wrap around
+        m_disk_counters.add_counter("reads", CT_MONOTONIC);
+        m_disk_counters.add_counter("rmerge", CT_MONOTONIC);
+        m_disk_counters.add_counter("rkb", CT_MONOTONIC, 0.5 /* 1 sector = 512 bytes = 1/2 Kbyte */);
+        m_disk_counters.add_counter("rmsec", CT_MONOTONIC, 1.0, 32);
+        m_disk_counters.add_counter("writes", CT_MONOTONIC);
+        m_disk_counters.add_counter("wmerge", CT_MONOTONIC);
+        m_disk_counters.add_counter("wkb", CT_MONOTONIC, 0.5 /* 1 sector = 512 bytes = 1/2 Kbyte */);
+        m_disk_counters.add_counter("wmsec", CT_MONOTONIC, 1.0, 32);
+        m_disk_counters.add_counter("inflight", CT_GAUGE);
+        // f18m: not really sure this is correct... assumes that this field is updated 10 times per second
+        m_disk_counters.add_counter("time", CT_MONOTONIC, 0.1 /* in milli-seconds to make it up to 100% */, 32);
+        m_disk_counters.add_counter("backlog", CT_MONOTONIC, 1.0, 32);
+        m_disk_counters.add_counter("xfers", CT_MONOTONIC);
+    }
 
-        // try to read all the 14 fields
-        dk_stats = sscanf(&buf[0], "%ld %ld %s %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld %lld",
-            &current.dk_major, &current.dk_minor, // force newline
-            &current.dk_name[0], // force newline
-            &current.dk_reads, &current.dk_rmerge, &current.dk_rkb, &current.dk_rmsec, // force newline
-            &current.dk_writes, &current.dk_wmerge, &current.dk_wkb, &current.dk_wmsec, // force newline
-            &current.dk_inflight, &current.dk_time, &current.dk_backlog);
+    // rescan the devices when the lines do not refer to the same devices, in the same order, as at the last
+    // scan: comparing only the number of lines misses a device added while another one is removed
+    size_t num_keys = 0;
+    bool changed = false;
+    const char* q = line;
+    do {
+        const char* p = q;
+        uint64_t major, minor;
+        if (!proc_parse_uint(p, major) || !proc_parse_uint(p, minor))
+            continue;
+        uint64_t key = DISK_KEY(major, minor);
+        if (!changed && num_keys < m_disks_diskstats_keys.size() && m_disks_diskstats_keys[num_keys] == key) {
+            num_keys++;
+            continue;
+        }
+        if (!changed) {
+            m_disks_diskstats_keys.resize(num_keys);
+            changed = true;
+        }
+        m_disks_diskstats_keys.push_back(key);
+        num_keys++;
+    } while (proc_next_line(q));
+    if (changed || num_keys != m_disks_diskstats_keys.size()) {
+        m_disks_diskstats_keys.resize(num_keys);
+        proc_diskstats_scan_devices();
+    }
 
+    m_disk_counters.start_update();
+    m_disks_listed.clear();
+    do {
+        const char* p = line;
+        // g_logger.LogDebug("DISKSTATS: \"%.*s\"", (int)strcspn(line, "\n"), line);
+
+        // partitions and devices discarded by proc_diskstats_scan_devices() are skipped right away
+        uint64_t major, minor;
+        if (!proc_parse_uint(p, major) || !proc_parse_uint(p, minor))
+            continue;
+        auto it = m_disks.find(DISK_KEY(major, minor));
+        if (it == m_disks.end())
+            continue;
+
+        // try to read the 11 fields after the device name
+        proc_skip_spaces(p);
+        proc_skip_token(p);
+        uint64_t values[DISK_MAX] = { 0 };
+        int dk_stats = 3 + proc_parse_uint_array(p, values, DISK_XFERS);
         if (dk_stats == 7) {
             /* shuffle the data around due to missing columns for partitions */
-            current.dk_wkb = current.dk_rmsec;
-            current.dk_writes = current.dk_rkb;
-            current.dk_rkb = current.dk_rmerge;
-            current.dk_rmsec = 0;
-            current.dk_rmerge = 0;
+            values[DISK_WKB] = values[DISK_RMSEC];
+            values[DISK_WRITES] = values[DISK_RKB];
+            values[DISK_RKB] = values[DISK_RMERGE];
+            values[DISK_RMSEC] = 0;
+            values[DISK_RMERGE] = 0;
         } else if (dk_stats != 14)
-            g_logger.LogError("disk sscanf wanted 14 but returned=%d line=%s\n", dk_stats, buf);
+            g_logger.LogError(
+                "disk parsing wanted 14 but returned=%d line=%.*s\n", dk_stats, (int)strcspn(line, "\n"), line);
+        values[DISK_XFERS] = values[DISK_READS] + values[DISK_WRITES];
 
-        current.dk_rkb /= 2; /* convert from sectors to Kbyte, keeping in mind that 1 sector = 512 bytes = 1/2 Kbyte */
-        current.dk_wkb /= 2;
-        current.dk_xfers = current.dk_reads + current.dk_writes;
-        if (current.dk_xfers == 0)
-            current.dk_bsize = 0;
-        else
-            current.dk_bsize = ((current.dk_rkb + current.dk_wkb) / current.dk_xfers) * 1024;
+        m_disk_counters.update(it->second.dk_row, values);
+        m_disks_listed.push_back(&it->second);
+    } while (proc_next_line(line));
 
-        // f18m: not really sure this is correct... assumes that this field is updated 10 times per second
-        current.dk_time /= 10.0; /* in milli-seconds to make it up to 100%, 1000/100 = 10 */
-
-        for (i = 0; i < disks_found; i++) {
-            // g_logger.LogDebug("DEBUG disks new %s old %s\n", current.dk_name, previous[i].dk_name);
-            if (!strcmp(current.dk_name, previous[i].dk_name)) {
-
-                if (!filtered_out && output_opts != PF_NONE) {
-                    g_output.psubsection_start(current.dk_name);
-
-                    switch (output_opts) {
-                    case PF_NONE:
-                        assert(0);
-                        break;
-
-                    case PF_ALL:
-                        g_output.pdouble("reads", (current.dk_reads - previous[i].dk_reads) / elapsed_sec);
-                        g_output.pdouble("rmerge", (current.dk_rmerge - previous[i].dk_rmerge) / elapsed_sec);
-                        g_output.pdouble("rkb", (current.dk_rkb - previous[i].dk_rkb) / elapsed_sec);
-                        g_output.pdouble("rmsec", (current.dk_rmsec - previous[i].dk_rmsec) / elapsed_sec);
-
-                        g_output.pdouble("writes", (current.dk_writes - previous[i].dk_writes) / elapsed_sec);
-                        g_output.pdouble("wmerge", (current.dk_wmerge - previous[i].dk_wmerge) / elapsed_sec);
-                        g_output.pdouble("wkb", (current.dk_wkb - previous[i].dk_wkb) / elapsed_sec);
-                        g_output.pdouble("wmsec", (current.dk_wmsec - previous[i].dk_wmsec) / elapsed_sec);
-
-                        g_output.plong("inflight", current.dk_inflight);
-                        g_output.pdouble("time", (current.dk_time - previous[i].dk_time) / elapsed_sec);
-                        g_output.pdouble("backlog", (current.dk_backlog - previous[i].dk_backlog) / elapsed_sec);
-                        g_output.pdouble("xfers", (current.dk_xfers - previous[i].dk_xfers) / elapsed_sec);
-                        g_output.plong("bsize", current.dk_bsize);
-                        break;
-
-                    case PF_USED_BY_CHART_SCRIPT_ONLY:
-                        g_output.pdouble("rkb", (current.dk_rkb - previous[i].dk_rkb) / elapsed_sec);
-                        g_output.pdouble("wkb", (current.dk_wkb - previous[i].dk_wkb) / elapsed_sec);
-                        break;
-                    }
-
-                    g_output.psubsection_end();
-                }
-                memcpy(&previous[i], &current, sizeof(struct diskinfo));
-                break; /* once found stop searching */
+    if (output_opts == PF_NONE)
+        return;
+
+    compute_table_rates(m_disk_counters, elapsed_sec);
+
+    g_output.psection_start("disks");
+    for (const diskinfo_t* disk : m_disks_listed) {
+        // devices found by a rescan have no baseline yet
+        size_t row = disk->dk_row;
+        if (!m_disk_counters.has_rates(row))
+            continue;
+
+        g_output.psubsection_start(disk->dk_name);
+        switch (output_opts) {
+        case PF_NONE:
+            assert(0);
+            break;
+
+        case PF_ALL: {
+            for (unsigned int i = 0; i < DISK_MAX; i++) {
+                if (m_disk_counters.get_counter_type(i) == CT_GAUGE)
+                    g_output.plong(m_disk_counters.get_counter_name(i), m_disk_counters.get_value(row, i));
+                else
+                    g_output.pdouble(m_disk_counters.get_counter_name(i), m_disk_counters.get_rate(row, i));
             }
+
+            // average size of the transfers since boot
+            uint64_t xfers = m_disk_counters.get_value(row, DISK_XFERS);
+            uint64_t kb = m_disk_counters.get_value(row, DISK_RKB) / 2 + m_disk_counters.get_value(row, DISK_WKB) / 2;
+            g_output.plong("bsize", xfers ? (kb / xfers) * 1024 : 0);
+        } break;
+
+        case PF_USED_BY_CHART_SCRIPT_ONLY:
+            g_output.pdouble("rkb", m_disk_counters.get_rate(row, DISK_RKB));
+            g_output.pdouble("wkb", m_disk_counters.get_rate(row, DISK_WKB));
+            break;
         }
+        g_output.psubsection_end();
     }
-    if (output_opts != PF_NONE)
-        g_output.psection_end();
+    g_output.psection_end();
 }
 
-void CMonitorCollectorApp::proc_net_dev(double elapsed_sec, OutputFields output_opts)
+static bool match_any_glob(const std::vector<std::string>& globs, const char* name)
 {
-    struct netinfo {
-        char if_name[128];
-        long long if_ibytes;
-        long long if_ipackets;
-        long long if_ierrs;
-        long long if_idrop;
-        long long if_ififo;
-        long long if_iframe;
-        long long if_obytes;
-        long long if_opackets;
-        long long if_oerrs;
-        long long if_odrop;
-        long long if_ofifo;
-        long long if_ocolls;
-        long long if_ocarrier;
-    };
+    for (const std::string& glob : globs)
+        if (fnmatch(glob.c_str(), name, 0) == 0)
+            return true;
+    return false;
+}
+
+// returns NETIF_REPORTED, NETIF_EXCLUDED or the index of the roll-up the interface belongs to
+static int proc_net_dev_classify(const char* name)
+{
+    for (size_t i = 0; i < g_cfg.m_vecNetRollups.size(); i++)
+        if (match_any_glob(g_cfg.m_vecNetRollups[i].m_vecGlobs, name))
+            return (int)i;
+    if (match_any_glob(g_cfg.m_vecNetExcludeGlobs, name))
+        return NETIF_EXCLUDED;
+    if (!g_cfg.m_vecNetIncludeGlobs.empty() && !match_any_glob(g_cfg.m_vecNetIncludeGlobs, name))
+        return NETIF_EXCLUDED;
+    return NETIF_REPORTED;
+}
+
+static const char* g_netif_field_names[NET_IF_MAX] = {
+    "ibytes", "ipackets", "ierrs", "idrop", "ififo", "iframe", // force newline
+    "obytes", "opackets", "oerrs", "odrop", "ofifo", "ocolls", "ocarrier" // force newline
+};
+
+static void proc_net_dev_output(const char* name, const double* rates, OutputFields output_opts)
+{
+    g_output.psubsection_start(name);
+    switch (output_opts) {
+    case PF_NONE:
+        assert(0);
+        break;
+
+    case PF_ALL:
+        for (unsigned int i = 0; i < NET_IF_MAX; i++)
+            g_output.pdouble(g_netif_field_names[i], rates[i]);
+        break;
+
+    case PF_USED_BY_CHART_SCRIPT_ONLY:
+        g_output.pdouble("ibytes", rates[NET_IF_IBYTES]);
+        g_output.pdouble("obytes", rates[NET_IF_OBYTES]);
+        g_output.pdouble("ipackets", rates[NET_IF_IPACKETS]);
+        g_output.pdouble("opackets", rates[NET_IF_OPACKETS]);
+        break;
+    }
+    g_output.psubsection_end();
+}
+
+uint64_t CMonitorCollectorApp::proc_net_dev_read_key(const std::string& name)
+{
+    uint64_t key;
+    CMonitorProcFile ifindex_file;
+    const char* p = ifindex_file.open(g_cfg.m_strSysRoot + "/class/net/" + name + "/ifindex") ? ifindex_file.read()
+                                                                                                 : NULL;
+    if (p == NULL || !proc_parse_uint(p, key))
+        key = NETIF_KEY_FROM_NAME_HASH(std::hash<std::string>()(name));
+    return key;
+}
 
-    static struct netinfo current;
-    static struct netinfo* previous;
-    static long interfaces_found = 0, interfaces_sampled = 0;
-    long long junk;
+uint64_t CMonitorCollectorApp::proc_net_dev_add_interface(const std::string& name)
+{
+    // /proc/net/dev lists only the names: the ifindex is read from sysfs the first time a name shows up,
+    // so that in steady state thousands of interfaces cost just the read of /proc/net/dev
+    uint64_t key = proc_net_dev_read_key(name);
+
+    // a renamed interface keeps its ifindex: forget its old name, unless already taken by another interface
+    auto it = m_netifs.find(key);
+    if (it != m_netifs.end()) {
+        auto old_name = m_netifs_by_name.find(it->second.if_name);
+        if (old_name != m_netifs_by_name.end() && old_name->second == key)
+            m_netifs_by_name.erase(old_name);
+        m_netif_counters.free_row(it->second.if_row);
+    }
 
-    static FILE* fp = 0;
-    char buf[1024];
-    int ret;
+    netinfo_t& netif = m_netifs[key];
+    memset(&netif, 0, sizeof(netif));
+    snprintf(netif.if_name, sizeof(netif.if_name), "%.127s", name.c_str());
+    netif.if_row = m_netif_counters.alloc_row();
+    netif.if_rollup = proc_net_dev_classify(netif.if_name);
+    m_netifs_by_name[name] = key;
+
+    if (netif.if_rollup == NETIF_EXCLUDED)
+        g_logger.LogDebug("Discarding net interface %s\n", netif.if_name);
+    else
+        g_logger.LogDebug("Found net interface %s (key %lu)\n", netif.if_name, key);
+    return key;
+}
 
-    /* popen variables */
-    FILE* pop;
-    char tmpstr[1024 + 1];
-    long i;
-    long j;
-    long len;
+void CMonitorCollectorApp::proc_net_dev(double elapsed_sec, OutputFields output_opts)
+{
+    // columns of /proc/net/dev after the interface name for each NetIfField; columns 6 and 7 are the
+    // received "compressed" and "multicast" and column 15 is the transmitted "compressed"
+    static const unsigned int column_of_field[NET_IF_MAX] = { 0, 1, 2, 3, 4, 5, 8, 9, 10, 11, 12, 13, 14 };
 
     DEBUGLOG_FUNCTION_START();
-    if (fp == (FILE*)0) {
-        /* Just count the number of UP network interfaces */
-        pop = popen("/sbin/ifconfig -s 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            tmpstr[0] = 0;
-            interfaces_found = 0;
-            if (fgets(tmpstr, 1024, pop)) {
-                for (;; interfaces_found++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 1024, pop) == NULL)
-                        break;
-                    // g_logger.LogDebug("DEBUG %ld interfaces - %s\n", interfaces, tmpstr);
-                }
-            }
-            pclose(pop);
-        } else
-            interfaces_found = 0;
-        // g_logger.LogDebug("DEBUG %ld intergaces\n", interfaces);
-        previous = (netinfo*)calloc(sizeof(struct netinfo), interfaces_found);
-
-        pop = popen("/sbin/ifconfig -s 2>/dev/null", "r");
-        if (pop != NULL) {
-            /* throw away the headerline */
-            if (fgets(tmpstr, 1024, pop)) {
-                for (i = 0; i < interfaces_found; i++) {
-                    tmpstr[0] = 0;
-                    if (fgets(tmpstr, 1024, pop) == NULL)
-                        break;
-                    tmpstr[strlen(tmpstr)] = 0; /* remove NL char */
-                    len = strlen(tmpstr);
-                    for (j = 0; j < len; j++)
-                        if (tmpstr[j] == ' ')
-                            tmpstr[j] = 0;
-
-                    if (strncmp(tmpstr, "veth", 4) != 0) {
-                        strcpy(previous[interfaces_sampled].if_name, tmpstr);
-                        interfaces_sampled++;
-                    } else {
-                        /* veth**** interfaces are not real */
-                        g_logger.LogDebug("Discarding net interface %s\n", tmpstr);
-                    }
-                }
-            }
-            pclose(pop);
-        } else
-            interfaces_found = 0;
+    const char* line = m_proc_net_dev_file.read(g_cfg.m_strProcRoot, "/net/dev");
+    if (line == NULL) {
+        g_logger.LogError("failed to read - %s/net/dev", g_cfg.m_strProcRoot.c_str());
+        return;
+    }
+
+    /* throw away the 2 header lines */
+    if (!proc_next_line(line) || !proc_next_line(line))
+        return;
 
-        if ((fp = fopen("/proc/net/dev", "r")) == NULL) {
-            g_logger.LogError("failed to open - /proc/net/dev");
-            return;
+    if (m_netif_counters.get_num_counters() == 0) {
+        for (unsigned int i = 0; i < NET_IF_MAX; i++)
+            m_netif_counters.add_counter(g_netif_field_names[i], CT_MONOTONIC);
+    }
+    m_netif_counters.start_update();
+    m_netifs_listed.clear();
+    m_netifs_num_reads++;
+
+    do {
+        const char* p = line;
+
+        // lines look like "  eth0: 1234 56 0 0 0 0 0 0 7890 12 0 0 0 0 0 0"
+        proc_skip_spaces(p);
+        const char* name = p;
+        while ((unsigned char)*p > ' ' && *p != ':')
+            p++;
+        m_netif_name.assign(name, p - name);
+        if (*p == ':')
+            p++;
+
+        uint64_t fields[15];
+        if (m_netif_name.empty() || proc_parse_uint_array(p, fields, 15) != 15) {
+            g_logger.LogError("net parsing failed on line=%.*s\n", (int)strcspn(line, "\n"), line);
+            continue;
         }
-    } else
-        rewind(fp);
 
-    if (interfaces_found == 0 || interfaces_sampled == 0)
-        return; // this happens in e.g. Docker containers having no network
+        uint64_t values[NET_IF_MAX];
+        for (unsigned int i = 0; i < NET_IF_MAX; i++)
+            values[i] = fields[column_of_field[i]];
+
+        auto it = m_netifs_by_name.find(m_netif_name);
+        uint64_t key = (it != m_netifs_by_name.end()) ? it->second : proc_net_dev_add_interface(m_netif_name);
+        netinfo_t* netif = &m_netifs[key];
+        m_netif_counters.update(netif->if_row, values);
+
+        // counters going backward mean that the interface has been deleted and created again with the same name,
+        // possibly with another ifindex: only in that case the ifindex of a known name is read again
+        if (it != m_netifs_by_name.end() && m_netif_counters.went_backward(netif->if_row)
+            && proc_net_dev_read_key(m_netif_name) != key) {
+            key = proc_net_dev_add_interface(m_netif_name); // the stale interface is forgotten below
+            netif = &m_netifs[key];
+            m_netif_counters.update(netif->if_row, values);
+        }
 
-    if (fgets(buf, 1024, fp) == NULL)
-        return; /* throw away the header line */
-    if (fgets(buf, 1024, fp) == NULL)
-        return; /* throw away the header line */
+        netif->if_last_seen = m_netifs_num_reads;
+        m_netifs_listed.push_back(netif);
+    } while (proc_next_line(line));
 
-    if (output_opts != PF_NONE)
-        g_output.psection_start("network_interfaces");
-    while (fgets(buf, 1024, fp) != NULL) {
-        strip_spaces(buf);
-
-        bzero(&current, sizeof(struct netinfo));
-        ret = sscanf(&buf[0], "%s %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu %llu",
-            (char*)current.if_name, &current.if_ibytes, &current.if_ipackets, &current.if_ierrs, &current.if_idrop,
-            &current.if_ififo, &current.if_iframe, &junk, &junk, &current.if_obytes, &current.if_opackets,
-            &current.if_oerrs, &current.if_odrop, &current.if_ofifo, &current.if_ocolls, &current.if_ocarrier);
-
-        if (ret != 16) {
-            g_logger.LogError("net sscanf wanted 16 returned = %d line=%s\n", ret, (char*)buf);
-        } else {
-            for (i = 0; i < interfaces_found; i++) {
-                // g_logger.LogDebug("DEBUG: i=%ld current.if_name=%s, previous=%s interfaces=%ld\n", i,
-                // *current.if_name, previous[i].if_name, interfaces);
-                if (!strcmp(current.if_name, previous[i].if_name)) {
-
-                    if (output_opts != PF_NONE) {
-                        g_output.psubsection_start(current.if_name);
-                        switch (output_opts) {
-                        case PF_NONE:
-                            assert(0);
-                            break;
-
-                        case PF_ALL:
-                            g_output.pdouble("ibytes", (current.if_ibytes - previous[i].if_ibytes) / elapsed_sec);
-                            g_output.pdouble("ipackets", (current.if_ipackets - previous[i].if_ipackets) / elapsed_sec);
-                            g_output.pdouble("ierrs", (current.if_ierrs - previous[i].if_ierrs) / elapsed_sec);
-                            g_output.pdouble("idrop", (current.if_idrop - previous[i].if_idrop) / elapsed_sec);
-                            g_output.pdouble("ififo", (current.if_ififo - previous[i].if_ififo) / elapsed_sec);
-                            g_output.pdouble("iframe", (current.if_iframe - previous[i].if_iframe) / elapsed_sec);
-
-                            g_output.pdouble("obytes", (current.if_obytes - previous[i].if_obytes) / elapsed_sec);
-                            g_output.pdouble("opackets", (current.if_opackets - previous[i].if_opackets) / elapsed_sec);
-                            g_output.pdouble("oerrs", (current.if_oerrs - previous[i].if_oerrs) / elapsed_sec);
-                            g_output.pdouble("odrop", (current.if_odrop - previous[i].if_odrop) / elapsed_sec);
-                            g_output.pdouble("ofifo", (current.if_ofifo - previous[i].if_ofifo) / elapsed_sec);
-
-                            g_output.pdouble("ocolls", (current.if_ocolls - previous[i].if_ocolls) / elapsed_sec);
-                            g_output.pdouble("ocarrier", (current.if_ocarrier - previous[i].if_ocarrier) / elapsed_sec);
-                            break;
-
-                        case PF_USED_BY_CHART_SCRIPT_ONLY:
-                            g_output.pdouble("ibytes", (current.if_ibytes - previous[i].if_ibytes) / elapsed_sec);
-                            g_output.pdouble("obytes", (current.if_obytes - previous[i].if_obytes) / elapsed_sec);
-                            g_output.pdouble("ipackets", (current.if_ipackets - previous[i].if_ipackets) / elapsed_sec);
-                            g_output.pdouble("opackets", (current.if_opackets - previous[i].if_opackets) / elapsed_sec);
-                            break;
-                        }
-                        g_output.psubsection_end();
-                    }
-                    memcpy(&previous[i], &current, sizeof(struct netinfo));
-                    break; /* once found stop searching */
+    if (output_opts != PF_NONE) {
+        // counters going backward, e.g. because the interface was deleted and created again with the same
+        // name, are handled by m_netif_counters
+        compute_table_rates(m_netif_counters, elapsed_sec);
+
+        size_t num_rollups = g_cfg.m_vecNetRollups.size();
+        m_netif_rollup_rates.assign(num_rollups * NET_IF_MAX, 0);
+
+        bool section_started = false;
+        for (const netinfo_t* netif : m_netifs_listed) {
+            if (netif->if_rollup == NETIF_EXCLUDED || !m_netif_counters.has_rates(netif->if_row))
+                continue;
+
+            double rates[NET_IF_MAX];
+            for (unsigned int i = 0; i < NET_IF_MAX; i++)
+                rates[i] = m_netif_counters.get_rate(netif->if_row, i);
+
+            if (netif->if_rollup == NETIF_REPORTED) {
+                if (!section_started) {
+                    g_output.psection_start("network_interfaces");
+                    section_started = true;
                 }
+                proc_net_dev_output(netif->if_name, rates, output_opts);
+            } else {
+                double* sums = &m_netif_rollup_rates[netif->if_rollup * NET_IF_MAX];
+                for (unsigned int i = 0; i < NET_IF_MAX; i++)
+                    sums[i] += rates[i];
             }
         }
+
+        if (num_rollups > 0) {
+            if (!section_started) {
+                g_output.psection_start("network_interfaces");
+                section_started = true;
+            }
+            for (size_t i = 0; i < num_rollups; i++)
+                proc_net_dev_output(
+                    g_cfg.m_vecNetRollups[i].m_strName.c_str(), &m_netif_rollup_rates[i * NET_IF_MAX], output_opts);
+        }
+        if (section_started)
+            g_output.psection_end();
+    }
+
+    // forget the interfaces not listed anymore, e.g. the veth interfaces of terminated containers
+    if (m_netifs_listed.size() != m_netifs.size()) {
+        for (auto it = m_netifs.begin(); it != m_netifs.end();) {
+            if (it->second.if_last_seen != m_netifs_num_reads) {
+                g_logger.LogDebug("Net interface %s removed\n", it->second.if_name);
+                auto name = m_netifs_by_name.find(it->second.if_name);
+                if (name != m_netifs_by_name.end() && name->second == it->first)
+                    m_netifs_by_name.erase(name); // unless the name has been taken by another interface
+                m_netif_counters.free_row(it->second.if_row);
+                it = m_netifs.erase(it);
+            } else
+                ++it;
+        }
     }
-    if (output_opts != PF_NONE)
-        g_output.psection_end();
 }
 
 void CMonitorCollectorApp::proc_uptime()
 {
-    static FILE* fp = 0;
-    char buf[1024 + 1];
-    int count;
-    long long value;
+    uint64_t value;
     long long days;
     long long hours;
 
     DEBUGLOG_FUNCTION_START();
-    if (fp == 0) {
-        if ((fp = fopen("/proc/uptime", "r")) == NULL) {
-            return;
-        }
-    } else
-        rewind(fp);
-
-    if (fgets(buf, 1024, fp) != NULL) {
-        count = sscanf(buf, "%lld", &value);
-        if (count == 1) {
-            g_output.psection_start("proc_uptime");
-            g_output.plong("total_seconds", value);
-            days = value / 60 / 60 / 24;
-            hours = (value - (days * 60 * 60 * 24)) / 60 / 60;
-            g_output.plong("days", days);
-            g_output.plong("hours", hours);
-            g_output.psection_end();
-        }
+    const char* p = m_proc_uptime_file.read(g_cfg.m_strProcRoot, "/uptime");
+    if (p == NULL)
+        return;
+
+    if (proc_parse_uint(p, value)) {
+        g_output.psection_start("proc_uptime");
+        g_output.plong("total_seconds", value);
+        days = value / 60 / 60 / 24;
+        hours = (value - (days * 60 * 60 * 24)) / 60 / 60;
+        g_output.plong("days", days);
+        g_output.plong("hours", hours);
+        g_output.psection_end();
     }
 }
 
 void CMonitorCollectorApp::proc_loadavg()
 {
-    char buf[1024 + 1];
-    int count;
-    float load_avg_1min;
-    float load_avg_5min;
-    float load_avg_15min;
-    FILE* fp;
+    double load_avg_1min;
+    double load_avg_5min;
+    double load_avg_15min;
 
     DEBUGLOG_FUNCTION_START();
 
-    if ((fp = fopen("/proc/loadavg", "r")) == NULL) {
+    const char* p = m_proc_loadavg_file.read(g_cfg.m_strProcRoot, "/loadavg");
+    if (p == NULL)
         return;
-    }
 
-    if (fgets(buf, 1024, fp) != NULL) {
-        /*
-                /proc/loadavg
-                The first three fields in this file are load average figures giving
-                the  number  of jobs in the run queue (state R) or waiting for disk
-                I/O (state D) averaged over 1, 5, and 15  minutes.
-                They are the same as the load average numbers given by
-                uptime(1) and other programs.  The fourth field consists of
-                two numbers separated by a slash (/).  The first of these is
-                the number of currently runnable kernel scheduling entities
-                (processes, threads).  The value after the slash is the number
-                of kernel scheduling entities that currently exist on the sys‐
-                tem.  The fifth field is the PID of the process that was most
-                recently created on the system.
-         */
-
-        count = sscanf(buf, "%f %f %f", &load_avg_1min, &load_avg_5min, &load_avg_15min);
-        if (count == 3) {
-            g_output.psection_start("proc_loadavg");
-            g_output.pdouble("load_avg_1min", load_avg_1min);
-            g_output.pdouble("load_avg_5min", load_avg_5min);
-            g_output.pdouble("load_avg_15min", load_avg_15min);
-            g_output.psection_end();
-        }
+    /*
+            /proc/loadavg
+            The first three fields in this file are load average figures giving
+            the  number  of jobs in the run queue (state R) or waiting for disk
+            I/O (state D) averaged over 1, 5, and 15  minutes.
+            They are the same as the load average numbers given by
+            uptime(1) and other programs.  The fourth field consists of
+            two numbers separated by a slash (/).  The first of these is
+            the number of currently runnable kernel scheduling entities
+            (processes, threads).  The value after the slash is the number
+            of kernel scheduling entities that currently exist on the sys‐
+            tem.  The fifth field is the PID of the process that was most
+            recently created on the system.
+     */
+
+    if (proc_parse_udouble(p, load_avg_1min) && proc_parse_udouble(p, load_avg_5min)
+        && proc_parse_udouble(p, load_avg_15min)) {
+        // NOTE: values are rounded to float precision to keep the same output produced by older versions
+        g_output.psection_start("proc_loadavg");
+        g_output.pdouble("load_avg_1min", (float)load_avg_1min);
+        g_output.pdouble("load_avg_5min", (float)load_avg_5min);
+        g_output.pdouble("load_avg_15min", (float)load_avg_15min);
+        g_output.psection_end();
     }
-
-    fclose(fp);
 }
 
 void CMonitorCollectorApp::proc_filesystems()
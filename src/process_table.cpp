@@ -0,0 +1,227 @@
+/*
+ * process_table.cpp -- storage of the monitored processes, indexed by PID
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "process_table.h"
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+#define PROCESS_TABLE_MIN_SLOTS (1U << PROCESS_TABLE_MIN_SLOT_BITS)
+#define PROCESS_TABLE_EMPTY_SLOT (UINT32_MAX)
+
+// start times are never this large, so that a new row always gets a new generation
+#define PROCESS_TABLE_NO_GENERATION (UINT64_MAX)
+
+//------------------------------------------------------------------------------
+// CMonitorProcessTable
+//------------------------------------------------------------------------------
+
+void CMonitorProcessTable::start_update(double elapsed_secs)
+{
+    // NOTE: swapping does not allocate; the counters of rows not updated are left stale
+    m_current.swap(m_previous);
+    m_num_updates++;
+    m_time_secs += elapsed_secs;
+}
+
+size_t CMonitorProcessTable::find(pid_t pid) const
+{
+    if (m_slots.empty())
+        return PROCESS_TABLE_NO_ROW;
+
+    size_t mask = m_slots.size() - 1;
+    for (size_t i = home_slot(pid);; i = (i + 1) & mask) {
+        if (m_slots[i].row == PROCESS_TABLE_EMPTY_SLOT)
+            return PROCESS_TABLE_NO_ROW;
+        if (m_slots[i].pid == pid)
+            return m_slots[i].row;
+    }
+}
+
+size_t CMonitorProcessTable::find_or_add(pid_t pid)
+{
+    assert(pid != 0);
+    if ((m_num_used + 1) * 2 > m_slots.size())
+        rehash(m_slots.empty() ? PROCESS_TABLE_MIN_SLOTS : m_slots.size() * 2);
+
+    size_t mask = m_slots.size() - 1;
+    size_t i = home_slot(pid);
+    for (; m_slots[i].row != PROCESS_TABLE_EMPTY_SLOT; i = (i + 1) & mask)
+        if (m_slots[i].pid == pid)
+            return m_slots[i].row;
+
+    size_t row;
+    if (m_free_rows.empty()) {
+        row = m_rows.size();
+        m_rows.resize(row + 1);
+        m_current.resize(row + 1);
+        m_previous.resize(row + 1);
+        m_gauges.resize(row + 1);
+        m_identity.resize(row + 1);
+        m_checkpoint.resize(row + 1);
+    } else {
+        row = m_free_rows.back();
+        m_free_rows.pop_back();
+    }
+
+    m_rows[row].pid = pid;
+    m_rows[row].last_update = 0; // updates are numbered from 1
+    m_rows[row].generation = PROCESS_TABLE_NO_GENERATION;
+    m_rows[row].fd = -1;
+    memset(&m_gauges[row], 0, sizeof(proc_gauges_t));
+    memset(&m_identity[row], 0, sizeof(proc_identity_t));
+
+    m_slots[i].pid = pid;
+    m_slots[i].row = row;
+    m_num_used++;
+    return row;
+}
+
+bool CMonitorProcessTable::set_updated(size_t row)
+{
+    row_t& r = m_rows[row];
+    r.last_update = m_num_updates;
+    if (r.generation == m_identity[row].pi_start_time)
+        return false;
+
+    // a new process: it has no baseline, so its rates are computed from zero, i.e. since its start
+    memset(&m_previous[row], 0, sizeof(proc_counters_t));
+    memset(&m_checkpoint[row], 0, sizeof(checkpoint_t));
+    r.generation = m_identity[row].pi_start_time;
+    return true;
+}
+
+void CMonitorProcessTable::set_checkpoint()
+{
+    // NOTE: rows not updated are either free or about to be freed: their checkpoint is never used
+    for (size_t row = 0; row < m_rows.size(); row++) {
+        m_checkpoint[row].counters = m_current[row];
+        m_checkpoint[row].stat_read_time = m_gauges[row].stat_read_time;
+        m_checkpoint[row].io_read_time = m_gauges[row].io_read_time;
+    }
+}
+
+double CMonitorProcessTable::get_stat_interval(size_t row) const
+{
+    if (!m_rates_since_checkpoint)
+        return m_gauges[row].stat_interval_secs;
+    double since = m_checkpoint[row].stat_read_time;
+    return since > 0 ? m_gauges[row].stat_read_time - since : 0;
+}
+
+double CMonitorProcessTable::get_io_interval(size_t row) const
+{
+    if (!m_rates_since_checkpoint)
+        return m_gauges[row].io_interval_secs;
+    double since = m_checkpoint[row].io_read_time;
+    return since > 0 ? m_gauges[row].io_read_time - since : 0;
+}
+
+void CMonitorProcessTable::remove_stale()
+{
+    for (size_t row = 0; row < m_rows.size(); row++) {
+        if (m_rows[row].pid == 0 || m_rows[row].last_update == m_num_updates)
+            continue;
+
+        size_t mask = m_slots.size() - 1;
+        size_t i = home_slot(m_rows[row].pid);
+        while (m_slots[i].row != row)
+            i = (i + 1) & mask;
+        erase_slot(i);
+
+        keep_fd(row, -1);
+        m_rows[row].pid = 0;
+        m_free_rows.push_back(row);
+        m_num_used--;
+    }
+}
+
+int CMonitorProcessTable::take_fd(size_t row)
+{
+    int fd = m_rows[row].fd;
+    if (fd != -1) {
+        m_rows[row].fd = -1;
+        m_num_fds--;
+    }
+    return fd;
+}
+
+void CMonitorProcessTable::keep_fd(size_t row, int fd)
+{
+    int old_fd = take_fd(row);
+    if (old_fd != -1 && old_fd != fd)
+        close(old_fd);
+
+    if (fd == -1)
+        return;
+    if (m_num_fds.fetch_add(1) >= m_max_fds) {
+        m_num_fds--;
+        close(fd);
+        return;
+    }
+    m_rows[row].fd = fd;
+}
+
+void CMonitorProcessTable::close_fds()
+{
+    for (size_t row = 0; row < m_rows.size(); row++)
+        keep_fd(row, -1);
+}
+
+void CMonitorProcessTable::erase_slot(size_t slot)
+{
+    // backward-shift deletion: the following entries of the same cluster are moved back when the
+    // emptied slot lies between their home slot and their current slot, so that no tombstone is needed
+    size_t mask = m_slots.size() - 1;
+    size_t hole = slot;
+    for (size_t i = (slot + 1) & mask; m_slots[i].row != PROCESS_TABLE_EMPTY_SLOT; i = (i + 1) & mask) {
+        size_t home = home_slot(m_slots[i].pid);
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            m_slots[hole] = m_slots[i];
+            hole = i;
+        }
+    }
+    m_slots[hole].row = PROCESS_TABLE_EMPTY_SLOT;
+}
+
+void CMonitorProcessTable::rehash(size_t num_slots)
+{
+    assert((num_slots & (num_slots - 1)) == 0);
+    m_slot_bits = 0;
+    while ((1UL << m_slot_bits) < num_slots)
+        m_slot_bits++;
+
+    slot_t empty = { 0, PROCESS_TABLE_EMPTY_SLOT };
+    std::vector<slot_t> old_slots(num_slots, empty);
+    old_slots.swap(m_slots);
+
+    size_t mask = m_slots.size() - 1;
+    for (const slot_t& s : old_slots) {
+        if (s.row == PROCESS_TABLE_EMPTY_SLOT)
+            continue;
+        size_t i = home_slot(s.pid);
+        while (m_slots[i].row != PROCESS_TABLE_EMPTY_SLOT)
+            i = (i + 1) & mask;
+        m_slots[i] = s;
+    }
+}
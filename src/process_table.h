@@ -0,0 +1,243 @@
+/*
+ * process_table.h -- storage of the monitored processes, indexed by PID
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Types
+// The stats of a process are split by how often they are needed; see
+// http://man7.org/linux/man-pages/man5/proc.5.html for the meaning of each field.
+//------------------------------------------------------------------------------
+
+/*
+ * Monotonic counters read at each sample: both the current and the previous
+ * values are stored, to compute rates and the process score.
+ */
+typedef struct proc_counters_s {
+    uint64_t pi_utime; // time scheduled in user mode, in clock ticks, including all threads
+    uint64_t pi_stime; // time scheduled in kernel mode, in clock ticks, including all threads
+    uint64_t pi_minflt; // minor faults, which have not required loading a memory page from disk
+    uint64_t pi_majflt; // major faults, which have required loading a memory page from disk
+    uint64_t io_rchar; // bytes read, including terminal I/O and reads satisfied from the page cache
+    uint64_t io_wchar; // bytes written, including terminal I/O
+    uint64_t io_read_bytes; // bytes really fetched from the storage layer
+    uint64_t io_write_bytes; // bytes really sent to the storage layer
+    uint64_t pi_nvcsw; // voluntary context switches: only for threads, see --threads
+    uint64_t pi_nivcsw; // involuntary context switches: only for threads, see --threads
+} proc_counters_t;
+
+/*
+ * Values read at each sample whose previous value is never needed.
+ */
+typedef struct proc_gauges_s {
+    uint64_t pi_vsize; // virtual memory size in bytes
+    uint64_t pi_rss; // resident set size, in pages
+    uint64_t pi_rsslimit; // soft limit of the resident set size, in bytes
+    uint64_t pi_vsize_peak; // only from taskstats: peak virtual memory size in bytes
+    uint64_t pi_rss_peak; // only from taskstats: peak resident set size in bytes
+    uint64_t pi_swap_pages; // not maintained by recent kernels
+    uint64_t pi_child_swap_pages; // not maintained by recent kernels
+    uint64_t pi_delayacct_blkio_ticks;
+    uint64_t pi_delayacct_cpu_nsec; // only from taskstats: time spent waiting for a CPU
+    uint64_t pi_delayacct_swapin_nsec; // only from taskstats: time spent waiting for swap-in
+    uint64_t pi_delayacct_reclaim_nsec; // only from taskstats: time spent waiting for memory reclaim
+    uint64_t statm_size; // total program size, in pages
+    uint64_t statm_resident; // resident set size, in pages
+    uint64_t statm_share; // shared pages
+    uint64_t statm_trs; // text (code) pages
+    uint64_t statm_drs; // data and stack pages
+    int32_t pi_priority;
+    int32_t pi_nice;
+    int32_t pi_num_threads;
+    int32_t pi_last_cpu;
+    int32_t pi_realtime_priority;
+    int32_t pi_sched_policy;
+    int32_t pi_exit_code; // only for processes reported after their exit, see --proc-events
+    char pi_state; // 0 if not available
+
+    // when the counters are not read at each sample, their deltas span more than one sampling interval:
+    double stat_read_time; // in seconds on the process sampling clock, 0 if never read
+    double stat_interval_secs; // time covered by the deltas of CPU times and faults; 0 if unknown
+    double io_read_time; // in seconds on the process sampling clock, 0 if never read
+    double io_interval_secs; // time covered by the deltas of the I/O counters; 0 if unknown
+    uint32_t idle_samples; // consecutive reads of /proc/<pid>/stat without any CPU time
+} proc_gauges_t;
+
+/*
+ * Identity of a process, which is read only when the process is first seen:
+ * the PID and the start time identify a process even when PIDs are reused.
+ */
+typedef struct proc_identity_s {
+    uint64_t pi_start_time; // in clock ticks since boot
+    pid_t pi_pid;
+    pid_t pi_tgid; // the PID of the process, if this is one of its threads
+    pid_t pi_ppid;
+    pid_t pi_pgrp;
+    pid_t pi_session;
+    int32_t pi_tty_nr;
+    uid_t uid;
+    bool from_taskstats; // if set, the fields provided only by /proc/<pid>/stat and /proc/<pid>/statm are zero
+    char pi_comm[64]; // the filename of the executable
+} proc_identity_t;
+
+//------------------------------------------------------------------------------
+// CMonitorProcessTable
+//
+// An open-addressing hash table, with linear probing, maps each PID to a row;
+// the counters, gauges and identity of all rows live in separate contiguous
+// arrays, so that the per-sample work (reading counters and computing scores)
+// touches only the counters. Rows are allocated when a PID is first seen and
+// reused after the process disappears: in steady state no memory is allocated.
+// Each row is tagged with the number of the last update it was refreshed in,
+// so that starting a new sample does not require to clear anything, and with
+// the start time of its process, its "generation": when the PID is reused by a
+// new process, the row is reset and the new process has no baseline.
+// Each row can also keep the file descriptor of /proc/<pid>/stat open across
+// updates, so that reading it again requires no path lookup: once the process
+// is gone, even if its PID is reused, reads from it fail and the file must be
+// opened again.
+// A checkpoint keeps the counters of all rows, and the times they were read,
+// until the next one, so that rates can span many updates, e.g. in flight
+// recorder mode, where the regular samples are much less frequent than the
+// updates; a new process has a zero checkpoint, like its previous counters.
+// Not thread-safe, except that different rows can be read, marked as updated
+// and can take or keep their descriptors concurrently, e.g. by the threads of
+// a parallel scan, once they have been allocated by find_or_add().
+//------------------------------------------------------------------------------
+
+#define PROCESS_TABLE_NO_ROW ((size_t)-1)
+#define PROCESS_TABLE_MIN_SLOT_BITS (8) // log2 of the slots of the smallest table
+
+class CMonitorProcessTable {
+public:
+    CMonitorProcessTable() {}
+    ~CMonitorProcessTable() { close_fds(); }
+
+    // non-copyable: rows may own file descriptors
+    CMonitorProcessTable(const CMonitorProcessTable&) = delete;
+    CMonitorProcessTable& operator=(const CMonitorProcessTable&) = delete;
+
+    // the current counters become the previous ones and all rows are marked as not updated;
+    // the sampling clock, used to time the reads of rows not read at each update, is advanced
+    void start_update(double elapsed_secs);
+
+    // returns the row of the given PID or PROCESS_TABLE_NO_ROW
+    size_t find(pid_t pid) const;
+
+    // returns the row of the given PID, allocating a new one with a zero identity if needed
+    size_t find_or_add(pid_t pid);
+
+    // marks the row as refreshed in the current update; its identity must be filled already:
+    // if its start time differs from the one of the last update, the previous counters are zeroed
+    // and true is returned, since the row describes a new process
+    bool set_updated(size_t row);
+    bool is_updated(size_t row) const { return m_rows[row].pid != 0 && m_rows[row].last_update == m_num_updates; }
+    bool was_updated(size_t row) const { return m_rows[row].pid != 0 && m_rows[row].last_update + 1 == m_num_updates; }
+    uint64_t get_num_updates() const { return m_num_updates; }
+    double get_time() const { return m_time_secs; }
+
+    // frees the rows not refreshed in the current update
+    void remove_stale();
+
+    // number of rows, including free ones: only those with is_updated() set are valid
+    size_t size() const { return m_rows.size(); }
+    size_t get_num_processes() const { return m_num_used; }
+
+    proc_counters_t& get_current(size_t row) { return m_current[row]; }
+    const proc_counters_t& get_previous(size_t row) const { return m_previous[row]; }
+    proc_gauges_t& get_gauges(size_t row) { return m_gauges[row]; }
+    proc_identity_t& get_identity(size_t row) { return m_identity[row]; }
+
+    // the current counters of all rows, and the times they were read, become the checkpoint
+    void set_checkpoint();
+
+    // the counters the rates are computed from, and the time elapsed since they were read (0 if unknown):
+    // those of the previous read by default, those of the checkpoint after set_rates_since_checkpoint(true)
+    void set_rates_since_checkpoint(bool enabled) { m_rates_since_checkpoint = enabled; }
+    const proc_counters_t& get_baseline(size_t row) const
+    {
+        return m_rates_since_checkpoint ? m_checkpoint[row].counters : m_previous[row];
+    }
+    double get_stat_interval(size_t row) const;
+    double get_io_interval(size_t row) const;
+
+    // the caller takes the ownership of the file descriptor kept by the row, -1 if none; then it can give it
+    // back with keep_fd(), which closes it if more than the maximum number of descriptors are kept already
+    int take_fd(size_t row);
+    void keep_fd(size_t row, int fd);
+    int get_fd(size_t row) const { return m_rows[row].fd; } // the ownership stays with the row
+    void set_max_fds(size_t max_fds) { m_max_fds = max_fds; } // 0 by default: no descriptor is kept
+    void close_fds(); // e.g. when the procfs root moves
+
+    // the slot where the lookup of a PID starts in a table of 2^slot_bits slots; public for the self-checks
+    static size_t home_slot(pid_t pid, unsigned int slot_bits)
+    {
+        // Fibonacci hashing: PIDs are often consecutive and must be spread over the whole table
+        return (uint32_t)((uint32_t)pid * 2654435769U) >> (32 - slot_bits);
+    }
+
+private:
+    struct row_t {
+        pid_t pid; // 0 if the row is free
+        uint64_t last_update; // value of m_num_updates when last refreshed
+        uint64_t generation; // start time of the process of the last update
+        int fd; // kept open across updates, or -1
+    };
+    struct slot_t {
+        pid_t pid;
+        uint32_t row; // UINT32_MAX if the slot is empty
+    };
+    struct checkpoint_t {
+        proc_counters_t counters;
+        double stat_read_time; // see proc_gauges_t
+        double io_read_time;
+    };
+
+    size_t home_slot(pid_t pid) const { return home_slot(pid, m_slot_bits); }
+    void erase_slot(size_t slot);
+    void rehash(size_t num_slots);
+
+private:
+    std::vector<slot_t> m_slots; // a power of 2, at most half full
+    unsigned int m_slot_bits = 0; // log2 of m_slots.size()
+    size_t m_num_used = 0;
+    std::atomic<size_t> m_num_fds { 0 };
+    size_t m_max_fds = 0;
+    uint64_t m_num_updates = 0;
+    double m_time_secs = 0; // sum of the elapsed times of all updates
+
+    std::vector<row_t> m_rows;
+    std::vector<size_t> m_free_rows;
+    std::vector<proc_counters_t> m_current;
+    std::vector<proc_counters_t> m_previous;
+    std::vector<proc_gauges_t> m_gauges;
+    std::vector<proc_identity_t> m_identity;
+    std::vector<checkpoint_t> m_checkpoint;
+    bool m_rates_since_checkpoint = false;
+};
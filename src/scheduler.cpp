@@ -0,0 +1,173 @@
+/*
+ * scheduler.cpp -- drift-free pacing of the sampling loop based on
+ *                  absolute CLOCK_MONOTONIC deadlines
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <errno.h>
+#include <time.h>
+
+#define NSEC_PER_SEC (1000000000ULL)
+#define NSEC_PER_MSEC (1000000ULL)
+#define NSEC_PER_USEC (1000ULL)
+
+// ----------------------------------------------------------------------------------
+// CMonitorScheduler
+// ----------------------------------------------------------------------------------
+
+/* static */
+uint64_t CMonitorScheduler::get_monotonic_time_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * NSEC_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t CMonitorScheduler::gcd(uint64_t a, uint64_t b)
+{
+    while (b != 0) {
+        uint64_t t = a % b;
+        a = b;
+        b = t;
+    }
+    return a;
+}
+
+void CMonitorScheduler::set_family_interval(unsigned int family, uint64_t interval_msec)
+{
+    m_families[family].interval_msec = interval_msec;
+}
+
+uint64_t CMonitorScheduler::get_families_gcd_msec() const
+{
+    uint64_t tick_msec = 0;
+    for (const auto& it : m_families)
+        tick_msec = gcd(it.second.interval_msec, tick_msec);
+    return tick_msec;
+}
+
+void CMonitorScheduler::start(uint64_t first_delay_msec, uint64_t now_nsec)
+{
+    // the tick is the greatest common divisor of all family intervals:
+    uint64_t tick_msec = get_families_gcd_msec();
+    if (tick_msec == 0)
+        tick_msec = first_delay_msec;
+
+    m_interval_nsec = tick_msec * NSEC_PER_MSEC;
+    m_last_wakeup_nsec = now_nsec ? now_nsec : get_monotonic_time_nsec();
+    m_next_deadline_nsec = m_last_wakeup_nsec + first_delay_msec * NSEC_PER_MSEC;
+    m_elapsed_sec = 0;
+    m_last_jitter_usec = 0;
+    m_last_overruns = 0;
+    m_total_overruns = 0;
+    m_tick_count = 0;
+
+    for (auto& it : m_families) {
+        it.second.period_ticks = tick_msec ? (it.second.interval_msec / tick_msec) : 1;
+        it.second.last_collect_nsec = m_last_wakeup_nsec;
+    }
+}
+
+double CMonitorScheduler::get_elapsed_sec(unsigned int family) const
+{
+    if (family == 0)
+        return m_elapsed_sec;
+
+    // NOTE: aggregated families (e.g. PK_ALL_CGROUP) are not registered: use the first matching one
+    for (const auto& it : m_families)
+        if (it.first & family)
+            return it.second.elapsed_sec;
+    return m_elapsed_sec;
+}
+
+bool CMonitorScheduler::wait_next_deadline()
+{
+    // NOTE: the deadline is absolute, so if the collection of the previous sample took e.g. 30% of
+    //       the sampling interval, we will sleep just the remaining 70%
+    struct timespec deadline;
+    deadline.tv_sec = m_next_deadline_nsec / NSEC_PER_SEC;
+    deadline.tv_nsec = m_next_deadline_nsec % NSEC_PER_SEC;
+
+    int rc;
+    while ((rc = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL)) == EINTR) {
+        if (g_bExiting)
+            return false;
+    }
+
+    advance_to(get_monotonic_time_nsec());
+    return true;
+}
+
+void CMonitorScheduler::advance_to(uint64_t now_nsec)
+{
+    uint64_t jitter_nsec = (now_nsec > m_next_deadline_nsec) ? (now_nsec - m_next_deadline_nsec) : 0;
+    m_last_jitter_usec = jitter_nsec / NSEC_PER_USEC;
+
+    // if we are late by one or more whole intervals, the deadlines in the past cannot be served anymore:
+    // skip them (counting them as overruns) instead of producing a burst of back-to-back samples
+    m_last_overruns = 0;
+    if (m_interval_nsec > 0 && jitter_nsec >= m_interval_nsec) {
+        m_last_overruns = jitter_nsec / m_interval_nsec;
+        m_total_overruns += m_last_overruns;
+        m_next_deadline_nsec += m_last_overruns * m_interval_nsec;
+    }
+    m_next_deadline_nsec += m_interval_nsec;
+
+    m_elapsed_sec = (double)(now_nsec - m_last_wakeup_nsec) / (double)NSEC_PER_SEC;
+    m_last_wakeup_nsec = now_nsec;
+
+    // decide which families are due: the very first tick collects all of them; skipped ticks
+    // still count so that a slow family is not postponed by overruns
+    bool first_tick = (m_tick_count == 0);
+    m_tick_count += 1 + m_last_overruns;
+    m_due_families = 0;
+    for (auto& it : m_families) {
+        family_schedule_t& f = it.second;
+        if (first_tick || m_tick_count - f.last_tick >= f.period_ticks) {
+            f.last_tick = m_tick_count;
+            f.elapsed_sec = (double)(now_nsec - f.last_collect_nsec) / (double)NSEC_PER_SEC;
+            f.last_collect_nsec = now_nsec;
+            m_due_families |= it.first;
+        }
+    }
+}
+
+void CMonitorScheduler::replay_tick(
+    uint64_t now_nsec, unsigned int due_families, uint64_t jitter_usec, uint64_t overruns)
+{
+    m_last_jitter_usec = jitter_usec;
+    m_last_overruns = overruns;
+    m_total_overruns += overruns;
+
+    m_elapsed_sec = (double)(now_nsec - m_last_wakeup_nsec) / (double)NSEC_PER_SEC;
+    m_last_wakeup_nsec = now_nsec;
+    m_next_deadline_nsec = now_nsec + m_interval_nsec;
+
+    // families that were not registered in the recording run are never due and vice versa
+    m_tick_count++;
+    m_due_families = 0;
+    for (auto& it : m_families) {
+        family_schedule_t& f = it.second;
+        if (due_families & it.first) {
+            f.last_tick = m_tick_count;
+            f.elapsed_sec = (double)(now_nsec - f.last_collect_nsec) / (double)NSEC_PER_SEC;
+            f.last_collect_nsec = now_nsec;
+            m_due_families |= it.first;
+        }
+    }
+}
@@ -0,0 +1,235 @@
+/*
+ * self_stats.cpp -- self-instrumentation of cmonitor_collector: time spent
+ *                   and memory allocated by each collector and output sink
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include "output_frontend.h"
+#include <new>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+//------------------------------------------------------------------------------
+// Globals
+//------------------------------------------------------------------------------
+
+CMonitorSelfStats g_self_stats;
+
+static bool g_count_allocations = false; // written only before any other thread starts
+static thread_local uint64_t g_thread_allocs = 0;
+static std::atomic<uint64_t> g_total_allocs { 0 };
+
+static const char* g_probe_names[SSP_MAX] = {
+    "proc_stat", // force newline
+    "proc_meminfo", // force newline
+    "proc_net_dev", // force newline
+    "proc_diskstats", // force newline
+    "cgroup_cpuacct", // force newline
+    "cgroup_memory", // force newline
+    "cgroup_blkio", // force newline
+    "cgroup_tasks", // force newline
+    "sink_json", // force newline
+    "sink_influxdb", // force newline
+    "sink_flight_recorder", // force newline
+};
+
+//------------------------------------------------------------------------------
+// Allocation counting
+// NOTE: only allocations done through operator new are counted; this covers all
+//       STL containers and strings but not the malloc() calls done inside libc
+//       (e.g. by fopen())
+//------------------------------------------------------------------------------
+
+void* operator new(size_t size)
+{
+    if (g_count_allocations)
+        CMonitorSelfStats::count_allocation();
+    void* p = malloc(size ? size : 1);
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+void operator delete(void* p) noexcept { free(p); }
+void operator delete(void* p, size_t) noexcept { free(p); }
+
+/* static */
+void CMonitorSelfStats::enable_allocation_counting() { g_count_allocations = true; }
+
+/* static */
+void CMonitorSelfStats::count_allocation()
+{
+    g_thread_allocs++;
+    g_total_allocs.fetch_add(1, std::memory_order_relaxed);
+}
+
+/* static */
+uint64_t CMonitorSelfStats::get_thread_allocations() { return g_thread_allocs; }
+
+//------------------------------------------------------------------------------
+// Timer
+//------------------------------------------------------------------------------
+
+static uint64_t get_thread_cpu_time_nsec()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+CMonitorSelfStats::Timer::Timer(SelfStatsProbe probe)
+{
+    m_probe = probe;
+    if (!g_self_stats.is_enabled())
+        return;
+
+    m_start_allocs = g_thread_allocs;
+    m_start_cpu_nsec = get_thread_cpu_time_nsec();
+    m_start_wall_nsec = CMonitorScheduler::get_monotonic_time_nsec();
+}
+
+CMonitorSelfStats::Timer::~Timer()
+{
+    if (!g_self_stats.is_enabled())
+        return;
+
+    uint64_t wall_nsec = CMonitorScheduler::get_monotonic_time_nsec() - m_start_wall_nsec;
+    uint64_t cpu_nsec = get_thread_cpu_time_nsec() - m_start_cpu_nsec;
+    g_self_stats.record(m_probe, wall_nsec, cpu_nsec, g_thread_allocs - m_start_allocs);
+}
+
+//------------------------------------------------------------------------------
+// CMonitorSelfStats
+//------------------------------------------------------------------------------
+
+void CMonitorSelfStats::enable()
+{
+    m_enabled = true;
+    enable_allocation_counting();
+}
+
+void CMonitorSelfStats::record(SelfStatsProbe probe, uint64_t wall_nsec, uint64_t cpu_nsec, uint64_t allocs)
+{
+    probe_stats_t& p = m_probes[probe];
+    p.calls++;
+    p.wall_nsec += wall_nsec;
+    p.cpu_nsec += cpu_nsec;
+    p.allocs += allocs;
+
+    p.total_calls++;
+    p.total_wall_nsec += wall_nsec;
+    uint64_t prev_max = p.max_wall_nsec;
+    while (wall_nsec > prev_max && !p.max_wall_nsec.compare_exchange_weak(prev_max, wall_nsec))
+        ;
+
+    // bucket N contains latencies in the range [2^(N-1), 2^N) usecs; bucket 0 contains latencies below 1usec
+    uint64_t wall_usec = wall_nsec / 1000;
+    unsigned int bucket = 0;
+    while (wall_usec > 0 && bucket < SELF_STATS_HISTOGRAM_BUCKETS - 1) {
+        wall_usec >>= 1;
+        bucket++;
+    }
+    p.histogram[bucket]++;
+}
+
+void CMonitorSelfStats::psample_start()
+{
+    if (!m_enabled)
+        return;
+    m_sample_start_wall_nsec = CMonitorScheduler::get_monotonic_time_nsec();
+}
+
+void CMonitorSelfStats::psection_self()
+{
+    if (!m_enabled)
+        return;
+
+    DEBUGLOG_FUNCTION_START();
+
+    g_output.psection_start("cmonitor_self");
+
+    // stats for the process as a whole:
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    uint64_t cpu_usec = (uint64_t)(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000ULL
+        + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+    uint64_t total_allocs = g_total_allocs.load(std::memory_order_relaxed);
+
+    g_output.psubsection_start("total");
+    g_output.plong("sample_wall_usec", (CMonitorScheduler::get_monotonic_time_nsec() - m_sample_start_wall_nsec) / 1000);
+    g_output.plong("process_cpu_usec", cpu_usec - m_last_rusage_cpu_usec); // includes the output thread
+    g_output.plong("allocs", total_allocs - m_last_total_allocs);
+    g_output.plong("max_rss_kb", usage.ru_maxrss);
+    g_output.psubsection_end();
+
+    m_last_rusage_cpu_usec = cpu_usec;
+    m_last_total_allocs = total_allocs;
+
+    // stats for each probe that ran since last sample;
+    // NOTE: sinks run on the output thread, so their stats refer to the previously-written samples
+    for (unsigned int i = 0; i < SSP_MAX; i++) {
+        probe_stats_t& p = m_probes[i];
+        uint64_t calls = p.calls.exchange(0);
+        if (calls == 0)
+            continue;
+
+        g_output.psubsection_start(g_probe_names[i]);
+        g_output.plong("calls", calls);
+        g_output.plong("wall_usec", p.wall_nsec.exchange(0) / 1000);
+        g_output.plong("cpu_usec", p.cpu_nsec.exchange(0) / 1000);
+        g_output.plong("allocs", p.allocs.exchange(0));
+        if (i == SSP_SINK_JSON || i == SSP_SINK_INFLUXDB || i == SSP_SINK_FLIGHT_RECORDER)
+            g_output.plong("bytes", p.bytes.exchange(0));
+        g_output.psubsection_end();
+    }
+
+    g_output.psection_end();
+}
+
+void CMonitorSelfStats::pfooter()
+{
+    if (!m_enabled)
+        return;
+
+    g_output.psection_start("cmonitor_self_latency_histograms");
+    for (unsigned int i = 0; i < SSP_MAX; i++) {
+        probe_stats_t& p = m_probes[i];
+        if (p.total_calls == 0)
+            continue;
+
+        g_output.psubsection_start(g_probe_names[i]);
+        g_output.plong("calls", p.total_calls);
+        g_output.plong("avg_usec", p.total_wall_nsec / p.total_calls / 1000);
+        g_output.plong("max_usec", p.max_wall_nsec / 1000);
+
+        // only non-empty buckets are reported; each one is named after its upper bound
+        char name[64];
+        for (unsigned int b = 0; b < SELF_STATS_HISTOGRAM_BUCKETS; b++) {
+            if (p.histogram[b] == 0)
+                continue;
+            if (b < SELF_STATS_HISTOGRAM_BUCKETS - 1)
+                snprintf(name, sizeof(name), "lt_%luusec", 1UL << b);
+            else
+                snprintf(name, sizeof(name), "ge_%luusec", 1UL << (b - 1));
+            g_output.plong(name, p.histogram[b]);
+        }
+        g_output.psubsection_end();
+    }
+    g_output.psection_end();
+}
@@ -0,0 +1,220 @@
+/*
+ * snapshot.cpp -- recording of the /proc and /sys files read at each tick and
+ *                 their replay through all the collectors
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "snapshot.h"
+#include "cmonitor.h"
+#include <algorithm>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+//------------------------------------------------------------------------------
+// Globals
+//------------------------------------------------------------------------------
+
+CMonitorSnapshotRecorder g_snapshot_recorder;
+CMonitorSnapshotReplayer g_snapshot_replayer;
+
+//------------------------------------------------------------------------------
+// Utilities
+//------------------------------------------------------------------------------
+
+static bool make_dir(const std::string& path)
+{
+    return mkdir(path.c_str(), 0755) == 0 || errno == EEXIST;
+}
+
+static bool write_file(const std::string& path, const char* data, size_t size)
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1)
+        return false;
+
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return false;
+        }
+        data += n;
+        size -= n;
+    }
+    close(fd);
+    return true;
+}
+
+// returns true if path is below the given root directory and in such case fills the relative path
+static bool get_path_below(const std::string& path, const std::string& root, std::string& relative_path)
+{
+    if (path.size() <= root.size() || path.compare(0, root.size(), root) != 0 || path[root.size()] != '/')
+        return false;
+    relative_path = path.substr(root.size());
+    return true;
+}
+
+//------------------------------------------------------------------------------
+// CMonitorSnapshotRecorder
+//------------------------------------------------------------------------------
+
+CMonitorSnapshotRecorder::~CMonitorSnapshotRecorder()
+{
+    if (is_enabled())
+        CMonitorProcFile::set_observer(nullptr);
+}
+
+bool CMonitorSnapshotRecorder::init(const std::string& dir)
+{
+    if (!make_dir(dir))
+        return false;
+
+    m_dir = dir;
+    CMonitorProcFile::set_observer(this);
+    return true;
+}
+
+bool CMonitorSnapshotRecorder::begin_tick(const snapshot_tick_t& tick)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    char name[64];
+    snprintf(name, sizeof(name), "/" SNAPSHOT_TICK_DIR_PREFIX "%06u", m_num_ticks++);
+    m_tick_dir = m_dir + name;
+    m_created_dirs.clear();
+    if (!make_dir(m_tick_dir)) {
+        g_logger.LogError("Cannot create the snapshot directory [%s]: %s", m_tick_dir.c_str(), strerror(errno));
+        m_tick_dir.clear(); // files read in this tick won't be recorded
+        return false;
+    }
+
+    char info[512];
+    int len = snprintf(info, sizeof(info),
+        "monotonic_nsec %lu\n"
+        "realtime_nsec %lu\n"
+        "due_families %u\n"
+        "jitter_usec %lu\n"
+        "overruns %lu\n"
+        "pid %d\n",
+        tick.monotonic_nsec, tick.realtime_nsec, tick.due_families, tick.jitter_usec, tick.overruns, (int)tick.pid);
+    return write_file(m_tick_dir + "/" SNAPSHOT_TICK_INFO_FILE, info, len);
+}
+
+bool CMonitorSnapshotRecorder::make_parent_dirs(const std::string& path)
+{
+    // NOTE: path always starts with m_tick_dir, which exists already
+    size_t pos = m_tick_dir.size();
+    while ((pos = path.find('/', pos + 1)) != std::string::npos) {
+        std::string dir = path.substr(0, pos);
+        if (m_created_dirs.find(dir) != m_created_dirs.end())
+            continue;
+        if (!make_dir(dir))
+            return false;
+        m_created_dirs.insert(dir);
+    }
+    return true;
+}
+
+void CMonitorSnapshotRecorder::on_file_read(const std::string& path, const char* data, size_t size)
+{
+    std::string relative_path;
+    if (get_path_below(path, g_cfg.m_strProcRoot, relative_path))
+        relative_path = "/proc" + relative_path;
+    else if (get_path_below(path, g_cfg.m_strSysRoot, relative_path))
+        relative_path = "/sys" + relative_path;
+    else
+        return; // not a procfs/sysfs file
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_tick_dir.empty())
+        return; // no tick started yet
+
+    std::string snapshot_path = m_tick_dir + relative_path;
+    if (!make_parent_dirs(snapshot_path) || !write_file(snapshot_path, data, size))
+        g_logger.LogError("Cannot record the snapshot file [%s]: %s", snapshot_path.c_str(), strerror(errno));
+}
+
+//------------------------------------------------------------------------------
+// CMonitorSnapshotReplayer
+//------------------------------------------------------------------------------
+
+bool CMonitorSnapshotReplayer::init(const std::string& dir)
+{
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr)
+        return false;
+
+    struct dirent* entry;
+    while ((entry = readdir(d)) != nullptr) {
+        if (strncmp(entry->d_name, SNAPSHOT_TICK_DIR_PREFIX, strlen(SNAPSHOT_TICK_DIR_PREFIX)) == 0)
+            m_tick_dirs.push_back(dir + "/" + entry->d_name);
+    }
+    closedir(d);
+
+    // tick numbers are zero-padded: the lexicographic order is the recording order
+    std::sort(m_tick_dirs.begin(), m_tick_dirs.end());
+
+    m_dir = dir;
+    m_next_tick = 0;
+    return !m_tick_dirs.empty();
+}
+
+bool CMonitorSnapshotReplayer::next_tick()
+{
+    if (m_next_tick >= m_tick_dirs.size())
+        return false;
+    const std::string& tick_dir = m_tick_dirs[m_next_tick++];
+
+    CMonitorProcFile info_file;
+    const char* p = info_file.read(tick_dir, "/" SNAPSHOT_TICK_INFO_FILE);
+    if (p == nullptr) {
+        g_logger.LogError("Cannot read the snapshot tick file in [%s]", tick_dir.c_str());
+        return false;
+    }
+
+    m_tick = snapshot_tick_t();
+    char label[64];
+    do {
+        uint64_t value = 0;
+        proc_parse_label(p, label, sizeof(label));
+        if (!proc_parse_uint(p, value))
+            continue;
+
+        if (strcmp(label, "monotonic_nsec") == 0)
+            m_tick.monotonic_nsec = value;
+        else if (strcmp(label, "realtime_nsec") == 0)
+            m_tick.realtime_nsec = value;
+        else if (strcmp(label, "due_families") == 0)
+            m_tick.due_families = (unsigned int)value;
+        else if (strcmp(label, "jitter_usec") == 0)
+            m_tick.jitter_usec = value;
+        else if (strcmp(label, "overruns") == 0)
+            m_tick.overruns = value;
+        else if (strcmp(label, "pid") == 0)
+            m_tick.pid = (pid_t)value;
+    } while (proc_next_line(p));
+
+    g_cfg.m_strProcRoot = tick_dir + "/proc";
+    g_cfg.m_strSysRoot = tick_dir + "/sys";
+    CMonitorProcFile::invalidate_all();
+    return true;
+}
@@ -0,0 +1,127 @@
+/*
+ * snapshot.h -- recording of the /proc and /sys files read at each tick and
+ *               their replay through all the collectors
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include "proc_file.h"
+#include <mutex>
+#include <set>
+#include <string>
+#include <sys/types.h>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Snapshot directory layout
+//
+// A recording is a directory containing one sub-directory per tick:
+//    tick_000000/              files read before the first sample (baselines and header)
+//    tick_000001/              files read to produce the first sample
+//    ...
+// and each tick directory contains:
+//    tick                      "key value" lines describing the tick (see snapshot_tick_t)
+//    proc/...                  copy of the files read below the procfs root
+//    sys/...                   copy of the files read below the sysfs root
+// so that a tick directory can be used as-is by --proc-root=<tick>/proc and
+// --sys-root=<tick>/sys. Fixtures for synthetic machines (e.g. 1000 CPUs and
+// 50k processes) can be generated with the same layout.
+//------------------------------------------------------------------------------
+
+#define SNAPSHOT_TICK_DIR_PREFIX "tick_"
+#define SNAPSHOT_TICK_INFO_FILE "tick"
+
+struct snapshot_tick_t {
+    uint64_t monotonic_nsec = 0; // CLOCK_MONOTONIC time of the wakeup
+    uint64_t realtime_nsec = 0; // wall-clock time of the wakeup, used for the sample timestamps
+    unsigned int due_families = 0; // families collected in this tick; 0 for the baseline tick
+    uint64_t jitter_usec = 0;
+    uint64_t overruns = 0;
+    pid_t pid = 0; // PID of the recording cmonitor_collector, used to find it inside its cgroup
+};
+
+//------------------------------------------------------------------------------
+// CMonitorSnapshotRecorder
+//
+// Installed as observer of all CMonitorProcFile instances: every file read
+// below the procfs or sysfs root is copied into the directory of current tick.
+//------------------------------------------------------------------------------
+
+class CMonitorSnapshotRecorder : public CMonitorProcFileObserver {
+public:
+    CMonitorSnapshotRecorder() {}
+    ~CMonitorSnapshotRecorder();
+
+    // creates the recording directory; the recording starts at first begin_tick()
+    bool init(const std::string& dir);
+    bool is_enabled() const { return !m_dir.empty(); }
+
+    // creates the directory of a new tick: all files read from now on are stored there
+    bool begin_tick(const snapshot_tick_t& tick);
+
+    virtual void on_file_read(const std::string& path, const char* data, size_t size) override;
+
+private:
+    bool make_parent_dirs(const std::string& path);
+
+private:
+    std::string m_dir;
+    unsigned int m_num_ticks = 0;
+    std::string m_tick_dir;
+
+    // on_file_read() may run on the collector threads:
+    std::mutex m_mutex;
+    std::set<std::string> m_created_dirs; // of current tick
+};
+
+//------------------------------------------------------------------------------
+// CMonitorSnapshotReplayer
+//
+// Moves the procfs/sysfs roots of the collectors from one tick directory of a
+// recording to the next one, providing the recorded timings of each tick so
+// that the whole recording can be processed at full speed.
+//------------------------------------------------------------------------------
+
+class CMonitorSnapshotReplayer {
+public:
+    CMonitorSnapshotReplayer() {}
+
+    // lists the tick directories of given recording
+    bool init(const std::string& dir);
+    bool is_enabled() const { return !m_dir.empty(); }
+    size_t get_num_ticks() const { return m_tick_dirs.size(); }
+
+    // points g_cfg.m_strProcRoot and g_cfg.m_strSysRoot to the next tick and invalidates all open
+    // CMonitorProcFile instances; returns false when there are no more ticks
+    bool next_tick();
+    const snapshot_tick_t& get_tick() const { return m_tick; }
+
+private:
+    std::string m_dir;
+    std::vector<std::string> m_tick_dirs;
+    size_t m_next_tick = 0;
+    snapshot_tick_t m_tick;
+};
+
+// app-wide snapshot recorder and replayer:
+extern CMonitorSnapshotRecorder g_snapshot_recorder;
+extern CMonitorSnapshotReplayer g_snapshot_replayer;
@@ -0,0 +1,205 @@
+/*
+ * spsc_queue.h -- bounded single-producer/single-consumer ring used to hand
+ *                 over finished samples from the sampling thread to the
+ *                 output thread
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#pragma once
+
+//------------------------------------------------------------------------------
+// Includes
+//------------------------------------------------------------------------------
+
+#include <atomic>
+#include <errno.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <utility>
+#include <vector>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+enum QueueOverflowPolicy {
+    QOP_DROP_OLDEST, // force newline
+    QOP_DROP_NEWEST, // force newline
+    QOP_BLOCK // force newline
+};
+
+//------------------------------------------------------------------------------
+// CMonitorSpscQueue
+//
+// A bounded ring of pre-allocated T items. Items are never copied: push() and
+// pop() swap() the caller's item with the one stored in the ring, so that the
+// memory owned by T (e.g. std::vector capacity) is recycled between producer
+// and consumer without any allocation at steady state.
+//
+// Each slot carries a sequence number (as in D. Vyukov's bounded queue): the
+// producer only advances the head and the consumer only advances the tail,
+// using a CAS. The CAS on the tail is needed just for the QOP_DROP_OLDEST
+// policy, where the producer "steals" the oldest item from the consumer.
+// The two semaphores are used only to sleep when there's nothing to do:
+// the data path never takes a lock.
+//------------------------------------------------------------------------------
+
+template <typename T> class CMonitorSpscQueue {
+public:
+    CMonitorSpscQueue() {}
+    ~CMonitorSpscQueue()
+    {
+        if (m_capacity) {
+            sem_destroy(&m_sem_items);
+            sem_destroy(&m_sem_free_slots);
+        }
+    }
+
+    // must be called once, before starting to use the queue; capacity is rounded up to a power of 2
+    void init(size_t capacity, QueueOverflowPolicy policy)
+    {
+        m_capacity = 1;
+        while (m_capacity < capacity)
+            m_capacity *= 2;
+        m_policy = policy;
+
+        m_slots = std::vector<slot_t>(m_capacity);
+        for (size_t i = 0; i < m_capacity; i++)
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+
+        sem_init(&m_sem_items, 0, 0);
+        sem_init(&m_sem_free_slots, 0, 0);
+    }
+
+    // PRODUCER API
+    // Moves the given item into the queue (the argument receives a recycled item in exchange).
+    // Returns false if the item was dropped because the queue is full (or, with QOP_BLOCK, if
+    // the wait for a free slot was interrupted by a signal).
+    bool push(T& item)
+    {
+        while (true) {
+            uint64_t pos = m_head.load(std::memory_order_relaxed);
+            slot_t& slot = m_slots[pos & (m_capacity - 1)];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+
+            if (seq == pos) {
+                // free slot:
+                std::swap(slot.item, item);
+                slot.seq.store(pos + 1, std::memory_order_release);
+                m_head.store(pos + 1, std::memory_order_relaxed);
+                sem_post(&m_sem_items);
+                return true;
+            }
+
+            // queue is full:
+            switch (m_policy) {
+            case QOP_DROP_NEWEST:
+                m_drops.fetch_add(1, std::memory_order_relaxed);
+                return false;
+
+            case QOP_DROP_OLDEST:
+                if (try_pop_internal(m_dropped_item))
+                    m_drops.fetch_add(1, std::memory_order_relaxed);
+                // else: the consumer is taking out the oldest item right now: the slot will be free soon
+                break;
+
+            case QOP_BLOCK:
+                if (sem_wait(&m_sem_free_slots) == -1 && errno == EINTR)
+                    return false;
+                break;
+            }
+        }
+    }
+
+    // CONSUMER API
+    // Swaps the oldest item of the queue into the given argument; blocks if the queue is empty.
+    // Returns false only if the wait was interrupted by wakeup_consumer().
+    bool pop(T& item)
+    {
+        while (true) {
+            if (try_pop_internal(item)) {
+                sem_post(&m_sem_free_slots);
+                return true;
+            }
+            if (m_wakeup_requested.exchange(false))
+                return false;
+            sem_wait(&m_sem_items);
+        }
+    }
+
+    // makes a pop() waiting on an empty queue return false
+    void wakeup_consumer()
+    {
+        m_wakeup_requested = true;
+        sem_post(&m_sem_items);
+    }
+
+    // STATS API (can be called from any thread)
+    size_t get_capacity() const { return m_capacity; }
+    size_t get_depth() const
+    {
+        uint64_t head = m_head.load(std::memory_order_relaxed);
+        uint64_t tail = m_tail.load(std::memory_order_relaxed);
+        return (head > tail) ? (head - tail) : 0;
+    }
+    uint64_t get_drops() const { return m_drops.load(std::memory_order_relaxed); }
+
+private:
+    bool try_pop_internal(T& item)
+    {
+        uint64_t pos = m_tail.load(std::memory_order_relaxed);
+        while (true) {
+            slot_t& slot = m_slots[pos & (m_capacity - 1)];
+            uint64_t seq = slot.seq.load(std::memory_order_acquire);
+
+            if (seq == pos + 1) {
+                // the slot contains an item: try to own it
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    std::swap(slot.item, item);
+                    slot.seq.store(pos + m_capacity, std::memory_order_release);
+                    return true;
+                }
+                // pos has been reloaded by compare_exchange_weak(): retry
+            } else if (seq < pos + 1) {
+                return false; // empty queue (or oldest item still being taken out by the other side)
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    struct slot_t {
+        std::atomic<uint64_t> seq { 0 };
+        T item;
+    };
+
+    std::vector<slot_t> m_slots;
+    size_t m_capacity = 0;
+    QueueOverflowPolicy m_policy = QOP_DROP_OLDEST;
+
+    // keep producer and consumer indexes on different cache lines:
+    alignas(64) std::atomic<uint64_t> m_head { 0 };
+    alignas(64) std::atomic<uint64_t> m_tail { 0 };
+    alignas(64) std::atomic<uint64_t> m_drops { 0 };
+    std::atomic<bool> m_wakeup_requested { false };
+
+    // item used by the producer to take out the oldest item when dropping it
+    T m_dropped_item;
+
+    sem_t m_sem_items;
+    sem_t m_sem_free_slots;
+};
@@ -0,0 +1,375 @@
+/*
+ * taskstats.cpp -- per-process accounting through the TASKSTATS generic netlink family
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <errno.h>
+#include <linux/genetlink.h>
+#include <linux/netlink.h>
+#include <sys/socket.h>
+
+// ----------------------------------------------------------------------------------
+// Constants
+// ----------------------------------------------------------------------------------
+
+// the kernel drops the replies that do not fit the socket receive buffer: each process gets 2 replies
+// of about 500 bytes each, so 256 processes per batch are far below the 1MB buffer
+#define TASKSTATS_BATCH_SIZE (256)
+#define TASKSTATS_SOCKET_BUFFER_SIZE (1024 * 1024)
+
+// each reply is received as a separate datagram: many of them are received with a single recvmmsg()
+#define TASKSTATS_RECV_DATAGRAMS (64)
+#define TASKSTATS_RECV_DATAGRAM_SIZE (2048)
+
+// the first version providing the thread group ID of each task
+#define TASKSTATS_MIN_VERSION (12)
+
+// ----------------------------------------------------------------------------------
+// Netlink utilities
+// ----------------------------------------------------------------------------------
+
+#define NLA_DATA(na) ((const char*)(na) + NLA_HDRLEN)
+
+// iterates over the netlink attributes in the given buffer
+#define FOR_EACH_NLA(na, buf, buflen)                                                                                  \
+    for (const struct nlattr* na = (const struct nlattr*)(buf); (buflen) >= (int)NLA_HDRLEN                           \
+         && na->nla_len >= NLA_HDRLEN && na->nla_len <= (buflen);                                                      \
+         (buflen) -= NLA_ALIGN(na->nla_len), na = (const struct nlattr*)((const char*)na + NLA_ALIGN(na->nla_len)))
+
+static void copy_taskstats(const struct nlattr* na, struct taskstats* out)
+{
+    // the structure grows with each kernel version: newer fields not known at build time are ignored,
+    // fields not provided by older kernels are left to zero
+    size_t len = std::min((size_t)(na->nla_len - NLA_HDRLEN), sizeof(struct taskstats));
+    memset(out, 0, sizeof(struct taskstats));
+    memcpy(out, NLA_DATA(na), len);
+}
+
+static unsigned int recv_datagrams(int sock, std::vector<char>& buf, int flags, struct mmsghdr* msgs)
+{
+    struct iovec iov[TASKSTATS_RECV_DATAGRAMS];
+    for (unsigned int i = 0; i < TASKSTATS_RECV_DATAGRAMS; i++) {
+        iov[i].iov_base = &buf[i * TASKSTATS_RECV_DATAGRAM_SIZE];
+        iov[i].iov_len = TASKSTATS_RECV_DATAGRAM_SIZE;
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_iov = &iov[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    int n;
+    do {
+        n = recvmmsg(sock, msgs, TASKSTATS_RECV_DATAGRAMS, flags, NULL);
+    } while (n < 0 && errno == EINTR);
+    return n < 0 ? 0 : n;
+}
+
+// ----------------------------------------------------------------------------------
+// CMonitorTaskstats
+// ----------------------------------------------------------------------------------
+
+bool CMonitorTaskstats::open()
+{
+    m_socket = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+    if (m_socket == -1) {
+        g_logger.LogError("Cannot open the generic netlink socket: %s", strerror(errno));
+        return false;
+    }
+
+    // SO_RCVBUFFORCE allows to go beyond the rmem_max limit but requires CAP_NET_ADMIN, which we need anyway
+    int bufsize = TASKSTATS_SOCKET_BUFFER_SIZE;
+    if (setsockopt(m_socket, SOL_SOCKET, SO_RCVBUFFORCE, &bufsize, sizeof(bufsize)) != 0)
+        setsockopt(m_socket, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+
+    // a reply dropped by the kernel must not block the collector forever
+    struct timeval timeout = { 1, 0 };
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    m_recv_buf.resize(TASKSTATS_RECV_DATAGRAMS * TASKSTATS_RECV_DATAGRAM_SIZE);
+    if (!resolve_family_id()) {
+        g_logger.LogError("Cannot find the %s generic netlink family", TASKSTATS_GENL_NAME);
+        close();
+        return false;
+    }
+
+    // check that the kernel provides both the permission and the fields we need on ourselves
+    std::vector<pid_t> pids(1, getpid());
+    std::vector<process_taskstats_t> results;
+    if (!query(pids, results) || results.empty()) {
+        g_logger.LogError("Cannot query the taskstats of our own process: missing CAP_NET_ADMIN or taskstats "
+                          "version older than %d",
+            TASKSTATS_MIN_VERSION);
+        close();
+        return false;
+    }
+
+    g_logger.LogDebug("Taskstats version %u found, family ID %u", results[0].pid_stats.version, m_family_id);
+    return true;
+}
+
+void CMonitorTaskstats::close()
+{
+    if (m_socket == -1)
+        return;
+
+    if (!m_exit_cpumask.empty()) {
+        append_request(m_family_id, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_DEREGISTER_CPUMASK, m_exit_cpumask.c_str(),
+            m_exit_cpumask.size() + 1, 0, false);
+        send_requests();
+        m_exit_cpumask.clear();
+    }
+
+    ::close(m_socket);
+    m_socket = -1;
+}
+
+bool CMonitorTaskstats::query(const std::vector<pid_t>& pids, std::vector<process_taskstats_t>& results)
+{
+    struct mmsghdr msgs[TASKSTATS_RECV_DATAGRAMS];
+
+    results.clear();
+    for (size_t start = 0; start < pids.size(); start += TASKSTATS_BATCH_SIZE) {
+        size_t n = std::min((size_t)TASKSTATS_BATCH_SIZE, pids.size() - start);
+        size_t base = results.size();
+        results.resize(base + n);
+
+        // 2 requests per process, whose sequence numbers identify the process and the type of request
+        uint32_t first_seq = m_next_seq;
+        m_next_seq += 2 * n;
+        for (size_t i = 0; i < n; i++) {
+            process_taskstats_t& r = results[base + i];
+            uint32_t pid = pids[start + i];
+            r.pid = pid;
+            r.has_pid_stats = false;
+            r.has_tgid_stats = false;
+            append_request(m_family_id, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_PID, &pid, sizeof(pid),
+                first_seq + 2 * i, false);
+            append_request(m_family_id, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_TGID, &pid, sizeof(pid),
+                first_seq + 2 * i + 1, false);
+        }
+        if (!send_requests()) {
+            g_logger.LogError("Cannot send the taskstats requests: %s", strerror(errno));
+            results.resize(base);
+            return false;
+        }
+
+        // the kernel sends exactly one reply for each request: either the stats or an error (e.g. ESRCH when
+        // the process has exited in the meanwhile)
+        size_t pending = 2 * n;
+        while (pending > 0) {
+            unsigned int ndatagrams = recv_datagrams(m_socket, m_recv_buf, MSG_WAITFORONE, msgs);
+            if (ndatagrams == 0) {
+                g_logger.LogError("Failed receiving the taskstats replies: %s", strerror(errno));
+                results.resize(base);
+                return false;
+            }
+
+            for (unsigned int d = 0; d < ndatagrams; d++) {
+                if (msgs[d].msg_hdr.msg_flags & MSG_TRUNC)
+                    continue;
+
+                int len = msgs[d].msg_len;
+                for (const struct nlmsghdr* hdr = (const struct nlmsghdr*)&m_recv_buf[d * TASKSTATS_RECV_DATAGRAM_SIZE];
+                     NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+                    uint32_t idx = hdr->nlmsg_seq - first_seq; // wraps around for replies of an older batch
+                    if (idx >= 2 * n)
+                        continue;
+                    pending--;
+                    if (hdr->nlmsg_type == m_family_id)
+                        parse_stats(hdr, &results[base + idx / 2], &results[base + idx / 2]);
+                }
+            }
+        }
+
+        // keep only the processes still alive, discarding the threads listed by the cgroup "tasks" file
+        size_t out = base;
+        for (size_t i = base; i < base + n; i++) {
+            const process_taskstats_t& r = results[i];
+            if (!r.has_pid_stats || !r.has_tgid_stats || r.pid_stats.ac_tgid != (uint32_t)r.pid)
+                continue;
+            if (out != i)
+                results[out] = r;
+            out++;
+        }
+        results.resize(out);
+    }
+
+    return true;
+}
+
+bool CMonitorTaskstats::register_exits(const std::string& cpumask)
+{
+    append_request(m_family_id, TASKSTATS_CMD_GET, TASKSTATS_CMD_ATTR_REGISTER_CPUMASK, cpumask.c_str(),
+        cpumask.size() + 1, m_next_seq, true);
+    if (!send_requests())
+        return false;
+
+    // wait for the acknowledgement
+    char buf[1024];
+    ssize_t len;
+    do {
+        len = recv(m_socket, buf, sizeof(buf), 0);
+    } while (len < 0 && errno == EINTR);
+
+    const struct nlmsghdr* hdr = (const struct nlmsghdr*)buf;
+    if (len < (ssize_t)NLMSG_LENGTH(sizeof(struct nlmsgerr)) || hdr->nlmsg_type != NLMSG_ERROR)
+        return false;
+    const struct nlmsgerr* err = (const struct nlmsgerr*)NLMSG_DATA(hdr);
+    if (err->error != 0) {
+        errno = -err->error;
+        return false;
+    }
+
+    m_exit_cpumask = cpumask;
+    return true;
+}
+
+bool CMonitorTaskstats::receive_exits(std::vector<process_taskstats_t>& records)
+{
+    struct mmsghdr msgs[TASKSTATS_RECV_DATAGRAMS];
+
+    while (true) {
+        unsigned int ndatagrams = recv_datagrams(m_socket, m_recv_buf, MSG_DONTWAIT, msgs);
+        if (ndatagrams == 0)
+            return errno != ENOBUFS; // EAGAIN: nothing more to read
+
+        for (unsigned int d = 0; d < ndatagrams; d++) {
+            if (msgs[d].msg_hdr.msg_flags & MSG_TRUNC)
+                continue;
+
+            int len = msgs[d].msg_len;
+            for (const struct nlmsghdr* hdr = (const struct nlmsghdr*)&m_recv_buf[d * TASKSTATS_RECV_DATAGRAM_SIZE];
+                 NLMSG_OK(hdr, len); hdr = NLMSG_NEXT(hdr, len)) {
+                if (hdr->nlmsg_type != m_family_id)
+                    continue;
+
+                // the exit of the last thread of a multi-threaded process provides also the per-TGID record
+                process_taskstats_t pid_rec, tgid_rec;
+                parse_stats(hdr, &pid_rec, &tgid_rec);
+                if (pid_rec.has_pid_stats)
+                    records.push_back(pid_rec);
+                if (tgid_rec.has_tgid_stats)
+                    records.push_back(tgid_rec);
+            }
+        }
+    }
+}
+
+bool CMonitorTaskstats::resolve_family_id()
+{
+    append_request(GENL_ID_CTRL, CTRL_CMD_GETFAMILY, CTRL_ATTR_FAMILY_NAME, TASKSTATS_GENL_NAME,
+        sizeof(TASKSTATS_GENL_NAME), m_next_seq++, false);
+    if (!send_requests())
+        return false;
+
+    ssize_t len;
+    do {
+        len = recv(m_socket, m_recv_buf.data(), m_recv_buf.size(), 0);
+    } while (len < 0 && errno == EINTR);
+
+    const struct nlmsghdr* hdr = (const struct nlmsghdr*)m_recv_buf.data();
+    if (len < 0 || !NLMSG_OK(hdr, len) || hdr->nlmsg_type != GENL_ID_CTRL)
+        return false;
+
+    int attrlen = hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    FOR_EACH_NLA(na, (const char*)NLMSG_DATA(hdr) + GENL_HDRLEN, attrlen)
+    {
+        if ((na->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID && na->nla_len >= NLA_HDRLEN + sizeof(uint16_t)) {
+            memcpy(&m_family_id, NLA_DATA(na), sizeof(uint16_t));
+            return true;
+        }
+    }
+    return false;
+}
+
+void CMonitorTaskstats::append_request(
+    uint16_t type, uint8_t cmd, uint16_t attr, const void* value, size_t len, uint32_t seq, bool ack)
+{
+    size_t msglen = NLMSG_LENGTH(GENL_HDRLEN + NLA_HDRLEN + len);
+    size_t offset = NLMSG_ALIGN(m_send_len);
+    if (m_send_buf.size() < offset + NLMSG_ALIGN(msglen))
+        m_send_buf.resize(2 * (offset + NLMSG_ALIGN(msglen)));
+    memset(&m_send_buf[offset], 0, NLMSG_ALIGN(msglen));
+
+    struct nlmsghdr* hdr = (struct nlmsghdr*)&m_send_buf[offset];
+    hdr->nlmsg_len = msglen;
+    hdr->nlmsg_type = type;
+    hdr->nlmsg_flags = NLM_F_REQUEST | (ack ? NLM_F_ACK : 0);
+    hdr->nlmsg_seq = seq;
+
+    struct genlmsghdr* genl = (struct genlmsghdr*)NLMSG_DATA(hdr);
+    genl->cmd = cmd;
+    genl->version = TASKSTATS_GENL_VERSION;
+
+    struct nlattr* na = (struct nlattr*)((char*)genl + GENL_HDRLEN);
+    na->nla_type = attr;
+    na->nla_len = NLA_HDRLEN + len;
+    memcpy((char*)na + NLA_HDRLEN, value, len);
+
+    m_send_len = offset + msglen;
+}
+
+bool CMonitorTaskstats::send_requests()
+{
+    // the kernel processes all the requests found in a single datagram, one after the other
+    struct sockaddr_nl kernel;
+    memset(&kernel, 0, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    ssize_t ret;
+    do {
+        ret = sendto(m_socket, m_send_buf.data(), m_send_len, 0, (struct sockaddr*)&kernel, sizeof(kernel));
+    } while (ret < 0 && errno == EINTR);
+
+    bool ok = ret == (ssize_t)m_send_len;
+    m_send_len = 0;
+    return ok;
+}
+
+void CMonitorTaskstats::parse_stats(
+    const struct nlmsghdr* hdr, process_taskstats_t* pid_rec, process_taskstats_t* tgid_rec)
+{
+    int attrlen = hdr->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+    FOR_EACH_NLA(na, (const char*)NLMSG_DATA(hdr) + GENL_HDRLEN, attrlen)
+    {
+        uint16_t type = na->nla_type & NLA_TYPE_MASK;
+        if (type != TASKSTATS_TYPE_AGGR_PID && type != TASKSTATS_TYPE_AGGR_TGID)
+            continue;
+
+        // nested attributes: the PID (or TGID) followed by the stats
+        process_taskstats_t* rec = type == TASKSTATS_TYPE_AGGR_PID ? pid_rec : tgid_rec;
+        int nestedlen = na->nla_len - NLA_HDRLEN;
+        FOR_EACH_NLA(nested, NLA_DATA(na), nestedlen)
+        {
+            uint16_t nested_type = nested->nla_type & NLA_TYPE_MASK;
+            if ((nested_type == TASKSTATS_TYPE_PID || nested_type == TASKSTATS_TYPE_TGID)
+                && nested->nla_len >= NLA_HDRLEN + sizeof(uint32_t)) {
+                uint32_t pid;
+                memcpy(&pid, NLA_DATA(nested), sizeof(pid));
+                rec->pid = pid;
+            } else if (nested_type == TASKSTATS_TYPE_STATS) {
+                if (type == TASKSTATS_TYPE_AGGR_PID) {
+                    copy_taskstats(nested, &rec->pid_stats);
+                    rec->has_pid_stats = true;
+                } else {
+                    copy_taskstats(nested, &rec->tgid_stats);
+                    rec->has_tgid_stats = true;
+                }
+            }
+        }
+    }
+}
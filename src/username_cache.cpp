@@ -0,0 +1,91 @@
+/*
+ * username_cache.cpp -- resolution of the UIDs of the monitored processes
+ *                       to user names, with caching
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <errno.h>
+#include <pwd.h>
+#include <sys/stat.h>
+#include <time.h>
+
+//------------------------------------------------------------------------------
+// Constants
+//------------------------------------------------------------------------------
+
+#define USERNAME_CACHE_PASSWD_FILE "/etc/passwd"
+#define USERNAME_CACHE_MIN_PWBUF_SIZE (1024)
+#define USERNAME_CACHE_MAX_PWBUF_SIZE (1024 * 1024)
+
+//------------------------------------------------------------------------------
+// CMonitorUsernameCache
+//------------------------------------------------------------------------------
+
+void CMonitorUsernameCache::check_passwd_file()
+{
+    struct stat st;
+    if (stat(USERNAME_CACHE_PASSWD_FILE, &st) != 0)
+        return; // e.g. a container without /etc/passwd: names come from other NSS sources, if any
+
+    // NOTE: tools like useradd replace the file with a new one, so check the inode too
+    if (st.st_mtim.tv_sec == m_passwd_mtime.tv_sec && st.st_mtim.tv_nsec == m_passwd_mtime.tv_nsec
+        && st.st_ino == m_passwd_ino)
+        return;
+
+    if (!m_entries.empty())
+        g_logger.LogDebug("%s has changed: dropping %zu cached user names", USERNAME_CACHE_PASSWD_FILE,
+            m_entries.size());
+    m_entries.clear();
+    m_passwd_mtime = st.st_mtim;
+    m_passwd_ino = st.st_ino;
+}
+
+const std::string& CMonitorUsernameCache::get(uid_t uid)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    auto it = m_entries.find(uid);
+    if (it != m_entries.end() && (uint64_t)now.tv_sec < it->second.lookup_time_sec + USERNAME_CACHE_TTL_SEC)
+        return it->second.name;
+
+    if (it == m_entries.end())
+        it = m_entries.insert(std::make_pair(uid, entry_t())).first;
+    entry_t& entry = it->second;
+    entry.lookup_time_sec = now.tv_sec;
+    entry.name.clear();
+    m_num_lookups++;
+
+    // the buffer for the strings of the passwd entry is grown only if some entry does not fit
+    if (m_pwbuf.empty())
+        m_pwbuf.resize(USERNAME_CACHE_MIN_PWBUF_SIZE);
+    while (true) {
+        struct passwd pwbuf;
+        struct passwd* pw = NULL;
+        int ret = getpwuid_r(uid, &pwbuf, m_pwbuf.data(), m_pwbuf.size(), &pw);
+        if (ret == ERANGE && m_pwbuf.size() < USERNAME_CACHE_MAX_PWBUF_SIZE) {
+            m_pwbuf.resize(m_pwbuf.size() * 2);
+            continue;
+        }
+        if (ret == 0 && pw)
+            entry.name = pw->pw_name;
+        break;
+    }
+
+    return entry.name;
+}
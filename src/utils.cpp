@@ -21,6 +21,7 @@
 #include "cmonitor.h"
 #include <limits.h>
 #include <sstream>
+#include <sys/resource.h>
 #include <sys/stat.h>
 
 // ----------------------------------------------------------------------------------
@@ -114,6 +115,29 @@ bool string2int(const char* s, uint64_t& result)
     return true;
 }
 
+bool string2msec(const char* s, uint64_t& result_msec)
+{
+    // here we support strings like:
+    //  - "3" or "3s": plain number of seconds (this is the legacy format)
+    //  - "100ms": number of milliseconds
+    char* end;
+    if (s[0] == '\0' || !isdigit(s[0]))
+        return false;
+
+    errno = 0;
+    unsigned long l = strtoul(s, &end, 10);
+    if (errno != 0)
+        return false;
+
+    if (*end == '\0' || strcmp(end, "s") == 0)
+        result_msec = l * 1000;
+    else if (strcmp(end, "ms") == 0)
+        result_msec = l;
+    else
+        return false;
+    return true;
+}
+
 bool file_or_dir_exists(const char* filename)
 {
     struct stat buffer;
@@ -220,60 +244,64 @@ bool parse_string_with_multiple_ranges(const std::string& data, std::set<uint64_
     return true;
 }
 
+// NOTE: the following functions read through CMonitorProcFile so that the files they read
+//       are seen by --record as well
+
 bool search_integer(std::string filePath, uint64_t valueToSearch)
 {
-    FILE* stream = fopen(filePath.c_str(), "r");
-    if (!stream) {
+    CMonitorProcFile file;
+    const char* line = file.open(filePath) ? file.read() : NULL;
+    if (!line) {
         g_logger.LogDebug("Cannot open file [%s]", filePath.c_str());
         return false; // file does not exist or not readable
     }
 
-#define MAX_LINE_LEN 1024
-    char line[MAX_LINE_LEN];
     uint64_t value;
-    while (fgets(line, MAX_LINE_LEN, stream) != NULL) {
+    do {
         // g_logger.LogDebug("Searching for %d into [%s]", valueToSearch, line);
-        if (sscanf(line, "%lu", &value) == 1) {
-            if (value == valueToSearch)
-                return true; // found!
-        }
-    }
-    fclose(stream);
+        const char* p = line;
+        if (proc_parse_uint(p, value) && value == valueToSearch)
+            return true; // found!
+    } while (proc_next_line(line));
 
     return false; // not found
 }
 
 bool read_integer(std::string filePath, uint64_t& value)
 {
-    FILE* stream = fopen(filePath.c_str(), "r");
-    if (!stream) {
+    CMonitorProcFile file;
+    const char* p = file.open(filePath) ? file.read() : NULL;
+    if (!p) {
         g_logger.LogDebug("Cannot open file [%s]", filePath.c_str());
         return false; // file does not exist or not readable
     }
 
     // read a single integer from the file
     value = 0;
-    bool bRet = fscanf(stream, "%lu", &value) == 1;
-    fclose(stream);
-
-    return bRet;
+    while (*p == '\n')
+        p++;
+    return proc_parse_uint(p, value);
 }
 
 bool read_integers_with_range_validation(
     const std::string& filename, uint64_t lower_limit, uint64_t upper_limit, std::set<uint64_t>& cpus)
 {
-    FILE* stream = fopen(filename.c_str(), "r");
-    if (!stream)
+    CMonitorProcFile file;
+    const char* p = file.open(filename) ? file.read() : NULL;
+    if (!p)
         return false; // file does not exist, try next path
 
-    char buffer[256] = "";
-    bool bRet = fscanf(stream, "%255s", buffer) == 1;
-    fclose(stream);
-
-    if (!bRet)
+    // the ranges are the first whitespace-delimited token
+    while (*p == ' ' || *p == '\t' || *p == '\n')
+        p++;
+    const char* end = p;
+    while ((unsigned char)*end > ' ')
+        end++;
+    if (end == p)
         return false;
+    std::string ranges(p, end - p);
 
-    if (!parse_string_with_multiple_ranges(buffer, cpus))
+    if (!parse_string_with_multiple_ranges(ranges, cpus))
         return false; // invalid content format??
 
     std::set<uint64_t>::iterator cpuit = cpus.begin();
@@ -286,3 +314,18 @@ bool read_integers_with_range_validation(
 
     return true;
 }
+
+uint64_t raise_max_open_files()
+{
+    // raising the soft limit up to the hard one requires no privilege
+    struct rlimit lim;
+    if (getrlimit(RLIMIT_NOFILE, &lim) != 0)
+        return 0;
+    if (lim.rlim_cur < lim.rlim_max) {
+        rlim_t soft_limit = lim.rlim_cur;
+        lim.rlim_cur = lim.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &lim) != 0)
+            lim.rlim_cur = soft_limit;
+    }
+    return lim.rlim_cur;
+}
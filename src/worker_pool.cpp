@@ -0,0 +1,106 @@
+/*
+ * worker_pool.cpp -- a small pool of threads used to run the collectors
+ *                    of independent performance stats families in parallel
+ * Developer: Francesco Montorsi.
+ * (C) Copyright 2018 Francesco Montorsi
+
+ This program is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+
+ This program is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+
+ You should have received a copy of the GNU General Public License
+ along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "cmonitor.h"
+#include <signal.h>
+
+// ----------------------------------------------------------------------------------
+// CMonitorWorkerPool
+// ----------------------------------------------------------------------------------
+
+void CMonitorWorkerPool::start(unsigned int num_threads)
+{
+    // signals like SIGTERM/SIGINT must be delivered to the main thread, which is the one sleeping
+    // in CMonitorScheduler::wait_next_deadline(): block all of them in the worker threads
+    // (the signal mask is inherited by new threads)
+    sigset_t all_signals, orig_signals;
+    sigfillset(&all_signals);
+    pthread_sigmask(SIG_BLOCK, &all_signals, &orig_signals);
+
+    m_stop = false;
+    for (unsigned int i = 0; i < num_threads; i++)
+        m_threads.push_back(std::thread(&CMonitorWorkerPool::worker_main, this));
+
+    pthread_sigmask(SIG_SETMASK, &orig_signals, NULL);
+
+    g_logger.LogDebug("Started %u collector threads", num_threads);
+}
+
+void CMonitorWorkerPool::stop()
+{
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cond_new_jobs.notify_all();
+
+    for (auto& t : m_threads)
+        t.join();
+    m_threads.clear();
+}
+
+bool CMonitorWorkerPool::run_next_job(std::unique_lock<std::mutex>& lock)
+{
+    // NOTE: must be called with the lock held; the job itself runs with the lock released
+    if (!m_jobs || m_next_job >= m_jobs->size())
+        return false;
+
+    job_t& job = (*m_jobs)[m_next_job++];
+    lock.unlock();
+    job();
+    lock.lock();
+
+    m_pending_jobs--;
+    if (m_pending_jobs == 0)
+        m_cond_jobs_done.notify_all();
+    return true;
+}
+
+void CMonitorWorkerPool::run_all(std::vector<job_t>& jobs)
+{
+    if (jobs.empty())
+        return;
+
+    std::unique_lock<std::mutex> lock(m_mutex);
+    m_jobs = &jobs;
+    m_next_job = 0;
+    m_pending_jobs = jobs.size();
+    m_cond_new_jobs.notify_all();
+
+    // help the workers instead of just sleeping:
+    while (run_next_job(lock))
+        ;
+
+    m_cond_jobs_done.wait(lock, [this] { return m_pending_jobs == 0; });
+    m_jobs = nullptr;
+}
+
+void CMonitorWorkerPool::worker_main()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    while (true) {
+        m_cond_new_jobs.wait(lock, [this] { return m_stop || (m_jobs && m_next_job < m_jobs->size()); });
+        if (m_stop)
+            return;
+
+        while (run_next_job(lock))
+            ;
+    }
+}